@@ -84,7 +84,7 @@ def cmd_for_report(report_name, keymap, type_map, payload_allowed):
     return '\n'.join(ans)
 
 
-def generate(function_name, callback_name, report_name, keymap, command_class, initial_key='a', payload_allowed=True):
+def generate(function_name, callback_name, report_name, keymap, command_class, initial_key='a', payload_allowed=True, payload_buffer_name=None):
     type_map = resolve_keys(keymap)
     keys_enum = enum(keymap)
     handle_key = parse_key(keymap)
@@ -94,11 +94,22 @@ def generate(function_name, callback_name, report_name, keymap, command_class, i
     if payload_allowed:
         payload_after_value = "case ';': state = PAYLOAD; break;"
         payload = payload = ', PAYLOAD'
-        parr = 'static uint8_t payload[4096];'
+        parr = 'static uint8_t payload_buf[4096];\n    uint8_t *payload = payload_buf;'
+        get_payload_buffer = ''
+        if payload_buffer_name:
+            # Allow the payload to be decoded directly into its final destination
+            get_payload_buffer = f'''
+                if ((sz / 4) * 3 <= sizeof(payload_buf)) {{
+                    uint8_t *dest = {payload_buffer_name}(screen, &g, (sz / 4) * 3);
+                    if (dest != NULL) {{ payload = dest; payload_capacity = (sz / 4) * 3; }}
+                }}
+            '''
         payload_case = f'''
             case PAYLOAD: {{
                 sz = screen->parser_buf_pos - pos;
-                const char *err = base64_decode(screen->parser_buf + pos, sz, payload, sizeof(payload), &g.payload_sz);
+                size_t payload_capacity = sizeof(payload_buf);
+                {get_payload_buffer}
+                const char *err = base64_decode(screen->parser_buf + pos, sz, payload, payload_capacity, &g.payload_sz);
                 if (err != NULL) {{ REPORT_ERROR("Failed to parse {command_class} command payload with error: %s", err); return; }}
                 pos = screen->parser_buf_pos;
                 }}
@@ -236,7 +247,7 @@ def write_header(text, path):
 def graphics_parser():
     flag = frozenset
     keymap = {
-        'a': ('action', flag('tTqpd')),
+        'a': ('action', flag('tTqpdf')),
         'd': ('delete_action', flag('aAiIcCpPqQxXyYzZ')),
         't': ('transmission_type', flag('dfts')),
         'o': ('compressed', flag('z')),
@@ -257,7 +268,9 @@ def graphics_parser():
         'Y': ('cell_y_offset', 'uint'),
         'z': ('z_index', 'int'),
     }
-    text = generate('parse_graphics_code', 'screen_handle_graphics_command', 'graphics_command', keymap, 'GraphicsCommand')
+    text = generate(
+        'parse_graphics_code', 'screen_handle_graphics_command', 'graphics_command', keymap, 'GraphicsCommand',
+        payload_buffer_name='screen_graphics_payload_buffer')
     write_header(text, 'kitty/parse-graphics-command.h')
 
 
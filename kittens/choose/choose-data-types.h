@@ -44,11 +44,21 @@ typedef struct {
     len_t *positions;
     double score;
     ssize_t idx;
+    // The set of character classes present in the text, see char_mask()
+    uint64_t char_mask;
 } Candidate;
 
 typedef struct {
     Candidate *haystack;
     size_t haystack_count;
+    len_t max_haystack_len;
+    // If not NULL, only the candidates at these indices in the haystack are scored
+    const size_t *subset;
+    size_t num_to_score;
+    // The start of the next chunk of candidates to be scored, shared by all threads
+    size_t next_chunk;
+    len_t *positions;
+    uint64_t needle_mask;
     text_t level1[LEN_MAX], level2[LEN_MAX], level3[LEN_MAX], needle[LEN_MAX];
     len_t level1_len, level2_len, level3_len, needle_len;
     size_t haystack_size;
@@ -65,18 +75,41 @@ typedef struct {
     size_t mark_before_sz, mark_after_sz, delimiter_sz;
 } Options;
 
+typedef struct {
+    // The matching candidates found by a thread. When limit is non-zero only
+    // the best limit candidates are kept, in a heap with the worst at the top.
+    Candidate **items;
+    size_t count, capacity, limit;
+} Results;
+
 VECTOR_OF(len_t, Positions)
 VECTOR_OF(text_t, Chars)
 VECTOR_OF(Candidate, Candidates)
 
 
-void output_results(GlobalData *, Candidate *haystack, size_t count, Options *opts, len_t needle_len);
+bool add_result(Results *results, Candidate *c);
+void output_results(GlobalData *, Results *results, size_t num_results, Options *opts, len_t needle_len);
 void* alloc_workspace(len_t max_haystack_len, GlobalData*);
 void* free_workspace(void *v);
 double score_item(void *v, text_t *haystack, len_t haystack_len, len_t *match_positions);
+uint64_t char_mask(const text_t *text, len_t len);
+bool is_subsequence(const text_t *needle, len_t needle_len, const text_t *haystack, len_t haystack_len);
+extern bool use_prefilter;
+
+static inline bool
+could_match(const GlobalData *global, const Candidate *c) {
+    // Whether c contains the needle, if it does not, there is no need to score it
+    return !use_prefilter || (!(global->needle_mask & ~c->char_mask) && is_subsequence(global->needle, global->needle_len, c->src, c->haystack_len));
+}
+
+size_t copy_unicode_object(PyObject *src, text_t *dest, size_t dest_sz);
+void set_levels(GlobalData *global, PyObject *levels);
+PyObject* output_as_unicode(GlobalData *global);
+bool init_stream(PyObject *module);
 unsigned int encode_codepoint(text_t ch, char* dest);
 size_t unescape(const char *src, char *dest, size_t destlen);
 int cpu_count();
+size_t atomic_fetch_add_size(size_t *target, size_t amt);
 void* alloc_threads(size_t num_threads);
 #ifdef ISWINDOWS
 bool start_thread(void* threads, size_t i, unsigned int (STDCALL *start_routine) (void *), void *arg);
@@ -86,3 +119,11 @@ bool start_thread(void* threads, size_t i, void *(*start_routine) (void *), void
 #endif
 void wait_for_thread(void *threads, size_t i);
 void free_threads(void *threads);
+void* alloc_lock(void);
+void free_lock(void *lock);
+void acquire_lock(void *lock);
+void release_lock(void *lock);
+void* alloc_condition(void);
+void free_condition(void *cond);
+void wait_for_condition(void *cond, void *lock);
+void signal_condition(void *cond);
@@ -18,11 +18,15 @@
 #include <unistd.h>
 #endif
 
+// The haystack is scored in chunks of this many candidates, every thread
+// taking the next unscored chunk when it is done with its current one, so
+// that threads that get easy chunks do not sit idle.
+#define CHUNK_SIZE 1024
+
 typedef struct {
-    size_t start, count;
     void *workspace;
-    len_t max_haystack_len;
-    bool started;
+    bool started, oom;
+    Results results;
     GlobalData *global;
 } JobData;
 
@@ -30,8 +34,19 @@ typedef struct {
 static unsigned int STDCALL
 run_scoring(JobData *job_data) {
     GlobalData *global = job_data->global;
-    for (size_t i = job_data->start; i < job_data->start + job_data->count; i++) {
-        global->haystack[i].score = score_item(job_data->workspace, global->haystack[i].src, global->haystack[i].haystack_len, global->haystack[i].positions);
+    size_t start;
+    while ((start = atomic_fetch_add_size(&global->next_chunk, CHUNK_SIZE)) < global->num_to_score) {
+        size_t end = MIN(start + CHUNK_SIZE, global->num_to_score);
+        for (size_t i = start; i < end; i++) {
+            Candidate *c = global->haystack + (global->subset ? global->subset[i] : i);
+            c->positions = global->positions + i * global->needle_len;
+            if (!could_match(global, c)) {
+                c->score = 0;
+                continue;
+            }
+            c->score = score_item(job_data->workspace, c->src, c->haystack_len, c->positions);
+            if (c->score > 0 && !add_result(&job_data->results, c)) { job_data->oom = true; return 1; }
+        }
     }
     return 0;
 }
@@ -48,18 +63,12 @@ run_scoring_pthreads(void *job_data) {
 #endif
 
 static JobData*
-create_job(size_t i, size_t blocksz, GlobalData *global) {
+create_job(GlobalData *global, size_t limit) {
     JobData *ans = (JobData*)calloc(1, sizeof(JobData));
     if (ans == NULL) return NULL;
-    ans->start = i * blocksz;
-    if (ans->start >= global->haystack_count) ans->count = 0;
-    else ans->count = global->haystack_count - ans->start;
-    ans->max_haystack_len = 0;
-    for (size_t i = ans->start; i < ans->start + ans->count; i++) ans->max_haystack_len = MAX(ans->max_haystack_len, global->haystack[i].haystack_len);
-    if (ans->count > 0) {
-        ans->workspace = alloc_workspace(ans->max_haystack_len, global);
-        if (!ans->workspace) { free(ans); return NULL; }
-    }
+    ans->workspace = alloc_workspace(global->max_haystack_len, global);
+    if (!ans->workspace) { free(ans); return NULL; }
+    ans->results.limit = limit;
     ans->global = global;
     return ans;
 }
@@ -68,6 +77,7 @@ static JobData*
 free_job(JobData *job) {
     if (job) {
         if (job->workspace) free_workspace(job->workspace);
+        free(job->results.items);
         free(job);
     }
     return NULL;
@@ -75,21 +85,23 @@ free_job(JobData *job) {
 
 
 static int
-run_threaded(int num_threads_asked, GlobalData *global) {
+run_threaded(int num_threads_asked, Options *opts, GlobalData *global) {
     int ret = 0;
-    size_t i, blocksz;
+    size_t i;
+    if (!global->num_to_score) return 0;
     size_t num_threads = MAX(1, num_threads_asked > 0 ? num_threads_asked : cpu_count());
     if (global->haystack_size < 10000) num_threads = 1;
+    num_threads = MIN(num_threads, global->num_to_score / CHUNK_SIZE + 1);
     /* printf("num_threads: %lu asked: %d sysconf: %ld\n", num_threads, num_threads_asked, sysconf(_SC_NPROCESSORS_ONLN)); */
 
     void *threads = alloc_threads(num_threads);
     JobData **job_data = calloc(num_threads, sizeof(JobData*));
-    if (threads == NULL || job_data == NULL) { ret = 1; goto end; }
-
-    blocksz = global->haystack_count / num_threads + global->haystack_count % num_threads;
+    Results *results = calloc(num_threads, sizeof(Results));
+    if (threads == NULL || job_data == NULL || results == NULL) { ret = 1; goto end; }
 
+    global->next_chunk = 0;
     for (i = 0; i < num_threads; i++) {
-        job_data[i] = create_job(i, blocksz, global);
+        job_data[i] = create_job(global, opts->limit);
         if (job_data[i] == NULL) { ret = 1; goto end; }
     }
 
@@ -98,10 +110,8 @@ run_threaded(int num_threads_asked, GlobalData *global) {
     } else {
         for (i = 0; i < num_threads; i++) {
             job_data[i]->started = false;
-            if (job_data[i]->count > 0) {
-                if (!start_thread(threads, i, START_FUNC, job_data[i])) ret = 1;
-                else job_data[i]->started = true;
-            }
+            if (!start_thread(threads, i, START_FUNC, job_data[i])) ret = 1;
+            else job_data[i]->started = true;
         }
     }
 
@@ -111,15 +121,24 @@ end:
             if (job_data[i] && job_data[i]->started) wait_for_thread(threads, i);
         }
     }
-    for (i = 0; i < num_threads; i++) job_data[i] = free_job(job_data[i]);
-    free(job_data);
+    if (ret == 0) {
+        for (i = 0; i < num_threads; i++) {
+            if (job_data[i]->oom) ret = 1;
+            results[i] = job_data[i]->results;
+        }
+        if (ret == 0) output_results(global, results, num_threads, opts, global->needle_len);
+    }
+    if (job_data) {
+        for (i = 0; i < num_threads; i++) job_data[i] = free_job(job_data[i]);
+    }
+    free(job_data); free(results);
     free_threads(threads);
     return ret;
 }
 
 
 static int
-run_search(Options *opts, GlobalData *global, const char * const *lines, const size_t* sizes, size_t num_lines) {
+decode_haystack(GlobalData *global, Chars *ans_chars, Candidates *ans_candidates, const char * const *lines, const size_t* sizes, size_t num_lines) {
     const char *linebuf = NULL;
     size_t idx = 0;
     ssize_t sz = 0;
@@ -142,34 +161,46 @@ run_search(Options *opts, GlobalData *global, const char * const *lines, const s
             NEXT(candidates).src_sz = sz;
             NEXT(candidates).haystack_len = (len_t)(MIN(LEN_MAX, sz));
             global->haystack_size += NEXT(candidates).haystack_len;
+            global->max_haystack_len = MAX(global->max_haystack_len, NEXT(candidates).haystack_len);
+            NEXT(candidates).char_mask = char_mask(&(NEXT(chars)), NEXT(candidates).haystack_len);
             NEXT(candidates).idx = idx++;
             INC(candidates, 1); INC(chars, sz);
         }
     }
+    if (ret != 0) { FREE_VEC(chars); FREE_VEC(candidates); return ret; }
 
-    // Prepare the haystack allocating space for positions arrays and settings
-    // up the src pointers to point to the correct locations
+    // Set up the src pointers to point to the correct locations, now that
+    // the decoded text will not move anymore
     Candidate *haystack = &ITEM(candidates, 0);
-    len_t *positions = (len_t*)calloc(SIZE(candidates), sizeof(len_t) * global->needle_len);
-    if (positions) {
-        text_t *cdata = &ITEM(chars, 0);
-        for (size_t i = 0, off = 0; i < SIZE(candidates); i++) {
-            haystack[i].positions = positions + (i * global->needle_len);
-            haystack[i].src = cdata + off;
-            off += haystack[i].src_sz;
-        }
-        global->haystack = haystack;
-        global->haystack_count = SIZE(candidates);
-        ret = run_threaded(opts->num_threads, global);
-        if (ret == 0) output_results(global, haystack, SIZE(candidates), opts, global->needle_len);
-        else { REPORT_OOM; }
-    } else { ret = 1; REPORT_OOM; }
+    text_t *cdata = &ITEM(chars, 0);
+    for (size_t i = 0, off = 0; i < SIZE(candidates); i++) {
+        haystack[i].src = cdata + off;
+        off += haystack[i].src_sz;
+    }
+    global->haystack = haystack;
+    global->haystack_count = SIZE(candidates);
+    *ans_chars = chars; *ans_candidates = candidates;
+    return 0;
+}
 
-    FREE_VEC(chars); free(positions); FREE_VEC(candidates);
+static int
+run_search(Options *opts, GlobalData *global, const size_t *subset, size_t count) {
+    // Score count candidates, the first count in the haystack or the ones at
+    // the indices in subset, and output the results
+    int ret = 0;
+    global->subset = subset;
+    global->num_to_score = count;
+    global->needle_mask = char_mask(global->needle, global->needle_len);
+    global->positions = (len_t*)malloc(MAX(1u, count * global->needle_len) * sizeof(len_t));
+    if (global->positions) {
+        ret = run_threaded(opts->num_threads, opts, global);
+        if (ret != 0) { REPORT_OOM; }
+    } else { ret = 1; REPORT_OOM; }
+    free(global->positions); global->positions = NULL;
     return ret;
 }
 
-static size_t
+size_t
 copy_unicode_object(PyObject *src, text_t *dest, size_t dest_sz) {
     PyUnicode_READY(src);
     int kind = PyUnicode_KIND(src);
@@ -181,6 +212,53 @@ copy_unicode_object(PyObject *src, text_t *dest, size_t dest_sz) {
     return len;
 }
 
+static void
+parse_options(Options *opts, GlobalData *global, PyObject *needle, int output_positions, unsigned long limit, PyObject *mark_before, PyObject *mark_after, PyObject *delimiter) {
+    opts->output_positions = output_positions ? true : false;
+    opts->limit = limit;
+    global->needle_len = MIN(LEN_MAX, copy_unicode_object(needle, global->needle, arraysz(global->needle)));
+    opts->mark_before_sz = copy_unicode_object(mark_before, opts->mark_before, arraysz(opts->mark_before));
+    opts->mark_after_sz = copy_unicode_object(mark_after, opts->mark_after, arraysz(opts->mark_after));
+    opts->delimiter_sz = copy_unicode_object(delimiter, opts->delimiter, arraysz(opts->delimiter));
+}
+
+void
+set_levels(GlobalData *global, PyObject *levels) {
+    global->level1_len = copy_unicode_object(PyTuple_GET_ITEM(levels, 0), global->level1, arraysz(global->level1));
+    global->level2_len = copy_unicode_object(PyTuple_GET_ITEM(levels, 1), global->level2, arraysz(global->level2));
+    global->level3_len = copy_unicode_object(PyTuple_GET_ITEM(levels, 2), global->level3, arraysz(global->level3));
+}
+
+static bool
+lines_as_arrays(PyObject *lines, char ***clines, size_t **sizes) {
+    size_t num_lines = PyList_GET_SIZE(lines);
+    *clines = malloc(sizeof(char*) * MAX(1u, num_lines));
+    *sizes = malloc(sizeof(size_t) * MAX(1u, num_lines));
+    if (!*clines || !*sizes) { free(*clines); free(*sizes); PyErr_NoMemory(); return false; }
+    for (size_t i = 0; i < num_lines; i++) {
+        PyObject *line = PyList_GET_ITEM(lines, i);
+        if (!PyBytes_Check(line)) {
+            free(*clines); free(*sizes);
+            PyErr_SetString(PyExc_TypeError, "lines must be a list of bytes objects");
+            return false;
+        }
+        (*clines)[i] = PyBytes_AS_STRING(line);
+        (*sizes)[i] = PyBytes_GET_SIZE(line);
+    }
+    return true;
+}
+
+PyObject*
+output_as_unicode(GlobalData *global) {
+    PyObject *ans = NULL;
+    if (global->oom) PyErr_NoMemory();
+    else if (global->output) ans = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, global->output, global->output_pos);
+    else { Py_INCREF(Py_None); ans = Py_None; }
+    free(global->output);
+    global->output = NULL; global->output_sz = 0; global->output_pos = 0; global->oom = 0;
+    return ans;
+}
+
 static PyObject*
 match(PyObject *self, PyObject *args) {
     (void)(self);
@@ -194,39 +272,205 @@ match(PyObject *self, PyObject *args) {
             &output_positions, &limit, &opts.num_threads,
             &mark_before, &mark_after, &delimiter
     )) return NULL;
-    opts.output_positions = output_positions ? true : false;
-    opts.limit = limit;
-    global.level1_len = copy_unicode_object(PyTuple_GET_ITEM(levels, 0), global.level1, arraysz(global.level1));
-    global.level2_len = copy_unicode_object(PyTuple_GET_ITEM(levels, 1), global.level2, arraysz(global.level2));
-    global.level3_len = copy_unicode_object(PyTuple_GET_ITEM(levels, 2), global.level3, arraysz(global.level3));
-    global.needle_len = copy_unicode_object(needle, global.needle, arraysz(global.needle));
-    opts.mark_before_sz = copy_unicode_object(mark_before, opts.mark_before, arraysz(opts.mark_before));
-    opts.mark_after_sz = copy_unicode_object(mark_after, opts.mark_after, arraysz(opts.mark_after));
-    opts.delimiter_sz = copy_unicode_object(delimiter, opts.delimiter, arraysz(opts.delimiter));
-    size_t num_lines = PyList_GET_SIZE(lines);
-    char **clines = malloc(sizeof(char*) * num_lines);
-    if (!clines) { return PyErr_NoMemory(); }
-    size_t *sizes = malloc(sizeof(size_t) * num_lines);
-    if (!sizes) { free(clines); clines = NULL; return PyErr_NoMemory(); }
-    for (size_t i = 0; i < num_lines; i++) {
-        clines[i] = PyBytes_AS_STRING(PyList_GET_ITEM(lines, i));
-        sizes[i] = PyBytes_GET_SIZE(PyList_GET_ITEM(lines, i));
-    }
+    set_levels(&global, levels);
+    parse_options(&opts, &global, needle, output_positions, limit, mark_before, mark_after, delimiter);
+    char **clines; size_t *sizes;
+    if (!lines_as_arrays(lines, &clines, &sizes)) return NULL;
+    Chars chars = {0};
+    Candidates candidates = {0};
     Py_BEGIN_ALLOW_THREADS;
-    run_search(&opts, &global, (const char* const *)clines, sizes, num_lines);
+    if (decode_haystack(&global, &chars, &candidates, (const char* const *)clines, sizes, PyList_GET_SIZE(lines)) == 0) {
+        run_search(&opts, &global, NULL, global.haystack_count);
+        FREE_VEC(chars); FREE_VEC(candidates);
+    } else global.oom = 1;
     Py_END_ALLOW_THREADS;
     free(clines); free(sizes);
-    if (global.oom) { free(global.output); return PyErr_NoMemory(); }
-    if (global.output) {
-        PyObject *ans = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, global.output, global.output_pos);
-        free(global.output);
-        return ans;
+    return output_as_unicode(&global);
+}
+
+// Matcher {{{
+
+// A matcher keeps the decoded haystack around between searches, for
+// interactive use where the needle changes one keystroke at a time. Since
+// every candidate that matches a needle also matches all its prefixes, only
+// the candidates that matched the longest previously searched prefix of a
+// needle need to be scored.
+
+typedef struct {
+    text_t needle[LEN_MAX];
+    len_t needle_len;
+    size_t *survivors, count;
+    // The output for the needle, kept when the number of results is limited,
+    // so that going back to the needle, with a backspace, needs no scoring
+    bool has_output;
+    Options opts;
+    text_t *output;
+    size_t output_sz;
+} CachedResult;
+
+typedef struct {
+    PyObject_HEAD
+
+    GlobalData global;
+    Chars chars;
+    Candidates candidates;
+    int num_threads;
+    // The indices of the candidates that matched previous needles, every
+    // needle is a prefix of the next one
+    CachedResult *cache;
+    size_t cache_count;
+} Matcher;
+
+static PyTypeObject Matcher_Type;
+
+static PyObject *
+Matcher_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    (void)(kwds);
+    PyObject *lines, *levels;
+    int num_threads;
+    if (!PyArg_ParseTuple(args, "O!O!i", &PyList_Type, &lines, &PyTuple_Type, &levels, &num_threads)) return NULL;
+    char **clines; size_t *sizes;
+    if (!lines_as_arrays(lines, &clines, &sizes)) return NULL;
+    Matcher *self = (Matcher*)type->tp_alloc(type, 0);
+    if (self) {
+        self->num_threads = num_threads;
+        set_levels(&self->global, levels);
+        self->cache = calloc(LEN_MAX, sizeof(CachedResult));
+        int ret = 1;
+        if (self->cache) {
+            Py_BEGIN_ALLOW_THREADS;
+            ret = decode_haystack(&self->global, &self->chars, &self->candidates, (const char* const *)clines, sizes, PyList_GET_SIZE(lines));
+            Py_END_ALLOW_THREADS;
+        }
+        if (ret != 0) { Py_CLEAR(self); PyErr_NoMemory(); }
+    }
+    free(clines); free(sizes);
+    return (PyObject*)self;
+}
+
+static inline void
+drop_cached_result(Matcher *self) {
+    CachedResult *r = self->cache + --self->cache_count;
+    free(r->survivors); r->survivors = NULL; r->count = 0;
+    free(r->output); r->output = NULL; r->output_sz = 0; r->has_output = false;
+}
+
+static void
+Matcher_dealloc(Matcher *self) {
+    if (self->cache) {
+        while (self->cache_count) drop_cached_result(self);
+        free(self->cache);
     }
+    FREE_VEC(self->chars); FREE_VEC(self->candidates);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static inline bool
+is_prefix_of_needle(const CachedResult *r, const GlobalData *global) {
+    return r->needle_len <= global->needle_len && memcmp(r->needle, global->needle, r->needle_len * sizeof(text_t)) == 0;
+}
+
+static bool
+collect_survivors(GlobalData *global, CachedResult *r) {
+    size_t count = 0;
+#define CANDIDATE(i) (global->haystack + (global->subset ? global->subset[i] : i))
+    for (size_t i = 0; i < global->num_to_score; i++) { if (CANDIDATE(i)->score > 0) count++; }
+    r->survivors = malloc(MAX(1u, count) * sizeof(size_t));
+    if (!r->survivors) return false;
+    for (size_t i = 0; i < global->num_to_score; i++) {
+        if (CANDIDATE(i)->score > 0) r->survivors[r->count++] = global->subset ? global->subset[i] : i;
+    }
+#undef CANDIDATE
+    return true;
+}
+
+static PyObject*
+Matcher_match(Matcher *self, PyObject *args) {
+    int output_positions;
+    unsigned long limit;
+    PyObject *needle, *mark_before, *mark_after, *delimiter;
+    Options opts;
+    // Options are compared with memcmp() so the padding must be zeroed as well
+    memset(&opts, 0, sizeof(opts));
+    GlobalData *global = &self->global;
+    if (!PyArg_ParseTuple(args, "UpkUUU", &needle, &output_positions, &limit, &mark_before, &mark_after, &delimiter)) return NULL;
+    parse_options(&opts, global, needle, output_positions, limit, mark_before, mark_after, delimiter);
+    opts.num_threads = self->num_threads;
+    if (!global->needle_len) Py_RETURN_NONE;
+    // Forget the results for needles that are not a prefix of this one, for example after a backspace
+    while (self->cache_count && !is_prefix_of_needle(self->cache + self->cache_count - 1, global)) drop_cached_result(self);
+    CachedResult *base = self->cache_count ? self->cache + self->cache_count - 1 : NULL, *r = NULL;
+    if (!base || base->needle_len < global->needle_len) r = self->cache + self->cache_count;
+    else if (base->has_output && memcmp(&base->opts, &opts, sizeof(Options)) == 0) {
+        if (!base->output) Py_RETURN_NONE;
+        return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, base->output, base->output_sz);
+    }
+    Py_BEGIN_ALLOW_THREADS;
+    int ret = base ? run_search(&opts, global, base->survivors, base->count) : run_search(&opts, global, NULL, global->haystack_count);
+    if (ret == 0 && r) {
+        if (collect_survivors(global, r)) {
+            memcpy(r->needle, global->needle, global->needle_len * sizeof(text_t));
+            r->needle_len = global->needle_len;
+            self->cache_count++;
+        } else r = NULL;
+    }
+    global->subset = NULL;
+    Py_END_ALLOW_THREADS;
+    CachedResult *dest = r ? r : base;
+    if (dest && opts.limit && !global->oom) {
+        dest->has_output = false;
+        free(dest->output); dest->output = NULL;
+        dest->output_sz = global->output_pos;
+        if (!global->output_pos || (dest->output = malloc(global->output_pos * sizeof(text_t)))) {
+            if (dest->output) memcpy(dest->output, global->output, global->output_pos * sizeof(text_t));
+            memcpy(&dest->opts, &opts, sizeof(Options)); dest->has_output = true;
+        }
+    }
+    return output_as_unicode(global);
+}
+
+static PyObject*
+Matcher_cached_needles(Matcher *self, PyObject *args) {
+    (void)(args);
+    PyObject *ans = PyTuple_New(self->cache_count);
+    if (!ans) return NULL;
+    for (size_t i = 0; i < self->cache_count; i++) {
+        PyObject *n = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, self->cache[i].needle, self->cache[i].needle_len);
+        if (!n) { Py_DECREF(ans); return NULL; }
+        PyTuple_SET_ITEM(ans, i, n);
+    }
+    return ans;
+}
+
+static PyMethodDef Matcher_methods[] = {
+    {"match", (PyCFunction)Matcher_match, METH_VARARGS, "Match the needle against the haystack, with the same options as the module level match()"},
+    {"cached_needles", (PyCFunction)Matcher_cached_needles, METH_NOARGS, "The needles whose results are currently cached"},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static PyTypeObject Matcher_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "subseq_matcher.Matcher",
+    .tp_basicsize = sizeof(Matcher),
+    .tp_dealloc = (destructor)Matcher_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Matcher(lines, levels, num_threads)",
+    .tp_methods = Matcher_methods,
+    .tp_new = Matcher_new,
+};
+
+// }}}
+
+static PyObject*
+set_use_prefilter(PyObject *self, PyObject *val) {
+    (void)(self);
+    use_prefilter = PyObject_IsTrue(val) ? true : false;
     Py_RETURN_NONE;
 }
 
 static PyMethodDef module_methods[] = {
     {"match", match, METH_VARARGS, ""},
+    {"set_use_prefilter", set_use_prefilter, METH_O, "Whether to reject candidates that cannot match before scoring them, for benchmarking"},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -240,5 +484,11 @@ static struct PyModuleDef module = {
 
 EXPORTED PyMODINIT_FUNC
 PyInit_subseq_matcher(void) {
-    return PyModule_Create(&module);
+    if (PyType_Ready(&Matcher_Type) < 0) return NULL;
+    PyObject *m = PyModule_Create(&module);
+    if (m == NULL) return NULL;
+    Py_INCREF(&Matcher_Type);
+    if (PyModule_AddObject(m, "Matcher", (PyObject*)&Matcher_Type) != 0) { Py_DECREF(&Matcher_Type); Py_DECREF(m); return NULL; }
+    if (!init_stream(m)) { Py_DECREF(m); return NULL; }
+    return m;
 }
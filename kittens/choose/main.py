@@ -11,6 +11,20 @@ from ..tui.loop import Loop
 from . import subseq_matcher
 
 
+def prepare_input(input_data, delimiter):
+    if isinstance(input_data, str):
+        input_data = input_data.encode('utf-8')
+    if isinstance(input_data, bytes):
+        return input_data.split(delimiter.encode('utf-8'))
+    return [x.encode('utf-8') if isinstance(x, str) else x for x in input_data]
+
+
+def split_results(data, delimiter):
+    if data is None:
+        return []
+    return list(filter(None, data.split(delimiter or '\n')))
+
+
 def match(
     input_data,
     query,
@@ -24,12 +38,7 @@ def match(
     mark_after='',
     delimiter='\n'
 ):
-    if isinstance(input_data, str):
-        input_data = input_data.encode('utf-8')
-    if isinstance(input_data, bytes):
-        input_data = input_data.split(delimiter.encode('utf-8'))
-    else:
-        input_data = [x.encode('utf-8') if isinstance(x, str) else x for x in input_data]
+    input_data = prepare_input(input_data, delimiter)
     query = query.lower()
     level1 = level1.lower()
     level2 = level2.lower()
@@ -38,9 +47,68 @@ def match(
         input_data, (level1, level2, level3), query,
         positions, limit, threads,
         mark_before, mark_after, delimiter)
-    if data is None:
-        return []
-    return list(filter(None, data.split(delimiter or '\n')))
+    return split_results(data, delimiter)
+
+
+class Matcher:
+
+    ''' Match queries against the same input repeatedly, as when the query is
+    typed interactively. The input is decoded only once and queries that
+    extend a previous query only consider the items that matched it. '''
+
+    def __init__(
+        self,
+        input_data,
+        threads=0,
+        level1='/',
+        level2='-_0123456789',
+        level3='.',
+        delimiter='\n'
+    ):
+        self.delimiter = delimiter
+        levels = level1.lower(), level2.lower(), level3.lower()
+        self.matcher = subseq_matcher.Matcher(prepare_input(input_data, delimiter), levels, threads)
+
+    def __call__(self, query, positions=False, limit=0, mark_before='', mark_after=''):
+        data = self.matcher.match(query.lower(), positions, limit, mark_before, mark_after, self.delimiter)
+        return split_results(data, self.delimiter)
+
+
+class StreamMatcher:
+
+    ''' Match a query against lines read from a file descriptor, such as a
+    pipe from find or git ls-files, while they are still being produced.
+    results() can be called at any time to get the best results found so
+    far. The file descriptor must remain open until wait() returns or the
+    matcher is destroyed. '''
+
+    def __init__(
+        self,
+        fd,
+        query,
+        threads=0,
+        limit=0,
+        level1='/',
+        level2='-_0123456789',
+        level3='.',
+        delimiter='\n'
+    ):
+        self.delimiter = delimiter
+        levels = level1.lower(), level2.lower(), level3.lower()
+        sep = delimiter.encode('utf-8')
+        if len(sep) != 1:
+            raise ValueError('The delimiter must be a single byte when streaming')
+        self.stream = subseq_matcher.Stream(fd, levels, query.lower(), limit, threads, sep)
+
+    def results(self, positions=False, mark_before='', mark_after=''):
+        data = self.stream.results(positions, mark_before, mark_after, self.delimiter)
+        return split_results(data, self.delimiter)
+
+    def status(self):
+        return self.stream.status()
+
+    def wait(self):
+        self.stream.wait()
 
 
 class ChooseHandler(Handler):
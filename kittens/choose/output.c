@@ -21,8 +21,6 @@ static inline ssize_t ms_write(int fd, const void* buf, size_t count) { return _
 #include <errno.h>
 
 
-#define FIELD(x, which) (((Candidate*)(x))->which)
-
 static inline bool
 ensure_space(GlobalData *global, size_t sz) {
     if (global->output_sz < sz + global->output_pos) {
@@ -45,13 +43,66 @@ output_text(GlobalData *global, const text_t *data, size_t sz) {
     }
 }
 
+static inline bool
+is_better(const Candidate *a, const Candidate *b) {
+    // Higher scores first, ties in input order
+    return a->score > b->score || (a->score == b->score && a->idx < b->idx);
+}
+
 static int
 cmpscore(const void *a, const void *b) {
-    double sa = FIELD(a, score), sb = FIELD(b, score);
+    const Candidate *ca = *(Candidate* const*)a, *cb = *(Candidate* const*)b;
     // Sort descending
-    return (sa > sb) ? -1 : ((sa == sb) ? ((int)FIELD(a, idx) - (int)FIELD(b, idx)) : 1);
+    return is_better(ca, cb) ? -1 : (is_better(cb, ca) ? 1 : 0);
 }
 
+// Results {{{
+
+static inline void
+sift_down(Candidate **heap, size_t count, size_t i) {
+    Candidate *item = heap[i];
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= count) break;
+        if (child + 1 < count && is_better(heap[child], heap[child + 1])) child++;
+        if (!is_better(item, heap[child])) break;
+        heap[i] = heap[child]; i = child;
+    }
+    heap[i] = item;
+}
+
+static inline void
+sift_up(Candidate **heap, size_t i) {
+    Candidate *item = heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!is_better(heap[parent], item)) break;
+        heap[i] = heap[parent]; i = parent;
+    }
+    heap[i] = item;
+}
+
+bool
+add_result(Results *r, Candidate *c) {
+    if (r->limit && r->count >= r->limit) {
+        // Replace the worst of the results so far, if c is better than it
+        if (is_better(c, r->items[0])) { r->items[0] = c; sift_down(r->items, r->count, 0); }
+        return true;
+    }
+    if (r->count >= r->capacity) {
+        size_t capacity = MAX(1024u, 2 * r->capacity);
+        if (r->limit) capacity = MIN(capacity, r->limit);
+        Candidate **items = realloc(r->items, capacity * sizeof(Candidate*));
+        if (!items) return false;
+        r->items = items; r->capacity = capacity;
+    }
+    r->items[r->count++] = c;
+    if (r->limit) sift_up(r->items, r->count - 1);
+    return true;
+}
+
+// }}}
+
 static void
 output_with_marks(GlobalData *global, Options *opts, text_t *src, size_t src_sz, len_t *positions, len_t poslen) {
     size_t pos, i = 0;
@@ -94,12 +145,22 @@ output_result(GlobalData *global, Candidate *c, Options *opts, len_t needle_len)
 
 
 void
-output_results(GlobalData *global, Candidate *haystack, size_t count, Options *opts, len_t needle_len) {
-    Candidate *c;
-    qsort(haystack, count, sizeof(*haystack), cmpscore);
-    size_t left = opts->limit > 0 ? opts->limit : count;
-    for (size_t i = 0; i < left; i++) {
-        c = haystack + i;
-        if (c->score > 0) output_result(global, c, opts, needle_len);
+output_results(GlobalData *global, Results *results, size_t num_results, Options *opts, len_t needle_len) {
+    // The results of every thread are sorted and then merged, until limit results have been output
+    size_t total = 0;
+    for (size_t i = 0; i < num_results; i++) {
+        qsort(results[i].items, results[i].count, sizeof(Candidate*), cmpscore);
+        total += results[i].count;
+    }
+    size_t left = opts->limit > 0 ? MIN(opts->limit, total) : total;
+    size_t *heads = calloc(num_results, sizeof(size_t));
+    if (!heads) { REPORT_OOM; return; }
+    for (; left > 0; left--) {
+        Results *best = NULL;
+        for (size_t i = 0; i < num_results; i++) {
+            if (heads[i] < results[i].count && (!best || is_better(results[i].items[heads[i]], best->items[heads[best - results]]))) best = results + i;
+        }
+        output_result(global, best->items[heads[best - results]++], opts, needle_len);
     }
+    free(heads);
 }
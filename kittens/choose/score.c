@@ -10,6 +10,9 @@
 #include <string.h>
 #include <float.h>
 #include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef struct {
     len_t *positions_buf;  // buffer to store positions for every char in needle
@@ -180,3 +183,59 @@ score_item(void *v, text_t *haystack, len_t haystack_len, len_t *match_positions
     if (!has_atleast_one_match(w)) return 0;
     return process_item(w, match_positions);
 }
+
+// Prefilter {{{
+
+bool use_prefilter = true;
+
+// Most candidates do not contain the needle at all, these are rejected
+// cheaply before scoring, first by comparing the sets of character classes
+// present in the needle and candidate, then by a linear scan for the
+// characters of the needle, in order.
+
+static inline unsigned int
+char_class(text_t ch) {
+    ch = LOWERCASE(ch);
+    if (ch >= 'a' && ch <= 'z') return ch - 'a';
+    if (ch >= '0' && ch <= '9') return 26 + ch - '0';
+    return 36 + ch % 28;
+}
+
+uint64_t
+char_mask(const text_t *text, len_t len) {
+    uint64_t ans = 0;
+    for (len_t i = 0; i < len; i++) ans |= 1ull << char_class(text[i]);
+    return ans;
+}
+
+static inline len_t
+find_char(const text_t *haystack, len_t i, len_t len, text_t ch) {
+    // The index of the first character at or after i that is ch when lowercased, or len
+#ifdef __SSE2__
+    const __m128i needle = _mm_set1_epi32(ch), before_upper = _mm_set1_epi32('A' - 1), after_upper = _mm_set1_epi32('Z' + 1), case_bit = _mm_set1_epi32(32);
+    for (; i + 4 <= len; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(haystack + i));
+        __m128i is_upper = _mm_and_si128(_mm_cmpgt_epi32(v, before_upper), _mm_cmplt_epi32(v, after_upper));
+        v = _mm_add_epi32(v, _mm_and_si128(is_upper, case_bit));
+        int found = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, needle)));
+        if (found) return i + __builtin_ctz(found);
+    }
+#endif
+    for (; i < len; i++) {
+        if (LOWERCASE(haystack[i]) == ch) return i;
+    }
+    return len;
+}
+
+bool
+is_subsequence(const text_t *needle, len_t needle_len, const text_t *haystack, len_t haystack_len) {
+    len_t pos = 0;
+    for (len_t i = 0; i < needle_len; i++, pos++) {
+        if (pos >= haystack_len) return false;
+        pos = find_char(haystack, pos, haystack_len, needle[i]);
+        if (pos >= haystack_len) return false;
+    }
+    return true;
+}
+
+// }}}
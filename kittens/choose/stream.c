@@ -0,0 +1,429 @@
+/*
+ * stream.c
+ * Copyright (C) 2019 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+// Matching of input that is still being produced, such as the output of find
+// or git ls-files on a large tree. A reader thread reads lines from a file
+// descriptor, decodes them into an arena and hands them over in batches to
+// scoring threads, which maintain the best results found so far. These can
+// be queried at any time, so that results are shown long before the input
+// is complete.
+
+#include "choose-data-types.h"
+#include "charsets.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef ISWINDOWS
+#include <io.h>
+#define read _read
+#else
+#include <unistd.h>
+#include <poll.h>
+#endif
+
+#define ARENA_BLOCK_SIZE (1024u * 1024u)
+#define BATCH_SIZE 1024
+#define READ_SIZE (64 * 1024)
+
+// Arena {{{
+
+// Memory for the decoded text, candidates and their positions. It is never
+// moved, so pointers into it stay valid until the whole arena is freed.
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, capacity;
+    uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+static void*
+arena_alloc(Arena *a, size_t sz) {
+    sz = (sz + 7) & ~(size_t)7;
+    if (!a->head || a->head->capacity - a->head->used < sz) {
+        size_t capacity = MAX(ARENA_BLOCK_SIZE, sz);
+        ArenaBlock *b = malloc(sizeof(ArenaBlock) + capacity);
+        if (!b) return NULL;
+        b->used = 0; b->capacity = capacity; b->next = a->head;
+        a->head = b;
+    }
+    void *ans = a->head->data + a->head->used;
+    a->head->used += sz;
+    return ans;
+}
+
+static void
+free_arena(Arena *a) {
+    while (a->head) {
+        ArenaBlock *b = a->head;
+        a->head = b->next;
+        free(b);
+    }
+}
+
+// }}}
+
+typedef struct Batch {
+    Candidate *candidates;
+    size_t count;
+    struct Batch *next;
+} Batch;
+
+typedef struct Stream Stream;
+
+typedef struct {
+    Stream *stream;
+    void *workspace;
+} Scorer;
+
+struct Stream {
+    PyObject_HEAD
+
+    int fd;
+    char delimiter;
+    GlobalData global;
+    Arena arena;
+    Batch *current, *last, *next_batch;
+    char *pending;
+    size_t pending_sz, pending_capacity, num_lines;
+    void *threads;
+    Scorer *scorers;
+    size_t num_scorers, num_started, num_busy;
+    bool reader_started;
+    // Everything below is protected by lock
+    void *lock, *cond;
+    Results results;
+    size_t num_scored, num_read;
+    bool input_finished, stop, oom;
+};
+
+static PyTypeObject Stream_Type;
+
+// Reading {{{
+
+static void
+publish_batch(Stream *s) {
+    Batch *b = s->current;
+    s->current = NULL;
+    if (!b || !b->count) return;
+    acquire_lock(s->lock);
+    if (s->last) s->last->next = b;
+    s->last = b;
+    if (!s->next_batch) s->next_batch = b;
+    s->num_read += b->count;
+    signal_condition(s->cond);
+    release_lock(s->lock);
+}
+
+static bool
+add_line(Stream *s, const char *line, size_t sz) {
+    if (!sz) return true;
+    if (!s->current) {
+        s->current = arena_alloc(&s->arena, sizeof(Batch));
+        if (!s->current) return false;
+        s->current->candidates = arena_alloc(&s->arena, BATCH_SIZE * sizeof(Candidate));
+        if (!s->current->candidates) return false;
+        s->current->count = 0; s->current->next = NULL;
+    }
+    Candidate *c = s->current->candidates + s->current->count;
+    c->src = arena_alloc(&s->arena, sz * sizeof(text_t));
+    c->positions = arena_alloc(&s->arena, MAX(1u, s->global.needle_len) * sizeof(len_t));
+    if (!c->src || !c->positions) return false;
+    c->src_sz = decode_utf8_string(line, sz, c->src);
+    c->haystack_len = (len_t)(MIN(LEN_MAX, c->src_sz));
+    c->char_mask = char_mask(c->src, c->haystack_len);
+    c->score = 0;
+    c->idx = s->num_lines++;
+    if (++s->current->count >= BATCH_SIZE) publish_batch(s);
+    return true;
+}
+
+static bool
+add_to_pending(Stream *s, const char *data, size_t sz) {
+    if (s->pending_sz + sz > s->pending_capacity) {
+        size_t capacity = MAX(2 * s->pending_capacity, s->pending_sz + sz);
+        char *pending = realloc(s->pending, capacity);
+        if (!pending) return false;
+        s->pending = pending; s->pending_capacity = capacity;
+    }
+    memcpy(s->pending + s->pending_sz, data, sz);
+    s->pending_sz += sz;
+    return true;
+}
+
+static bool
+process_chunk(Stream *s, const char *data, size_t sz) {
+    const char *end = data + sz, *p;
+    while (data < end && (p = memchr(data, s->delimiter, end - data)) != NULL) {
+        bool ok;
+        if (s->pending_sz) {
+            ok = add_to_pending(s, data, p - data) && add_line(s, s->pending, s->pending_sz);
+            s->pending_sz = 0;
+        } else ok = add_line(s, data, p - data);
+        if (!ok) return false;
+        data = p + 1;
+    }
+    return add_to_pending(s, data, end - data);
+}
+
+static bool
+should_stop(Stream *s) {
+    acquire_lock(s->lock);
+    bool ans = s->stop;
+    release_lock(s->lock);
+    return ans;
+}
+
+static unsigned int STDCALL
+run_reader(Stream *s) {
+    char *buf = malloc(READ_SIZE);
+    bool ok = buf != NULL;
+    while (ok && !should_stop(s)) {
+#ifndef ISWINDOWS
+        // Wake up periodically to check if reading should be abandoned
+        struct pollfd pfd = {.fd = s->fd, .events = POLLIN};
+        int ret = poll(&pfd, 1, 100);
+        if (ret == 0 || (ret < 0 && errno == EINTR)) continue;
+#endif
+        ssize_t n = read(s->fd, buf, READ_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (!(ok = process_chunk(s, buf, n))) break;
+        // Make what has been read so far available for scoring, so that
+        // results appear even when the input trickles in
+        publish_batch(s);
+    }
+    free(buf);
+    if (ok && s->pending_sz) ok = add_line(s, s->pending, s->pending_sz);
+    s->pending_sz = 0;
+    publish_batch(s);
+    acquire_lock(s->lock);
+    if (!ok) s->oom = true;
+    s->input_finished = true;
+    signal_condition(s->cond);
+    release_lock(s->lock);
+    return 0;
+}
+
+static void*
+run_reader_pthreads(void *s) {
+    run_reader((Stream*)s);
+    return NULL;
+}
+
+// }}}
+
+// Scoring {{{
+
+static unsigned int STDCALL
+run_scorer(Scorer *scorer) {
+    Stream *s = scorer->stream;
+    GlobalData *global = &s->global;
+    Candidate *matches[BATCH_SIZE];
+    acquire_lock(s->lock);
+    while (true) {
+        while (!s->next_batch && !s->input_finished && !s->stop) wait_for_condition(s->cond, s->lock);
+        if (s->stop || !s->next_batch) break;
+        Batch *b = s->next_batch;
+        s->next_batch = b->next;
+        s->num_busy++;
+        release_lock(s->lock);
+        size_t num_matches = 0;
+        for (size_t i = 0; i < b->count; i++) {
+            Candidate *c = b->candidates + i;
+            if (!could_match(global, c)) continue;
+            c->score = score_item(scorer->workspace, c->src, c->haystack_len, c->positions);
+            if (c->score > 0) matches[num_matches++] = c;
+        }
+        acquire_lock(s->lock);
+        for (size_t i = 0; i < num_matches; i++) {
+            if (!add_result(&s->results, matches[i])) s->oom = true;
+        }
+        s->num_scored += b->count;
+        s->num_busy--;
+        signal_condition(s->cond);
+    }
+    release_lock(s->lock);
+    return 0;
+}
+
+static void*
+run_scorer_pthreads(void *scorer) {
+    run_scorer((Scorer*)scorer);
+    return NULL;
+}
+
+#ifdef ISWINDOWS
+#define READER_FUNC run_reader
+#define SCORER_FUNC run_scorer
+#else
+#define READER_FUNC run_reader_pthreads
+#define SCORER_FUNC run_scorer_pthreads
+#endif
+
+static inline bool
+is_finished(Stream *s) {
+    return s->input_finished && !s->next_batch && !s->num_busy;
+}
+
+// }}}
+
+// Python API {{{
+
+static void
+stop_threads(Stream *s) {
+    if (!s->lock) return;
+    acquire_lock(s->lock);
+    s->stop = true;
+    signal_condition(s->cond);
+    release_lock(s->lock);
+    if (s->reader_started) wait_for_thread(s->threads, 0);
+    for (size_t i = 0; i < s->num_started; i++) wait_for_thread(s->threads, i + 1);
+    s->reader_started = false; s->num_started = 0;
+}
+
+static void
+Stream_dealloc(Stream *self) {
+    Py_BEGIN_ALLOW_THREADS;
+    stop_threads(self);
+    Py_END_ALLOW_THREADS;
+    for (size_t i = 0; self->scorers && i < self->num_scorers; i++) {
+        if (self->scorers[i].workspace) free_workspace(self->scorers[i].workspace);
+    }
+    free(self->scorers);
+    free_threads(self->threads);
+    free(self->results.items);
+    free(self->pending);
+    free_arena(&self->arena);
+    free_lock(self->lock); free_condition(self->cond);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject*
+Stream_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    (void)(kwds);
+    int fd, num_threads;
+    unsigned long limit;
+    PyObject *levels, *needle;
+    char delimiter;
+    if (!PyArg_ParseTuple(args, "iO!Ukic", &fd, &PyTuple_Type, &levels, &needle, &limit, &num_threads, &delimiter)) return NULL;
+    Stream *self = (Stream*)type->tp_alloc(type, 0);
+    if (!self) return NULL;
+    self->fd = fd; self->delimiter = delimiter;
+    set_levels(&self->global, levels);
+    GlobalData *global = &self->global;
+    global->needle_len = MIN(LEN_MAX, copy_unicode_object(needle, global->needle, arraysz(global->needle)));
+    global->needle_mask = char_mask(global->needle, global->needle_len);
+    self->results.limit = limit;
+    self->num_scorers = MAX(1, num_threads > 0 ? num_threads : cpu_count());
+    self->lock = alloc_lock(); self->cond = alloc_condition();
+    self->threads = alloc_threads(self->num_scorers + 1);
+    self->scorers = calloc(self->num_scorers, sizeof(Scorer));
+    if (!self->lock || !self->cond || !self->threads || !self->scorers) { Py_CLEAR(self); return PyErr_NoMemory(); }
+    for (size_t i = 0; i < self->num_scorers; i++) {
+        self->scorers[i].stream = self;
+        // The length of the lines is not known in advance
+        self->scorers[i].workspace = alloc_workspace(LEN_MAX, global);
+        if (!self->scorers[i].workspace) { Py_CLEAR(self); return PyErr_NoMemory(); }
+    }
+    if (!global->needle_len) {
+        // Nothing can match an empty needle, so there is no need to read anything
+        self->input_finished = true;
+        return (PyObject*)self;
+    }
+    for (size_t i = 0; i < self->num_scorers; i++) {
+        if (!start_thread(self->threads, i + 1, SCORER_FUNC, self->scorers + i)) break;
+        self->num_started++;
+    }
+    if (self->num_started) self->reader_started = start_thread(self->threads, 0, READER_FUNC, self);
+    if (!self->reader_started) {
+        Py_CLEAR(self);
+        PyErr_SetString(PyExc_OSError, "Failed to start threads for matching");
+    }
+    return (PyObject*)self;
+}
+
+static PyObject*
+Stream_results(Stream *self, PyObject *args) {
+    int output_positions;
+    PyObject *mark_before, *mark_after, *delimiter;
+    Options opts = {0};
+    GlobalData global = self->global;
+    global.output = NULL; global.output_sz = 0; global.output_pos = 0; global.oom = 0;
+    if (!PyArg_ParseTuple(args, "pUUU", &output_positions, &mark_before, &mark_after, &delimiter)) return NULL;
+    opts.output_positions = output_positions ? true : false;
+    opts.limit = self->results.limit;
+    opts.mark_before_sz = copy_unicode_object(mark_before, opts.mark_before, arraysz(opts.mark_before));
+    opts.mark_after_sz = copy_unicode_object(mark_after, opts.mark_after, arraysz(opts.mark_after));
+    opts.delimiter_sz = copy_unicode_object(delimiter, opts.delimiter, arraysz(opts.delimiter));
+    Results snapshot = {0};
+    bool oom;
+    acquire_lock(self->lock);
+    oom = self->oom;
+    snapshot.count = self->results.count;
+    snapshot.items = malloc(MAX(1u, snapshot.count) * sizeof(Candidate*));
+    if (snapshot.items) memcpy(snapshot.items, self->results.items, snapshot.count * sizeof(Candidate*));
+    release_lock(self->lock);
+    if (oom || !snapshot.items) { free(snapshot.items); return PyErr_NoMemory(); }
+    Py_BEGIN_ALLOW_THREADS;
+    output_results(&global, &snapshot, 1, &opts, global.needle_len);
+    Py_END_ALLOW_THREADS;
+    free(snapshot.items);
+    return output_as_unicode(&global);
+}
+
+static PyObject*
+Stream_status(Stream *self, PyObject *args) {
+    (void)(args);
+    acquire_lock(self->lock);
+    PyObject *ans = Py_BuildValue("{sOsnsn}", "finished", is_finished(self) ? Py_True : Py_False, "read", (Py_ssize_t)self->num_read, "scored", (Py_ssize_t)self->num_scored);
+    release_lock(self->lock);
+    return ans;
+}
+
+static PyObject*
+Stream_wait(Stream *self, PyObject *args) {
+    (void)(args);
+    Py_BEGIN_ALLOW_THREADS;
+    acquire_lock(self->lock);
+    while (!is_finished(self) && !self->stop) wait_for_condition(self->cond, self->lock);
+    release_lock(self->lock);
+    Py_END_ALLOW_THREADS;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Stream_methods[] = {
+    {"results", (PyCFunction)Stream_results, METH_VARARGS, "results(output_positions, mark_before, mark_after, delimiter) -> The best results found so far"},
+    {"status", (PyCFunction)Stream_status, METH_NOARGS, "The number of lines read and scored so far and whether all input has been scored"},
+    {"wait", (PyCFunction)Stream_wait, METH_NOARGS, "Wait for all input to be read and scored"},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static PyTypeObject Stream_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "subseq_matcher.Stream",
+    .tp_basicsize = sizeof(Stream),
+    .tp_dealloc = (destructor)Stream_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Stream(fd, levels, needle, limit, num_threads, delimiter)",
+    .tp_methods = Stream_methods,
+    .tp_new = Stream_new,
+};
+
+bool
+init_stream(PyObject *module) {
+    if (PyType_Ready(&Stream_Type) < 0) return false;
+    Py_INCREF(&Stream_Type);
+    if (PyModule_AddObject(module, "Stream", (PyObject*)&Stream_Type) != 0) { Py_DECREF(&Stream_Type); return false; }
+    return true;
+}
+
+// }}}
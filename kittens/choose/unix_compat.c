@@ -23,6 +23,11 @@ cpu_count() {
     return sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+size_t
+atomic_fetch_add_size(size_t *target, size_t amt) {
+    return __atomic_fetch_add(target, amt, __ATOMIC_RELAXED);
+}
+
 
 void*
 alloc_threads(size_t num_threads) {
@@ -48,3 +53,47 @@ void
 free_threads(void *threads) {
     free(threads);
 }
+
+void*
+alloc_lock(void) {
+    pthread_mutex_t *ans = malloc(sizeof(pthread_mutex_t));
+    if (ans && pthread_mutex_init(ans, NULL) != 0) { free(ans); ans = NULL; }
+    return ans;
+}
+
+void
+free_lock(void *lock) {
+    if (lock) { pthread_mutex_destroy(lock); free(lock); }
+}
+
+void
+acquire_lock(void *lock) {
+    pthread_mutex_lock(lock);
+}
+
+void
+release_lock(void *lock) {
+    pthread_mutex_unlock(lock);
+}
+
+void*
+alloc_condition(void) {
+    pthread_cond_t *ans = malloc(sizeof(pthread_cond_t));
+    if (ans && pthread_cond_init(ans, NULL) != 0) { free(ans); ans = NULL; }
+    return ans;
+}
+
+void
+free_condition(void *cond) {
+    if (cond) { pthread_cond_destroy(cond); free(cond); }
+}
+
+void
+wait_for_condition(void *cond, void *lock) {
+    pthread_cond_wait(cond, lock);
+}
+
+void
+signal_condition(void *cond) {
+    pthread_cond_broadcast(cond);
+}
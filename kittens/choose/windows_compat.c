@@ -19,6 +19,15 @@ cpu_count() {
     return sysinfo.dwNumberOfProcessors;
 }
 
+size_t
+atomic_fetch_add_size(size_t *target, size_t amt) {
+#ifdef _WIN64
+    return (size_t)InterlockedExchangeAdd64((LONG64 volatile*)target, (LONG64)amt);
+#else
+    return (size_t)InterlockedExchangeAdd((LONG volatile*)target, (LONG)amt);
+#endif
+}
+
 void*
 alloc_threads(size_t num_threads) {
     return calloc(num_threads, sizeof(uintptr_t));
@@ -49,6 +58,50 @@ free_threads(void *threads) {
     free(threads);
 }
 
+void*
+alloc_lock(void) {
+    CRITICAL_SECTION *ans = malloc(sizeof(CRITICAL_SECTION));
+    if (ans) InitializeCriticalSection(ans);
+    return ans;
+}
+
+void
+free_lock(void *lock) {
+    if (lock) { DeleteCriticalSection(lock); free(lock); }
+}
+
+void
+acquire_lock(void *lock) {
+    EnterCriticalSection(lock);
+}
+
+void
+release_lock(void *lock) {
+    LeaveCriticalSection(lock);
+}
+
+void*
+alloc_condition(void) {
+    CONDITION_VARIABLE *ans = malloc(sizeof(CONDITION_VARIABLE));
+    if (ans) InitializeConditionVariable(ans);
+    return ans;
+}
+
+void
+free_condition(void *cond) {
+    free(cond);
+}
+
+void
+wait_for_condition(void *cond, void *lock) {
+    SleepConditionVariableCS(cond, lock, INFINITE);
+}
+
+void
+signal_condition(void *cond) {
+    WakeAllConditionVariable(cond);
+}
+
 ssize_t
 getdelim(char **lineptr, size_t *n, int delim, FILE *stream) {
     char c, *cur_pos, *new_lineptr;
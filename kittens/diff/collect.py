@@ -2,12 +2,14 @@
 # vim:fileencoding=utf-8
 # License: GPL v3 Copyright: 2018, Kovid Goyal <kovid at kovidgoyal.net>
 
+import concurrent.futures
 import os
 import re
 from functools import lru_cache
-from hashlib import md5
 from mimetypes import guess_type
 
+from .diff_speedup import compare_files, hash_files
+
 path_name_map = {}
 
 
@@ -78,6 +80,24 @@ class Collection:
         return len(self.all_paths)
 
 
+def worker_pool():
+    if worker_pool.ans is None:
+        worker_pool.ans = concurrent.futures.ThreadPoolExecutor(max_workers=os.cpu_count())
+    return worker_pool.ans
+
+
+worker_pool.ans = None
+
+
+def parallel_map(func, items, chunk_size=64):
+    # func must release the GIL, it is called with lists of items
+    chunks = [items[i:i + chunk_size] for i in range(0, len(items), chunk_size)]
+    ans = []
+    for result in worker_pool().map(func, chunks):
+        ans.extend(result)
+    return ans
+
+
 def collect_files(collection, left, right):
     left_names, right_names = set(), set()
     left_path_map, right_path_map = {}, {}
@@ -90,19 +110,25 @@ def collect_files(collection, left, right):
                 names.add(name)
                 pmap[name] = path
 
-    walk(left, left_names, left_path_map), walk(right, right_names, right_path_map)
-    common_names = left_names & right_names
-    changed_names = {n for n in common_names if data_for_path(left_path_map[n]) != data_for_path(right_path_map[n])}
-    for n in changed_names:
-        collection.add_change(left_path_map[n], right_path_map[n])
-
-    removed = left_names - common_names
-    added = right_names - common_names
-    ahash = {a: hash_for_path(right_path_map[a]) for a in added}
-    rhash = {r: hash_for_path(left_path_map[r]) for r in removed}
-    for name, rh in rhash.items():
-        for n, ah in ahash.items():
-            if ah == rh and data_for_path(left_path_map[name]) == data_for_path(right_path_map[n]):
+    tuple(worker_pool().map(walk, (left, right), (left_names, right_names), (left_path_map, right_path_map)))
+    common_names = sorted(left_names & right_names)
+    # Only files that differ are ever read into memory, identical files are
+    # compared without the GIL, and without reading them if their sizes differ
+    equal = parallel_map(compare_files, [(left_path_map[n], right_path_map[n]) for n in common_names])
+    for n, is_equal in zip(common_names, equal):
+        if not is_equal:
+            collection.add_change(left_path_map[n], right_path_map[n])
+
+    removed = sorted(left_names - right_names)
+    added = sorted(right_names - left_names)
+    added_by_hash = {}
+    for name, h in zip(added, parallel_map(hash_files, [right_path_map[n] for n in added])):
+        added_by_hash.setdefault(h, []).append(name)
+    added_by_hash.pop(None, None)
+    added = set(added)
+    for name, rh in zip(removed, parallel_map(hash_files, [left_path_map[n] for n in removed])):
+        for n in added_by_hash.get(rh, ()):
+            if n in added and compare_files([(left_path_map[name], right_path_map[n])])[0]:
                 collection.add_rename(left_path_map[name], right_path_map[n])
                 added.discard(n)
                 break
@@ -156,11 +182,6 @@ def lines_for_path(path):
 lines_for_path.replace_tab_by = ' ' * 4
 
 
-@lru_cache(maxsize=1024)
-def hash_for_path(path):
-    return md5(raw_data_for_path(path)).digest()
-
-
 def create_collection(left, right):
     collection = Collection()
     if os.path.isdir(left):
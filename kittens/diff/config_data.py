@@ -47,6 +47,9 @@ o('diff_cmd', 'auto', long_text=_('''
 The diff command to use. Must contain the placeholder :code:`_CONTEXT_`
 which will be replaced by the number of lines of context. The default
 is to search the system for either git or diff and use that, if found.
+A value of :code:`builtin` means to use the diff implementation built into
+kitty, which does not need to run a separate program for every file, and so
+is much faster when comparing directories with many changed files.
 '''))
 
 o('replace_tab_by', r'\x20\x20\x20\x20', option_type=python_string, long_text=_('''
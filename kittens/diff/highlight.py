@@ -5,12 +5,17 @@
 import concurrent
 import os
 import re
+import struct
+import zlib
+from array import array
+from hashlib import sha1
 
-from pygments import highlight
+from pygments import __version__ as pygments_version, highlight
 from pygments.formatter import Formatter
 from pygments.lexers import get_lexer_for_filename
 from pygments.util import ClassNotFound
 
+from kitty.constants import cache_dir, str_version
 from kitty.rgb import color_as_sgr, parse_sharp
 
 from .collect import Segment, data_for_path, lines_for_path
@@ -31,6 +36,7 @@ class DiffFormatter(Formatter):
         if not initialized:
             raise StyleNotFound('pygments style "{}" not found'.format(style))
 
+        self.style_name = style
         self.styles = {}
         for token, style in self.style:
             start = []
@@ -84,12 +90,17 @@ def initialize_highlighter(style='default'):
     formatter = DiffFormatter(style)
 
 
-def highlight_data(code, filename, aliases=None):
+def lexer_filename(filename, aliases=None):
     if aliases:
         base, ext = os.path.splitext(filename)
         alias = aliases.get(ext[1:])
         if alias is not None:
             filename = base + '.' + alias
+    return filename
+
+
+def highlight_data(code, filename, aliases=None):
+    filename = lexer_filename(filename, aliases)
     try:
         lexer = get_lexer_for_filename(filename, stripnl=False)
     except ClassNotFound:
@@ -119,28 +130,150 @@ def highlight_line(line):
     return ans
 
 
-def highlight_for_diff(path, aliases):
+def highlight_for_diff(path, aliases, cache_path=None):
     ans = []
     lines = lines_for_path(path)
     hd = highlight_data('\n'.join(lines), path, aliases)
     if hd is not None:
         for line in hd.splitlines():
             ans.append(highlight_line(line))
+    if cache_path is not None:
+        write_cache_entry(cache_path, ans)
+    return ans
+
+
+# On disk cache of highlights {{{
+
+# The lexer is determined by the file name and the contents, so those are
+# used in the key, along with everything else that changes the escape codes.
+# Every entry is a zlib compressed table of the distinct escape codes followed
+# by an array of integers, for every line: the number of segments and then
+# the start, end, start code index and end code index of every segment.
+
+CACHE_FORMAT_VERSION = 1
+MAX_CACHE_ENTRIES = 4096
+
+
+def highlight_cache_dir():
+    ans = getattr(highlight_cache_dir, 'ans', False)
+    if ans is False:
+        try:
+            ans = os.path.join(cache_dir(), 'diff-highlight')
+            os.makedirs(ans, exist_ok=True)
+        except OSError:
+            ans = None
+        highlight_cache_dir.ans = ans
+    return ans
+
+
+def cache_path_for(path, aliases, cdir):
+    h = sha1('{}:{}:{}:{}:{}\0'.format(
+        CACHE_FORMAT_VERSION, str_version, pygments_version, formatter.style_name,
+        os.path.basename(lexer_filename(path, aliases))).encode('utf-8'))
+    h.update('\n'.join(lines_for_path(path)).encode('utf-8', 'surrogatepass'))
+    return os.path.join(cdir, h.hexdigest())
+
+
+def serialize_highlights(highlights):
+    codes, code_map, nums = [], {}, array('I')
+
+    def code_index(code):
+        ans = code_map.get(code)
+        if ans is None:
+            ans = code_map[code] = len(codes)
+            codes.append(code)
+        return ans
+
+    for line in highlights:
+        nums.append(len(line))
+        for sg in line:
+            nums.extend((sg.start, sg.end, code_index(sg.start_code), code_index(sg.end_code)))
+    header = '\0'.join(codes).encode('utf-8')
+    return zlib.compress(struct.pack('=I', len(header)) + header + nums.tobytes(), 1)
+
+
+def deserialize_highlights(data):
+    data = zlib.decompress(data)
+    hlen = struct.unpack_from('=I', data)[0]
+    codes = data[4:4 + hlen].decode('utf-8').split('\0')
+    nums = array('I')
+    nums.frombytes(data[4 + hlen:])
+    ans, pos = [], 0
+    while pos < len(nums):
+        line, count = [], nums[pos]
+        pos += 1
+        for i in range(count):
+            sg = Segment(nums[pos], codes[nums[pos + 2]])
+            sg.end, sg.end_code = nums[pos + 1], codes[nums[pos + 3]]
+            line.append(sg)
+            pos += 4
+        ans.append(line)
     return ans
 
 
+def read_cache_entry(cache_path):
+    try:
+        with open(cache_path, 'rb') as f:
+            ans = deserialize_highlights(f.read())
+        # The modification time is used to expire the least recently used entries
+        os.utime(cache_path)
+    except Exception:
+        return
+    return ans
+
+
+def write_cache_entry(cache_path, highlights):
+    data = serialize_highlights(highlights)
+    temp_path = '{}.{}.tmp'.format(cache_path, os.getpid())
+    try:
+        with open(temp_path, 'wb') as f:
+            f.write(data)
+        os.replace(temp_path, cache_path)
+    except OSError:
+        try:
+            os.remove(temp_path)
+        except OSError:
+            pass
+
+
+def prune_cache(cdir):
+    try:
+        entries = [e for e in os.scandir(cdir) if e.is_file()]
+        if len(entries) > MAX_CACHE_ENTRIES:
+            entries.sort(key=lambda e: e.stat().st_mtime)
+            for e in entries[:len(entries) - MAX_CACHE_ENTRIES]:
+                os.remove(e.path)
+    except OSError:
+        pass
+
+# }}}
+
+
 def highlight_collection(collection, aliases=None):
     jobs = {}
     ans = {}
-    with concurrent.futures.ProcessPoolExecutor(max_workers=os.cpu_count()) as executor:
+    pending = {}
+    cdir = highlight_cache_dir()
+    for path, item_type, other_path in collection:
+        if item_type != 'rename':
+            for p in (path, other_path):
+                if p and p not in ans and p not in pending:
+                    is_binary = isinstance(data_for_path(p), bytes)
+                    if not is_binary:
+                        cache_path = highlights = None
+                        if cdir is not None:
+                            cache_path = cache_path_for(p, aliases, cdir)
+                            highlights = read_cache_entry(cache_path)
+                        if highlights is None:
+                            pending[p] = cache_path
+                        else:
+                            ans[p] = highlights
+    if not pending:
+        return ans
+    with concurrent.futures.ProcessPoolExecutor(max_workers=min(len(pending), os.cpu_count())) as executor:
         highlight_collection.processes = executor._processes
-        for path, item_type, other_path in collection:
-            if item_type != 'rename':
-                for p in (path, other_path):
-                    if p:
-                        is_binary = isinstance(data_for_path(p), bytes)
-                        if not is_binary:
-                            jobs[executor.submit(highlight_for_diff, p, aliases)] = p
+        for p, cache_path in pending.items():
+            jobs[executor.submit(highlight_for_diff, p, aliases, cache_path)] = p
         for future in concurrent.futures.as_completed(jobs):
             path = jobs[future]
             try:
@@ -148,6 +281,8 @@ def highlight_collection(collection, aliases=None):
             except Exception as e:
                 return 'Running syntax highlighting for {} generated an exception: {}'.format(path, e)
             ans[path] = highlights
+    if cdir is not None:
+        prune_cache(cdir)
     return ans
 
 
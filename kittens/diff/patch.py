@@ -8,12 +8,13 @@ import shlex
 import shutil
 import subprocess
 
-from .collect import lines_for_path
-from .diff_speedup import changed_center
+from .collect import lines_for_path, worker_pool
+from .diff_speedup import changed_center, diff_lines
 
 left_lines = right_lines = None
 GIT_DIFF = 'git diff --no-color --no-ext-diff --exit-code -U_CONTEXT_ --no-index --'
 DIFF_DIFF = 'diff -p -U _CONTEXT_ --'
+BUILTIN_DIFF = 'builtin'
 worker_processes = []
 
 
@@ -25,7 +26,9 @@ def find_differ():
 
 
 def set_diff_command(opt):
-    if opt == 'auto':
+    if opt == BUILTIN_DIFF:
+        cmd = BUILTIN_DIFF
+    elif opt == 'auto':
         cmd = find_differ()
         if cmd is None:
             raise SystemExit('Failed to find either the git or diff programs on your system')
@@ -53,6 +56,14 @@ def run_diff(file1, file2, context=3):
     return False, returncode, stderr.decode('utf-8')
 
 
+def run_builtin_diff(file1, file2, context=3):
+    # returns: ok, is_different, hunks
+    # The diffing is done with the GIL released, so that files are diffed in
+    # parallel by the threads of the executor
+    hunks = diff_lines(lines_for_path(file1), lines_for_path(file2), context)
+    return True, bool(hunks), hunks
+
+
 class Chunk:
 
     __slots__ = ('is_context', 'left_start', 'right_start', 'left_count', 'right_count', 'centers')
@@ -137,6 +148,16 @@ class Hunk:
         self.ensure_context_chunk()
         self.current_chunk.context_line()
 
+    def add_chunk(self, is_context, left_count, right_count):
+        if is_context:
+            self.ensure_context_chunk()
+        else:
+            self.ensure_diff_chunk()
+            self.added_count += right_count
+            self.removed_count += left_count
+        self.current_chunk.left_count += left_count
+        self.current_chunk.right_count += right_count
+
     def finalize(self):
         self.chunks.append(self.current_chunk)
         del self.current_chunk
@@ -206,6 +227,19 @@ def parse_patch(raw):
     return Patch(all_hunks)
 
 
+def patch_from_hunks(hunks):
+    # Convert the hunks returned by diff_lines(), which have zero based
+    # starting line numbers, to the numbering used in unified diffs
+    all_hunks = []
+    for title, left_start, left_count, right_start, right_count, chunks in hunks:
+        h = Hunk(title, (left_start + 1 if left_count else left_start, left_count), (right_start + 1 if right_count else right_start, right_count))
+        for is_context, lc, rc in chunks:
+            h.add_chunk(is_context, lc, rc)
+        h.finalize()
+        all_hunks.append(h)
+    return Patch(all_hunks)
+
+
 class Differ:
 
     diff_executor = None
@@ -214,7 +248,7 @@ class Differ:
         self.jmap = {}
         self.jobs = []
         if Differ.diff_executor is None:
-            Differ.diff_executor = self.diff_executor = concurrent.futures.ThreadPoolExecutor(max_workers=os.cpu_count())
+            Differ.diff_executor = self.diff_executor = worker_pool()
 
     def add_diff(self, file1, file2):
         self.jmap[file1] = file2
@@ -224,7 +258,8 @@ class Differ:
         global left_lines, right_lines
         ans = {}
         executor = Differ.diff_executor
-        jobs = {executor.submit(run_diff, key, self.jmap[key], context): key for key in self.jobs}
+        builtin = set_diff_command.cmd == BUILTIN_DIFF
+        jobs = {executor.submit(run_builtin_diff if builtin else run_diff, key, self.jmap[key], context): key for key in self.jobs}
         for future in concurrent.futures.as_completed(jobs):
             key = jobs[future]
             left_path, right_path = key, self.jmap[key]
@@ -239,7 +274,7 @@ class Differ:
             left_lines = lines_for_path(left_path)
             right_lines = lines_for_path(right_path)
             try:
-                patch = parse_patch(output)
+                patch = patch_from_hunks(output) if builtin else parse_patch(output)
             except Exception:
                 import traceback
                 return traceback.format_exc() + '\nParsing diff for {} vs. {} failed'.format(left_path, right_path)
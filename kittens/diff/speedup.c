@@ -6,6 +6,11 @@
  */
 
 #include "data-types.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static PyObject*
 changed_center(PyObject *self UNUSED, PyObject *args) {
@@ -155,9 +160,542 @@ split_with_highlights(PyObject *self UNUSED, PyObject *args) {
 #undef NEXT_TRUNCATE_POINT
 }
 
+// Diffing {{{
+
+// Line comparisons are reduced to integer comparisons by giving every
+// distinct line a number, lines that do not occur in the other file cannot
+// be matched and are marked as changed before the Myers algorithm is run on
+// the remaining lines. The implementation of the algorithm is the linear
+// space divide and conquer one, with the same cost limit as in git, so that
+// very different files do not take quadratic time.
+
+#define MAX_COST_MIN 256
+
+typedef struct {
+    const void *data;
+    Py_ssize_t len;
+    int kind;
+} LineData;
+
+typedef struct {
+    uint64_t hash;
+    const LineData *line;
+    unsigned int id;
+} Bucket;
+
+typedef struct {
+    Py_ssize_t left_start, left_count, right_start, right_count;
+} Change;
+
+typedef struct {
+    Py_ssize_t num;
+    LineData *lines;
+    bool *changed;
+    unsigned int *ids, *reduced;
+    Py_ssize_t *reduced_map, num_reduced;
+} Side;
+
+typedef struct {
+    Side left, right;
+    Change *changes;
+    Py_ssize_t num_changes;
+} DiffData;
+
+typedef struct {
+    const unsigned int *a, *b;
+    bool *changed_a, *changed_b;
+    Py_ssize_t *kvdf, *kvdb, max_cost;
+} Myers;
+
+static inline uint64_t
+hash_line(const LineData *l) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    const uint8_t *p = l->data;
+    for (Py_ssize_t i = 0; i < l->len * l->kind; i++) { h ^= p[i]; h *= 1099511628211ULL; }
+    return h;
+}
+
+static inline bool
+lines_equal(const LineData *a, const LineData *b) {
+    return a->kind == b->kind && a->len == b->len && memcmp(a->data, b->data, a->len * a->kind) == 0;
+}
+
+static bool
+assign_ids(DiffData *d) {
+    size_t sz = 16;
+    while (sz < 2 * (size_t)(d->left.num + d->right.num)) sz *= 2;
+    Bucket *table = calloc(sz, sizeof(Bucket));
+    // bit 1 is set if the line occurs in the left file, bit 2 if in the right
+    uint8_t *present = calloc(d->left.num + d->right.num + 1, sizeof(uint8_t));
+    if (!table || !present) { free(table); free(present); return false; }
+    unsigned int num_ids = 0;
+    Side *sides[2] = {&d->left, &d->right};
+    for (unsigned s = 0; s < 2; s++) {
+        for (Py_ssize_t i = 0; i < sides[s]->num; i++) {
+            const LineData *l = sides[s]->lines + i;
+            uint64_t h = hash_line(l);
+            size_t pos = h & (sz - 1);
+            while (table[pos].id && (table[pos].hash != h || !lines_equal(table[pos].line, l))) pos = (pos + 1) & (sz - 1);
+            if (!table[pos].id) { table[pos].hash = h; table[pos].line = l; table[pos].id = ++num_ids; }
+            sides[s]->ids[i] = table[pos].id;
+            present[table[pos].id] |= 1 << s;
+        }
+    }
+    for (unsigned s = 0; s < 2; s++) {
+        Side *side = sides[s];
+        side->num_reduced = 0;
+        for (Py_ssize_t i = 0; i < side->num; i++) {
+            if (present[side->ids[i]] == 3) {
+                side->reduced[side->num_reduced] = side->ids[i];
+                side->reduced_map[side->num_reduced++] = i;
+            } else side->changed[i] = true;
+        }
+    }
+    free(table); free(present);
+    return true;
+}
+
+static void
+split(Myers *m, Py_ssize_t off1, Py_ssize_t lim1, Py_ssize_t off2, Py_ssize_t lim2, Py_ssize_t *s1, Py_ssize_t *s2) {
+    const unsigned int *a = m->a, *b = m->b;
+    Py_ssize_t *kvdf = m->kvdf, *kvdb = m->kvdb;
+    const Py_ssize_t dmin = off1 - lim2, dmax = lim1 - off2, fmid = off1 - off2, bmid = lim1 - lim2;
+    const bool odd = (fmid - bmid) & 1;
+    Py_ssize_t fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid, d, i1, i2;
+    kvdf[fmid] = off1; kvdb[bmid] = lim1;
+    for (Py_ssize_t cost = 1; ; cost++) {
+        // Extend the forward paths
+        if (fmin > dmin) kvdf[--fmin - 1] = -1; else fmin++;
+        if (fmax < dmax) kvdf[++fmax + 1] = -1; else fmax--;
+        for (d = fmax; d >= fmin; d -= 2) {
+            i1 = kvdf[d - 1] >= kvdf[d + 1] ? kvdf[d - 1] + 1 : kvdf[d + 1];
+            i2 = i1 - d;
+            while (i1 < lim1 && i2 < lim2 && a[i1] == b[i2]) { i1++; i2++; }
+            kvdf[d] = i1;
+            if (odd && bmin <= d && d <= bmax && kvdb[d] <= i1) { *s1 = i1; *s2 = i2; return; }
+        }
+        // Extend the backward paths
+        if (bmin > dmin) kvdb[--bmin - 1] = PY_SSIZE_T_MAX; else bmin++;
+        if (bmax < dmax) kvdb[++bmax + 1] = PY_SSIZE_T_MAX; else bmax--;
+        for (d = bmax; d >= bmin; d -= 2) {
+            i1 = kvdb[d - 1] < kvdb[d + 1] ? kvdb[d - 1] : kvdb[d + 1] - 1;
+            i2 = i1 - d;
+            while (i1 > off1 && i2 > off2 && a[i1 - 1] == b[i2 - 1]) { i1--; i2--; }
+            kvdb[d] = i1;
+            if (!odd && fmin <= d && d <= fmax && i1 <= kvdf[d]) { *s1 = i1; *s2 = i2; return; }
+        }
+        if (cost >= m->max_cost) {
+            // Too expensive, split at the furthest reaching path instead of
+            // at the middle snake, the result is no longer minimal
+            Py_ssize_t fbest = -1, fbest1 = -1, bbest = PY_SSIZE_T_MAX, bbest1 = PY_SSIZE_T_MAX;
+            for (d = fmax; d >= fmin; d -= 2) {
+                i1 = MIN(kvdf[d], lim1); i2 = i1 - d;
+                if (lim2 < i2) { i1 = lim2 + d; i2 = lim2; }
+                if (fbest < i1 + i2) { fbest = i1 + i2; fbest1 = i1; }
+            }
+            for (d = bmax; d >= bmin; d -= 2) {
+                i1 = MAX(off1, kvdb[d]); i2 = i1 - d;
+                if (i2 < off2) { i1 = off2 + d; i2 = off2; }
+                if (i1 + i2 < bbest) { bbest = i1 + i2; bbest1 = i1; }
+            }
+            if ((lim1 + lim2) - bbest < fbest - (off1 + off2)) { *s1 = fbest1; *s2 = fbest - fbest1; }
+            else { *s1 = bbest1; *s2 = bbest - bbest1; }
+            return;
+        }
+    }
+}
+
+static void
+compare(Myers *m, Py_ssize_t off1, Py_ssize_t lim1, Py_ssize_t off2, Py_ssize_t lim2) {
+    Py_ssize_t s1, s2;
+    while (true) {
+        while (off1 < lim1 && off2 < lim2 && m->a[off1] == m->b[off2]) { off1++; off2++; }
+        while (off1 < lim1 && off2 < lim2 && m->a[lim1 - 1] == m->b[lim2 - 1]) { lim1--; lim2--; }
+        if (off1 == lim1) { while (off2 < lim2) m->changed_b[off2++] = true; return; }
+        if (off2 == lim2) { while (off1 < lim1) m->changed_a[off1++] = true; return; }
+        split(m, off1, lim1, off2, lim2, &s1, &s2);
+        compare(m, off1, s1, off2, s2);
+        off1 = s1; off2 = s2;
+    }
+}
+
+static bool
+run_myers(DiffData *d) {
+    const Py_ssize_t n = d->left.num_reduced, m = d->right.num_reduced, ndiags = n + m + 3;
+    Py_ssize_t *kvd = malloc(sizeof(Py_ssize_t) * (2 * ndiags + 2));
+    bool *changed = calloc(n + m + 1, sizeof(bool));
+    if (!kvd || !changed) { free(kvd); free(changed); return false; }
+    Myers my = {.a = d->left.reduced, .b = d->right.reduced, .changed_a = changed, .changed_b = changed + n, .kvdf = kvd + m + 1};
+    my.kvdb = my.kvdf + ndiags;
+    my.max_cost = 1;
+    for (Py_ssize_t x = ndiags; x > 0; x >>= 2) my.max_cost <<= 1;
+    my.max_cost = MAX(my.max_cost, MAX_COST_MIN);
+    compare(&my, 0, n, 0, m);
+    for (Py_ssize_t i = 0; i < n; i++) { if (changed[i]) d->left.changed[d->left.reduced_map[i]] = true; }
+    for (Py_ssize_t i = 0; i < m; i++) { if (changed[n + i]) d->right.changed[d->right.reduced_map[i]] = true; }
+    free(kvd); free(changed);
+    return true;
+}
+
+static bool
+find_changes(DiffData *d) {
+    const Side *l = &d->left, *r = &d->right;
+    Py_ssize_t i = 0, j = 0;
+    for (unsigned pass = 0; pass < 2; pass++) {
+        i = 0; j = 0; d->num_changes = 0;
+        while (i < l->num || j < r->num) {
+            if ((i < l->num && l->changed[i]) || (j < r->num && r->changed[j])) {
+                Change c = {.left_start = i, .right_start = j};
+                while (i < l->num && l->changed[i]) i++;
+                while (j < r->num && r->changed[j]) j++;
+                c.left_count = i - c.left_start; c.right_count = j - c.right_start;
+                if (pass) d->changes[d->num_changes] = c;
+                d->num_changes++;
+            } else { i++; j++; }
+        }
+        if (!pass) {
+            d->changes = malloc(sizeof(Change) * (d->num_changes + 1));
+            if (!d->changes) return false;
+        }
+    }
+    return true;
+}
+
+static bool
+compute_diff(DiffData *d) {
+    return assign_ids(d) && run_myers(d) && find_changes(d);
+}
+
+static void
+free_diff_data(DiffData *d) {
+    Side *sides[2] = {&d->left, &d->right};
+    for (unsigned s = 0; s < 2; s++) {
+        free(sides[s]->lines); free(sides[s]->changed); free(sides[s]->ids); free(sides[s]->reduced); free(sides[s]->reduced_map);
+    }
+    free(d->changes);
+}
+
+static bool
+init_side(Side *side, PyObject *seq) {
+    side->num = PySequence_Fast_GET_SIZE(seq);
+    side->lines = malloc(sizeof(LineData) * (side->num + 1));
+    side->changed = calloc(side->num + 1, sizeof(bool));
+    side->ids = malloc(sizeof(unsigned int) * (side->num + 1));
+    side->reduced = malloc(sizeof(unsigned int) * (side->num + 1));
+    side->reduced_map = malloc(sizeof(Py_ssize_t) * (side->num + 1));
+    if (!side->lines || !side->changed || !side->ids || !side->reduced || !side->reduced_map) { PyErr_NoMemory(); return false; }
+    for (Py_ssize_t i = 0; i < side->num; i++) {
+        PyObject *line = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyUnicode_Check(line)) { PyErr_SetString(PyExc_TypeError, "lines must be strings"); return false; }
+        if (PyUnicode_READY(line) != 0) return false;
+        side->lines[i].data = PyUnicode_DATA(line);
+        side->lines[i].kind = PyUnicode_KIND(line);
+        side->lines[i].len = PyUnicode_GET_LENGTH(line);
+    }
+    return true;
+}
+
+static inline bool
+is_function_line(const LineData *l) {
+    // The same default as git uses for hunk headers
+    if (!l->len) return false;
+    Py_UCS4 ch = PyUnicode_READ(l->kind, l->data, 0);
+    return (ch < 128 && isalpha(ch)) || ch == '_' || ch == '$';
+}
+
+static PyObject*
+build_hunks(DiffData *d, PyObject *left, Py_ssize_t context) {
+    PyObject *ans = PyList_New(0);
+    if (!ans) return NULL;
+    Py_ssize_t title_line = -1, searched_to = -1;
+#define CHECK(x) if (!(x)) { Py_XDECREF(chunks); Py_DECREF(ans); return NULL; }
+#define ADD_CHUNK(is_context, lc, rc) { \
+    PyObject *chunk = Py_BuildValue("Onn", (is_context) ? Py_True : Py_False, (Py_ssize_t)(lc), (Py_ssize_t)(rc)); \
+    CHECK(chunk); int ret = PyList_Append(chunks, chunk); Py_DECREF(chunk); CHECK(ret == 0); \
+}
+    for (Py_ssize_t k = 0; k < d->num_changes; k++) {
+        PyObject *chunks = NULL;
+        const Py_ssize_t first = k;
+        // Changes separated by no more than twice the context are merged into one hunk
+        while (k + 1 < d->num_changes && d->changes[k + 1].left_start - (d->changes[k].left_start + d->changes[k].left_count) <= 2 * context) k++;
+        const Change *f = d->changes + first, *l = d->changes + k;
+        const Py_ssize_t before = MIN(context, f->left_start), after = MIN(context, d->left.num - (l->left_start + l->left_count));
+        const Py_ssize_t left_start = f->left_start - before, right_start = f->right_start - before;
+        chunks = PyList_New(0);
+        CHECK(chunks);
+        if (before) ADD_CHUNK(true, before, before);
+        for (const Change *c = f; c <= l; c++) {
+            if (c > f) {
+                Py_ssize_t gap = c->left_start - (c[-1].left_start + c[-1].left_count);
+                ADD_CHUNK(true, gap, gap);
+            }
+            ADD_CHUNK(false, c->left_count, c->right_count);
+        }
+        if (after) ADD_CHUNK(true, after, after);
+        for (Py_ssize_t i = left_start - 1; i > searched_to; i--) {
+            if (is_function_line(d->left.lines + i)) { title_line = i; break; }
+        }
+        searched_to = left_start - 1;
+        PyObject *title = title_line > -1 ? PySequence_Fast_GET_ITEM(left, title_line) : NULL;
+        PyObject *hunk = Py_BuildValue("NnnnnN", title ? PyObject_CallMethod(title, "strip", NULL) : PyUnicode_FromString(""),
+                left_start, l->left_start + l->left_count + after - left_start,
+                right_start, l->right_start + l->right_count + after - right_start, chunks);
+        chunks = NULL;
+        CHECK(hunk);
+        int ret = PyList_Append(ans, hunk); Py_DECREF(hunk); CHECK(ret == 0);
+    }
+#undef ADD_CHUNK
+#undef CHECK
+    return ans;
+}
+
+static PyObject*
+diff_lines(PyObject *self UNUSED, PyObject *args) {
+    PyObject *left, *right, *ans = NULL;
+    unsigned int context;
+    if (!PyArg_ParseTuple(args, "OOI", &left, &right, &context)) return NULL;
+    left = PySequence_Fast(left, "left must be a sequence of lines");
+    if (!left) return NULL;
+    right = PySequence_Fast(right, "right must be a sequence of lines");
+    if (!right) { Py_DECREF(left); return NULL; }
+    DiffData d = {{0}};
+    if (init_side(&d.left, left) && init_side(&d.right, right)) {
+        bool ok;
+        Py_BEGIN_ALLOW_THREADS;
+        ok = compute_diff(&d);
+        Py_END_ALLOW_THREADS;
+        if (ok) ans = build_hunks(&d, left, context);
+        else PyErr_NoMemory();
+    }
+    free_diff_data(&d);
+    Py_DECREF(left); Py_DECREF(right);
+    return ans;
+}
+
+// }}}
+
+// Files {{{
+
+// Files are read in chunks, into buffers that are reused for all files, with
+// the GIL released, so that the collection stage can read many files in
+// parallel, without the data ever becoming a Python object. They are read
+// until EOF rather than up to the size they have when opened, as files can be
+// truncated while they are read and special files, such as those in /proc,
+// have a size of zero. The hash is not cryptographic, it is only used to find
+// candidates for renames, which are then confirmed by comparing contents.
+
+#define READ_CHUNK_SZ (64u * 1024u)
+
+static inline ssize_t
+read_chunk(int fd, uint8_t *buf, size_t sz) {
+    // Returns the number of bytes read, which is less than sz only at EOF, or -1 on error
+    size_t pos = 0;
+    while (pos < sz) {
+        ssize_t n = read(fd, buf + pos, sz - pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        pos += n;
+    }
+    return pos;
+}
+
+static inline uint64_t
+rotl(uint64_t x, unsigned r) { return (x << r) | (x >> (64 - r)); }
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+
+static inline uint64_t
+hash_lane(uint64_t h, uint64_t v) { return rotl(h + v * P2, 31) * P1; }
+
+typedef struct {
+    // Four independent lanes of eight bytes each, so that the multiplies
+    // are pipelined
+    uint64_t lanes[4];
+    uint8_t tail[32];
+    size_t tail_sz, total;
+} Hasher;
+
+static inline void
+hasher_init(Hasher *h) {
+    *h = (Hasher){.lanes={P1 + P2, P2, 0, -P1}};
+}
+
+static inline void
+hash_block(Hasher *h, const uint8_t *p) {
+    uint64_t v;
+    for (unsigned l = 0; l < 4; l++) { memcpy(&v, p + 8 * l, 8); h->lanes[l] = hash_lane(h->lanes[l], v); }
+}
+
+static void
+hasher_update(Hasher *h, const uint8_t *p, size_t sz) {
+    h->total += sz;
+    if (h->tail_sz) {
+        size_t n = MIN(sz, sizeof(h->tail) - h->tail_sz);
+        memcpy(h->tail + h->tail_sz, p, n);
+        h->tail_sz += n; p += n; sz -= n;
+        if (h->tail_sz < sizeof(h->tail)) return;
+        hash_block(h, h->tail);
+        h->tail_sz = 0;
+    }
+    for (; sz >= 32; p += 32, sz -= 32) hash_block(h, p);
+    memcpy(h->tail, p, sz);
+    h->tail_sz = sz;
+}
+
+static uint64_t
+hasher_digest(const Hasher *h) {
+    const uint64_t *lanes = h->lanes;
+    const uint8_t *p = h->tail;
+    uint64_t v, ans = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) + h->total;
+    size_t i = 0;
+    for (; i + 8 <= h->tail_sz; i += 8) { memcpy(&v, p + i, 8); ans = rotl(ans ^ hash_lane(0, v), 27) * P1 + P2; }
+    for (; i < h->tail_sz; i++) ans = rotl(ans ^ (p[i] * P1), 11) * P2;
+    ans ^= ans >> 33; ans *= P2; ans ^= ans >> 29; ans *= P1; ans ^= ans >> 32;
+    return ans;
+}
+
+#undef P1
+#undef P2
+
+static inline bool
+hash_file(const char *path, uint8_t *buf, uint64_t *hash) {
+    int fd;
+    while ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 && errno == EINTR);
+    if (fd < 0) return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    Hasher h;
+    hasher_init(&h);
+    ssize_t n;
+    while ((n = read_chunk(fd, buf, READ_CHUNK_SZ)) > 0) {
+        hasher_update(&h, buf, n);
+        if ((size_t)n < READ_CHUNK_SZ) break;
+    }
+    close(fd);
+    if (n < 0) return false;
+    *hash = hasher_digest(&h);
+    return true;
+}
+
+static inline bool
+files_equal(const char *left, const char *right, uint8_t *lbuf, uint8_t *rbuf) {
+    int lfd, rfd;
+    while ((lfd = open(left, O_RDONLY | O_CLOEXEC)) < 0 && errno == EINTR);
+    if (lfd < 0) return false;
+    while ((rfd = open(right, O_RDONLY | O_CLOEXEC)) < 0 && errno == EINTR);
+    if (rfd < 0) { close(lfd); return false; }
+    bool ans = false;
+    while (true) {
+        ssize_t ln = read_chunk(lfd, lbuf, READ_CHUNK_SZ), rn = read_chunk(rfd, rbuf, READ_CHUNK_SZ);
+        if (ln < 0 || rn < 0 || ln != rn || memcmp(lbuf, rbuf, ln) != 0) break;
+        if ((size_t)ln < READ_CHUNK_SZ) { ans = true; break; }
+    }
+    close(lfd); close(rfd);
+    return ans;
+}
+
+static bool
+fs_paths(PyObject *seq, PyObject **paths, Py_ssize_t num) {
+    for (Py_ssize_t i = 0; i < num; i++) {
+        if (!PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(seq, i), paths + i)) return false;
+    }
+    return true;
+}
+
+static PyObject*
+hash_files(PyObject *self UNUSED, PyObject *args) {
+    PyObject *seq;
+    if (!PyArg_ParseTuple(args, "O", &seq)) return NULL;
+    seq = PySequence_Fast(seq, "paths must be a sequence");
+    if (!seq) return NULL;
+    const Py_ssize_t num = PySequence_Fast_GET_SIZE(seq);
+    PyObject **paths = calloc(num + 1, sizeof(PyObject*)), *ans = NULL;
+    uint64_t *hashes = calloc(num + 1, sizeof(uint64_t));
+    bool *ok = calloc(num + 1, sizeof(bool));
+    if (!paths || !hashes || !ok) { PyErr_NoMemory(); goto end; }
+    if (!fs_paths(seq, paths, num)) goto end;
+    uint8_t *buf = NULL;
+    Py_BEGIN_ALLOW_THREADS;
+    buf = malloc(READ_CHUNK_SZ);
+    if (buf) {
+        for (Py_ssize_t i = 0; i < num; i++) ok[i] = hash_file(PyBytes_AS_STRING(paths[i]), buf, hashes + i);
+        free(buf);
+    }
+    Py_END_ALLOW_THREADS;
+    if (!buf) { PyErr_NoMemory(); goto end; }
+    ans = PyList_New(num);
+    if (!ans) goto end;
+    for (Py_ssize_t i = 0; i < num; i++) {
+        PyObject *h = ok[i] ? PyLong_FromUnsignedLongLong(hashes[i]) : Py_None;
+        if (!h) { Py_CLEAR(ans); goto end; }
+        if (!ok[i]) Py_INCREF(h);
+        PyList_SET_ITEM(ans, i, h);
+    }
+end:
+    if (paths) { for (Py_ssize_t i = 0; i < num; i++) Py_XDECREF(paths[i]); }
+    free(paths); free(hashes); free(ok);
+    Py_DECREF(seq);
+    return ans;
+}
+
+static PyObject*
+compare_files(PyObject *self UNUSED, PyObject *args) {
+    PyObject *seq, *ans = NULL;
+    if (!PyArg_ParseTuple(args, "O", &seq)) return NULL;
+    seq = PySequence_Fast(seq, "pairs must be a sequence");
+    if (!seq) return NULL;
+    const Py_ssize_t num = PySequence_Fast_GET_SIZE(seq);
+    PyObject **paths = calloc(2 * num + 1, sizeof(PyObject*));
+    bool *equal = calloc(num + 1, sizeof(bool));
+    if (!paths || !equal) { PyErr_NoMemory(); goto end; }
+    for (Py_ssize_t i = 0; i < num; i++) {
+        PyObject *pair = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyArg_ParseTuple(pair, "O&O&", PyUnicode_FSConverter, paths + 2 * i, PyUnicode_FSConverter, paths + 2 * i + 1)) goto end;
+    }
+    uint8_t *buf = NULL;
+    Py_BEGIN_ALLOW_THREADS;
+    buf = malloc(2 * READ_CHUNK_SZ);
+    if (buf) {
+        for (Py_ssize_t i = 0; i < num; i++) {
+            const char *left = PyBytes_AS_STRING(paths[2 * i]), *right = PyBytes_AS_STRING(paths[2 * i + 1]);
+            struct stat ls, rs;
+            if (stat(left, &ls) != 0 || stat(right, &rs) != 0) continue;
+            // Regular files of different sizes are never read, the size of other files is not meaningful
+            if (S_ISREG(ls.st_mode) && S_ISREG(rs.st_mode) && ls.st_size != rs.st_size) continue;
+            equal[i] = files_equal(left, right, buf, buf + READ_CHUNK_SZ);
+        }
+        free(buf);
+    }
+    Py_END_ALLOW_THREADS;
+    if (!buf) { PyErr_NoMemory(); goto end; }
+    ans = PyList_New(num);
+    if (!ans) goto end;
+    for (Py_ssize_t i = 0; i < num; i++) {
+        PyObject *e = equal[i] ? Py_True : Py_False;
+        Py_INCREF(e);
+        PyList_SET_ITEM(ans, i, e);
+    }
+end:
+    if (paths) { for (Py_ssize_t i = 0; i < 2 * num; i++) Py_XDECREF(paths[i]); }
+    free(paths); free(equal);
+    Py_DECREF(seq);
+    return ans;
+}
+
+// }}}
+
 static PyMethodDef module_methods[] = {
     {"changed_center", (PyCFunction)changed_center, METH_VARARGS, ""},
     {"split_with_highlights", (PyCFunction)split_with_highlights, METH_VARARGS, ""},
+    {"diff_lines", (PyCFunction)diff_lines, METH_VARARGS, ""},
+    {"hash_files", (PyCFunction)hash_files, METH_VARARGS, ""},
+    {"compare_files", (PyCFunction)compare_files, METH_VARARGS, ""},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -11,7 +11,7 @@ from gettext import gettext as _
 from itertools import repeat
 
 from kitty.cli import parse_args
-from kitty.fast_data_types import set_clipboard_string
+from kitty.fast_data_types import find_hint_matches, set_clipboard_string
 from kitty.key_encoding import ESCAPE, backspace_key, enter_key
 from kitty.utils import screen_size_function
 
@@ -232,11 +232,30 @@ def quotes(text, s, e):
     return s, e
 
 
-def mark(pattern, post_processors, text, args):
+def regex_matches(pattern, post_processors, text, args):
     pat = re.compile(pattern)
-    for idx, (s, e) in enumerate(regex_finditer(pat, args.minimum_match_length, text)):
+    for s, e in regex_finditer(pat, args.minimum_match_length, text):
         for func in post_processors:
             s, e = func(text, s, e)
+        yield s, e
+
+
+def native_match_type(args):
+    # The types of matches for which find_hint_matches() gives the same
+    # results as the regular expressions and post processors, much faster
+    if args.type in ('path', 'hash'):
+        return args.type
+    if args.type == 'url' and all(re.match(r'[a-zA-Z0-9_-]+$', x) for x in args.url_prefixes.split(',')):
+        return args.type
+
+
+def mark(pattern, post_processors, text, args):
+    native_type = native_match_type(args)
+    if native_type is None:
+        matches = regex_matches(pattern, post_processors, text, args)
+    else:
+        matches = find_hint_matches(text, native_type, args.minimum_match_length, tuple(args.url_prefixes.split(',')))
+    for idx, (s, e) in enumerate(matches):
         mark_text = text[s:e].replace('\n', '').replace('\0', '')
         yield Mark(idx, s, e, mark_text)
 
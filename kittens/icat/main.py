@@ -9,7 +9,8 @@ import signal
 import sys
 import zlib
 from base64 import standard_b64encode
-from collections import namedtuple
+from collections import deque, namedtuple
+from itertools import count, islice
 from math import ceil
 from tempfile import NamedTemporaryFile
 
@@ -53,12 +54,13 @@ Remove all images currently displayed on the screen.
 
 --transfer-mode
 type=choices
-choices=detect,file,stream
+choices=detect,file,memory,stream
 default=detect
 Which mechanism to use to transfer images to the terminal. The default is to
-auto-detect. :italic:`file` means to use a temporary file and :italic:`stream` means to
-send the data via terminal escape codes. Note that if you use the :italic:`file`
-transfer mode and you are connecting over a remote session then image display
+auto-detect. :italic:`file` means to use a temporary file, :italic:`memory` means
+to use POSIX shared memory and :italic:`stream` means to send the data via
+terminal escape codes. Note that if you use the :italic:`file` or :italic:`memory`
+transfer modes and you are connecting over a remote session then image display
 will not work.
 
 
@@ -168,12 +170,31 @@ def write_chunked(cmd, data):
         cmd.clear()
 
 
-def show(outfile, width, height, fmt, transmit_mode='t', align='center', place=None):
+shm_counter = count()
+
+
+def show(outfile, width, height, fmt, transmit_mode='t', align='center', place=None, data=None):
     cmd = {'a': 'T', 'f': fmt, 's': width, 'v': height}
     if place:
         set_cursor_for_place(place, cmd, width, height, align)
     else:
         set_cursor(cmd, width, height, align)
+    if data is not None:
+        # Decoded pixels, that are not in any file yet
+        if detect_support.has_shm:
+            from kitty.fast_data_types import shm_write
+            name = '/icat-{}-{}'.format(os.getpid(), next(shm_counter))
+            shm_write(name, data)
+            cmd['t'] = 's'
+            write_gr_cmd(cmd, standard_b64encode(name.encode(fsenc)))
+            return
+        if detect_support.has_files:
+            with NamedTemporaryFile(prefix='icat-', delete=False) as f:
+                f.write(data)
+            outfile = f.name
+        else:
+            write_chunked(cmd, data)
+            return
     if detect_support.has_files:
         cmd['t'] = transmit_mode
         write_gr_cmd(cmd, standard_b64encode(os.path.abspath(outfile).encode(fsenc)))
@@ -187,7 +208,52 @@ def show(outfile, width, height, fmt, transmit_mode='t', align='center', place=N
         write_chunked(cmd, data)
 
 
-def process(path, args, is_tempfile):
+def native_image(path, args):
+    # Decode and scale the image in this process, returns None if the image
+    # is in a format that needs ImageMagick
+    from kitty.fast_data_types import load_image
+    ss = screen_size()
+    available_width = args.place.width * (ss.width / ss.cols) if args.place else ss.width
+    available_height = args.place.height * (ss.height / ss.rows) if args.place else 0
+    try:
+        return load_image(path, available_width, available_height, args.scale_up)
+    except (OSError, ValueError) as e:
+        raise OpenFailed(path, str(e))
+
+
+def decode_ahead(items, args):
+    # Yield every item along with a future for its decoded image, while the
+    # images for the next few items are decoded in parallel. Only images in
+    # local files are decoded ahead.
+    from concurrent.futures import ThreadPoolExecutor
+    num_workers = os.cpu_count() or 1
+    with ThreadPoolExecutor(max_workers=num_workers) as pool:
+
+        def submit(item):
+            if isinstance(item, str) and os.path.isfile(item):
+                return item, pool.submit(native_image, item, args)
+            return item, None
+
+        items = iter(items)
+        pending = deque(map(submit, islice(items, 2 * num_workers)))
+        while pending:
+            item, decoded = pending.popleft()
+            pending.extend(map(submit, islice(items, 1)))
+            yield item, decoded
+
+
+def process(path, args, is_tempfile, decoded=None):
+    image = native_image(path, args) if decoded is None else decoded.result()
+    if image is not None:
+        data, width, height, fmt = image
+        if data is None:
+            # A PNG that needs no scaling, send the file itself
+            show(path, width, height, fmt, 't' if is_tempfile else 'f', align=args.align, place=args.place)
+        else:
+            show(None, width, height, fmt, align=args.align, place=args.place, data=data)
+        if not args.place:
+            print()  # ensure cursor is on a new line
+        return
     m = identify(path)
     ss = screen_size()
     available_width = args.place.width * (ss.width / ss.cols) if args.place else ss.width
@@ -220,14 +286,16 @@ def detect_support(wait_for=10, silent=False):
     if not silent:
         print('Checking for graphics ({}s max. wait)...'.format(wait_for), end='\r')
     sys.stdout.flush()
+    from kitty.fast_data_types import shm_unlink, shm_write
+    shm_name = '/icat-{}-detect'.format(os.getpid())
     try:
         received = b''
         responses = {}
 
         def parse_responses():
-            for m in re.finditer(b'\033_Gi=([1|2]);(.+?)\033\\\\', received):
+            for m in re.finditer(b'\033_Gi=([1-3]);(.+?)\033\\\\', received):
                 iid = m.group(1)
-                if iid in (b'1', b'2'):
+                if iid in (b'1', b'2', b'3'):
                     iid = int(iid.decode('ascii'))
                     if iid not in responses:
                         responses[iid] = m.group(2) == b'OK'
@@ -236,18 +304,25 @@ def detect_support(wait_for=10, silent=False):
             nonlocal received
             received += data
             parse_responses()
-            return 1 not in responses or 2 not in responses
+            return 1 not in responses or 2 not in responses or 3 not in responses
 
         with NamedTemporaryFile() as f:
             f.write(b'abcd'), f.flush()
+            shm_write(shm_name, b'abcd')
             write_gr_cmd(dict(a='q', s=1, v=1, i=1), standard_b64encode(b'abcd'))
             write_gr_cmd(dict(a='q', s=1, v=1, i=2, t='f'), standard_b64encode(f.name.encode(fsenc)))
+            write_gr_cmd(dict(a='q', s=1, v=1, i=3, t='s'), standard_b64encode(shm_name.encode(fsenc)))
             with TTYIO() as io:
                 io.recv(more_needed, timeout=float(wait_for))
     finally:
         if not silent:
             sys.stdout.buffer.write(b'\033[J'), sys.stdout.flush()
+        try:
+            shm_unlink(shm_name)  # in case the terminal did not read it
+        except FileNotFoundError:
+            pass
     detect_support.has_files = bool(responses.get(2))
+    detect_support.has_shm = bool(responses.get(3))
     return responses.get(1, False)
 
 
@@ -270,7 +345,7 @@ help_text = (
 usage = 'image-file-or-url-or-directory ...'
 
 
-def process_single_item(item, args, url_pat, maybe_dir=True):
+def process_single_item(item, args, url_pat, errors, maybe_dir=True, decoded=None):
     is_tempfile = False
     try:
         if isinstance(item, bytes):
@@ -300,10 +375,15 @@ def process_single_item(item, args, url_pat, maybe_dir=True):
             process(item, args, is_tempfile)
         else:
             if maybe_dir and os.path.isdir(item):
-                for x in scan(item):
-                    process_single_item(item, args, url_pat, maybe_dir=False)
+                for path, decoded in decode_ahead((x[0] for x in scan(item)), args):
+                    # A file that fails to open must not stop the rest of
+                    # the directory from being displayed
+                    try:
+                        process_single_item(path, args, url_pat, errors, maybe_dir=False, decoded=decoded)
+                    except OpenFailed as e:
+                        errors.append(e)
             else:
-                process(item, args, is_tempfile)
+                process(item, args, is_tempfile, decoded)
     finally:
         if is_tempfile:
             os.remove(item)
@@ -346,13 +426,14 @@ def main(args=sys.argv):
     if args.detect_support:
         if not detect_support(wait_for=args.detection_timeout, silent=True):
             raise SystemExit(1)
-        print('file' if detect_support.has_files else 'stream', end='', file=sys.stderr)
+        print('memory' if detect_support.has_shm else ('file' if detect_support.has_files else 'stream'), end='', file=sys.stderr)
         return
     if args.transfer_mode == 'detect':
         if not detect_support(wait_for=args.detection_timeout, silent=args.silent):
             raise SystemExit('This terminal emulator does not support the graphics protocol, use a terminal emulator such as kitty that does support it')
     else:
-        detect_support.has_files = args.transfer_mode == 'file'
+        detect_support.has_files = args.transfer_mode in ('file', 'memory')
+        detect_support.has_shm = args.transfer_mode == 'memory'
     errors = []
     if args.clear:
         sys.stdout.buffer.write(clear_images_on_screen(delete_data=True))
@@ -365,9 +446,9 @@ def main(args=sys.argv):
             raise SystemExit(f'The --place option can only be used with a single image, not {items}')
         sys.stdout.buffer.write(b'\0337')  # save cursor
     url_pat = re.compile(r'(?:https?|ftp)://', flags=re.I)
-    for item in items:
+    for item, decoded in decode_ahead(items, args):
         try:
-            process_single_item(item, args, url_pat)
+            process_single_item(item, args, url_pat, errors, decoded=decoded)
         except NoImageMagick as e:
             raise SystemExit(str(e))
         except ConvertFailed as e:
@@ -41,12 +41,6 @@ def codepoint_ok(code):
     return not (code <= 32 or code == 127 or 128 <= code <= 159 or 0xd800 <= code <= 0xdbff or 0xDC00 <= code <= 0xDFFF)
 
 
-@lru_cache(maxsize=256)
-def points_for_word(w):
-    from .unicode_names import codepoints_for_word
-    return codepoints_for_word(w.lower())
-
-
 @lru_cache(maxsize=4096)
 def name(cp):
     from .unicode_names import name_for_codepoint
@@ -56,21 +50,11 @@ def name(cp):
 
 
 @lru_cache(maxsize=256)
-def codepoints_matching_search(parts):
-    ans = []
+def codepoints_matching_search(parts, limit=1024):
+    from .unicode_names import codepoints_for_query
     if parts and parts[0] and len(parts[0]) > 1:
-        codepoints = points_for_word(parts[0])
-        for word in parts[1:]:
-            pts = points_for_word(word)
-            if pts:
-                intersection = codepoints & pts
-                if intersection:
-                    codepoints = intersection
-                    continue
-            codepoints = {c for c in codepoints if word in name(c).lower()}
-        if codepoints:
-            ans = list(sorted(codepoints))
-    return ans
+        return codepoints_for_query(tuple(w.lower() for w in parts), limit)
+    return []
 
 
 def parse_favorites(raw):
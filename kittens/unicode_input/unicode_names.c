@@ -6,6 +6,7 @@
  */
 
 #include "names.h"
+#include <ctype.h>
 
 static PyObject*
 all_words(PYNOARG) {
@@ -39,13 +40,13 @@ process_trie_node(const word_trie *wt, char_type *codepoints, size_t *pos, const
     }
 }
 
-static inline PyObject*
-codepoints_for_word(const char *word, size_t len) {
+static inline const word_trie*
+trie_node_for_word(const char *word, size_t len) {
     const word_trie *wt = all_trie_nodes;
     for (size_t i = 0; i < len; i++) {
         unsigned char ch = word[i];
         size_t num_children = children_array[wt->children_offset];
-        if (!num_children) return PyFrozenSet_New(NULL);
+        if (!num_children) return NULL;
         bool found = false;
         for (size_t c = wt->children_offset + 1; c < wt->children_offset + 1 + num_children; c++) {
             uint32_t x = children_array[c];
@@ -55,8 +56,15 @@ codepoints_for_word(const char *word, size_t len) {
                 break;
             }
         }
-        if (!found) return PyFrozenSet_New(NULL);
+        if (!found) return NULL;
     }
+    return wt;
+}
+
+static inline PyObject*
+codepoints_for_word(const char *word, size_t len) {
+    const word_trie *wt = trie_node_for_word(word, len);
+    if (!wt) return PyFrozenSet_New(NULL);
     static char_type codepoints[1024];
     size_t cpos = 0;
     process_trie_node(wt, codepoints, &cpos, arraysz(codepoints));
@@ -84,9 +92,212 @@ nfc(PyObject *self UNUSED, PyObject *args) {
     return PyUnicode_FromString(n);
 }
 
+// Queries {{{
+
+// The codepoints matching a word are those with a word in their name that
+// starts with it. Sets of codepoints are bitmaps indexed by mark, marks are in
+// codepoint order, so iterating over a bitmap gives codepoints in order. The
+// matches for recently used words, and the matches for all but the last word
+// of the last query, are cached, so that typing the last word of a query only
+// needs to match that word.
+
+#define NUM_MARKS arraysz(mark_to_cp)
+#define BITMAP_WORDS ((NUM_MARKS + 63) / 64)
+#define MAX_QUERY_WORDS 16
+#define MAX_WORD_LEN 64
+// Must be at least twice MAX_QUERY_WORDS so that the words of a query are not
+// evicted while it is being run
+#define WORD_CACHE_SIZE 32
+
+typedef struct {
+    uint64_t bits[BITMAP_WORDS];
+} Bitmap;
+
+typedef struct {
+    char word[MAX_WORD_LEN];
+    unsigned long long last_used;
+    bool has_prefix_matches;
+    Bitmap prefix, exact;
+} WordMatches;
+
+static WordMatches word_cache[WORD_CACHE_SIZE];
+static const WordMatches no_matches = {{0}};
+static unsigned long long word_cache_clock = 0;
+static struct {
+    char key[MAX_QUERY_WORDS * MAX_WORD_LEN];
+    size_t key_len;
+    Bitmap candidates;
+} query_cache;
+static Bitmap scratch;
+static uint8_t name_lengths[NUM_MARKS];
+
+static inline void
+set_bit(Bitmap *b, size_t m) { b->bits[m / 64] |= 1ull << (m % 64); }
+
+static inline bool
+has_bit(const Bitmap *b, size_t m) { return (b->bits[m / 64] >> (m % 64)) & 1; }
+
+static void
+add_mark_group(Bitmap *b, uint32_t match_offset) {
+    size_t num = mark_groups[match_offset];
+    for (size_t i = match_offset + 1; i < match_offset + 1 + num; i++) set_bit(b, mark_groups[i]);
+}
+
+static void
+add_trie_node(Bitmap *b, const word_trie *wt) {
+    if (wt->match_offset) add_mark_group(b, wt->match_offset);
+    size_t num_children = children_array[wt->children_offset];
+    for (size_t c = wt->children_offset + 1; c < wt->children_offset + 1 + num_children; c++) {
+        add_trie_node(b, &all_trie_nodes[children_array[c] >> 8]);
+    }
+}
+
+static const WordMatches*
+matches_for_word(const char *word) {
+    size_t len = strlen(word);
+    if (len >= MAX_WORD_LEN) return &no_matches;  // longer than any word in a name
+    WordMatches *ans = word_cache;
+    for (size_t i = 0; i < WORD_CACHE_SIZE; i++) {
+        WordMatches *w = word_cache + i;
+        if (w->last_used && strcmp(w->word, word) == 0) { w->last_used = ++word_cache_clock; return w; }
+        if (w->last_used < ans->last_used) ans = w;
+    }
+    memcpy(ans->word, word, len + 1);
+    ans->last_used = ++word_cache_clock;
+    memset(&ans->prefix, 0, sizeof(Bitmap)); memset(&ans->exact, 0, sizeof(Bitmap));
+    const word_trie *wt = trie_node_for_word(word, len);
+    ans->has_prefix_matches = wt != NULL;
+    if (wt) {
+        if (wt->match_offset) add_mark_group(&ans->exact, wt->match_offset);
+        add_trie_node(&ans->prefix, wt);
+    }
+    return ans;
+}
+
+static inline bool
+name_contains(const char *name, const char *word) {
+    for (; *name; name++) {
+        size_t i = 0;
+        while (word[i] && name[i] && tolower((unsigned char)name[i]) == (unsigned char)word[i]) i++;
+        if (!word[i]) return true;
+    }
+    return false;
+}
+
+static void
+narrow_candidates(Bitmap *candidates, const char *word) {
+    // Codepoints must also match the word, unless that leaves no codepoints,
+    // in which case they must contain the word anywhere in their names
+    const WordMatches *wm = matches_for_word(word);
+    if (wm->has_prefix_matches) {
+        uint64_t any = 0;
+        for (size_t i = 0; i < BITMAP_WORDS; i++) { scratch.bits[i] = candidates->bits[i] & wm->prefix.bits[i]; any |= scratch.bits[i]; }
+        if (any) { *candidates = scratch; return; }
+    }
+    for (size_t i = 0; i < BITMAP_WORDS; i++) {
+        for (uint64_t b = candidates->bits[i]; b; b &= b - 1) {
+            size_t m = i * 64 + __builtin_ctzll(b);
+            if (!name_contains(name_map[m], word)) candidates->bits[i] &= ~(1ull << (m % 64));
+        }
+    }
+}
+
+static void
+find_candidates(const char **words, size_t num_words, Bitmap *candidates) {
+    char key[sizeof(query_cache.key)];
+    size_t key_len = 0;
+    for (size_t i = 0; i + 1 < num_words; i++) {
+        size_t len = strlen(words[i]) + 1;
+        if (key_len + len > sizeof(key)) { key_len = 0; break; }
+        memcpy(key + key_len, words[i], len); key_len += len;
+    }
+    if (key_len && key_len == query_cache.key_len && memcmp(key, query_cache.key, key_len) == 0) {
+        *candidates = query_cache.candidates;
+    } else {
+        *candidates = matches_for_word(words[0])->prefix;
+        for (size_t i = 1; i + 1 < num_words; i++) narrow_candidates(candidates, words[i]);
+        if (key_len) {
+            memcpy(query_cache.key, key, key_len); query_cache.key_len = key_len;
+            query_cache.candidates = *candidates;
+        }
+    }
+    if (num_words > 1) narrow_candidates(candidates, words[num_words - 1]);
+}
+
+typedef struct {
+    uint32_t mark, key;
+} RankedMatch;
+
+static int
+cmp_ranked(const void *a_, const void *b_) {
+    const RankedMatch *a = a_, *b = b_;
+    if (a->key != b->key) return a->key < b->key ? -1 : 1;
+    return a->mark < b->mark ? -1 : (a->mark > b->mark ? 1 : 0);
+}
+
+static PyObject*
+codepoints_for_query(PyObject *self UNUSED, PyObject *args) {
+    // Return up to limit codepoints matching all the words, the ones matching
+    // the most words exactly first, then those with the shortest names
+    PyObject *pywords;
+    unsigned int limit;
+    if (!PyArg_ParseTuple(args, "O!I", &PyTuple_Type, &pywords, &limit)) return NULL;
+    const char *words[MAX_QUERY_WORDS];
+    size_t num_words = MIN((size_t)PyTuple_GET_SIZE(pywords), arraysz(words));
+    for (size_t i = 0; i < num_words; i++) {
+        if (!PyUnicode_Check(PyTuple_GET_ITEM(pywords, i))) { PyErr_SetString(PyExc_TypeError, "words must be strings"); return NULL; }
+        words[i] = PyUnicode_AsUTF8(PyTuple_GET_ITEM(pywords, i));
+        if (!words[i]) return NULL;
+    }
+    if (!num_words) return PyList_New(0);
+    if (!name_lengths[1]) {
+        for (size_t m = 0; m < NUM_MARKS; m++) name_lengths[m] = MIN(strlen(name_map[m]), 255u);
+    }
+    static Bitmap candidates;
+    find_candidates(words, num_words, &candidates);
+    size_t count = 0;
+    for (size_t i = 0; i < BITMAP_WORDS; i++) count += __builtin_popcountll(candidates.bits[i]);
+    RankedMatch *matches = malloc(sizeof(RankedMatch) * (count + 1));
+    if (!matches) return PyErr_NoMemory();
+    count = 0;
+    for (size_t i = 0; i < BITMAP_WORDS; i++) {
+        for (uint64_t b = candidates.bits[i]; b; b &= b - 1) matches[count++].mark = i * 64 + __builtin_ctzll(b);
+    }
+    static uint32_t histogram[(MAX_QUERY_WORDS + 1) * 256];
+    memset(histogram, 0, sizeof(histogram));
+    for (size_t j = 0; j < count; j++) matches[j].key = num_words << 8;
+    for (size_t w = 0; w < num_words; w++) {
+        const WordMatches *wm = matches_for_word(words[w]);
+        for (size_t j = 0; j < count; j++) matches[j].key -= has_bit(&wm->exact, matches[j].mark) << 8;
+    }
+    for (size_t j = 0; j < count; j++) { matches[j].key |= name_lengths[matches[j].mark]; histogram[matches[j].key]++; }
+    // Find the key of the last match that is returned and keep only the
+    // matches before it, so that only those need to be sorted
+    size_t num = limit ? MIN(limit, count) : count, before = 0, last_key = 0;
+    while (last_key < arraysz(histogram) && before + histogram[last_key] < num) before += histogram[last_key++];
+    size_t kept = 0, num_at_last_key = num - before;
+    for (size_t j = 0; j < count && kept < num; j++) {
+        if (matches[j].key < last_key || (matches[j].key == last_key && num_at_last_key && num_at_last_key--)) matches[kept++] = matches[j];
+    }
+    qsort(matches, kept, sizeof(matches[0]), cmp_ranked);
+    PyObject *ans = PyList_New(kept);
+    if (ans) {
+        for (size_t j = 0; j < kept; j++) {
+            PyObject *cp = PyLong_FromUnsignedLong(mark_to_cp[matches[j].mark]);
+            if (!cp) { Py_CLEAR(ans); break; }
+            PyList_SET_ITEM(ans, j, cp);
+        }
+    }
+    free(matches);
+    return ans;
+}
+
+// }}}
+
 static PyMethodDef module_methods[] = {
     {"all_words", (PyCFunction)all_words, METH_NOARGS, ""},
     {"codepoints_for_word", (PyCFunction)cfw, METH_VARARGS, ""},
+    {"codepoints_for_query", (PyCFunction)codepoints_for_query, METH_VARARGS, ""},
     {"name_for_codepoint", (PyCFunction)nfc, METH_VARARGS, ""},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
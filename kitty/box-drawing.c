@@ -0,0 +1,602 @@
+/*
+ * box-drawing.c
+ * Copyright (C) 2019 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+// Native renderer for the box drawing, block element, braille and powerline
+// glyphs. This is a port of kitty/fonts/box_drawing.py, which remains as the
+// reference implementation, and must produce identical output to it, except
+// for the rounded corners, which the python implementation does not have.
+
+#include "fonts.h"
+#include <math.h>
+
+static double scale[4] = {0.001, 1, 1.5, 2};
+
+typedef struct {
+    uint8_t *buf;
+    int width, height;
+    double dpi;
+} Canvas;
+
+#define TOP true
+#define BOTTOM false
+#define LEFT true
+#define RIGHT false
+enum { ONLY_BOTH, ONLY_TOP, ONLY_BOTTOM, ONLY_LEFT, ONLY_RIGHT };
+
+static inline int
+thickness(Canvas *c, unsigned int level) {
+    return (int)ceil(scale[level] * (c->dpi / 72.0));
+}
+
+static inline void
+set_pixel(Canvas *c, int x, int y, uint8_t val) {
+    if (0 <= x && x < c->width && 0 <= y && y < c->height) c->buf[y * c->width + x] = val;
+}
+
+// Lines {{{
+
+static void
+draw_hline(Canvas *c, int x1, int x2, int y, unsigned int level) {
+    // Draw a horizontal line between [x1, x2) centered at y with the thickness given by level
+    int sz = thickness(c, level), start = y - sz / 2;
+    for (y = start; y < start + sz; y++) {
+        for (int x = x1; x < x2; x++) set_pixel(c, x, y, 255);
+    }
+}
+
+static void
+draw_vline(Canvas *c, int y1, int y2, int x, unsigned int level) {
+    // Draw a vertical line between [y1, y2) centered at x with the thickness given by level
+    int sz = thickness(c, level), start = x - sz / 2;
+    for (x = start; x < start + sz; x++) {
+        for (int y = y1; y < y2; y++) set_pixel(c, x, y, 255);
+    }
+}
+
+static void
+half_hline(Canvas *c, unsigned int level, bool left, int extend_by) {
+    int x1 = left ? 0 : c->width / 2 - extend_by, x2 = left ? extend_by + c->width / 2 : c->width;
+    draw_hline(c, x1, x2, c->height / 2, level);
+}
+
+static void
+half_vline(Canvas *c, unsigned int level, bool top, int extend_by) {
+    int y1 = top ? 0 : c->height / 2 - extend_by, y2 = top ? c->height / 2 + extend_by : c->height;
+    draw_vline(c, y1, y2, c->width / 2, level);
+}
+
+static inline void
+hline(Canvas *c, unsigned int level) {
+    half_hline(c, level, LEFT, 0);
+    half_hline(c, level, RIGHT, 0);
+}
+
+static inline void
+vline(Canvas *c, unsigned int level) {
+    half_vline(c, level, TOP, 0);
+    half_vline(c, level, BOTTOM, 0);
+}
+
+static unsigned int
+get_holes(int sz, int hole_sz, unsigned int num, int *holes) {
+    int ssz;
+    switch(num) {
+        case 1:
+            holes[0] = sz / 2;
+            break;
+        case 2:
+            ssz = (sz - 2 * hole_sz) / 3;
+            holes[0] = ssz + hole_sz / 2; holes[1] = 2 * ssz + hole_sz / 2 + hole_sz;
+            break;
+        default:
+            ssz = (sz - 3 * hole_sz) / 4;
+            holes[0] = ssz + hole_sz / 2; holes[1] = 2 * ssz + hole_sz / 2 + hole_sz; holes[2] = 3 * ssz + 2 * hole_sz + hole_sz / 2;
+            break;
+    }
+    for (unsigned int i = 0; i < num; i++) holes[i] -= hole_sz / 2;
+    return num;
+}
+
+#define HOLE_FACTOR 8
+
+static void
+hholes(Canvas *c, unsigned int level, unsigned int num) {
+    hline(c, level);
+    int holes[3], line_sz = thickness(c, level), hole_sz = c->width / HOLE_FACTOR, start = c->height / 2 - line_sz / 2;
+    num = get_holes(c->width, hole_sz, num, holes);
+    for (int y = start; y < start + line_sz; y++) {
+        for (unsigned int i = 0; i < num; i++) {
+            for (int x = holes[i]; x < holes[i] + hole_sz; x++) set_pixel(c, x, y, 0);
+        }
+    }
+}
+
+static void
+vholes(Canvas *c, unsigned int level, unsigned int num) {
+    vline(c, level);
+    int holes[3], line_sz = thickness(c, level), hole_sz = c->height / HOLE_FACTOR, start = c->width / 2 - line_sz / 2;
+    num = get_holes(c->height, hole_sz, num, holes);
+    for (int x = start; x < start + line_sz; x++) {
+        for (unsigned int i = 0; i < num; i++) {
+            for (int y = holes[i]; y < holes[i] + hole_sz; y++) set_pixel(c, x, y, 0);
+        }
+    }
+}
+
+static void
+corner(Canvas *c, unsigned int hlevel, unsigned int vlevel, bool left, bool top) {
+    half_hline(c, hlevel, left, thickness(c, vlevel) / 2);
+    half_vline(c, vlevel, top, 0);
+}
+
+static void
+vert_t(Canvas *c, unsigned int a, unsigned int b, unsigned int d, bool left) {
+    half_vline(c, a, TOP, 0);
+    half_hline(c, b, left, 0);
+    half_vline(c, d, BOTTOM, 0);
+}
+
+static void
+horz_t(Canvas *c, unsigned int a, unsigned int b, unsigned int d, bool top) {
+    half_hline(c, a, LEFT, 0);
+    half_hline(c, b, RIGHT, 0);
+    half_vline(c, d, top, 0);
+}
+
+static void
+cross(Canvas *c, unsigned int a, unsigned int b, unsigned int d, unsigned int e) {
+    half_hline(c, a, LEFT, 0);
+    half_hline(c, b, RIGHT, 0);
+    half_vline(c, d, TOP, 0);
+    half_vline(c, e, BOTTOM, 0);
+}
+
+// }}}
+
+// Double lines {{{
+
+static int
+half_dhline(Canvas *c, unsigned int level, bool left, int only) {
+    int x1 = left ? 0 : c->width / 2, x2 = left ? c->width / 2 : c->width;
+    int gap = thickness(c, level + 1);
+    if (only != ONLY_BOTTOM) draw_hline(c, x1, x2, c->height / 2 - gap, level);
+    if (only != ONLY_TOP) draw_hline(c, x1, x2, c->height / 2 + gap, level);
+    return gap;
+}
+
+static int
+half_dvline(Canvas *c, unsigned int level, bool top, int only) {
+    int y1 = top ? 0 : c->height / 2, y2 = top ? c->height / 2 : c->height;
+    int gap = thickness(c, level + 1);
+    if (only != ONLY_RIGHT) draw_vline(c, y1, y2, c->width / 2 - gap, level);
+    if (only != ONLY_LEFT) draw_vline(c, y1, y2, c->width / 2 + gap, level);
+    return gap;
+}
+
+static inline int
+dhline(Canvas *c, int only) {
+    half_dhline(c, 1, LEFT, only);
+    return half_dhline(c, 1, RIGHT, only);
+}
+
+static inline int
+dvline(Canvas *c, int only) {
+    half_dvline(c, 1, TOP, only);
+    return half_dvline(c, 1, BOTTOM, only);
+}
+
+static void
+dvcorner(Canvas *c, bool left, bool top) {
+    half_dhline(c, 1, left, ONLY_BOTH);
+    int gap = thickness(c, 2);
+    half_vline(c, 1, top, gap / 2 + thickness(c, 1));
+}
+
+static void
+dhcorner(Canvas *c, bool left, bool top) {
+    half_dvline(c, 1, top, ONLY_BOTH);
+    int gap = thickness(c, 2);
+    half_hline(c, 1, left, gap / 2 + thickness(c, 1));
+}
+
+static void
+dcorner(Canvas *c, bool left, bool top) {
+    const unsigned int level = 1;
+    int hgap = thickness(c, level + 1), vgap = thickness(c, level + 1);
+    int x1 = left ? 0 : c->width / 2, x2 = left ? c->width / 2 : c->width;
+    int ydelta = top ? hgap : -hgap;
+    if (left) x2 += vgap; else x1 -= vgap;
+    draw_hline(c, x1, x2, c->height / 2 + ydelta, level);
+    if (left) x2 -= 2 * vgap; else x1 += 2 * vgap;
+    draw_hline(c, x1, x2, c->height / 2 - ydelta, level);
+    int y1 = top ? 0 : c->height / 2, y2 = top ? c->height / 2 : c->height;
+    int xdelta = left ? -vgap : vgap, yd = thickness(c, level) / 2;
+    if (top) y2 += hgap + yd; else y1 -= hgap + yd;
+    draw_vline(c, y1, y2, c->width / 2 - xdelta, level);
+    if (top) y2 -= 2 * hgap; else y1 += 2 * hgap;
+    draw_vline(c, y1, y2, c->width / 2 + xdelta, level);
+}
+
+static void
+dpip(Canvas *c, char_type which) {
+    int gap;
+    switch(which) {
+        case 0x255f:  // ╟
+        case 0x2562:  // ╢
+            gap = dvline(c, ONLY_BOTH);
+            if (which == 0x2562) draw_hline(c, 0, c->width / 2 - gap, c->height / 2, 1);
+            else draw_hline(c, c->width / 2 + gap, c->width, c->height / 2, 1);
+            break;
+        default:
+            gap = dhline(c, ONLY_BOTH);
+            if (which == 0x2567) draw_vline(c, 0, c->height / 2 - gap, c->width / 2, 1);
+            else draw_vline(c, c->height / 2 + gap, c->height, c->width / 2, 1);
+            break;
+    }
+}
+
+static void
+inner_corner(Canvas *c, bool left, bool top) {
+    const unsigned int level = 1;
+    int hgap = thickness(c, level + 1), vgap = thickness(c, level + 1), vthick = thickness(c, level) / 2;
+    int x1 = left ? 0 : c->width / 2 + hgap - vthick, x2 = left ? c->width / 2 - hgap + vthick + 1 : c->width;
+    draw_hline(c, x1, x2, c->height / 2 + (top ? -vgap : vgap), level);
+    int y1 = top ? 0 : c->height / 2 + vgap, y2 = top ? c->height / 2 - vgap : c->height;
+    draw_vline(c, y1, y2, c->width / 2 + (left ? -hgap : hgap), level);
+}
+
+// }}}
+
+// Curves {{{
+
+static inline double
+coverage(double half_thickness, double distance) {
+    // Approximates the fraction of a pixel covered by a line of the specified thickness
+    // whose center is at the specified distance from the center of the pixel
+    return MAX(0, MIN(1, half_thickness + 0.5 - fabs(distance)));
+}
+
+static void
+rounded_corner(Canvas *c, bool left, bool top) {
+    // Draw an anti-aliased quarter circle that meets the straight lines of the
+    // neighboring cells at the middle of the cell edges
+    int sz = thickness(c, 1);
+    double half_thickness = sz / 2.0;
+    double xc = c->width / 2 - sz / 2 + half_thickness, yc = c->height / 2 - sz / 2 + half_thickness;
+    double hdir = left ? -1 : 1, vdir = top ? -1 : 1;
+    // Leave the last pixel at each edge straight so the joins with the neighboring cells are seamless
+    double radius = MAX(1, MIN(left ? xc : c->width - xc, top ? yc : c->height - yc) - 1);
+    double cx = xc + hdir * radius, cy = yc + vdir * radius;
+    for (int y = 0; y < c->height; y++) {
+        double py = y + 0.5;
+        for (int x = 0; x < c->width; x++) {
+            double px = x + 0.5, alpha = 0;
+            bool on_hline = (px - cx) * hdir >= 0, on_vline = (py - cy) * vdir >= 0;
+            if (on_hline) alpha = MAX(alpha, coverage(half_thickness, py - yc));
+            if (on_vline) alpha = MAX(alpha, coverage(half_thickness, px - xc));
+            if (!on_hline && !on_vline) alpha = coverage(half_thickness, sqrt((px - cx) * (px - cx) + (py - cy) * (py - cy)) - radius);
+            uint8_t *p = c->buf + y * c->width + x;
+            *p = MAX(*p, (uint8_t)(alpha * 255));
+        }
+    }
+}
+
+typedef struct {
+    double upper, lower;
+} XLimit;
+
+static void
+fill_region(Canvas *c, XLimit *xlimits, int num) {
+    for (int y = 0; y < c->height; y++) {
+        uint8_t *row = c->buf + y * c->width;
+        for (int x = 0; x < num; x++) row[x] = xlimits[x].upper <= y && y <= xlimits[x].lower ? 255 : 0;
+    }
+    // Anti-alias the boundary, simple y-axis anti-aliasing
+    for (int x = 0; x < num; x++) {
+        double limits[2] = {xlimits[x].upper, xlimits[x].lower};
+        for (unsigned int i = 0; i < arraysz(limits); i++) {
+            double y = limits[i];
+            for (int ypx = (int)floor(y); ypx <= (int)ceil(y); ypx++) {
+                if (0 <= ypx && ypx < c->height) {
+                    uint8_t *p = c->buf + ypx * c->width + x;
+                    *p = MIN(255, *p + (int)((1 - fabs(y - ypx)) * 255));
+                }
+            }
+        }
+    }
+}
+
+static void
+mirror_horizontally(Canvas *c) {
+    for (int y = 0; y < c->height; y++) {
+        uint8_t *row = c->buf + y * c->width;
+        for (int x = 0; x < c->width / 2; x++) {
+            uint8_t t = row[x]; row[x] = row[c->width - 1 - x]; row[c->width - 1 - x] = t;
+        }
+    }
+}
+
+static void
+triangle(Canvas *c, bool left) {
+    if (c->width < 2) return;
+    XLimit *xlimits = calloc(c->width, sizeof(XLimit));
+    if (!xlimits) fatal("Out of memory");
+    double x1 = left ? 0 : c->width - 1, x2 = left ? c->width - 1 : 0, y2 = c->height / 2;
+    double um = (y2 - 0) / (x2 - x1), uc = 0 - um * x1;
+    double lm = (y2 - (c->height - 1)) / (x2 - x1), lc = (c->height - 1) - lm * x1;
+    for (int x = 0; x < c->width; x++) {
+        xlimits[x].upper = um * x + uc;
+        xlimits[x].lower = lm * x + lc;
+    }
+    fill_region(c, xlimits, c->width);
+    free(xlimits);
+}
+
+static inline double
+bezier_eq(double p0, double p1, double p2, double p3, double t) {
+    double tm1 = 1 - t, tm1_3 = tm1 * tm1 * tm1, t_3 = t * t * t;
+    return tm1_3 * p0 + 3 * t * tm1 * (tm1 * p1 + t * p2) + t_3 * p3;
+}
+
+#define bezier_x(t) bezier_eq(0, cx, cx, 0, t)
+#define bezier_y(t) bezier_eq(0, 0, c->height - 1, c->height - 1, t)
+
+static double
+find_t_for_x(double cx, int x, double start_t) {
+    const double t_limit = 0.5;
+    if (fabs(bezier_x(start_t) - x) < 0.1) return start_t;
+    double increment = t_limit - start_t;
+    if (increment <= 0) return start_t;
+    while (true) {
+        double q = bezier_x(start_t + increment);
+        if (fabs(q - x) < 0.1) return start_t + increment;
+        if (q > x) {
+            increment /= 2;
+            if (increment < 1e-6) return start_t;
+        } else {
+            start_t += increment;
+            increment = t_limit - start_t;
+            if (increment <= 0) return start_t;
+        }
+    }
+}
+
+static void
+D(Canvas *c, bool left) {
+    // Find the control point for a bezier curve that just fits in the cell
+    double cx = c->width - 1, last_cx = cx;
+    while (bezier_x(0.5) <= c->width - 1) { last_cx = cx; cx += 1; }
+    cx = last_cx;
+    XLimit *xlimits = calloc(c->width, sizeof(XLimit));
+    if (!xlimits) fatal("Out of memory");
+    int num = 0, max_x = (int)bezier_x(0.5);
+    double last_t = 0;
+    for (int x = 0; x <= max_x && num < c->width; x++) {
+        if (x > 0) last_t = find_t_for_x(cx, x, last_t);
+        double upper = bezier_y(last_t), lower = bezier_y(1 - last_t);
+        if (fabs(upper - lower) <= 2) break;  // avoid pip on end of D
+        xlimits[num].upper = upper; xlimits[num++].lower = lower;
+    }
+    fill_region(c, xlimits, num);
+    free(xlimits);
+    if (!left) mirror_horizontally(c);
+}
+
+#undef bezier_x
+#undef bezier_y
+
+// }}}
+
+// Blocks {{{
+
+static void
+vblock(Canvas *c, double frac, bool top) {
+    int num_rows = MIN(c->height, (int)nearbyint(frac * c->height));
+    int start = top ? 0 : c->height - num_rows;
+    memset(c->buf + start * c->width, 255, num_rows * c->width);
+}
+
+static void
+hblock(Canvas *c, double frac, bool left) {
+    int num_cols = MIN(c->width, (int)nearbyint(frac * c->width));
+    int start = left ? 0 : c->width - num_cols;
+    for (int y = 0; y < c->height; y++) memset(c->buf + y * c->width + start, 255, num_cols);
+}
+
+static void
+shade(Canvas *c, bool light, bool invert) {
+    int square_sz = MAX(1, c->width / 12), number_of_rows = c->height / square_sz, number_of_cols = c->width / square_sz;
+    for (int r = 0; r < number_of_rows; r += 2) {
+        bool fill_even = r % 4 == 0;
+        for (int y = r * square_sz; y < (r + 1) * square_sz && y < c->height; y++) {
+            uint8_t *row = c->buf + y * c->width;
+            for (int col = 0; col < number_of_cols; col++) {
+                bool fill = light ? (col % 4) == (fill_even ? 0 : 2) : (col % 2 == 0) == fill_even;
+                if (fill) {
+                    for (int x = col * square_sz; x < (col + 1) * square_sz && x < c->width; x++) row[x] = 255;
+                }
+            }
+        }
+    }
+    if (invert) {
+        for (int i = 0; i < c->width * c->height; i++) c->buf[i] = 255 - c->buf[i];
+    }
+}
+
+static void
+quad(Canvas *c, bool right, bool bottom) {
+    int num_cols = c->width / 2, left = right ? num_cols : 0, xend = right ? c->width : num_cols;
+    int num_rows = c->height / 2, top = bottom ? num_rows : 0, yend = bottom ? c->height : num_rows;
+    for (int y = top; y < yend; y++) memset(c->buf + y * c->width + left, 255, xend - left);
+}
+
+static void
+braille(Canvas *c, uint8_t dots) {
+    // The dots are numbered down the left column then down the right column,
+    // with dots 7 and 8 being the bottom row, added later to the standard
+    static const unsigned int positions[8][2] = {{0, 0}, {0, 1}, {0, 2}, {1, 0}, {1, 1}, {1, 2}, {0, 3}, {1, 3}};
+    int sz = MAX(1, MIN(c->width / 4, c->height / 8));
+    for (unsigned int i = 0; i < arraysz(positions); i++) {
+        if (!(dots & (1 << i))) continue;
+        int x = (2 * positions[i][0] + 1) * c->width / 4 - sz / 2, y = (2 * positions[i][1] + 1) * c->height / 8 - sz / 2;
+        for (int r = y; r < y + sz; r++) {
+            for (int col = x; col < x + sz; col++) set_pixel(c, col, r, 255);
+        }
+    }
+}
+
+// }}}
+
+bool
+render_box_char(char_type ch, uint8_t *buf, unsigned int width, unsigned int height, double dpi) {
+    // Render the specified character into buf, which must be zeroed and
+    // width * height bytes in size. Returns false if the character is not
+    // supported.
+    Canvas canvas = {.buf=buf, .width=width, .height=height, .dpi=dpi}, *c = &canvas;
+    enum { t = 1, f = 3 };
+    static const unsigned int corner_levels[4][2] = {{t, t}, {f, t}, {t, f}, {f, f}};
+    static const unsigned int cross_levels[16][4] = {
+        {t, t, t, t}, {f, t, t, t}, {t, f, t, t}, {f, f, t, t}, {t, t, f, t}, {t, t, t, f}, {t, t, f, f},
+        {f, t, f, t}, {t, f, f, t}, {f, t, t, f}, {t, f, t, f}, {f, f, f, t}, {f, f, t, f}, {f, t, f, f},
+        {t, f, f, f}, {f, f, f, f}
+    };
+    static const unsigned int vert_t_levels[8][3] = {{t, t, t}, {t, f, t}, {f, t, t}, {t, t, f}, {f, t, f}, {f, f, t}, {t, f, f}, {f, f, f}};
+    static const unsigned int horz_t_levels[8][3] = {{t, t, t}, {f, t, t}, {t, f, t}, {f, f, t}, {t, t, f}, {f, t, f}, {t, f, f}, {f, f, f}};
+#define CASE(x, ...) case x: __VA_ARGS__; break;
+START_ALLOW_CASE_RANGE
+    switch(ch) {
+        CASE(0x2500, hline(c, t))  // ─
+        CASE(0x2501, hline(c, f))  // ━
+        CASE(0x2502, vline(c, t))  // │
+        CASE(0x2503, vline(c, f))  // ┃
+        CASE(0x2504, hholes(c, t, 2))  // ┄
+        CASE(0x2505, hholes(c, f, 2))  // ┅
+        CASE(0x2506, vholes(c, t, 2))  // ┆
+        CASE(0x2507, vholes(c, f, 2))  // ┇
+        CASE(0x2508, hholes(c, t, 3))  // ┈
+        CASE(0x2509, hholes(c, f, 3))  // ┉
+        CASE(0x250a, vholes(c, t, 3))  // ┊
+        CASE(0x250b, vholes(c, f, 3))  // ┋
+        CASE(0x250c ... 0x250f, corner(c, corner_levels[ch - 0x250c][0], corner_levels[ch - 0x250c][1], RIGHT, BOTTOM))  // ┌
+        CASE(0x2510 ... 0x2513, corner(c, corner_levels[ch - 0x2510][0], corner_levels[ch - 0x2510][1], LEFT, BOTTOM))  // ┐
+        CASE(0x2514 ... 0x2517, corner(c, corner_levels[ch - 0x2514][0], corner_levels[ch - 0x2514][1], RIGHT, TOP))  // └
+        CASE(0x2518 ... 0x251b, corner(c, corner_levels[ch - 0x2518][0], corner_levels[ch - 0x2518][1], LEFT, TOP))  // ┘
+        CASE(0x251c ... 0x2523, vert_t(c, vert_t_levels[ch - 0x251c][0], vert_t_levels[ch - 0x251c][1], vert_t_levels[ch - 0x251c][2], RIGHT))  // ├
+        CASE(0x2524 ... 0x252b, vert_t(c, vert_t_levels[ch - 0x2524][0], vert_t_levels[ch - 0x2524][1], vert_t_levels[ch - 0x2524][2], LEFT))  // ┤
+        CASE(0x252c ... 0x2533, horz_t(c, horz_t_levels[ch - 0x252c][0], horz_t_levels[ch - 0x252c][1], horz_t_levels[ch - 0x252c][2], BOTTOM))  // ┬
+        CASE(0x2534 ... 0x253b, horz_t(c, horz_t_levels[ch - 0x2534][0], horz_t_levels[ch - 0x2534][1], horz_t_levels[ch - 0x2534][2], TOP))  // ┴
+        CASE(0x253c ... 0x254b, cross(c, cross_levels[ch - 0x253c][0], cross_levels[ch - 0x253c][1], cross_levels[ch - 0x253c][2], cross_levels[ch - 0x253c][3]))  // ┼
+        CASE(0x254c, hholes(c, t, 1))  // ╌
+        CASE(0x254d, hholes(c, f, 1))  // ╍
+        CASE(0x254e, vholes(c, t, 1))  // ╎
+        CASE(0x254f, vholes(c, f, 1))  // ╏
+        CASE(0x2550, dhline(c, ONLY_BOTH))  // ═
+        CASE(0x2551, dvline(c, ONLY_BOTH))  // ║
+        CASE(0x2552, dvcorner(c, RIGHT, BOTTOM))  // ╒
+        CASE(0x2553, dhcorner(c, RIGHT, BOTTOM))  // ╓
+        CASE(0x2554, dcorner(c, RIGHT, BOTTOM))  // ╔
+        CASE(0x2555, dvcorner(c, LEFT, BOTTOM))  // ╕
+        CASE(0x2556, dhcorner(c, LEFT, BOTTOM))  // ╖
+        CASE(0x2557, dcorner(c, LEFT, BOTTOM))  // ╗
+        CASE(0x2558, dvcorner(c, RIGHT, TOP))  // ╘
+        CASE(0x2559, dhcorner(c, RIGHT, TOP))  // ╙
+        CASE(0x255a, dcorner(c, RIGHT, TOP))  // ╚
+        CASE(0x255b, dvcorner(c, LEFT, TOP))  // ╛
+        CASE(0x255c, dhcorner(c, LEFT, TOP))  // ╜
+        CASE(0x255d, dcorner(c, LEFT, TOP))  // ╝
+        CASE(0x255e, vline(c, t); half_dhline(c, 1, RIGHT, ONLY_BOTH))  // ╞
+        CASE(0x255f, dpip(c, ch))  // ╟
+        CASE(0x2560, inner_corner(c, RIGHT, TOP); inner_corner(c, RIGHT, BOTTOM); dvline(c, ONLY_LEFT))  // ╠
+        CASE(0x2561, vline(c, t); half_dhline(c, 1, LEFT, ONLY_BOTH))  // ╡
+        CASE(0x2562, dpip(c, ch))  // ╢
+        CASE(0x2563, inner_corner(c, LEFT, TOP); inner_corner(c, LEFT, BOTTOM); dvline(c, ONLY_RIGHT))  // ╣
+        CASE(0x2564, dpip(c, ch))  // ╤
+        CASE(0x2565, hline(c, t); half_dvline(c, 1, BOTTOM, ONLY_BOTH))  // ╥
+        CASE(0x2566, inner_corner(c, LEFT, BOTTOM); inner_corner(c, RIGHT, BOTTOM); dhline(c, ONLY_TOP))  // ╦
+        CASE(0x2567, dpip(c, ch))  // ╧
+        CASE(0x2568, hline(c, t); half_dvline(c, 1, TOP, ONLY_BOTH))  // ╨
+        CASE(0x2569, inner_corner(c, LEFT, TOP); inner_corner(c, RIGHT, TOP); dhline(c, ONLY_BOTTOM))  // ╩
+        CASE(0x256a, vline(c, t); half_dhline(c, 1, LEFT, ONLY_BOTH); half_dhline(c, 1, RIGHT, ONLY_BOTH))  // ╪
+        CASE(0x256b, hline(c, t); half_dvline(c, 1, TOP, ONLY_BOTH); half_dvline(c, 1, BOTTOM, ONLY_BOTH))  // ╫
+        CASE(0x256c, inner_corner(c, LEFT, TOP); inner_corner(c, RIGHT, TOP); inner_corner(c, LEFT, BOTTOM); inner_corner(c, RIGHT, BOTTOM))  // ╬
+        CASE(0x256d, rounded_corner(c, RIGHT, BOTTOM))  // ╭
+        CASE(0x256e, rounded_corner(c, LEFT, BOTTOM))  // ╮
+        CASE(0x256f, rounded_corner(c, LEFT, TOP))  // ╯
+        CASE(0x2570, rounded_corner(c, RIGHT, TOP))  // ╰
+        CASE(0x2574, half_hline(c, t, LEFT, 0))  // ╴
+        CASE(0x2575, half_vline(c, t, TOP, 0))  // ╵
+        CASE(0x2576, half_hline(c, t, RIGHT, 0))  // ╶
+        CASE(0x2577, half_vline(c, t, BOTTOM, 0))  // ╷
+        CASE(0x2578, half_hline(c, f, LEFT, 0))  // ╸
+        CASE(0x2579, half_vline(c, f, TOP, 0))  // ╹
+        CASE(0x257a, half_hline(c, f, RIGHT, 0))  // ╺
+        CASE(0x257b, half_vline(c, f, BOTTOM, 0))  // ╻
+        CASE(0x257c, half_hline(c, t, LEFT, 0); half_hline(c, f, RIGHT, 0))  // ╼
+        CASE(0x257d, half_vline(c, t, TOP, 0); half_vline(c, f, BOTTOM, 0))  // ╽
+        CASE(0x257e, half_hline(c, f, LEFT, 0); half_hline(c, t, RIGHT, 0))  // ╾
+        CASE(0x257f, half_vline(c, f, TOP, 0); half_vline(c, t, BOTTOM, 0))  // ╿
+        CASE(0x2580, vblock(c, 1./2, TOP))  // ▀
+        CASE(0x2581 ... 0x2588, vblock(c, (ch - 0x2580) / 8., BOTTOM))  // ▁
+        CASE(0x2589 ... 0x258f, hblock(c, (0x2590 - ch) / 8., LEFT))  // ▉
+        CASE(0x2590, hblock(c, 1./2, RIGHT))  // ▐
+        CASE(0x2591, shade(c, true, false))  // ░
+        CASE(0x2592, shade(c, false, false))  // ▒
+        CASE(0x2593, shade(c, false, true))  // ▓
+        CASE(0x2594, vblock(c, 1./8, TOP))  // ▔
+        CASE(0x2595, hblock(c, 1./8, RIGHT))  // ▕
+        CASE(0x2596, quad(c, false, true))  // ▖
+        CASE(0x2597, quad(c, true, true))  // ▗
+        CASE(0x2598, quad(c, false, false))  // ▘
+        CASE(0x2599, quad(c, false, false); quad(c, false, true); quad(c, true, true))  // ▙
+        CASE(0x259a, quad(c, false, false); quad(c, true, true))  // ▚
+        CASE(0x259b, quad(c, false, false); quad(c, true, false); quad(c, false, true))  // ▛
+        CASE(0x259c, quad(c, false, false); quad(c, true, true); quad(c, true, false))  // ▜
+        CASE(0x259d, quad(c, true, false))  // ▝
+        CASE(0x259e, quad(c, true, false); quad(c, false, true))  // ▞
+        CASE(0x259f, quad(c, true, false); quad(c, false, true); quad(c, true, true))  // ▟
+        CASE(0x2800 ... 0x28ff, braille(c, ch - 0x2800))  // ⠀
+        CASE(0xe0b0, triangle(c, true))
+        CASE(0xe0b2, triangle(c, false))
+        CASE(0xe0b4, D(c, true))
+        CASE(0xe0b6, D(c, false))
+        default:
+            return false;
+    }
+END_ALLOW_CASE_RANGE
+#undef CASE
+    return true;
+}
+
+static PyObject*
+set_box_drawing_scale(PyObject *self UNUSED, PyObject *args) {
+    if (!PyArg_ParseTuple(args, "(dddd)", scale, scale + 1, scale + 2, scale + 3)) return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+render_box_glyph(PyObject *self UNUSED, PyObject *args) {
+    unsigned int ch, width, height;
+    double dpi = 96.0;
+    if (!PyArg_ParseTuple(args, "III|d", &ch, &width, &height, &dpi)) return NULL;
+    PyObject *ans = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)width * height);
+    if (ans == NULL) return NULL;
+    memset(PyBytes_AS_STRING(ans), 0, PyBytes_GET_SIZE(ans));
+    if (!render_box_char(ch, (uint8_t*)PyBytes_AS_STRING(ans), width, height, dpi)) { Py_DECREF(ans); Py_RETURN_NONE; }
+    return ans;
+}
+
+static PyMethodDef module_methods[] = {
+    METHODB(set_box_drawing_scale, METH_VARARGS),
+    METHODB(render_box_glyph, METH_VARARGS),
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+bool
+init_box_drawing(PyObject *module) {
+    if (PyModule_AddFunctions(module, module_methods) != 0) return false;
+    return true;
+}
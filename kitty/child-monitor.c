@@ -342,6 +342,7 @@ shutdown_monitor(ChildMonitor *self, PyObject *a UNUSED) {
 static inline void
 do_parse(ChildMonitor *self, Screen *screen, double now) {
     screen_mutex(lock, read);
+    if (screen_handle_decoded_images(screen)) set_maximum_wait(0);
     if (screen->read_buf_sz || screen->pending_mode.used) {
         double time_since_new_input = now - screen->new_input_at;
         if (time_since_new_input >= OPT(input_delay)) {
@@ -671,6 +672,7 @@ render(double now) {
         set_maximum_wait(OPT(repaint_delay) - time_since_last_render);
         return;
     }
+    grman_new_frame();
 
     for (size_t i = 0; i < global_state.num_os_windows; i++) {
         OSWindow *w = global_state.os_windows + i;
@@ -691,6 +693,7 @@ render(double now) {
             if (USE_RENDER_FRAMES) request_frame_render(w);
             continue;
         }
+        if (w->fonts_data) upload_rendered_glyphs(w->fonts_data);
         bool needs_render = w->is_damaged;
         if (w->viewport_size_dirty) {
             w->clear_count = 0;
@@ -288,6 +288,15 @@ a pixel value. There must be four values corresponding to thin, normal, thick,
 and very thick lines.
 '''))
 
+o('disk_cache_glyphs', False, long_text=_('''
+Store the rendered images of glyphs in the kitty cache directory, so that
+they do not have to be rendered again when kitty is next started, or
+a window with the same font size and DPI is created. Glyphs are only
+used from the cache if the font files and rendering settings have not
+changed. Cache files that have not been used for a month are deleted, as are
+the least recently used ones, once the cache grows beyond 64MB.
+'''))
+
 # }}}
 
 g('cursor')  # {{{
@@ -487,6 +496,18 @@ it limits the rendering speed to the refresh rate of your monitor. With a
 very high speed mouse/high keyboard repeat rate, you may notice some slight input latency.
 If so, set this to no.'''))
 
+o('images_gpu_memory', 1024, option_type=positive_int, long_text=_('''
+The maximum amount of GPU memory (in MB) to use for images displayed with the
+graphics protocol, in all windows. When it is exceeded, images that are not
+currently visible are moved into compressed main memory, and are moved back
+when they are displayed again. If that is not enough, images that are displayed
+at a much smaller size than their actual size are downscaled. Set to zero
+for no limit.'''))
+
+o('images_gpu_memory_per_window', 256, option_type=positive_int, long_text=_('''
+The maximum amount of GPU memory (in MB) to use for the images in a single
+window, see :opt:`images_gpu_memory`. Set to zero for no limit.'''))
+
 # }}}
 
 g('bell')  # {{{
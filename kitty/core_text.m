@@ -319,6 +319,18 @@ face_from_path(const char *path, int UNUSED index, FONTS_DATA_HANDLE fg UNUSED)
     return (PyObject*) ct_face(ct_font);
 }
 
+PyObject*
+face_for_render_thread(PyObject *s UNUSED, FONTS_DATA_HANDLE fg UNUSED) {
+    // Rendering uses a shared static buffer, so glyphs are always rendered on the main thread
+    return NULL;
+}
+
+uint64_t
+face_cache_key(PyObject *s UNUSED) {
+    // CoreText faces are not loaded from a known file, so their glyphs are not cached
+    return 0;
+}
+
 PyObject*
 specialize_font_descriptor(PyObject *base_descriptor, FONTS_DATA_HANDLE fg UNUSED) {
     Py_INCREF(base_descriptor);
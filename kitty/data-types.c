@@ -236,6 +236,10 @@ extern bool init_mouse(PyObject *module);
 extern bool init_kittens(PyObject *module);
 extern bool init_logging(PyObject *module);
 extern bool init_png_reader(PyObject *module);
+extern bool init_image_loader(PyObject *module);
+extern bool init_box_drawing(PyObject *module);
+extern bool init_glyph_cache(PyObject *module);
+extern bool init_fake_gpu(PyObject *module);
 #ifdef __APPLE__
 extern int init_CoreText(PyObject *);
 extern bool init_cocoa(PyObject *module);
@@ -273,6 +277,10 @@ PyInit_fast_data_types(void) {
         if (!init_mouse(m)) return NULL;
         if (!init_kittens(m)) return NULL;
         if (!init_png_reader(m)) return NULL;
+        if (!init_image_loader(m)) return NULL;
+        if (!init_box_drawing(m)) return NULL;
+        if (!init_glyph_cache(m)) return NULL;
+        if (!init_fake_gpu(m)) return NULL;
 #ifdef __APPLE__
         if (!init_macos_process_info(m)) return NULL;
         if (!init_CoreText(m)) return NULL;
@@ -0,0 +1,184 @@
+/*
+ * fake-gpu.c
+ * Copyright (C) 2019 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+// Operations on textures that keep them in memory rather than on the GPU, so
+// that the sharing, eviction and atlases of image textures can be tested
+// without an OpenGL context. They are only used when set_fake_gpu() is called
+// by the tests.
+
+#include "graphics.h"
+
+#define FAKE_GPU_MAX_ATLAS_LAYERS 256
+
+typedef struct {
+    // RGBA pixels, num_layers images of width x height
+    uint32_t width, height, num_layers;
+    uint8_t *pixels;
+} FakeTexture;
+
+static struct {
+    FakeTexture *items;
+    size_t count, capacity;
+} fake_textures = {0};
+
+static inline FakeTexture*
+fake_texture(uint32_t tex_id) {
+    if (!tex_id || tex_id > fake_textures.count || !fake_textures.items[tex_id - 1].pixels) fatal("Invalid fake texture id: %u", tex_id);
+    return fake_textures.items + tex_id - 1;
+}
+
+static inline uint32_t
+new_fake_texture(uint32_t width, uint32_t height, uint32_t num_layers) {
+    ensure_space_for(&fake_textures, items, FakeTexture, fake_textures.count + 1, capacity, 16, true);
+    FakeTexture *t = fake_textures.items + fake_textures.count++;
+    t->width = width; t->height = height; t->num_layers = num_layers;
+    t->pixels = calloc(4, (size_t)width * height * num_layers);
+    if (!t->pixels) fatal("Out of memory allocating fake texture");
+    return fake_textures.count;
+}
+
+static void
+fake_free_texture(uint32_t *tex_id) {
+    FakeTexture *t = fake_texture(*tex_id);
+    free(t->pixels); t->pixels = NULL;
+    *tex_id = 0;
+}
+
+static inline void
+fake_write(FakeTexture *t, unsigned int layer, int32_t x, int32_t y, const uint8_t *data, int32_t width, int32_t height, bool is_opaque) {
+    unsigned int bpp = is_opaque ? 3 : 4;
+    for (int32_t r = 0; r < height; r++) {
+        uint8_t *d = t->pixels + 4 * (((size_t)layer * t->height + y + r) * t->width + x);
+        for (int32_t c = 0; c < width; c++, d += 4, data += bpp) {
+            memcpy(d, data, bpp);
+            if (is_opaque) d[3] = 0xff;
+        }
+    }
+}
+
+static inline void
+fake_read(FakeTexture *t, unsigned int layer, uint8_t *data, int32_t width, int32_t height, bool is_opaque) {
+    unsigned int bpp = is_opaque ? 3 : 4;
+    for (int32_t r = 0; r < height; r++) {
+        const uint8_t *s = t->pixels + 4 * (((size_t)layer * t->height + r) * t->width);
+        for (int32_t c = 0; c < width; c++, s += 4, data += bpp) memcpy(data, s, bpp);
+    }
+}
+
+static void
+fake_send_image(uint32_t *tex_id, const void *data, int32_t width, int32_t height, bool is_opaque, bool is_4byte_aligned UNUSED) {
+    // Like glTexImage2D() the texture keeps its id when it is replaced
+    if (!*tex_id) *tex_id = new_fake_texture(width, height, 1);
+    else {
+        FakeTexture *t = fake_texture(*tex_id);
+        free(t->pixels);
+        t->width = width; t->height = height;
+        t->pixels = calloc(4, (size_t)width * height);
+        if (!t->pixels) fatal("Out of memory allocating fake texture");
+    }
+    fake_write(fake_texture(*tex_id), 0, 0, 0, data, width, height, is_opaque);
+}
+
+static void*
+fake_send_image_async(uint32_t *tex_id, const void *data, int32_t width, int32_t height, bool is_opaque, bool is_4byte_aligned) {
+    fake_send_image(tex_id, data, width, height, is_opaque, is_4byte_aligned);
+    return NULL;
+}
+
+static void
+fake_send_image_region(uint32_t tex_id, int32_t x, int32_t y, const void *data, int32_t width, int32_t height, bool is_opaque, bool is_4byte_aligned UNUSED) {
+    fake_write(fake_texture(tex_id), 0, x, y, data, width, height, is_opaque);
+}
+
+static void
+fake_download_image(uint32_t tex_id, void *data, bool is_opaque) {
+    FakeTexture *t = fake_texture(tex_id);
+    fake_read(t, 0, data, t->width, t->height, is_opaque);
+}
+
+static void*
+fake_download_image_async(uint32_t tex_id, uint32_t *buffer, bool is_opaque UNUSED, size_t sz UNUSED) {
+    // The buffer is a copy of the texture, the download completes immediately
+    FakeTexture *t = fake_texture(tex_id);
+    uint32_t width = t->width, height = t->height;
+    *buffer = new_fake_texture(width, height, 1);
+    memcpy(fake_texture(*buffer)->pixels, fake_texture(tex_id)->pixels, 4 * (size_t)width * height);
+    return NULL;
+}
+
+static bool
+fake_finish_download(uint32_t *buffer, void *data, size_t sz UNUSED) {
+    FakeTexture *t = fake_texture(*buffer);
+    if (data) fake_read(t, 0, data, t->width, t->height, sz == (size_t)t->width * t->height * 3);
+    fake_free_texture(buffer);
+    return true;
+}
+
+static unsigned int
+fake_realloc_atlas(uint32_t *tex_id, unsigned int slot_size, unsigned int num_layers, unsigned int new_num_layers) {
+    new_num_layers = MIN(new_num_layers, FAKE_GPU_MAX_ATLAS_LAYERS);
+    if (new_num_layers <= num_layers) return num_layers;
+    uint32_t tex = new_fake_texture(slot_size, slot_size, new_num_layers);
+    if (*tex_id) {
+        FakeTexture *t = fake_texture(*tex_id);
+        memcpy(fake_texture(tex)->pixels, t->pixels, 4 * (size_t)slot_size * slot_size * num_layers);
+        fake_free_texture(tex_id);
+    }
+    *tex_id = tex;
+    return new_num_layers;
+}
+
+static void
+fake_compact_atlas(uint32_t *tex_id, unsigned int slot_size, unsigned int new_num_layers, const uint32_t *layers, unsigned int count) {
+    uint32_t tex = new_fake_texture(slot_size, slot_size, new_num_layers);
+    size_t layer_sz = 4 * (size_t)slot_size * slot_size;
+    for (unsigned int i = 0; i < count; i++) memcpy(fake_texture(tex)->pixels + i * layer_sz, fake_texture(*tex_id)->pixels + layers[i] * layer_sz, layer_sz);
+    fake_free_texture(tex_id);
+    *tex_id = tex;
+}
+
+static void
+fake_send_image_to_atlas(uint32_t tex_id, unsigned int layer, int32_t x, int32_t y, const void *data, int32_t width, int32_t height, bool is_opaque, bool is_4byte_aligned UNUSED) {
+    fake_write(fake_texture(tex_id), layer, x, y, data, width, height, is_opaque);
+}
+
+static void
+fake_download_image_from_atlas(uint32_t tex_id, unsigned int layer, void *data, int32_t width, int32_t height, bool is_opaque) {
+    fake_read(fake_texture(tex_id), layer, data, width, height, is_opaque);
+}
+
+static PyObject*
+set_fake_gpu(PyObject *self UNUSED, PyObject *args) {
+    static const GPUOperations fake_ops = {
+        fake_send_image, fake_send_image_async, fake_send_image_region, fake_download_image,
+        fake_download_image_async, fake_finish_download, fake_free_texture, fake_realloc_atlas,
+        fake_compact_atlas, fake_send_image_to_atlas, fake_download_image_from_atlas
+    };
+    grman_set_gpu_operations(PyObject_IsTrue(args) ? &fake_ops : NULL);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+    METHODB(set_fake_gpu, METH_O),
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static void
+finalize(void) {
+    for (size_t i = 0; i < fake_textures.count; i++) free(fake_textures.items[i].pixels);
+    free(fake_textures.items); fake_textures.items = NULL; fake_textures.count = 0;
+}
+
+bool
+init_fake_gpu(PyObject *module) {
+    if (PyModule_AddFunctions(module, module_methods) != 0) return false;
+    if (Py_AtExit(finalize) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to register the fake GPU at exit handler");
+        return false;
+    }
+    return true;
+}
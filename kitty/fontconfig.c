@@ -220,6 +220,41 @@ end:
 }
 
 #undef AP
+
+bool
+find_fallback_font_file(const char_type *text, size_t num, bool bold, bool italic, bool emoji_presentation, FallbackFontFile *ans) {
+    // Must not use python or char_buf, as it is called from the fallback font thread
+    bool found = false;
+    FcPattern *pat = FcPatternCreate(), *match = NULL;
+    FcCharSet *charset = FcCharSetCreate();
+    FcResult result;
+    FcChar8 *path;
+    if (pat == NULL || charset == NULL) goto end;
+    if (!FcPatternAddString(pat, FC_FAMILY, (const FcChar8*)(emoji_presentation ? "emoji" : "monospace"))) goto end;
+    if (!emoji_presentation && bold && !FcPatternAddInteger(pat, FC_WEIGHT, FC_WEIGHT_BOLD)) goto end;
+    if (!emoji_presentation && italic && !FcPatternAddInteger(pat, FC_SLANT, FC_SLANT_ITALIC)) goto end;
+    if (emoji_presentation && !FcPatternAddBool(pat, FC_COLOR, true)) goto end;
+    for (size_t i = 0; i < num; i++) { if (!FcCharSetAddChar(charset, text[i])) goto end; }
+    if (num && !FcPatternAddCharSet(pat, FC_CHARSET, charset)) goto end;
+    FcConfigSubstitute(NULL, pat, FcMatchPattern);
+    FcDefaultSubstitute(pat);
+    match = FcFontMatch(NULL, pat, &result);
+    if (match == NULL || FcPatternGetString(match, FC_FILE, 0, &path) != FcResultMatch) goto end;
+    FcBool hinting = false;
+    ans->index = 0; ans->hint_style = 0;
+    FcPatternGetInteger(match, FC_INDEX, 0, &ans->index);
+    FcPatternGetInteger(match, FC_HINT_STYLE, 0, &ans->hint_style);
+    FcPatternGetBool(match, FC_HINTING, 0, &hinting);
+    ans->hinting = hinting;
+    ans->path = strdup((const char*)path);
+    found = ans->path != NULL;
+end:
+    if (match != NULL) FcPatternDestroy(match);
+    if (charset != NULL) FcCharSetDestroy(charset);
+    if (pat != NULL) FcPatternDestroy(pat);
+    return found;
+}
+
 static PyMethodDef module_methods[] = {
     METHODB(fc_list, METH_VARARGS),
     METHODB(fc_match, METH_VARARGS),
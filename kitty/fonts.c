@@ -8,13 +8,21 @@
 
 #include "fonts.h"
 #include "state.h"
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#include <hb-ot.h>
+#pragma GCC diagnostic pop
 #include "emoji.h"
 #include "unicode-data.h"
+#include "threading.h"
+#include "glyph-cache.h"
+#include <unistd.h>
 
 #define MISSING_GLYPH 4
 #define MAX_NUM_EXTRA_GLYPHS 8
 #define CELLS_IN_CANVAS ((MAX_NUM_EXTRA_GLYPHS + 1) * 3)
 #define MAX_NUM_EXTRA_GLYPHS_PUA 4
+#define MAX_RENDER_THREADS 4
 
 typedef void (*send_sprite_to_gpu_func)(FONTS_DATA_HANDLE fg, unsigned int, unsigned int, unsigned int, pixel*);
 send_sprite_to_gpu_func current_send_sprite_to_gpu = NULL;
@@ -70,6 +78,40 @@ typedef struct {
 static SymbolMap *symbol_maps = NULL;
 static size_t num_symbol_maps = 0;
 
+// Cache of the sprites that runs of cells were rendered into, keyed by the
+// contents of the cells, so that frequently repeated text does not need to be
+// shaped again.
+#define SHAPE_CACHE_SIZE 2048
+#define MAX_CACHED_RUN_LENGTH 256
+
+typedef struct {
+    uint64_t hash;
+    ssize_t font_idx;
+    int cursor_offset;
+    bool pua_space_ligature, center_glyph, disable_ligatures;
+    index_type num_cells, capacity;
+    CPUCell *cpu_cells;
+    attrs_type *widths;
+    sprite_index *sprites;
+    double shaping_time;
+} ShapedRun;
+
+static struct {
+    unsigned long long hits, misses;
+    double shaping_time_saved;
+} shape_cache_stats_data = {0};
+
+// Cache of the font used for cells, keyed by their text, style and width,
+// since finding it can require checking every symbol map and fallback font.
+// It includes cells for which no font was found, and is only cleared when
+// the fonts are reloaded.
+#define FONT_CACHE_INITIAL_CAPACITY 1024
+
+typedef struct {
+    uint64_t key;
+    ssize_t font_idx;
+} FontForCell;
+
 
 
 typedef struct {
@@ -78,6 +120,17 @@ typedef struct {
     SpritePosition sprite_map[1024];
     SpecialGlyphCache special_glyph_cache[SPECIAL_GLYPH_CACHE_SIZE];
     bool bold, italic, emoji_presentation;
+    // Copies of face, one per render thread, since faces cannot be shared between threads
+    PyObject *render_faces[MAX_RENDER_THREADS];
+    bool render_faces_unavailable;
+    // ASCII codepoints that can be rendered without shaping and their sprites,
+    // found the first time a run in the font is rendered
+    bool simple_codepoints_found;
+    uint64_t simple_codepoints[2], simple_sprites_filled[2];
+    sprite_index simple_sprites[128][3];
+    // Identifies the font in the on-disk glyph cache, 0 if it cannot be cached
+    uint64_t glyph_cache_key;
+    bool glyph_cache_key_computed;
 } Font;
 
 typedef struct {
@@ -89,6 +142,10 @@ typedef struct {
     Font *fonts;
     pixel *canvas;
     GPUSpriteTracker sprite_tracker;
+    ShapedRun *shape_cache;
+    GlyphCache *glyph_cache;
+    FontForCell *font_cache;
+    size_t font_cache_capacity, font_cache_count;
 } FontGroup;
 
 static FontGroup* font_groups = NULL;
@@ -177,6 +234,14 @@ clear_canvas(FontGroup *fg) {
     if (fg->canvas) memset(fg->canvas, 0, CELLS_IN_CANVAS * fg->cell_width * fg->cell_height * sizeof(pixel));
 }
 
+static inline pixel*
+extract_cell_from_canvas(FontGroup *fg, pixel *canvas, unsigned int i, unsigned int num_cells) {
+    pixel *ans = fg->canvas + (fg->cell_width * fg->cell_height * (CELLS_IN_CANVAS - 1)), *dest = ans, *src = canvas + (i * fg->cell_width);
+    unsigned int stride = fg->cell_width * num_cells;
+    for (unsigned int r = 0; r < fg->cell_height; r++, dest += fg->cell_width, src += stride) memcpy(dest, src, fg->cell_width * sizeof(pixel));
+    return ans;
+}
+
 
 
 // Sprites {{{
@@ -336,8 +401,190 @@ sprite_tracker_set_layout(GPUSpriteTracker *sprite_tracker, unsigned int cell_wi
 }
 // }}}
 
+// Render threads {{{
+// Rasterizing glyphs is the slowest part of rendering a line containing text
+// not seen before. Shaping and the assignment of sprite positions still
+// happen on the main thread, so the result is the same as for synchronous
+// rendering, only the rasterization is done by a pool of threads. Until the
+// rendered bitmaps are uploaded, the reserved sprites are blank.
+
+_Thread_local bool in_render_thread = false;
+
+typedef struct {
+    id_type font_group_id;
+    struct { FONTS_DATA_HEAD } fonts_data;
+    PyObject *faces[MAX_RENDER_THREADS];
+    bool bold, italic, center_glyph;
+    unsigned int num_cells, num_glyphs, baseline;
+    hb_glyph_info_t info[MAX_NUM_EXTRA_GLYPHS + 1];
+    hb_glyph_position_t positions[MAX_NUM_EXTRA_GLYPHS + 1];
+    sprite_index x[16], y[16], z[16];
+    uint64_t glyph_cache_keys[16];
+    bool ok;
+    pixel *canvas;
+} RenderJob;
+
+typedef struct {
+    pthread_t threads[MAX_RENDER_THREADS];
+    size_t num_threads, num_busy;
+    pthread_mutex_t lock;
+    pthread_cond_t has_jobs, is_idle;
+    bool shutting_down, wakeup_main_loop;
+    RenderJob *jobs, *finished;
+    size_t jobs_start, jobs_count, jobs_capacity, finished_count, finished_capacity;
+} RenderThreads;
+
+static RenderThreads render_threads = {{0}};
+// -1 means use as many threads as there are spare CPU cores, when rendering to the GPU
+static int requested_num_of_render_threads = -1;
+#define render_threads_lock(op) pthread_mutex_##op(&render_threads.lock)
+
+static inline void
+rasterize_job(RenderJob *job, size_t thread_idx) {
+    job->canvas = calloc(job->num_cells * job->fonts_data.cell_width * job->fonts_data.cell_height, sizeof(pixel));
+    if (job->canvas == NULL) fatal("Out of memory allocating canvas for glyph rendering");
+    bool was_colored = false;
+    job->ok = render_glyphs_in_cells(job->faces[thread_idx], job->bold, job->italic, job->info, job->positions, job->num_glyphs, job->canvas, job->fonts_data.cell_width, job->fonts_data.cell_height, job->num_cells, job->baseline, &was_colored, (FONTS_DATA_HANDLE)&job->fonts_data, job->center_glyph);
+}
+
+static void*
+render_thread(void *data) {
+    size_t thread_idx = (size_t)data;
+    RenderJob job;
+    set_thread_name("KittyGlyphs");
+    in_render_thread = true;
+    render_threads_lock(lock);
+    while (true) {
+        while (!render_threads.jobs_count && !render_threads.shutting_down) pthread_cond_wait(&render_threads.has_jobs, &render_threads.lock);
+        if (render_threads.shutting_down) break;
+        job = render_threads.jobs[render_threads.jobs_start++];
+        if (!--render_threads.jobs_count) render_threads.jobs_start = 0;
+        render_threads.num_busy++;
+        render_threads_lock(unlock);
+
+        rasterize_job(&job, thread_idx);
+
+        render_threads_lock(lock);
+        ensure_space_for(&render_threads, finished, RenderJob, render_threads.finished_count + 1, finished_capacity, 64, false);
+        render_threads.finished[render_threads.finished_count++] = job;
+        render_threads.num_busy--;
+        if (!render_threads.num_busy && !render_threads.jobs_count) pthread_cond_broadcast(&render_threads.is_idle);
+        // Only wakeup the main loop for the first of a batch of finished jobs
+        if (render_threads.wakeup_main_loop && render_threads.finished_count == 1) wakeup_main_loop();
+    }
+    render_threads_lock(unlock);
+    return NULL;
+}
+
+static inline size_t
+desired_num_of_render_threads() {
+    if (requested_num_of_render_threads > -1) return MIN(MAX_RENDER_THREADS, (size_t)requested_num_of_render_threads);
+    if (python_send_to_gpu_impl) return 0;
+    static long num_cpus = 0;
+    if (!num_cpus) num_cpus = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+    return MIN(MAX_RENDER_THREADS, (size_t)(num_cpus - 1));
+}
+
+static inline bool
+ensure_render_threads() {
+    if (render_threads.num_threads) return true;
+    size_t num = desired_num_of_render_threads();
+    render_threads.shutting_down = false;
+    render_threads.wakeup_main_loop = !python_send_to_gpu_impl;
+    for (size_t i = 0; i < num; i++) {
+        int ret = pthread_create(render_threads.threads + i, NULL, render_thread, (void*)i);
+        if (ret != 0) {
+            log_error("Failed to start glyph render thread with error: %s", strerror(ret));
+            if (requested_num_of_render_threads < 0) requested_num_of_render_threads = i;
+            break;
+        }
+        render_threads.num_threads++;
+    }
+    return render_threads.num_threads > 0;
+}
+
+static inline void
+wait_for_render_threads() {
+    if (!render_threads.num_threads) return;
+    render_threads_lock(lock);
+    while (render_threads.jobs_count || render_threads.num_busy) pthread_cond_wait(&render_threads.is_idle, &render_threads.lock);
+    render_threads_lock(unlock);
+}
+
+static inline void
+free_render_faces(Font *f) {
+    for (size_t i = 0; i < arraysz(f->render_faces); i++) Py_CLEAR(f->render_faces[i]);
+    f->render_faces_unavailable = false;
+}
+
+static bool
+process_finished_render_jobs(FontGroup *fg, bool upload) {
+    bool found = false;
+    render_threads_lock(lock);
+    size_t i, j;
+    for (i = 0, j = 0; i < render_threads.finished_count; i++) {
+        RenderJob *job = render_threads.finished + i;
+        if (job->font_group_id == fg->id) {
+            found = true;
+            for (unsigned int c = 0; c < job->num_cells && (upload || (fg->glyph_cache && job->ok)); c++) {
+                pixel *buf = job->num_cells == 1 ? job->canvas : extract_cell_from_canvas(fg, job->canvas, c, job->num_cells);
+                if (upload) current_send_sprite_to_gpu((FONTS_DATA_HANDLE)fg, job->x[c], job->y[c], job->z[c], buf);
+                if (fg->glyph_cache && job->ok && job->glyph_cache_keys[c]) glyph_cache_add(fg->glyph_cache, job->glyph_cache_keys[c], buf, false);
+            }
+            free(job->canvas);
+        } else {
+            if (i != j) render_threads.finished[j] = *job;
+            j++;
+        }
+    }
+    render_threads.finished_count = j;
+    render_threads_lock(unlock);
+    if (found && upload) {
+        for (size_t o = 0; o < global_state.num_os_windows; o++) {
+            OSWindow *w = global_state.os_windows + o;
+            if (w->fonts_data == (FONTS_DATA_HANDLE)fg) w->is_damaged = true;
+        }
+    }
+    return found;
+}
+
+static void free_all_render_faces(void);
+
+static void
+stop_render_threads() {
+    if (!render_threads.num_threads) return;
+    wait_for_render_threads();
+    render_threads_lock(lock);
+    render_threads.shutting_down = true;
+    pthread_cond_broadcast(&render_threads.has_jobs);
+    render_threads_lock(unlock);
+    for (size_t i = 0; i < render_threads.num_threads; i++) pthread_join(render_threads.threads[i], NULL);
+    render_threads.num_threads = 0;
+    for (size_t i = 0; i < render_threads.finished_count; i++) free(render_threads.finished[i].canvas);
+    render_threads.finished_count = 0;
+    free(render_threads.jobs); render_threads.jobs = NULL; render_threads.jobs_capacity = 0;
+    free(render_threads.finished); render_threads.finished = NULL; render_threads.finished_capacity = 0;
+    free_all_render_faces();
+}
+
+#ifndef __APPLE__
+static void process_finished_fallback_lookups(FontGroup *fg);
+static void discard_fallback_font_lookups(FontGroup *fg);
+#endif
+
+void
+upload_rendered_glyphs(FONTS_DATA_HANDLE fg) {
+    if (render_threads.num_threads) process_finished_render_jobs((FontGroup*)fg, true);
+#ifndef __APPLE__
+    process_finished_fallback_lookups((FontGroup*)fg);
+#endif
+}
+// }}}
+
 static inline PyObject*
 desc_to_face(PyObject *desc, FONTS_DATA_HANDLE fg) {
+    // Tests use the paths of font files as descriptors
+    if (PyUnicode_Check(desc)) return face_from_path(PyUnicode_AsUTF8(desc), 0, fg);
     PyObject *d = specialize_font_descriptor(desc, fg);
     if (d == NULL) return NULL;
     PyObject *ans = face_from_descriptor(d, fg);
@@ -346,22 +593,76 @@ desc_to_face(PyObject *desc, FONTS_DATA_HANDLE fg) {
 }
 
 
+static inline void
+find_simple_codepoints(Font *f) {
+    // A codepoint is simple if it maps to a glyph that no GSUB or GPOS
+    // lookup touches, so shaping it will always give the same glyph
+    // with no offsets. Fonts using AAT substitution tables are never simple.
+    f->simple_codepoints_found = true;
+    memset(f->simple_codepoints, 0, sizeof(f->simple_codepoints));
+    memset(f->simple_sprites_filled, 0, sizeof(f->simple_sprites_filled));
+    hb_face_t *face = hb_font_get_face(harfbuzz_font_for_face(f->face));
+    hb_blob_t *morx = hb_face_reference_table(face, HB_TAG('m', 'o', 'r', 'x'));
+    unsigned int morx_length = hb_blob_get_length(morx);
+    hb_blob_destroy(morx);
+    if (morx_length) return;
+    hb_set_t *touched = hb_set_create();
+    if (!hb_set_allocation_successful(touched)) { hb_set_destroy(touched); return; }
+    static const hb_tag_t tables[] = {HB_OT_TAG_GSUB, HB_OT_TAG_GPOS};
+    for (size_t t = 0; t < arraysz(tables); t++) {
+        unsigned int num_lookups = hb_ot_layout_table_get_lookup_count(face, tables[t]);
+        for (unsigned int i = 0; i < num_lookups; i++) hb_ot_layout_lookup_collect_glyphs(face, tables[t], i, touched, touched, touched, NULL);
+    }
+    for (char_type ch = 33; ch < 127; ch++) {
+        glyph_index glyph = glyph_id_for_codepoint(f->face, ch);
+        if (glyph && !hb_set_has(touched, glyph)) f->simple_codepoints[ch >> 6] |= 1ull << (ch & 63);
+    }
+    hb_set_destroy(touched);
+}
+
 static inline bool
 init_font(Font *f, PyObject *face, bool bold, bool italic, bool emoji_presentation) {
     f->face = face; Py_INCREF(f->face);
     f->bold = bold; f->italic = italic; f->emoji_presentation = emoji_presentation;
+    f->simple_codepoints_found = false;
     return true;
 }
 
 static inline void
 del_font(Font *f) {
     Py_CLEAR(f->face);
+    free_render_faces(f);
     free_maps(f);
     f->bold = false; f->italic = false;
 }
 
+static inline void
+free_shape_cache(FontGroup *fg) {
+    if (fg->shape_cache) {
+        for (size_t i = 0; i < SHAPE_CACHE_SIZE; i++) {
+            ShapedRun *r = fg->shape_cache + i;
+            free(r->cpu_cells); free(r->widths); free(r->sprites);
+        }
+        free(fg->shape_cache); fg->shape_cache = NULL;
+    }
+}
+
+static inline void
+free_font_cache(FontGroup *fg) {
+    free(fg->font_cache); fg->font_cache = NULL;
+    fg->font_cache_capacity = 0; fg->font_cache_count = 0;
+}
+
 static inline void
 del_font_group(FontGroup *fg) {
+    wait_for_render_threads();
+    process_finished_render_jobs(fg, false);
+#ifndef __APPLE__
+    discard_fallback_font_lookups(fg);
+#endif
+    fg->glyph_cache = close_glyph_cache(fg->glyph_cache);
+    free_shape_cache(fg);
+    free_font_cache(fg);
     free(fg->canvas); fg->canvas = NULL;
     fg->sprite_map = free_sprite_map(fg->sprite_map);
     for (size_t i = 0; i < fg->fonts_count; i++) del_font(fg->fonts + i);
@@ -377,6 +678,14 @@ free_font_groups() {
     }
 }
 
+static void
+free_all_render_faces(void) {
+    for (size_t i = 0; i < num_font_groups; i++) {
+        FontGroup *fg = font_groups + i;
+        for (size_t f = 0; f < fg->fonts_count; f++) free_render_faces(fg->fonts + f);
+    }
+}
+
 static void
 python_send_to_gpu(FONTS_DATA_HANDLE fg, unsigned int x, unsigned int y, unsigned int z, pixel* buf) {
     if (python_send_to_gpu_impl) {
@@ -450,6 +759,40 @@ has_cell_text(Font *self, CPUCell *cell) {
     return true;
 }
 
+static inline uint64_t
+font_cache_key(CPUCell *cpu_cell, GPUCell *gpu_cell) {
+    // 0 means the cell cannot be cached
+    if (cpu_cell->ch > 0x10ffff) return 0;
+    uint64_t flags = BI_VAL(gpu_cell->attrs) | (((gpu_cell->attrs & WIDTH_MASK) == 2) << 2);
+    return (uint64_t)cpu_cell->ch | ((uint64_t)cpu_cell->cc_idx[0] << 21) | ((uint64_t)cpu_cell->cc_idx[1] << 37) | (flags << 53);
+}
+
+static inline FontForCell*
+font_cache_slot(FontGroup *fg, uint64_t key) {
+    // Linear probing in a power of two sized table, returns the slot for key or the empty slot it should go in
+    size_t mask = fg->font_cache_capacity - 1, i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+    while (fg->font_cache[i].key && fg->font_cache[i].key != key) i = (i + 1) & mask;
+    return fg->font_cache + i;
+}
+
+static inline void
+font_cache_store(FontGroup *fg, uint64_t key, ssize_t font_idx) {
+    if (4 * (fg->font_cache_count + 1) > 3 * fg->font_cache_capacity) {
+        FontForCell *old = fg->font_cache;
+        size_t old_capacity = fg->font_cache_capacity;
+        fg->font_cache_capacity = MAX(FONT_CACHE_INITIAL_CAPACITY, 2 * old_capacity);
+        fg->font_cache = calloc(fg->font_cache_capacity, sizeof(FontForCell));
+        if (!fg->font_cache) fatal("Out of memory allocating font cache");
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].key) *font_cache_slot(fg, old[i].key) = old[i];
+        }
+        free(old);
+    }
+    FontForCell *slot = font_cache_slot(fg, key);
+    if (!slot->key) fg->font_cache_count++;
+    slot->key = key; slot->font_idx = font_idx;
+}
+
 static inline void
 output_cell_fallback_data(CPUCell *cell, bool bold, bool italic, bool emoji_presentation, PyObject *face, bool new_face) {
     printf("U+%x ", cell->ch);
@@ -464,6 +807,18 @@ output_cell_fallback_data(CPUCell *cell, bool bold, bool italic, bool emoji_pres
     printf("\n");
 }
 
+static inline ssize_t
+add_fallback_font(FontGroup *fg, PyObject *face, bool bold, bool italic, bool emoji_presentation) {
+    set_size_for_face(face, fg->cell_height, true, (FONTS_DATA_HANDLE)fg);
+    ensure_space_for(fg, fonts, Font, fg->fonts_count + 1, fonts_capacity, 5, true);
+    ssize_t ans = fg->first_fallback_font_idx + fg->fallback_fonts_count;
+    Font *af = &fg->fonts[ans];
+    if (!init_font(af, face, bold, italic, emoji_presentation)) fatal("Out of memory");
+    fg->fallback_fonts_count++;
+    fg->fonts_count++;
+    return ans;
+}
+
 static inline ssize_t
 load_fallback_font(FontGroup *fg, CPUCell *cell, bool bold, bool italic, bool emoji_presentation) {
     if (fg->fallback_fonts_count > 100) { log_error("Too many fallback fonts"); return MISSING_FONT; }
@@ -477,25 +832,13 @@ load_fallback_font(FontGroup *fg, CPUCell *cell, bool bold, bool italic, bool em
     if (face == NULL) { PyErr_Print(); return MISSING_FONT; }
     if (face == Py_None) { Py_DECREF(face); return MISSING_FONT; }
     if (global_state.debug_font_fallback) output_cell_fallback_data(cell, bold, italic, emoji_presentation, face, true);
-    set_size_for_face(face, fg->cell_height, true, (FONTS_DATA_HANDLE)fg);
-
-    ensure_space_for(fg, fonts, Font, fg->fonts_count + 1, fonts_capacity, 5, true);
-    ssize_t ans = fg->first_fallback_font_idx + fg->fallback_fonts_count;
-    Font *af = &fg->fonts[ans];
-    if (!init_font(af, face, bold, italic, emoji_presentation)) fatal("Out of memory");
+    ssize_t ans = add_fallback_font(fg, face, bold, italic, emoji_presentation);
     Py_DECREF(face);
-    fg->fallback_fonts_count++;
-    fg->fonts_count++;
     return ans;
 }
 
 static inline ssize_t
-fallback_font(FontGroup *fg, CPUCell *cpu_cell, GPUCell *gpu_cell) {
-    bool bold = (gpu_cell->attrs >> BOLD_SHIFT) & 1;
-    bool italic = (gpu_cell->attrs >> ITALIC_SHIFT) & 1;
-    bool emoji_presentation = has_emoji_presentation(cpu_cell, gpu_cell);
-
-    // Check if one of the existing fallback fonts has this text
+existing_fallback_font(FontGroup *fg, CPUCell *cpu_cell, bool bold, bool italic, bool emoji_presentation) {
     for (size_t i = 0, j = fg->first_fallback_font_idx; i < fg->fallback_fonts_count; i++, j++)  {
         Font *ff = fg->fonts +j;
         if (ff->bold == bold && ff->italic == italic && ff->emoji_presentation == emoji_presentation && has_cell_text(ff, cpu_cell)) {
@@ -503,50 +846,409 @@ fallback_font(FontGroup *fg, CPUCell *cpu_cell, GPUCell *gpu_cell) {
             return j;
         }
     }
+    return NO_FONT;
+}
+
+#ifndef __APPLE__
+// Fallback font lookups {{{
+// Querying fontconfig for a font that has some text can take long enough to
+// freeze the window when text in several new scripts is displayed at once, so
+// when rendering to the GPU, it is done in a background thread. The cells are
+// rendered as missing glyphs until the lookup finishes, at which point the
+// result is stored in the font cache and the screens are re-rendered. Fonts
+// found for text are remembered in a file, so that fontconfig does not need
+// to be queried for it again in later sessions.
+
+#define CELL_TEXT_SIZE (arraysz(((CPUCell*)0)->cc_idx) + 1)
+#define MAX_KNOWN_FALLBACK_FONTS 4096
+
+typedef struct {
+    char_type text[CELL_TEXT_SIZE];
+    size_t num;
+    bool bold, italic, emoji_presentation;
+    FallbackFontFile file;
+} KnownFallbackFont;
+
+typedef struct {
+    id_type font_group_id;
+    uint64_t key;
+    CPUCell cell;
+    KnownFallbackFont q;
+    bool found;
+} FallbackFontLookup;
+
+static struct {
+    pthread_t thread;
+    bool started, shutting_down, busy, wakeup_main_loop;
+    pthread_mutex_t lock;
+    pthread_cond_t has_lookups, is_idle;
+    FallbackFontLookup *pending, *finished;
+    size_t pending_count, pending_capacity, finished_count, finished_capacity;
+} fallback_lookups = {0};
+// Set by the tests, which otherwise look up fallback fonts synchronously
+static bool async_fallback_font_lookups = false;
+#define fallback_lookups_lock(op) pthread_mutex_##op(&fallback_lookups.lock)
+
+static struct {
+    char *path, *fingerprint;
+    KnownFallbackFont *items;
+    size_t count, capacity;
+} known_fallback_fonts = {0};
+
+static inline KnownFallbackFont*
+find_known_fallback_font(const KnownFallbackFont *q) {
+    for (size_t i = 0; i < known_fallback_fonts.count; i++) {
+        KnownFallbackFont *k = known_fallback_fonts.items + i;
+        if (k->num == q->num && k->bold == q->bold && k->italic == q->italic && k->emoji_presentation == q->emoji_presentation && memcmp(k->text, q->text, q->num * sizeof(char_type)) == 0) return k;
+    }
+    return NULL;
+}
+
+static inline void
+forget_known_fallback_font(KnownFallbackFont *k) {
+    free(k->file.path);
+    size_t i = k - known_fallback_fonts.items;
+    memmove(k, k + 1, (--known_fallback_fonts.count - i) * sizeof(KnownFallbackFont));
+}
+
+static inline bool
+add_known_fallback_font(const KnownFallbackFont *k) {
+    // Takes ownership of k->file.path
+    KnownFallbackFont *existing = find_known_fallback_font(k);
+    if (existing) forget_known_fallback_font(existing);
+    if (known_fallback_fonts.count >= MAX_KNOWN_FALLBACK_FONTS) { free(k->file.path); return false; }
+    ensure_space_for(&known_fallback_fonts, items, KnownFallbackFont, known_fallback_fonts.count + 1, capacity, 64, false);
+    known_fallback_fonts.items[known_fallback_fonts.count++] = *k;
+    return true;
+}
+
+static void
+free_known_fallback_fonts(void) {
+    for (size_t i = 0; i < known_fallback_fonts.count; i++) free(known_fallback_fonts.items[i].file.path);
+    free(known_fallback_fonts.items); free(known_fallback_fonts.path); free(known_fallback_fonts.fingerprint);
+    memset(&known_fallback_fonts, 0, sizeof(known_fallback_fonts));
+}
+
+static inline void
+load_known_fallback_fonts(void) {
+    // The first line is the fingerprint of the font configuration the fonts
+    // were found with, the cache is ignored if it has changed.
+    // Each following line is: bold italic emoji_presentation index hinting hint_style codepoints path
+    FILE *f = fopen(known_fallback_fonts.path, "r");
+    if (!f) return;
+    char line[4096], codepoints[64];
+    if (!fgets(line, sizeof(line), f) || line[0] != '#') { fclose(f); return; }
+    line[strcspn(line, "\n")] = 0;
+    if (strcmp(line + 1, known_fallback_fonts.fingerprint) != 0) { fclose(f); return; }
+    while (fgets(line, sizeof(line), f)) {
+        KnownFallbackFont k = {{0}};
+        int bold, italic, emoji_presentation, hinting, n = 0;
+        if (sscanf(line, "%d %d %d %d %d %d %63s %n", &bold, &italic, &emoji_presentation, &k.file.index, &hinting, &k.file.hint_style, codepoints, &n) < 7 || !n) continue;
+        char *path = line + n, *p = codepoints;
+        path[strcspn(path, "\n")] = 0;
+        if (!path[0]) continue;
+        while (*p && k.num < CELL_TEXT_SIZE) {
+            k.text[k.num++] = strtoul(p, &p, 16);
+            if (*p == ',') p++;
+        }
+        if (!k.num || *p) continue;
+        k.bold = bold; k.italic = italic; k.emoji_presentation = emoji_presentation; k.file.hinting = hinting;
+        k.file.path = strdup(path);
+        if (!k.file.path) break;
+        add_known_fallback_font(&k);
+    }
+    fclose(f);
+}
+
+static void
+save_known_fallback_fonts(void) {
+    // Rewrite the whole file, so that forgotten fonts are removed from it as well
+    if (!known_fallback_fonts.path) return;
+    size_t sz = strlen(known_fallback_fonts.path) + 16;
+    char *tpath = malloc(sz);
+    if (!tpath) return;
+    snprintf(tpath, sz, "%s.XXXXXX", known_fallback_fonts.path);
+    int fd = mkstemp(tpath);
+    FILE *f = fd == -1 ? NULL : fdopen(fd, "w");
+    if (!f) {
+        log_error("Failed to create fallback font cache file with error: %s", strerror(errno));
+        if (fd != -1) { close(fd); unlink(tpath); }
+        free(tpath); return;
+    }
+    fprintf(f, "#%s\n", known_fallback_fonts.fingerprint);
+    for (size_t n = 0; n < known_fallback_fonts.count; n++) {
+        const KnownFallbackFont *k = known_fallback_fonts.items + n;
+        fprintf(f, "%d %d %d %d %d %d ", k->bold, k->italic, k->emoji_presentation, k->file.index, k->file.hinting, k->file.hint_style);
+        for (size_t i = 0; i < k->num; i++) fprintf(f, i ? ",%x" : "%x", k->text[i]);
+        fprintf(f, " %s\n", k->file.path);
+    }
+    bool ok = !ferror(f);
+    if (fclose(f) != 0) ok = false;
+    if (ok && rename(tpath, known_fallback_fonts.path) != 0) ok = false;
+    if (!ok) { log_error("Failed to write fallback font cache file with error: %s", strerror(errno)); unlink(tpath); }
+    free(tpath);
+}
+
+static inline PyObject*
+face_from_fallback_font_file(const FallbackFontFile *ff, FontGroup *fg) {
+    PyObject *d = Py_BuildValue("{sssisOsi}", "path", ff->path, "index", ff->index, "hinting", ff->hinting ? Py_True : Py_False, "hint_style", ff->hint_style);
+    if (d == NULL) return NULL;
+    PyObject *ans = face_from_descriptor(d, (FONTS_DATA_HANDLE)fg);
+    Py_DECREF(d);
+    return ans;
+}
+
+static void*
+fallback_font_thread(void *data UNUSED) {
+    FallbackFontLookup l;
+    set_thread_name("KittyFallback");
+    fallback_lookups_lock(lock);
+    while (true) {
+        while (!fallback_lookups.pending_count && !fallback_lookups.shutting_down) pthread_cond_wait(&fallback_lookups.has_lookups, &fallback_lookups.lock);
+        if (fallback_lookups.shutting_down) break;
+        l = fallback_lookups.pending[0];
+        memmove(fallback_lookups.pending, fallback_lookups.pending + 1, --fallback_lookups.pending_count * sizeof(FallbackFontLookup));
+        fallback_lookups.busy = true;
+        fallback_lookups_lock(unlock);
+
+        l.found = find_fallback_font_file(l.q.text, l.q.num, l.q.bold, l.q.italic, l.q.emoji_presentation, &l.q.file);
+
+        fallback_lookups_lock(lock);
+        ensure_space_for(&fallback_lookups, finished, FallbackFontLookup, fallback_lookups.finished_count + 1, finished_capacity, 16, false);
+        fallback_lookups.finished[fallback_lookups.finished_count++] = l;
+        fallback_lookups.busy = false;
+        if (!fallback_lookups.pending_count) pthread_cond_broadcast(&fallback_lookups.is_idle);
+        if (fallback_lookups.wakeup_main_loop && fallback_lookups.finished_count == 1) wakeup_main_loop();
+    }
+    fallback_lookups_lock(unlock);
+    return NULL;
+}
+
+static void
+wait_for_fallback_font_thread(void) {
+    if (!fallback_lookups.started) return;
+    fallback_lookups_lock(lock);
+    while (fallback_lookups.pending_count || fallback_lookups.busy) pthread_cond_wait(&fallback_lookups.is_idle, &fallback_lookups.lock);
+    fallback_lookups_lock(unlock);
+}
+
+static void
+stop_fallback_font_thread(void) {
+    if (!fallback_lookups.started) return;
+    fallback_lookups_lock(lock);
+    fallback_lookups.shutting_down = true;
+    pthread_cond_signal(&fallback_lookups.has_lookups);
+    fallback_lookups_lock(unlock);
+    pthread_join(fallback_lookups.thread, NULL);
+    fallback_lookups.started = false; fallback_lookups.shutting_down = false;
+    for (size_t i = 0; i < fallback_lookups.finished_count; i++) free(fallback_lookups.finished[i].q.file.path);
+    free(fallback_lookups.pending); fallback_lookups.pending = NULL; fallback_lookups.pending_count = 0; fallback_lookups.pending_capacity = 0;
+    free(fallback_lookups.finished); fallback_lookups.finished = NULL; fallback_lookups.finished_count = 0; fallback_lookups.finished_capacity = 0;
+}
+
+static inline ssize_t
+known_fallback_font(FontGroup *fg, CPUCell *cell, bool bold, bool italic, bool emoji_presentation) {
+    KnownFallbackFont q = {.bold=bold, .italic=italic, .emoji_presentation=emoji_presentation};
+    q.num = cell_as_unicode(cell, true, q.text, ' ');
+    KnownFallbackFont *k = find_known_fallback_font(&q);
+    if (!k || fg->fallback_fonts_count > 100) return NO_FONT;
+    PyObject *face = face_from_fallback_font_file(&k->file, fg);
+    if (face) {
+        if (global_state.debug_font_fallback) output_cell_fallback_data(cell, bold, italic, emoji_presentation, face, true);
+        ssize_t ans = add_fallback_font(fg, face, bold, italic, emoji_presentation);
+        Py_DECREF(face);
+        if (has_cell_text(fg->fonts + ans, cell)) return ans;
+    } else PyErr_Clear();
+    // The font file has changed or gone away since it was found
+    forget_known_fallback_font(k);
+    save_known_fallback_fonts();
+    return NO_FONT;
+}
+
+static inline ssize_t
+load_fallback_font_async(FontGroup *fg, CPUCell *cell, uint64_t key, bool bold, bool italic, bool emoji_presentation) {
+    if (fg->fallback_fonts_count > 100) { log_error("Too many fallback fonts"); return MISSING_FONT; }
+    FallbackFontLookup l = {.font_group_id=fg->id, .key=key, .cell=*cell, .q={.bold=bold, .italic=italic, .emoji_presentation=emoji_presentation}};
+    l.q.num = cell_as_unicode(cell, true, l.q.text, ' ');
+    if (!fallback_lookups.started) {
+        fallback_lookups.wakeup_main_loop = !python_send_to_gpu_impl;
+        int ret = pthread_create(&fallback_lookups.thread, NULL, fallback_font_thread, NULL);
+        if (ret != 0) {
+            log_error("Failed to start fallback font thread with error: %s", strerror(ret));
+            return load_fallback_font(fg, cell, bold, italic, emoji_presentation);
+        }
+        fallback_lookups.started = true;
+    }
+    fallback_lookups_lock(lock);
+    ensure_space_for(&fallback_lookups, pending, FallbackFontLookup, fallback_lookups.pending_count + 1, pending_capacity, 16, false);
+    fallback_lookups.pending[fallback_lookups.pending_count++] = l;
+    pthread_cond_signal(&fallback_lookups.has_lookups);
+    fallback_lookups_lock(unlock);
+    // Stored in the font cache until the lookup finishes, so it is not repeated
+    return MISSING_FONT;
+}
+
+static inline bool
+font_group_exists(id_type id) {
+    for (size_t i = 0; i < num_font_groups; i++) { if (font_groups[i].id == id) return true; }
+    return false;
+}
+
+static inline void
+finish_fallback_font_lookup(FontGroup *fg, FallbackFontLookup *l) {
+    ssize_t ans = existing_fallback_font(fg, &l->cell, l->q.bold, l->q.italic, l->q.emoji_presentation);
+    if (ans == NO_FONT) ans = MISSING_FONT;
+    if (ans == MISSING_FONT && l->found && fg->fallback_fonts_count <= 100) {
+        PyObject *face = face_from_fallback_font_file(&l->q.file, fg);
+        if (face) {
+            if (global_state.debug_font_fallback) output_cell_fallback_data(&l->cell, l->q.bold, l->q.italic, l->q.emoji_presentation, face, true);
+            ans = add_fallback_font(fg, face, l->q.bold, l->q.italic, l->q.emoji_presentation);
+            Py_DECREF(face);
+            if (has_cell_text(fg->fonts + ans, &l->cell)) {
+                if (add_known_fallback_font(&l->q)) save_known_fallback_fonts();
+                l->q.file.path = NULL;
+            }
+        } else PyErr_Print();
+    }
+    font_cache_store(fg, l->key, ans);
+}
+
+static void
+process_finished_fallback_lookups(FontGroup *fg) {
+    if (!fallback_lookups.started) return;
+    // The lookups for fg are taken out under the lock and finished after it
+    // is released, as loading the fonts and saving the cache is slow and the
+    // fallback font thread would wait for the lock
+    FallbackFontLookup *mine = NULL;
+    size_t num_mine = 0, i, j;
+    fallback_lookups_lock(lock);
+    if (fallback_lookups.finished_count) {
+        mine = malloc(fallback_lookups.finished_count * sizeof(FallbackFontLookup));
+        if (!mine) fatal("Out of memory processing fallback font lookups");
+    }
+    for (i = 0, j = 0; i < fallback_lookups.finished_count; i++) {
+        FallbackFontLookup *l = fallback_lookups.finished + i;
+        if (l->font_group_id == fg->id) mine[num_mine++] = *l;
+        else if (!font_group_exists(l->font_group_id)) free(l->q.file.path);
+        else {
+            if (i != j) fallback_lookups.finished[j] = *l;
+            j++;
+        }
+    }
+    fallback_lookups.finished_count = j;
+    fallback_lookups_lock(unlock);
+    for (i = 0; i < num_mine; i++) { finish_fallback_font_lookup(fg, mine + i); free(mine[i].q.file.path); }
+    free(mine);
+    if (!num_mine) return;
+    for (size_t o = 0; o < global_state.num_os_windows; o++) {
+        OSWindow *w = global_state.os_windows + o;
+        if (w->fonts_data != (FONTS_DATA_HANDLE)fg) continue;
+        for (size_t t = 0; t < w->num_tabs; t++) {
+            Tab *tab = w->tabs + t;
+            for (size_t c = 0; c < tab->num_windows; c++) {
+                if (tab->windows[c].render_data.screen) screen_dirty_sprite_positions(tab->windows[c].render_data.screen);
+            }
+        }
+        if (w->tab_bar_render_data.screen) screen_dirty_sprite_positions(w->tab_bar_render_data.screen);
+        w->is_damaged = true;
+    }
+}
+
+static void
+discard_fallback_font_lookups(FontGroup *fg) {
+    if (!fallback_lookups.started) return;
+    fallback_lookups_lock(lock);
+    size_t i, j;
+    for (i = 0, j = 0; i < fallback_lookups.pending_count; i++) {
+        if (fallback_lookups.pending[i].font_group_id == fg->id) continue;
+        if (i != j) fallback_lookups.pending[j] = fallback_lookups.pending[i];
+        j++;
+    }
+    fallback_lookups.pending_count = j;
+    fallback_lookups_lock(unlock);
+}
+// }}}
+#endif
+
+static inline ssize_t
+fallback_font(FontGroup *fg, CPUCell *cpu_cell, GPUCell *gpu_cell) {
+    bool bold = (gpu_cell->attrs >> BOLD_SHIFT) & 1;
+    bool italic = (gpu_cell->attrs >> ITALIC_SHIFT) & 1;
+    bool emoji_presentation = has_emoji_presentation(cpu_cell, gpu_cell);
+
+    // Check if one of the existing fallback fonts has this text
+    ssize_t ans = existing_fallback_font(fg, cpu_cell, bold, italic, emoji_presentation);
+    if (ans != NO_FONT) return ans;
+#ifndef __APPLE__
+    ans = known_fallback_font(fg, cpu_cell, bold, italic, emoji_presentation);
+    if (ans != NO_FONT) return ans;
+    // When rendering for tests, lookups are synchronous, unless async_fallback_font_lookups is set
+    uint64_t key = font_cache_key(cpu_cell, gpu_cell);
+    if (key && (!python_send_to_gpu_impl || async_fallback_font_lookups)) return load_fallback_font_async(fg, cpu_cell, key, bold, italic, emoji_presentation);
+#endif
 
     return load_fallback_font(fg, cpu_cell, bold, italic, emoji_presentation);
 }
 
 static inline ssize_t
 in_symbol_maps(FontGroup *fg, char_type ch) {
-    for (size_t i = 0; i < num_symbol_maps; i++) {
-        if (symbol_maps[i].left <= ch && ch <= symbol_maps[i].right) return fg->first_symbol_font_idx + symbol_maps[i].font_idx;
+    // symbol_maps is sorted and non-overlapping, see normalize_symbol_maps()
+    size_t lo = 0, hi = num_symbol_maps;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (symbol_maps[mid].right < ch) lo = mid + 1;
+        else hi = mid;
     }
+    if (lo < num_symbol_maps && symbol_maps[lo].left <= ch) return fg->first_symbol_font_idx + symbol_maps[lo].font_idx;
     return NO_FONT;
 }
 
 
+static inline ssize_t
+font_for_text(FontGroup *fg, CPUCell *cpu_cell, GPUCell *gpu_cell) {
+    ssize_t ans = in_symbol_maps(fg, cpu_cell->ch);
+    if (ans > -1) return ans;
+    switch(BI_VAL(gpu_cell->attrs)) {
+        case 0:
+            ans = fg->medium_font_idx; break;
+        case 1:
+            ans = fg->bold_font_idx ; break;
+        case 2:
+            ans = fg->italic_font_idx; break;
+        case 3:
+            ans = fg->bi_font_idx; break;
+    }
+    if (ans < 0) ans = fg->medium_font_idx;
+    if (!has_emoji_presentation(cpu_cell, gpu_cell) && has_cell_text(fg->fonts + ans, cpu_cell)) return ans;
+    return fallback_font(fg, cpu_cell, gpu_cell);
+}
+
 static ssize_t
 font_for_cell(FontGroup *fg, CPUCell *cpu_cell, GPUCell *gpu_cell) {
 START_ALLOW_CASE_RANGE
     ssize_t ans;
+    uint64_t key;
     switch(cpu_cell->ch) {
         case 0:
         case ' ':
             return BLANK_FONT;
         case 0x2500 ... 0x2570:
         case 0x2574 ... 0x259f:
+        case 0x2800 ... 0x28ff:
         case 0xe0b0:
         case 0xe0b2:
         case 0xe0b4:
         case 0xe0b6:
             return BOX_FONT;
         default:
-            ans = in_symbol_maps(fg, cpu_cell->ch);
-            if (ans > -1) return ans;
-            switch(BI_VAL(gpu_cell->attrs)) {
-                case 0:
-                    ans = fg->medium_font_idx; break;
-                case 1:
-                    ans = fg->bold_font_idx ; break;
-                case 2:
-                    ans = fg->italic_font_idx; break;
-                case 3:
-                    ans = fg->bi_font_idx; break;
+            key = font_cache_key(cpu_cell, gpu_cell);
+            if (key && fg->font_cache) {
+                FontForCell *cached = font_cache_slot(fg, key);
+                if (cached->key == key) return cached->font_idx;
             }
-            if (ans < 0) ans = fg->medium_font_idx;
-            if (!has_emoji_presentation(cpu_cell, gpu_cell) && has_cell_text(fg->fonts + ans, cpu_cell)) return ans;
-            return fallback_font(fg, cpu_cell, gpu_cell);
+            ans = font_for_text(fg, cpu_cell, gpu_cell);
+            if (key) font_cache_store(fg, key, ans);
+            return ans;
     }
 END_ALLOW_CASE_RANGE
 }
@@ -562,6 +1264,8 @@ START_ALLOW_CASE_RANGE
     switch(ch) {
         case 0x2500 ... 0x259f:
             return ch - 0x2500;
+        case 0x2800 ... 0x28ff:
+            return 0x100 + ch - 0x2800;
         case 0xe0b0:
             return 0xfa;
         case 0xe0b2:
@@ -606,14 +1310,21 @@ render_box_cell(FontGroup *fg, CPUCell *cpu_cell, GPUCell *gpu_cell) {
     if (sp->rendered) return;
     sp->rendered = true;
     sp->colored = false;
-    PyObject *ret = PyObject_CallFunction(box_drawing_function, "IIId", cpu_cell->ch, fg->cell_width, fg->cell_height, (fg->logical_dpi_x + fg->logical_dpi_y) / 2.0);
-    if (ret == NULL) { PyErr_Print(); return; }
-    uint8_t *alpha_mask = PyLong_AsVoidPtr(PyTuple_GET_ITEM(ret, 0));
-    clear_canvas(fg);
+    double dpi = (fg->logical_dpi_x + fg->logical_dpi_y) / 2.0;
     Region r = { .right = fg->cell_width, .bottom = fg->cell_height };
-    render_alpha_mask(alpha_mask, fg->canvas, &r, &r, fg->cell_width, fg->cell_width);
+    clear_canvas(fg);
+    uint8_t *alpha_mask = calloc((size_t)fg->cell_width * fg->cell_height, sizeof(uint8_t));
+    if (!alpha_mask) fatal("Out of memory");
+    if (render_box_char(cpu_cell->ch, alpha_mask, fg->cell_width, fg->cell_height, dpi)) {
+        render_alpha_mask(alpha_mask, fg->canvas, &r, &r, fg->cell_width, fg->cell_width);
+    } else {
+        PyObject *ret = PyObject_CallFunction(box_drawing_function, "IIId", cpu_cell->ch, fg->cell_width, fg->cell_height, dpi);
+        if (ret == NULL) { PyErr_Print(); free(alpha_mask); return; }
+        render_alpha_mask(PyLong_AsVoidPtr(PyTuple_GET_ITEM(ret, 0)), fg->canvas, &r, &r, fg->cell_width, fg->cell_width);
+        Py_DECREF(ret);
+    }
+    free(alpha_mask);
     current_send_sprite_to_gpu((FONTS_DATA_HANDLE)fg, sp->x, sp->y, sp->z, fg->canvas);
-    Py_DECREF(ret);
 }
 
 static inline void
@@ -642,19 +1353,93 @@ set_cell_sprite(GPUCell *cell, SpritePosition *sp) {
     if (sp->colored) cell->sprite_z |= 0x4000;
 }
 
-static inline pixel*
-extract_cell_from_canvas(FontGroup *fg, unsigned int i, unsigned int num_cells) {
-    pixel *ans = fg->canvas + (fg->cell_width * fg->cell_height * (CELLS_IN_CANVAS - 1)), *dest = ans, *src = fg->canvas + (i * fg->cell_width);
-    unsigned int stride = fg->cell_width * num_cells;
-    for (unsigned int r = 0; r < fg->cell_height; r++, dest += fg->cell_width, src += stride) memcpy(dest, src, fg->cell_width * sizeof(pixel));
-    return ans;
-}
-
 static inline bool
 is_private_use(char_type ch) {
     return (0xe000 <= ch && ch <= 0xf8ff) || (0xF0000 <= ch && ch <= 0xFFFFF) || (0x100000 <= ch && ch <= 0x10FFFF);
 }
 
+static inline bool
+ensure_render_faces(FontGroup *fg, Font *font) {
+    if (font->render_faces[0]) return true;
+    if (font->render_faces_unavailable) return false;
+    for (size_t i = 0; i < render_threads.num_threads; i++) {
+        font->render_faces[i] = face_for_render_thread(font->face, (FONTS_DATA_HANDLE)fg);
+        if (font->render_faces[i] == NULL) {
+            if (PyErr_Occurred()) PyErr_Print();
+            free_render_faces(font);
+            font->render_faces_unavailable = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline bool
+queue_render_job(FontGroup *fg, Font *font, unsigned int num_cells, unsigned int num_glyphs, hb_glyph_info_t *info, hb_glyph_position_t *positions, SpritePosition **sprite_positions, uint64_t *glyph_cache_keys, bool center_glyph) {
+    if (!ensure_render_threads() || !ensure_render_faces(fg, font)) return false;
+    render_threads_lock(lock);
+    ensure_space_for(&render_threads, jobs, RenderJob, render_threads.jobs_start + render_threads.jobs_count + 1, jobs_capacity, 64, false);
+    RenderJob *job = render_threads.jobs + render_threads.jobs_start + render_threads.jobs_count;
+    job->font_group_id = fg->id;
+    job->fonts_data.sprite_map = NULL;
+    job->fonts_data.logical_dpi_x = fg->logical_dpi_x; job->fonts_data.logical_dpi_y = fg->logical_dpi_y;
+    job->fonts_data.font_sz_in_pts = fg->font_sz_in_pts;
+    job->fonts_data.cell_width = fg->cell_width; job->fonts_data.cell_height = fg->cell_height;
+    memcpy(job->faces, font->render_faces, sizeof(job->faces));
+    job->bold = font->bold; job->italic = font->italic; job->center_glyph = center_glyph;
+    job->num_cells = num_cells; job->baseline = fg->baseline;
+    job->num_glyphs = MIN(num_glyphs, arraysz(job->info));
+    memcpy(job->info, info, sizeof(job->info[0]) * job->num_glyphs);
+    memcpy(job->positions, positions, sizeof(job->positions[0]) * job->num_glyphs);
+    for (unsigned int i = 0; i < num_cells; i++) {
+        job->x[i] = sprite_positions[i]->x; job->y[i] = sprite_positions[i]->y; job->z[i] = sprite_positions[i]->z;
+        job->glyph_cache_keys[i] = glyph_cache_keys[i];
+    }
+    job->canvas = NULL;
+    render_threads.jobs_count++;
+    pthread_cond_signal(&render_threads.has_jobs);
+    render_threads_lock(unlock);
+    return true;
+}
+
+static inline uint64_t
+glyph_cache_key_for(Font *font, SpritePosition *sp) {
+    if (!font->glyph_cache_key_computed) {
+        font->glyph_cache_key_computed = true;
+        font->glyph_cache_key = face_cache_key(font->face);
+        if (font->glyph_cache_key) {
+            uint8_t style = font->bold | (font->italic << 1);
+            font->glyph_cache_key = glyph_cache_hash(font->glyph_cache_key, &style, sizeof(style));
+        }
+    }
+    if (!font->glyph_cache_key) return 0;
+    uint64_t h = glyph_cache_hash(font->glyph_cache_key, &sp->glyph, sizeof(sp->glyph));
+    h = glyph_cache_hash(h, &sp->ligature_index, sizeof(sp->ligature_index));
+    for (size_t i = 0; i < MAX_NUM_EXTRA_GLYPHS && sp->extra_glyphs.data[i]; i++) h = glyph_cache_hash(h, sp->extra_glyphs.data + i, sizeof(sp->extra_glyphs.data[i]));
+    return h ? h : 1;
+}
+
+static inline bool
+render_group_from_glyph_cache(FontGroup *fg, Font *font, unsigned int num_cells, GPUCell *gpu_cells, SpritePosition **sprite_position, uint64_t *glyph_cache_keys) {
+    static const pixel *bitmaps[16];
+    static bool colored[16];
+    for (unsigned int i = 0; i < num_cells; i++) {
+        glyph_cache_keys[i] = glyph_cache_key_for(font, sprite_position[i]);
+        if (!glyph_cache_keys[i]) return false;
+    }
+    for (unsigned int i = 0; i < num_cells; i++) {
+        bitmaps[i] = glyph_cache_lookup(fg->glyph_cache, glyph_cache_keys[i], colored + i);
+        if (!bitmaps[i]) return false;
+    }
+    for (unsigned int i = 0; i < num_cells; i++) {
+        sprite_position[i]->rendered = true;
+        sprite_position[i]->colored = colored[i];
+        set_cell_sprite(gpu_cells + i, sprite_position[i]);
+        current_send_sprite_to_gpu((FONTS_DATA_HANDLE)fg, sprite_position[i]->x, sprite_position[i]->y, sprite_position[i]->z, (pixel*)bitmaps[i]);
+    }
+    return true;
+}
+
 static inline void
 render_group(FontGroup *fg, unsigned int num_cells, unsigned int num_glyphs, CPUCell *cpu_cells, GPUCell *gpu_cells, hb_glyph_info_t *info, hb_glyph_position_t *positions, Font *font, glyph_index glyph, ExtraGlyphs *extra_glyphs, bool center_glyph) {
     static SpritePosition* sprite_position[16];
@@ -668,18 +1453,33 @@ render_group(FontGroup *fg, unsigned int num_cells, unsigned int num_glyphs, CPU
         for (unsigned int i = 0; i < num_cells; i++) { set_cell_sprite(gpu_cells + i, sprite_position[i]); }
         return;
     }
+    static uint64_t glyph_cache_keys[16];
+    memset(glyph_cache_keys, 0, sizeof(glyph_cache_keys));
+    if (fg->glyph_cache && render_group_from_glyph_cache(fg, font, num_cells, gpu_cells, sprite_position, glyph_cache_keys)) return;
 
     clear_canvas(fg);
     bool was_colored = (gpu_cells->attrs & WIDTH_MASK) == 2 && is_emoji(cpu_cells->ch);
-    render_glyphs_in_cells(font->face, font->bold, font->italic, info, positions, num_glyphs, fg->canvas, fg->cell_width, fg->cell_height, num_cells, fg->baseline, &was_colored, (FONTS_DATA_HANDLE)fg, center_glyph);
-    if (PyErr_Occurred()) PyErr_Print();
+    // Whether a colored glyph can be rendered in color is only known after
+    // rendering it, so those are always rendered synchronously
+    if (!was_colored && queue_render_job(fg, font, num_cells, num_glyphs, info, positions, sprite_position, glyph_cache_keys, center_glyph)) {
+        for (unsigned int i = 0; i < num_cells; i++) {
+            sprite_position[i]->rendered = true;
+            sprite_position[i]->colored = false;
+            set_cell_sprite(gpu_cells + i, sprite_position[i]);
+            current_send_sprite_to_gpu((FONTS_DATA_HANDLE)fg, sprite_position[i]->x, sprite_position[i]->y, sprite_position[i]->z, fg->canvas);
+        }
+        return;
+    }
+    bool ok = render_glyphs_in_cells(font->face, font->bold, font->italic, info, positions, num_glyphs, fg->canvas, fg->cell_width, fg->cell_height, num_cells, fg->baseline, &was_colored, (FONTS_DATA_HANDLE)fg, center_glyph);
+    if (PyErr_Occurred()) { ok = false; PyErr_Print(); }
 
     for (unsigned int i = 0; i < num_cells; i++) {
         sprite_position[i]->rendered = true;
         sprite_position[i]->colored = was_colored;
         set_cell_sprite(gpu_cells + i, sprite_position[i]);
-        pixel *buf = num_cells == 1 ? fg->canvas : extract_cell_from_canvas(fg, i, num_cells);
+        pixel *buf = num_cells == 1 ? fg->canvas : extract_cell_from_canvas(fg, fg->canvas, i, num_cells);
         current_send_sprite_to_gpu((FONTS_DATA_HANDLE)fg, sprite_position[i]->x, sprite_position[i]->y, sprite_position[i]->z, buf);
+        if (ok && glyph_cache_keys[i]) glyph_cache_add(fg->glyph_cache, glyph_cache_keys[i], buf, was_colored);
     }
 
 }
@@ -1014,30 +1814,163 @@ test_shape(PyObject UNUSED *self, PyObject *args) {
 }
 #undef G
 
+// Shape cache {{{
+
+static inline uint64_t
+hash_run(CPUCell *cpu_cells, GPUCell *gpu_cells, index_type num_cells, ssize_t font_idx, bool pua_space_ligature, bool center_glyph, bool disable_ligatures, int cursor_offset) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+#define H(x) { h ^= (uint64_t)(x); h *= 1099511628211ULL; }
+    H(font_idx); H(cursor_offset + 1); H(pua_space_ligature | (center_glyph << 1) | (disable_ligatures << 2));
+    for (index_type i = 0; i < num_cells; i++) {
+        H(cpu_cells[i].ch);
+        for (unsigned c = 0; c < arraysz(cpu_cells[i].cc_idx); c++) H(cpu_cells[i].cc_idx[c]);
+        H(gpu_cells[i].attrs & WIDTH_MASK);
+    }
+#undef H
+    return h;
+}
+
+static inline ShapedRun*
+shape_cache_slot(FontGroup *fg, uint64_t hash) {
+    if (!fg->shape_cache) {
+        fg->shape_cache = calloc(SHAPE_CACHE_SIZE, sizeof(ShapedRun));
+        if (!fg->shape_cache) fatal("Out of memory allocating shape cache");
+    }
+    return fg->shape_cache + (hash & (SHAPE_CACHE_SIZE - 1));
+}
+
+static inline bool
+shaped_run_matches(ShapedRun *r, uint64_t hash, CPUCell *cpu_cells, GPUCell *gpu_cells, index_type num_cells, ssize_t font_idx, bool pua_space_ligature, bool center_glyph, bool disable_ligatures, int cursor_offset) {
+    if (r->hash != hash || r->num_cells != num_cells || r->font_idx != font_idx || r->cursor_offset != cursor_offset || r->pua_space_ligature != pua_space_ligature || r->center_glyph != center_glyph || r->disable_ligatures != disable_ligatures) return false;
+    if (memcmp(r->cpu_cells, cpu_cells, sizeof(CPUCell) * num_cells) != 0) return false;
+    for (index_type i = 0; i < num_cells; i++) {
+        if (r->widths[i] != (gpu_cells[i].attrs & WIDTH_MASK)) return false;
+    }
+    return true;
+}
+
+static inline void
+store_shaped_run(ShapedRun *r, uint64_t hash, CPUCell *cpu_cells, GPUCell *gpu_cells, index_type num_cells, ssize_t font_idx, bool pua_space_ligature, bool center_glyph, bool disable_ligatures, int cursor_offset, double shaping_time) {
+    if (r->capacity < num_cells) {
+        r->capacity = MAX(16, num_cells);
+        r->cpu_cells = realloc(r->cpu_cells, sizeof(CPUCell) * r->capacity);
+        r->widths = realloc(r->widths, sizeof(attrs_type) * r->capacity);
+        r->sprites = realloc(r->sprites, sizeof(sprite_index) * 3 * r->capacity);
+        if (!r->cpu_cells || !r->widths || !r->sprites) fatal("Out of memory storing shaped run");
+    }
+    r->hash = hash; r->num_cells = num_cells; r->font_idx = font_idx; r->cursor_offset = cursor_offset;
+    r->pua_space_ligature = pua_space_ligature; r->center_glyph = center_glyph; r->disable_ligatures = disable_ligatures;
+    r->shaping_time = shaping_time;
+    memcpy(r->cpu_cells, cpu_cells, sizeof(CPUCell) * num_cells);
+    for (index_type i = 0; i < num_cells; i++) {
+        r->widths[i] = gpu_cells[i].attrs & WIDTH_MASK;
+        r->sprites[3*i] = gpu_cells[i].sprite_x; r->sprites[3*i + 1] = gpu_cells[i].sprite_y; r->sprites[3*i + 2] = gpu_cells[i].sprite_z;
+    }
+}
+
+static PyObject*
+shape_cache_stats(PYNOARG) {
+    return Py_BuildValue("{sKsKsd}", "hits", shape_cache_stats_data.hits, "misses", shape_cache_stats_data.misses, "shaping_time_saved", shape_cache_stats_data.shaping_time_saved);
+}
+
+// }}}
+
+// Disabled by the tests, to compare with shaping
+static bool render_simple_runs = true;
+
+static inline bool
+is_simple_run(FontGroup *fg, ssize_t font_idx, CPUCell *cpu_cells, GPUCell *gpu_cells, index_type num_cells) {
+    // Only runs in the main faces are checked, fallback fonts are rarely used for ASCII
+    if (!render_simple_runs || (font_idx != fg->medium_font_idx && font_idx != fg->bold_font_idx && font_idx != fg->italic_font_idx && font_idx != fg->bi_font_idx)) return false;
+    Font *font = fg->fonts + font_idx;
+    if (!font->simple_codepoints_found) find_simple_codepoints(font);
+    for (index_type i = 0; i < num_cells; i++) {
+        char_type ch = cpu_cells[i].ch;
+        if (ch > 127 || !(font->simple_codepoints[ch >> 6] & (1ull << (ch & 63))) || cpu_cells[i].cc_idx[0] || (gpu_cells[i].attrs & WIDTH_MASK) != 1) return false;
+    }
+    return true;
+}
+
+static inline void
+render_simple_run(FontGroup *fg, Font *font, CPUCell *cpu_cells, GPUCell *gpu_cells, index_type num_cells, bool center_glyph) {
+    // Every cell is rendered exactly as shaping would have, as a group of one glyph in one cell
+    static const ExtraGlyphs no_extra_glyphs = {{0}};
+    ExtraGlyphs ed;
+    for (index_type i = 0; i < num_cells; i++) {
+        char_type ch = cpu_cells[i].ch;
+        uint64_t mask = 1ull << (ch & 63);
+        sprite_index *sp = font->simple_sprites[ch];
+        if (font->simple_sprites_filled[ch >> 6] & mask) {
+            set_sprite(gpu_cells + i, sp[0], sp[1], sp[2]);
+            continue;
+        }
+        hb_glyph_info_t info = {.codepoint = glyph_id_for_codepoint(font->face, ch)};
+        hb_glyph_position_t position = {0};
+        ed = no_extra_glyphs;
+        set_sprite(gpu_cells + i, 0, 0, 0);
+        render_group(fg, 1, 1, cpu_cells + i, gpu_cells + i, &info, &position, font, info.codepoint, &ed, center_glyph);
+        sp[0] = gpu_cells[i].sprite_x; sp[1] = gpu_cells[i].sprite_y; sp[2] = gpu_cells[i].sprite_z;
+        if (sp[0] || sp[1] || sp[2]) font->simple_sprites_filled[ch >> 6] |= mask;
+    }
+}
+
+static inline double
+shape_and_render_run(FontGroup *fg, CPUCell *first_cpu_cell, GPUCell *first_gpu_cell, index_type num_cells, ssize_t font_idx, bool pua_space_ligature, bool center_glyph, int cursor_offset) {
+    double shaping_time = 0, start;
+#define SHAPE(...) { start = monotonic(); shape_run(__VA_ARGS__); shaping_time += monotonic() - start; }
+    SHAPE(first_cpu_cell, first_gpu_cell, num_cells, &fg->fonts[font_idx], false);
+    if (pua_space_ligature) merge_groups_for_pua_space_ligature();
+    else if (cursor_offset > -1) {
+        index_type left, right;
+        split_run_at_offset(cursor_offset, &left, &right);
+        if (right > left) {
+            if (left) {
+                SHAPE(first_cpu_cell, first_gpu_cell, left, &fg->fonts[font_idx], false);
+                render_groups(fg, &fg->fonts[font_idx], center_glyph);
+            }
+                SHAPE(first_cpu_cell + left, first_gpu_cell + left, right - left, &fg->fonts[font_idx], true);
+                render_groups(fg, &fg->fonts[font_idx], center_glyph);
+            if (right < num_cells) {
+                SHAPE(first_cpu_cell + right, first_gpu_cell + right, num_cells - right, &fg->fonts[font_idx], false);
+                render_groups(fg, &fg->fonts[font_idx], center_glyph);
+            }
+            return shaping_time;
+        }
+    }
+    render_groups(fg, &fg->fonts[font_idx], center_glyph);
+    return shaping_time;
+#undef SHAPE
+}
+
 static inline void
 render_run(FontGroup *fg, CPUCell *first_cpu_cell, GPUCell *first_gpu_cell, index_type num_cells, ssize_t font_idx, bool pua_space_ligature, bool center_glyph, int cursor_offset) {
+    ShapedRun *cached_run = NULL;
+    uint64_t hash;
+    bool disable_ligatures;
+    double shaping_time;
     switch(font_idx) {
         default:
-            shape_run(first_cpu_cell, first_gpu_cell, num_cells, &fg->fonts[font_idx], false);
-            if (pua_space_ligature) merge_groups_for_pua_space_ligature();
-            else if (cursor_offset > -1) {
-                index_type left, right;
-                split_run_at_offset(cursor_offset, &left, &right);
-                if (right > left) {
-                    if (left) {
-                        shape_run(first_cpu_cell, first_gpu_cell, left, &fg->fonts[font_idx], false);
-                        render_groups(fg, &fg->fonts[font_idx], center_glyph);
-                    }
-                        shape_run(first_cpu_cell + left, first_gpu_cell + left, right - left, &fg->fonts[font_idx], true);
-                        render_groups(fg, &fg->fonts[font_idx], center_glyph);
-                    if (right < num_cells) {
-                        shape_run(first_cpu_cell + right, first_gpu_cell + right, num_cells - right, &fg->fonts[font_idx], false);
-                        render_groups(fg, &fg->fonts[font_idx], center_glyph);
-                    }
+            if (!pua_space_ligature && is_simple_run(fg, font_idx, first_cpu_cell, first_gpu_cell, num_cells)) {
+                render_simple_run(fg, fg->fonts + font_idx, first_cpu_cell, first_gpu_cell, num_cells, center_glyph);
+                break;
+            }
+            if (num_cells <= MAX_CACHED_RUN_LENGTH) {
+                disable_ligatures = OPT(disable_ligatures) == DISABLE_LIGATURES_ALWAYS;
+                hash = hash_run(first_cpu_cell, first_gpu_cell, num_cells, font_idx, pua_space_ligature, center_glyph, disable_ligatures, cursor_offset);
+                cached_run = shape_cache_slot(fg, hash);
+                if (shaped_run_matches(cached_run, hash, first_cpu_cell, first_gpu_cell, num_cells, font_idx, pua_space_ligature, center_glyph, disable_ligatures, cursor_offset)) {
+                    for (index_type i = 0; i < num_cells; i++) set_sprite(first_gpu_cell + i, cached_run->sprites[3*i], cached_run->sprites[3*i + 1], cached_run->sprites[3*i + 2]);
+                    shape_cache_stats_data.hits++;
+                    shape_cache_stats_data.shaping_time_saved += cached_run->shaping_time;
                     break;
                 }
+                shape_cache_stats_data.misses++;
+                // ensure cells not covered by any glyph group are blank rather than stale
+                for (index_type i = 0; i < num_cells; i++) set_sprite(first_gpu_cell + i, 0, 0, 0);
             }
-            render_groups(fg, &fg->fonts[font_idx], center_glyph);
+            shaping_time = shape_and_render_run(fg, first_cpu_cell, first_gpu_cell, num_cells, font_idx, pua_space_ligature, center_glyph, cursor_offset);
+            if (cached_run) store_shaped_run(cached_run, hash, first_cpu_cell, first_gpu_cell, num_cells, font_idx, pua_space_ligature, center_glyph, disable_ligatures, cursor_offset, shaping_time);
             break;
         case BLANK_FONT:
             while(num_cells--) { set_sprite(first_gpu_cell, 0, 0, 0); first_cpu_cell++; first_gpu_cell++; }
@@ -1136,6 +2069,42 @@ clear_symbol_maps() {
     if (symbol_maps) { free(symbol_maps); symbol_maps = NULL; num_symbol_maps = 0; }
 }
 
+static int
+cmp_boundaries(const void *a_, const void *b_) {
+    uint64_t a = *(const uint64_t*)a_, b = *(const uint64_t*)b_;
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static bool
+normalize_symbol_maps() {
+    // Turn the symbol maps into a sorted table of non-overlapping intervals,
+    // so they can be binary searched. Where maps overlap, the first one wins.
+    if (!num_symbol_maps) return true;
+    uint64_t *boundaries = malloc(2 * num_symbol_maps * sizeof(uint64_t));
+    SymbolMap *ans = malloc(2 * num_symbol_maps * sizeof(SymbolMap));
+    if (!boundaries || !ans) { free(boundaries); free(ans); return false; }
+    for (size_t i = 0; i < num_symbol_maps; i++) {
+        boundaries[2*i] = symbol_maps[i].left; boundaries[2*i + 1] = (uint64_t)symbol_maps[i].right + 1;
+    }
+    qsort(boundaries, 2 * num_symbol_maps, sizeof(uint64_t), cmp_boundaries);
+    size_t count = 0;
+    for (size_t b = 0; b + 1 < 2 * num_symbol_maps; b++) {
+        if (boundaries[b] == boundaries[b + 1]) continue;
+        char_type left = boundaries[b], right = boundaries[b + 1] - 1;
+        for (size_t i = 0; i < num_symbol_maps; i++) {
+            if (symbol_maps[i].left <= left && right <= symbol_maps[i].right) {
+                if (count && ans[count - 1].font_idx == symbol_maps[i].font_idx && ans[count - 1].right + 1 == left) ans[count - 1].right = right;
+                else { ans[count].left = left; ans[count].right = right; ans[count].font_idx = symbol_maps[i].font_idx; count++; }
+                break;
+            }
+        }
+    }
+    free(boundaries);
+    free(symbol_maps);
+    symbol_maps = ans; num_symbol_maps = count;
+    return true;
+}
+
 typedef struct {
     unsigned int main, bold, italic, bi, num_symbol_fonts;
 } DescriptorIndices;
@@ -1162,6 +2131,7 @@ set_font_data(PyObject UNUSED *m, PyObject *args) {
         if (!PyArg_ParseTuple(PyTuple_GET_ITEM(sm, s), "III", &left, &right, &font_idx)) return NULL;
         x->left = left; x->right = right; x->font_idx = font_idx;
     }
+    if (!normalize_symbol_maps()) return PyErr_NoMemory();
     Py_RETURN_NONE;
 }
 
@@ -1227,6 +2197,11 @@ initialize_font_group(FontGroup *fg) {
     }
 #undef I
     calc_cell_metrics(fg);
+    uint64_t key = GLYPH_CACHE_HASH_SEED;
+#define H(x) key = glyph_cache_hash(key, &(x), sizeof(x))
+    H(fg->cell_width); H(fg->cell_height); H(fg->baseline); H(fg->logical_dpi_x); H(fg->logical_dpi_y); H(fg->font_sz_in_pts);
+#undef H
+    fg->glyph_cache = open_glyph_cache(key, fg->cell_width, fg->cell_height);
 }
 
 
@@ -1248,6 +2223,11 @@ load_fonts_data(double font_sz_in_pts, double dpi_x, double dpi_y) {
 
 static void
 finalize(void) {
+    stop_render_threads();
+#ifndef __APPLE__
+    stop_fallback_font_thread();
+    free_known_fallback_fonts();
+#endif
     Py_CLEAR(python_send_to_gpu_impl);
     clear_symbol_maps();
     Py_CLEAR(box_drawing_function);
@@ -1288,6 +2268,46 @@ set_send_sprite_to_gpu(PyObject UNUSED *self, PyObject *func) {
         Py_INCREF(python_send_to_gpu_impl);
     }
     current_send_sprite_to_gpu = python_send_to_gpu_impl ? python_send_to_gpu : send_sprite_to_gpu;
+    // the number of render threads to use depends on where sprites are sent
+    stop_render_threads();
+    Py_RETURN_NONE;
+}
+
+#ifndef __APPLE__
+static PyObject*
+set_fallback_font_cache(PyObject UNUSED *self, PyObject *args) {
+    const char *path = NULL, *fingerprint = "";
+    if (!PyArg_ParseTuple(args, "z|s", &path, &fingerprint)) return NULL;
+    free_known_fallback_fonts();
+    if (path) {
+        known_fallback_fonts.path = strdup(path);
+        known_fallback_fonts.fingerprint = strdup(fingerprint);
+        if (!known_fallback_fonts.path || !known_fallback_fonts.fingerprint) return PyErr_NoMemory();
+        load_known_fallback_fonts();
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+set_async_fallback_font_lookups(PyObject UNUSED *self, PyObject *val) {
+    stop_fallback_font_thread();
+    async_fallback_font_lookups = PyObject_IsTrue(val) ? true : false;
+    Py_RETURN_NONE;
+}
+#endif
+
+static PyObject*
+set_glyph_render_threads(PyObject UNUSED *self, PyObject *args) {
+    int num;
+    if (!PyArg_ParseTuple(args, "i", &num)) return NULL;
+    stop_render_threads();
+    requested_num_of_render_threads = MAX(-1, num);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+set_simple_run_rendering(PyObject UNUSED *self, PyObject *val) {
+    render_simple_runs = PyObject_IsTrue(val) ? true : false;
     Py_RETURN_NONE;
 }
 
@@ -1297,6 +2317,17 @@ test_render_line(PyObject UNUSED *self, PyObject *args) {
     if (!PyArg_ParseTuple(args, "O!", &Line_Type, &line)) return NULL;
     if (!num_font_groups) { PyErr_SetString(PyExc_RuntimeError, "must create font group first"); return NULL; }
     render_line((FONTS_DATA_HANDLE)font_groups, (Line*)line, 0, NULL);
+    if (render_threads.num_threads) {
+        wait_for_render_threads();
+        process_finished_render_jobs(font_groups, true);
+    }
+#ifndef __APPLE__
+    // Cells whose fallback font was being looked up get it when the line is next rendered
+    if (fallback_lookups.started) {
+        wait_for_fallback_font_thread();
+        process_finished_fallback_lookups(font_groups);
+    }
+#endif
     Py_RETURN_NONE;
 }
 
@@ -1409,7 +2440,14 @@ static PyMethodDef module_methods[] = {
     METHODB(test_shape, METH_VARARGS),
     METHODB(current_fonts, METH_NOARGS),
     METHODB(test_render_line, METH_VARARGS),
+    METHODB(set_glyph_render_threads, METH_VARARGS),
+    METHODB(set_simple_run_rendering, METH_O),
+    METHODB(shape_cache_stats, METH_NOARGS),
     METHODB(get_fallback_font, METH_VARARGS),
+#ifndef __APPLE__
+    METHODB(set_fallback_font_cache, METH_VARARGS),
+    METHODB(set_async_fallback_font_lookups, METH_O),
+#endif
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -1424,6 +2462,16 @@ init_fonts(PyObject *module) {
         return false;
     }
 #undef feature_str
+    if (pthread_mutex_init(&render_threads.lock, NULL) != 0 || pthread_cond_init(&render_threads.has_jobs, NULL) != 0 || pthread_cond_init(&render_threads.is_idle, NULL) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to create locks for glyph render threads");
+        return false;
+    }
+#ifndef __APPLE__
+    if (pthread_mutex_init(&fallback_lookups.lock, NULL) != 0 || pthread_cond_init(&fallback_lookups.has_lookups, NULL) != 0 || pthread_cond_init(&fallback_lookups.is_idle, NULL) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to create locks for the fallback font thread");
+        return false;
+    }
+#endif
     if (PyModule_AddFunctions(module, module_methods) != 0) return false;
     current_send_sprite_to_gpu = send_sprite_to_gpu;
     return true;
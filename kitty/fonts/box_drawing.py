@@ -6,6 +6,8 @@ import math
 from functools import partial as p
 from itertools import repeat
 
+from kitty.fast_data_types import set_box_drawing_scale
+
 scale = (0.001, 1, 1.5, 2)
 _dpi = 96.0
 
@@ -13,6 +15,7 @@ _dpi = 96.0
 def set_scale(new_scale):
     global scale
     scale = tuple(new_scale)
+    set_box_drawing_scale(scale)
 
 
 def thickness(level=1, horizontal=True):
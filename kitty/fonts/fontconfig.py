@@ -2,6 +2,8 @@
 # vim:fileencoding=utf-8
 # License: GPL v3 Copyright: 2016, Kovid Goyal <kovid at kovidgoyal.net>
 
+import hashlib
+import os
 import re
 from functools import lru_cache
 
@@ -113,3 +115,22 @@ def get_font_files(opts):
 def font_for_family(family):
     ans = find_best_match(family, monospaced=False)
     return ans, ans.get('weight', 0) >= FC_WEIGHT_BOLD, ans.get('slant', FC_SLANT_ROMAN) != FC_SLANT_ROMAN
+
+
+def fallback_font_cache_fingerprint(faces):
+    # Fallback fonts are only remembered as long as the main fonts and the
+    # fontconfig configuration they were found with have not changed
+    config_home = os.environ.get('XDG_CONFIG_HOME') or os.path.expanduser('~/.config')
+    paths = [os.environ.get('FONTCONFIG_FILE') or '/etc/fonts/fonts.conf', '/etc/fonts/conf.d',
+             os.path.join(config_home, 'fontconfig'), os.path.join(config_home, 'fontconfig', 'conf.d'),
+             os.path.expanduser('~/.fonts.conf')]
+    h = hashlib.sha1()
+    for face, bold, italic in faces:
+        h.update(repr((face.get('path'), face.get('index', 0), bold, italic)).encode('utf-8'))
+    for path in paths:
+        try:
+            mtime = os.stat(path).st_mtime_ns
+        except EnvironmentError:
+            mtime = 0
+        h.update('{}:{}'.format(path, mtime).encode('utf-8'))
+    return h.hexdigest()
@@ -221,8 +221,9 @@ def render_box_drawing(codepoint, cell_width, cell_height, dpi):
 
 class setup_for_testing:
 
-    def __init__(self, family='monospace', size=11.0, dpi=96.0):
+    def __init__(self, family='monospace', size=11.0, dpi=96.0, main_face_path=None):
         self.family, self.size, self.dpi = family, size, dpi
+        self.main_face_path = main_face_path
 
     def __enter__(self):
         from collections import OrderedDict
@@ -237,6 +238,9 @@ class setup_for_testing:
         set_send_sprite_to_gpu(send_to_gpu)
         try:
             set_font_family(opts)
+            if self.main_face_path:
+                # Use the font file for the regular face, installed or not
+                current_faces[0] = (self.main_face_path, False, False)
             cell_width, cell_height = create_test_font_group(self.size, self.dpi, self.dpi)
             return sprites, cell_width, cell_height
         except Exception:
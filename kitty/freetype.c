@@ -7,7 +7,9 @@
 
 #include "fonts.h"
 #include "state.h"
+#include "glyph-cache.h"
 #include <math.h>
+#include <sys/stat.h>
 #include <structmember.h>
 #include <ft2build.h>
 #include <hb-ft.h>
@@ -46,6 +48,8 @@ static PyObject* FreeType_Exception = NULL;
 void
 set_freetype_error(const char* prefix, int err_code) {
     int i = 0;
+    // Render threads do not hold the GIL, so errors are only logged
+#define REPORT(fmt, ...) { if (in_render_thread) log_error(fmt, __VA_ARGS__); else PyErr_Format(FreeType_Exception, fmt, __VA_ARGS__); }
 #undef FTERRORS_H_
 #undef __FTERRORS_H__
 #define FT_ERRORDEF( e, v, s )  { e, s },
@@ -65,12 +69,13 @@ set_freetype_error(const char* prefix, int err_code) {
 
     while(ft_errors[i].err_msg != NULL) {
         if (ft_errors[i].err_code == err_code) {
-            PyErr_Format(FreeType_Exception, "%s %s", prefix, ft_errors[i].err_msg);
+            REPORT("%s %s", prefix, ft_errors[i].err_msg);
             return;
         }
         i++;
     }
-    PyErr_Format(FreeType_Exception, "%s (error code: %d)", prefix, err_code);
+    REPORT("%s (error code: %d)", prefix, err_code);
+#undef REPORT
 }
 
 static FT_Library  library;
@@ -210,10 +215,49 @@ face_from_path(const char *path, int index, FONTS_DATA_HANDLE fg) {
     int error;
     error = FT_New_Face(library, path, index, &ans->face);
     if (error) { set_freetype_error("Failed to load face, with error:", error); ans->face = NULL; return NULL; }
-    if (!init_ft_face(ans, Py_None, true, 3, fg)) { Py_CLEAR(ans); return NULL; }
+    // Keep the path, so that the face can be opened again by the render threads
+    PyObject *p = PyUnicode_FromString(path);
+    if (p == NULL) { Py_CLEAR(ans); return NULL; }
+    bool ok = init_ft_face(ans, p, true, 3, fg);
+    Py_DECREF(p);
+    if (!ok) { Py_CLEAR(ans); return NULL; }
     return (PyObject*)ans;
 }
 
+PyObject*
+face_for_render_thread(PyObject *s, FONTS_DATA_HANDLE fg) {
+    Face *self = (Face*)s;
+    if (!PyUnicode_Check(self->path)) return NULL;
+    const char *path = PyUnicode_AsUTF8(self->path);
+    if (path == NULL) return NULL;
+    Face *ans = (Face*)Face_Type.tp_alloc(&Face_Type, 0);
+    if (ans == NULL) return NULL;
+    int error = FT_New_Face(library, path, self->face->face_index, &ans->face);
+    if (error) { ans->face = NULL; Py_CLEAR(ans); set_freetype_error("Failed to load face, with error:", error); return NULL; }
+    if (!init_ft_face(ans, self->path, self->hinting, self->hintstyle, fg)) { Py_CLEAR(ans); return NULL; }
+    // Use the exact size of the original face, which may have been adjusted to fit the cell height
+    if (self->char_height && !set_font_size(ans, self->char_width, self->char_height, self->xdpi, self->ydpi, 0, fg->cell_height)) { Py_CLEAR(ans); return NULL; }
+    return (PyObject*)ans;
+}
+
+uint64_t
+face_cache_key(PyObject *s) {
+    // Identifies the font file, its size and rendering options, 0 if the face cannot be cached
+    Face *self = (Face*)s;
+    if (!PyUnicode_Check(self->path)) return 0;
+    const char *path = PyUnicode_AsUTF8(self->path);
+    if (path == NULL) { PyErr_Clear(); return 0; }
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+    int64_t file_size = st.st_size, mtime = st.st_mtime;
+    uint64_t h = glyph_cache_hash(GLYPH_CACHE_HASH_SEED, path, strlen(path));
+#define H(x) h = glyph_cache_hash(h, &(x), sizeof(x))
+    H(file_size); H(mtime); H(self->index); H(self->hinting); H(self->hintstyle);
+    H(self->char_width); H(self->char_height); H(self->xdpi); H(self->ydpi);
+#undef H
+    return h ? h : 1;
+}
+
 static void
 dealloc(Face* self) {
     if (self->harfbuzz_font) hb_font_destroy(self->harfbuzz_font);
@@ -533,7 +577,7 @@ render_glyphs_in_cells(PyObject *f, bool bold, bool italic, hb_glyph_info_t *inf
         bm = EMPTY_PBM;
         if (*was_colored) {
             if (!render_color_bitmap(self, info[i].codepoint, &bm, cell_width, cell_height, num_cells, baseline)) {
-                if (PyErr_Occurred()) PyErr_Print();
+                if (!in_render_thread && PyErr_Occurred()) PyErr_Print();
                 *was_colored = false;
                 if (!render_bitmap(self, info[i].codepoint, &bm, cell_width, cell_height, num_cells, bold, italic, true, fg)) return false;
             }
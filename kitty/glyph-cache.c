@@ -0,0 +1,311 @@
+/*
+ * glyph-cache.c
+ * Copyright (C) 2019 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+// The cache file consists of a header, followed by an array of entries sorted
+// by key, followed by the bitmaps of the glyphs, in the same order as the
+// entries. The file is mmapped and searched in place, glyphs rendered while
+// it is open are written out, together with the existing ones, into a new
+// file that atomically replaces it, when it is closed. Files are touched
+// whenever they are used, and the least recently used ones are deleted when
+// the cache directory is set, so that the cache does not grow without bound.
+
+#include "glyph-cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_FORMAT_VERSION 2
+#define MAX_CACHE_ENTRIES 16384
+#define MAX_CACHE_AGE (30 * 24 * 60 * 60)
+#define MAX_TEMP_FILE_AGE (10 * 60)
+#define MAX_CACHE_SIZE (64u * 1024u * 1024u)
+static const char cache_magic[8] = "KGLYPHS";
+
+typedef struct {
+    char magic[8];
+    uint32_t format_version, primary_version, secondary_version, patch_version, cell_width, cell_height, num_entries;
+    uint64_t key;
+} Header;
+
+typedef struct {
+    uint64_t key;
+    uint32_t colored, unused;
+} Entry;
+
+typedef struct {
+    Entry entry;
+    pixel *data;
+} AddedGlyph;
+
+struct GlyphCache {
+    char *path;
+    uint64_t key;
+    unsigned int cell_width, cell_height;
+    uint8_t *map;
+    size_t map_size, num_entries;
+    const Entry *entries;
+    const pixel *bitmaps;
+    AddedGlyph *added;
+    size_t num_added, added_capacity;
+};
+
+static char *cache_dir = NULL;
+static struct {
+    unsigned long long hits, misses, added;
+} stats = {0};
+
+static inline size_t
+bitmap_size(GlyphCache *gc) {
+    return (size_t)gc->cell_width * gc->cell_height;
+}
+
+static inline void
+map_cache_file(GlyphCache *gc) {
+    int fd;
+    while ((fd = open(gc->path, O_RDONLY | O_CLOEXEC)) == -1 && errno == EINTR);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) { gc->map = map; gc->map_size = st.st_size; }
+    }
+    close(fd);
+    if (!gc->map) return;
+    const Header *h = (const Header*)gc->map;
+    if (
+        memcmp(h->magic, cache_magic, sizeof(cache_magic)) != 0 || h->format_version != CACHE_FORMAT_VERSION ||
+        // Glyphs rendered by any other version of kitty are not used, as rendering may have changed
+        h->primary_version != PRIMARY_VERSION || h->secondary_version != SECONDARY_VERSION || h->patch_version != PATCH_VERSION ||
+        h->cell_width != gc->cell_width || h->cell_height != gc->cell_height || h->key != gc->key ||
+        gc->map_size != sizeof(Header) + h->num_entries * (sizeof(Entry) + bitmap_size(gc) * sizeof(pixel))
+    ) {
+        munmap(gc->map, gc->map_size); gc->map = NULL; gc->map_size = 0;
+        return;
+    }
+    gc->num_entries = h->num_entries;
+    // Mark the file as recently used, for prune_cache_dir()
+    utimensat(AT_FDCWD, gc->path, NULL, 0);
+    gc->entries = (const Entry*)(gc->map + sizeof(Header));
+    gc->bitmaps = (const pixel*)(gc->map + sizeof(Header) + gc->num_entries * sizeof(Entry));
+}
+
+GlyphCache*
+open_glyph_cache(uint64_t key, unsigned int cell_width, unsigned int cell_height) {
+    if (!cache_dir) return NULL;
+    GlyphCache *gc = calloc(1, sizeof(GlyphCache));
+    if (!gc) fatal("Out of memory allocating glyph cache");
+    gc->key = key; gc->cell_width = cell_width; gc->cell_height = cell_height;
+    size_t sz = strlen(cache_dir) + 64;
+    gc->path = malloc(sz);
+    if (!gc->path) fatal("Out of memory allocating glyph cache");
+    snprintf(gc->path, sz, "%s/%016llx.glyphs", cache_dir, (unsigned long long)key);
+    map_cache_file(gc);
+    return gc;
+}
+
+static inline const Entry*
+find_entry(GlyphCache *gc, uint64_t glyph_key) {
+    size_t lo = 0, hi = gc->num_entries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (gc->entries[mid].key < glyph_key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < gc->num_entries && gc->entries[lo].key == glyph_key ? gc->entries + lo : NULL;
+}
+
+const pixel*
+glyph_cache_lookup(GlyphCache *gc, uint64_t glyph_key, bool *colored) {
+    const Entry *e = find_entry(gc, glyph_key);
+    if (!e) { stats.misses++; return NULL; }
+    stats.hits++;
+    *colored = e->colored != 0;
+    return gc->bitmaps + (e - gc->entries) * bitmap_size(gc);
+}
+
+void
+glyph_cache_add(GlyphCache *gc, uint64_t glyph_key, const pixel *data, bool colored) {
+    if (gc->num_added >= MAX_CACHE_ENTRIES || find_entry(gc, glyph_key)) return;
+    ensure_space_for(gc, added, AddedGlyph, gc->num_added + 1, added_capacity, 64, false);
+    AddedGlyph *a = gc->added + gc->num_added;
+    a->data = malloc(bitmap_size(gc) * sizeof(pixel));
+    if (!a->data) fatal("Out of memory adding glyph to glyph cache");
+    memcpy(a->data, data, bitmap_size(gc) * sizeof(pixel));
+    a->entry.key = glyph_key; a->entry.colored = colored; a->entry.unused = 0;
+    gc->num_added++;
+    stats.added++;
+}
+
+static int
+cmp_added(const void *a_, const void *b_) {
+    const AddedGlyph *a = a_, *b = b_;
+    return a->entry.key < b->entry.key ? -1 : (a->entry.key > b->entry.key ? 1 : 0);
+}
+
+static bool
+write_merged(GlyphCache *gc, FILE *f, size_t num_old, bool bitmaps) {
+    // Write either the entries or the bitmaps of the existing and added glyphs, merged in key order
+    size_t o = 0, a = 0, bsz = bitmap_size(gc) * sizeof(pixel);
+    while (o < num_old || a < gc->num_added) {
+        const void *src;
+        if (a >= gc->num_added || (o < num_old && gc->entries[o].key < gc->added[a].entry.key)) {
+            src = bitmaps ? (const void*)(gc->bitmaps + o * bitmap_size(gc)) : (const void*)(gc->entries + o);
+            o++;
+        } else {
+            src = bitmaps ? (const void*)gc->added[a].data : (const void*)&gc->added[a].entry;
+            a++;
+        }
+        if (fwrite(src, bitmaps ? bsz : sizeof(Entry), 1, f) != 1) return false;
+    }
+    return true;
+}
+
+static bool
+write_cache_file(GlyphCache *gc) {
+    // If the cache would grow too large, start over with only the glyphs rendered this time
+    size_t num_old = gc->num_entries + gc->num_added > MAX_CACHE_ENTRIES ? 0 : gc->num_entries;
+    qsort(gc->added, gc->num_added, sizeof(AddedGlyph), cmp_added);
+    // A glyph can be added more than once if it was rendered again after the sprite map was cleared
+    size_t n = 0;
+    for (size_t i = 0; i < gc->num_added; i++) {
+        if (n && gc->added[n-1].entry.key == gc->added[i].entry.key) free(gc->added[i].data);
+        else gc->added[n++] = gc->added[i];
+    }
+    gc->num_added = n;
+    size_t sz = strlen(gc->path) + 16;
+    char *tpath = malloc(sz);
+    if (!tpath) return false;
+    snprintf(tpath, sz, "%s.XXXXXX", gc->path);
+    int fd = mkstemp(tpath);
+    if (fd == -1) { log_error("Failed to create glyph cache file with error: %s", strerror(errno)); free(tpath); return false; }
+    FILE *f = fdopen(fd, "wb");
+    if (!f) { close(fd); unlink(tpath); free(tpath); return false; }
+    Header h = {
+        .format_version=CACHE_FORMAT_VERSION, .primary_version=PRIMARY_VERSION, .secondary_version=SECONDARY_VERSION, .patch_version=PATCH_VERSION,
+        .cell_width=gc->cell_width, .cell_height=gc->cell_height, .num_entries=num_old + gc->num_added, .key=gc->key
+    };
+    memcpy(h.magic, cache_magic, sizeof(cache_magic));
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && write_merged(gc, f, num_old, false) && write_merged(gc, f, num_old, true);
+    if (fclose(f) != 0) ok = false;
+    if (ok && rename(tpath, gc->path) != 0) ok = false;
+    if (!ok) { log_error("Failed to write glyph cache file with error: %s", strerror(errno)); unlink(tpath); }
+    free(tpath);
+    return ok;
+}
+
+GlyphCache*
+close_glyph_cache(GlyphCache *gc) {
+    if (!gc) return NULL;
+    if (gc->num_added) write_cache_file(gc);
+    for (size_t i = 0; i < gc->num_added; i++) free(gc->added[i].data);
+    free(gc->added);
+    if (gc->map) munmap(gc->map, gc->map_size);
+    free(gc->path);
+    free(gc);
+    return NULL;
+}
+
+typedef struct {
+    char *path;
+    time_t mtime;
+    off_t size;
+} CacheFile;
+
+static int
+cmp_cache_files(const void *a_, const void *b_) {
+    const CacheFile *a = a_, *b = b_;
+    return a->mtime > b->mtime ? -1 : (a->mtime < b->mtime ? 1 : 0);
+}
+
+static void
+prune_cache_dir(void) {
+    // Delete cache files not used for MAX_CACHE_AGE and then the least
+    // recently used ones, until the total size is below MAX_CACHE_SIZE.
+    // Temporary files left behind by a crash are deleted as well, once they
+    // are old enough that no kitty instance can still be writing them.
+    DIR *d = opendir(cache_dir);
+    if (!d) return;
+    CacheFile *files = NULL;
+    size_t num = 0, capacity = 0;
+    time_t now = time(NULL);
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (!strstr(de->d_name, ".glyphs")) continue;
+        size_t sz = strlen(cache_dir) + strlen(de->d_name) + 2;
+        char *path = malloc(sz);
+        if (!path) break;
+        snprintf(path, sz, "%s/%s", cache_dir, de->d_name);
+        struct stat st;
+        const char *ext = strrchr(de->d_name, '.');
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) { free(path); continue; }
+        if (strcmp(ext, ".glyphs") != 0) {
+            if (now - st.st_mtime > MAX_TEMP_FILE_AGE) unlink(path);
+            free(path); continue;
+        }
+        if (now - st.st_mtime > MAX_CACHE_AGE) { unlink(path); free(path); continue; }
+        if (num >= capacity) {
+            capacity = MAX(16u, 2 * capacity);
+            files = realloc(files, capacity * sizeof(CacheFile));
+            if (!files) fatal("Out of memory pruning the glyph cache");
+        }
+        files[num].path = path; files[num].mtime = st.st_mtime; files[num].size = st.st_size;
+        num++;
+    }
+    closedir(d);
+    qsort(files, num, sizeof(CacheFile), cmp_cache_files);
+    size_t total = 0;
+    for (size_t i = 0; i < num; i++) {
+        total += files[i].size;
+        if (total > MAX_CACHE_SIZE) unlink(files[i].path);
+        free(files[i].path);
+    }
+    free(files);
+}
+
+static PyObject*
+set_glyph_cache_dir(PyObject *self UNUSED, PyObject *args) {
+    const char *path = NULL;
+    if (!PyArg_ParseTuple(args, "z", &path)) return NULL;
+    free(cache_dir); cache_dir = NULL;
+    if (path) {
+        cache_dir = strdup(path);
+        if (!cache_dir) return PyErr_NoMemory();
+        prune_cache_dir();
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+glyph_cache_stats(PyObject *self UNUSED, PyObject *args UNUSED) {
+    return Py_BuildValue("{sKsKsK}", "hits", stats.hits, "misses", stats.misses, "added", stats.added);
+}
+
+static PyMethodDef module_methods[] = {
+    METHODB(set_glyph_cache_dir, METH_VARARGS),
+    METHODB(glyph_cache_stats, METH_NOARGS),
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static void
+finalize(void) {
+    free(cache_dir); cache_dir = NULL;
+}
+
+bool
+init_glyph_cache(PyObject *module) {
+    if (PyModule_AddFunctions(module, module_methods) != 0) return false;
+    if (Py_AtExit(finalize) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to register the glyph cache at exit handler");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2019 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+#pragma once
+
+#include "data-types.h"
+
+// An on-disk cache of rendered glyph bitmaps, one file per combination of cell
+// size and font size/DPI, so that glyphs do not have to be rasterized again
+// every time kitty starts.
+typedef struct GlyphCache GlyphCache;
+
+GlyphCache* open_glyph_cache(uint64_t key, unsigned int cell_width, unsigned int cell_height);
+GlyphCache* close_glyph_cache(GlyphCache *gc);
+const pixel* glyph_cache_lookup(GlyphCache *gc, uint64_t glyph_key, bool *colored);
+void glyph_cache_add(GlyphCache *gc, uint64_t glyph_key, const pixel *data, bool colored);
+
+static inline uint64_t
+glyph_cache_hash(uint64_t h, const void *data, size_t sz) {
+    // FNV-1a, start with h = 14695981039346656037ULL
+    for (const uint8_t *p = data, *limit = p + sz; p < limit; p++) { h ^= *p; h *= 1099511628211ULL; }
+    return h;
+}
+#define GLYPH_CACHE_HASH_SEED 14695981039346656037ULL
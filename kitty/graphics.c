@@ -13,22 +13,32 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include <zlib.h>
 #include <structmember.h>
 #include "png-reader.h"
+#include "threading.h"
 PyTypeObject GraphicsManager_Type;
 
 #define STORAGE_LIMIT (320 * (1024 * 1024))
+#define MAX_DATA_SZ (4 * 100000000)
+// Buffers for directly transmitted data at least this large are mapped, so
+// that they can use huge pages and be grown without copying
+#define MIN_MAPPED_BUF_SZ (4 * 1024 * 1024)
+enum FORMATS { RGB=24, RGBA=32, PNG=100 };
 
 #define REPORT_ERROR(...) { log_error(__VA_ARGS__); }
 
 
 static bool send_to_gpu = true;
+static id_type grman_id_counter = 0;
+static void discard_decode_jobs(GraphicsManager *self);
 
 GraphicsManager*
 grman_alloc() {
     GraphicsManager *self = (GraphicsManager *)GraphicsManager_Type.tp_alloc(&GraphicsManager_Type, 0);
+    self->id = ++grman_id_counter;
     self->images_capacity = 64;
     self->images = calloc(self->images_capacity, sizeof(Image));
     self->capacity = 64;
@@ -48,30 +58,656 @@ free_refs_data(Image *img) {
 
 static inline void
 free_load_data(LoadData *ld) {
-    free(ld->buf); ld->buf_used = 0; ld->buf_capacity = 0;
-    ld->buf = NULL;
+    if (ld->buf_is_mapped) munmap(ld->buf, ld->buf_capacity);
+    else free(ld->buf);
+    ld->buf_used = 0; ld->buf_capacity = 0;
+    ld->buf = NULL; ld->buf_is_mapped = false;
 
     if (ld->mapped_file) munmap(ld->mapped_file, ld->mapped_file_sz);
     ld->mapped_file = NULL; ld->mapped_file_sz = 0;
 }
 
+static bool
+alloc_load_buffer(LoadData *ld, size_t capacity) {
+    // Allocate or grow the buffer to capacity, preserving its contents. On failure the buffer is left unchanged.
+    if (capacity <= ld->buf_capacity && ld->buf) return true;
+    if (capacity < MIN_MAPPED_BUF_SZ && !ld->buf_is_mapped) {
+        uint8_t *buf = realloc(ld->buf, capacity);
+        if (!buf) return false;
+        ld->buf = buf; ld->buf_capacity = capacity;
+        return true;
+    }
+    uint8_t *buf;
+#ifdef MREMAP_MAYMOVE
+    if (ld->buf_is_mapped) {
+        buf = mremap(ld->buf, ld->buf_capacity, capacity, MREMAP_MAYMOVE);
+        if (buf == MAP_FAILED) return false;
+        ld->buf = buf; ld->buf_capacity = capacity;
+        return true;
+    }
+#endif
+    buf = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) return false;
+#ifdef MADV_HUGEPAGE
+    madvise(buf, capacity, MADV_HUGEPAGE);
+#endif
+    if (ld->buf) {
+        memcpy(buf, ld->buf, ld->buf_used);
+        if (ld->buf_is_mapped) munmap(ld->buf, ld->buf_capacity);
+        else free(ld->buf);
+    }
+    ld->buf = buf; ld->buf_capacity = capacity; ld->buf_is_mapped = true;
+    return true;
+}
+
+static inline const char*
+zlib_strerror(int ret) {
+#define Z(x) case x: return #x;
+    static char buf[128];
+    switch(ret) {
+        case Z_ERRNO:
+            return strerror(errno);
+        default:
+            snprintf(buf, sizeof(buf)/sizeof(buf[0]), "Unknown error: %d", ret);
+            return buf;
+        Z(Z_STREAM_ERROR);
+        Z(Z_DATA_ERROR);
+        Z(Z_MEM_ERROR);
+        Z(Z_BUF_ERROR);
+        Z(Z_VERSION_ERROR);
+    }
+#undef Z
+}
+
+// GPU operations {{{
+// The operations used to manage textures go through this table, so that the
+// tests can replace them with ones that keep the textures in memory, see
+// fake-gpu.c
+
+static GPUOperations gpu = {
+    send_image_to_gpu, send_image_to_gpu_async, send_image_region_to_gpu, download_image_from_gpu,
+    download_image_from_gpu_async, finish_image_download, free_texture, realloc_image_atlas,
+    compact_image_atlas, send_image_to_atlas, download_image_from_atlas
+};
+// Set while the operations are replaced, images are uploaded even though send_to_gpu is false
+static bool fake_gpu = false;
+
+void
+grman_set_gpu_operations(const GPUOperations *ops) {
+    // Textures created with the replaced operations remain, so they are
+    // never switched back, a NULL ops only stops images being uploaded
+    if (ops) gpu = *ops;
+    fake_gpu = ops != NULL;
+}
+// }}}
+
+// Shared textures {{{
+// Programs that display images, such as file managers and plotting REPLs,
+// often transmit the same image repeatedly, under new ids. Since all OS
+// windows share a single OpenGL context, images with identical content share
+// a single texture, and it is counted only once against the storage quota of
+// each graphics manager. Textures are found by a 128 bit hash of their
+// content, which is long enough that the content does not have to be compared,
+// as that would need it to be read back from the GPU.
+//
+// The GPU memory used by textures is kept within the images_gpu_memory
+// budgets. When a budget is exceeded, textures that were not displayed in the
+// last frame, because they are scrolled out of view or in a tab or OS window
+// that is not drawn, are evicted, least recently displayed first, to a
+// compressed copy in memory, and uploaded again when they are displayed. If
+// that is not enough, textures that are displayed at a much smaller size than
+// the image are replaced by downscaled ones. Textures are read back from the
+// GPU asynchronously, via a pixel buffer object, to make the copy, so that
+// rendering does not wait for the transfer, the texture is evicted or
+// downscaled on a later frame, once it is complete.
+//
+// Large images transmitted in shared memory or files, such as the frames of
+// animations and plots, are uploaded asynchronously, via a pixel buffer
+// object, so that rendering does not wait for the transfer. They are drawn
+// immediately, as OpenGL orders draw calls after the transfer, except that an
+// image transmitted again under the same id keeps drawing the texture of the
+// previous transmission until the transfer is complete, so that it does not
+// flicker. The transfer only prevents the texture from being evicted.
+//
+// Small images, such as thumbnails and icons, are stored in the layers of
+// texture arrays, one per slot size, rather than in textures of their own, so
+// that consecutive images, in draw order, in the same atlas can be drawn with
+// a single instanced draw call. Their slots are never evicted or downscaled.
+// When at most a quarter of the layers of an atlas are used, at the start of a
+// frame, the used layers are moved to the start of a new atlas, with half as
+// many layers, and the render data of all graphics managers is rebuilt, as
+// the layers of their images have changed. Empty atlases are freed.
+
+#define MIN_ASYNC_UPLOAD_SZ (256 * 1024)
+#define NUM_IMAGE_ATLASES 3
+#define ATLAS_SLOT_SIZE(atlas) (64u << ((atlas) - 1))
+#define MIN_ATLAS_LAYERS 16
+
+struct SharedTexture {
+    uint64_t hash[2];
+    uint32_t texture_id, width, height;
+    // The dimensions of the texture on the GPU, smaller than the image if it has been downscaled
+    uint32_t texture_width, texture_height;
+    // The largest size at which the texture has been displayed since it was uploaded
+    uint32_t needed_width, needed_height;
+    bool is_opaque;
+    // Set when a region of the texture is updated in place, as the hash no longer matches its content
+    bool modified;
+    // The atlas and layer the image is stored in, atlas is zero if it has a texture of its own
+    unsigned int atlas;
+    uint32_t atlas_layer;
+    // num_visible is the number of render data entries using the texture, it
+    // is kept until they are released. visible_frame is the last frame it was
+    // displayed in.
+    size_t refcnt, num_visible;
+    uint64_t visible_frame;
+    double atime;
+    // zlib compressed image data, present if the texture is evicted or downscaled
+    uint8_t *cpu_copy;
+    size_t cpu_copy_sz;
+    // Signalled when an asynchronous upload is complete
+    void *upload_fence;
+    // The pixel buffer the texture is being read back into, with the fence
+    // signalled when that is complete, and what to do with it then
+    uint32_t download_buffer;
+    void *download_fence;
+    size_t pending_reduction;
+    bool evict_when_downloaded;
+};
+
+static struct {
+    SharedTexture **items;
+    // pending_reduction is the GPU memory that will be freed when the textures being read back are evicted or downscaled
+    size_t count, capacity, gpu_memory, pending_reduction;
+    uint64_t current_frame;
+} shared_textures = {0};
+
+typedef struct {
+    uint32_t texture_id, num_layers, num_used;
+    uint8_t *used;
+} ImageAtlas;
+
+static ImageAtlas image_atlases[NUM_IMAGE_ATLASES] = {{0}};
+// Changed whenever images are moved to other layers of an atlas
+static uint64_t image_atlas_generation = 0;
+
+static inline void
+hash_image_data(const uint8_t *data, size_t sz, uint64_t hash[2]) {
+    // A fast, non-cryptographic 128 bit hash, processing eight bytes at a
+    // time into two halves that are mixed with different constants
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define MIX(h) { h ^= h >> 33; h *= 0xff51afd7ed558ccdULL; h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL; h ^= h >> 33; }
+    uint64_t h1 = 0x9e3779b97f4a7c15ULL ^ (sz * 0x87c37b91114253d5ULL), h2 = 0x6a09e667f3bcc909ULL ^ (sz * 0x4cf5ad432745937fULL), w, k;
+    const uint8_t *p = data, *limit = data + (sz & ~(size_t)7);
+    for (; p < limit; p += 8) {
+        memcpy(&w, p, sizeof(w));
+        k = w * 0x87c37b91114253d5ULL; k = ROTL(k, 31); k *= 0x4cf5ad432745937fULL;
+        h1 ^= k; h1 = ROTL(h1, 27); h1 = h1 * 5 + 0x52dce729;
+        k = w * 0x4cf5ad432745937fULL; k = ROTL(k, 33); k *= 0x87c37b91114253d5ULL;
+        h2 ^= k; h2 = ROTL(h2, 31) + h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    w = 0;
+    memcpy(&w, p, sz & 7);
+    h1 ^= w * 0x4cf5ad432745937fULL; h2 ^= w * 0x87c37b91114253d5ULL;
+    h1 += h2; h2 += h1;
+    MIX(h1); MIX(h2);
+    h1 += h2; h2 += h1;
+    hash[0] = h1; hash[1] = h2;
+#undef MIX
+#undef ROTL
+}
+
+static inline size_t
+texture_gpu_memory(const SharedTexture *t) {
+    if (t->atlas) return (size_t)ATLAS_SLOT_SIZE(t->atlas) * ATLAS_SLOT_SIZE(t->atlas) * 4;
+    return t->texture_id ? (size_t)t->texture_width * t->texture_height * 4 : 0;
+}
+
+static inline void
+upload_texture(SharedTexture *t, const uint8_t *data, uint32_t width, uint32_t height, bool is_4byte_aligned) {
+    shared_textures.gpu_memory -= texture_gpu_memory(t);
+    gpu.send_image(&t->texture_id, data, width, height, t->is_opaque, is_4byte_aligned);
+    t->texture_width = width; t->texture_height = height;
+    shared_textures.gpu_memory += texture_gpu_memory(t);
+}
+
+static inline unsigned int
+atlas_for_size(uint32_t width, uint32_t height) {
+    // The atlas with the smallest slots that an image of this size fits in, zero if it is too large for all of them
+    for (unsigned int a = 1; a <= NUM_IMAGE_ATLASES; a++) {
+        if (width <= ATLAS_SLOT_SIZE(a) && height <= ATLAS_SLOT_SIZE(a)) return a;
+    }
+    return 0;
+}
+
+static inline bool
+add_to_atlas(SharedTexture *t, const uint8_t *data, bool is_4byte_aligned) {
+    unsigned int a = atlas_for_size(t->width, t->height);
+    if (!a) return false;
+    ImageAtlas *atlas = image_atlases + a - 1;
+    if (atlas->num_used >= atlas->num_layers) {
+        uint32_t num_layers = gpu.realloc_atlas(&atlas->texture_id, ATLAS_SLOT_SIZE(a), atlas->num_layers, MAX(MIN_ATLAS_LAYERS, 2 * atlas->num_layers));
+        if (num_layers <= atlas->num_layers) return false;  // the atlas is full
+        atlas->used = realloc(atlas->used, num_layers);
+        if (!atlas->used) fatal("Out of memory allocating image atlas");
+        memset(atlas->used + atlas->num_layers, 0, num_layers - atlas->num_layers);
+        atlas->num_layers = num_layers;
+    }
+    uint32_t layer = 0;
+    while (atlas->used[layer]) layer++;
+    atlas->used[layer] = 1; atlas->num_used++;
+    gpu.send_image_to_atlas(atlas->texture_id, layer, 0, 0, data, t->width, t->height, t->is_opaque, is_4byte_aligned);
+    t->atlas = a; t->atlas_layer = layer;
+    t->texture_width = t->width; t->texture_height = t->height;
+    shared_textures.gpu_memory += texture_gpu_memory(t);
+    return true;
+}
+
+static inline void
+remove_from_atlas(SharedTexture *t) {
+    ImageAtlas *atlas = image_atlases + t->atlas - 1;
+    atlas->used[t->atlas_layer] = 0; atlas->num_used--;
+    t->atlas = 0;
+}
+
+static inline void
+shrink_image_atlases(void) {
+    for (unsigned int a = 1; a <= NUM_IMAGE_ATLASES; a++) {
+        ImageAtlas *atlas = image_atlases + a - 1;
+        if (!atlas->num_layers || atlas->num_used > atlas->num_layers / 4) continue;
+        if (!atlas->num_used) {
+            gpu.free_texture(&atlas->texture_id);
+            free(atlas->used); atlas->used = NULL; atlas->num_layers = 0;
+            continue;
+        }
+        uint32_t num_layers = MAX(MIN_ATLAS_LAYERS, atlas->num_layers / 2);
+        if (num_layers >= atlas->num_layers) continue;
+        // layers is the used layers, in order, new_layer is the layer each of them moves to
+        uint32_t *layers = malloc(atlas->num_used * sizeof(uint32_t)), *new_layer = malloc(atlas->num_layers * sizeof(uint32_t)), count = 0;
+        if (!layers || !new_layer) fatal("Out of memory shrinking image atlas");
+        for (uint32_t l = 0; l < atlas->num_layers; l++) {
+            if (atlas->used[l]) { layers[count] = l; new_layer[l] = count++; }
+        }
+        gpu.compact_atlas(&atlas->texture_id, ATLAS_SLOT_SIZE(a), num_layers, layers, count);
+        for (size_t i = 0; i < shared_textures.count; i++) {
+            SharedTexture *t = shared_textures.items[i];
+            if (t->atlas == a) t->atlas_layer = new_layer[t->atlas_layer];
+        }
+        free(layers); free(new_layer);
+        memset(atlas->used, 0, num_layers); memset(atlas->used, 1, count);
+        atlas->num_layers = num_layers;
+        image_atlas_generation++;
+    }
+}
+
+uint32_t
+image_atlas_texture_id(unsigned int atlas) {
+    // The texture is looked up when drawing, as it is replaced when the atlas grows
+    return image_atlases[atlas - 1].texture_id;
+}
+
+static inline bool
+texture_upload_pending(SharedTexture *t) {
+    if (t->upload_fence && gpu_upload_finished(t->upload_fence)) t->upload_fence = NULL;
+    return t->upload_fence != NULL;
+}
+
+static inline void cancel_texture_download(SharedTexture *t);
+
+static inline void
+free_shared_texture(SharedTexture *t) {
+    if (t->upload_fence) free_gpu_fence(t->upload_fence);
+    cancel_texture_download(t);
+    shared_textures.gpu_memory -= texture_gpu_memory(t);
+    if (t->atlas) remove_from_atlas(t);
+    if (t->texture_id) gpu.free_texture(&t->texture_id);
+    free(t->cpu_copy);
+    for (size_t i = 0; i < shared_textures.count; i++) {
+        if (shared_textures.items[i] == t) { shared_textures.items[i] = shared_textures.items[--shared_textures.count]; break; }
+    }
+    free(t);
+}
+
+static inline void
+maybe_free_shared_texture(SharedTexture *t) {
+    // Textures are kept until they are no longer in the render data of any graphics manager
+    if (!t->refcnt && !t->num_visible) free_shared_texture(t);
+}
+
+static inline bool
+set_cpu_copy(SharedTexture *t, const uint8_t *data) {
+    size_t sz = (size_t)t->width * t->height * (t->is_opaque ? 3 : 4);
+    uLongf csz = compressBound(sz);
+    t->cpu_copy = malloc(csz);
+    if (!t->cpu_copy) fatal("Out of memory saving image data");
+    int ret = compress2(t->cpu_copy, &csz, data, sz, Z_BEST_SPEED);
+    if (ret != Z_OK) {
+        log_error("Failed to compress image data with error: %s", zlib_strerror(ret));
+        free(t->cpu_copy); t->cpu_copy = NULL;
+        return false;
+    }
+    uint8_t *shrunk = realloc(t->cpu_copy, csz);
+    if (shrunk) t->cpu_copy = shrunk;
+    t->cpu_copy_sz = csz;
+    return true;
+}
+
+static inline uint8_t*
+load_cpu_copy(SharedTexture *t) {
+    uLongf sz = (size_t)t->width * t->height * (t->is_opaque ? 3 : 4);
+    uint8_t *data = malloc(sz);
+    if (!data) fatal("Out of memory loading image data");
+    int ret = uncompress(data, &sz, t->cpu_copy, t->cpu_copy_sz);
+    if (ret != Z_OK) {
+        log_error("Failed to decompress image data with error: %s", zlib_strerror(ret));
+        free(data); return NULL;
+    }
+    return data;
+}
+
+static inline uint8_t*
+texture_pixels(SharedTexture *t) {
+    // A copy of the pixels of the texture at full size
+    if (t->cpu_copy) return load_cpu_copy(t);
+    uint8_t *data = malloc((size_t)t->width * t->height * (t->is_opaque ? 3 : 4));
+    if (!data) fatal("Out of memory reading image data");
+    if (t->atlas) gpu.download_image_from_atlas(image_atlases[t->atlas - 1].texture_id, t->atlas_layer, data, t->width, t->height, t->is_opaque);
+    else gpu.download_image(t->texture_id, data, t->is_opaque);
+    return data;
+}
+
+static inline void
+downscale_pixels(const uint8_t *src, uint32_t src_width, uint32_t src_height, uint8_t *dest, uint32_t width, uint32_t height, unsigned int bpp) {
+    // Each destination pixel is the average of the block of source pixels it covers
+    uint64_t sum[4];
+    for (uint32_t y = 0; y < height; y++) {
+        uint32_t y0 = (uint64_t)y * src_height / height, y1 = MAX(y0 + 1, (uint64_t)(y + 1) * src_height / height);
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t x0 = (uint64_t)x * src_width / width, x1 = MAX(x0 + 1, (uint64_t)(x + 1) * src_width / width);
+            memset(sum, 0, sizeof(sum));
+            for (uint32_t sy = y0; sy < y1; sy++) {
+                const uint8_t *p = src + ((size_t)sy * src_width + x0) * bpp;
+                for (uint32_t sx = x0; sx < x1; sx++) for (unsigned int c = 0; c < bpp; c++) sum[c] += *(p++);
+            }
+            uint64_t n = (uint64_t)(y1 - y0) * (x1 - x0);
+            uint8_t *d = dest + ((size_t)y * width + x) * bpp;
+            for (unsigned int c = 0; c < bpp; c++) d[c] = (sum[c] + n / 2) / n;
+        }
+    }
+}
+
+static inline void
+evict_texture(SharedTexture *t) {
+    shared_textures.gpu_memory -= texture_gpu_memory(t);
+    gpu.free_texture(&t->texture_id);
+    t->needed_width = 0; t->needed_height = 0;
+}
+
+static inline bool
+can_downscale(const SharedTexture *t) {
+    return t->texture_id && t->needed_width && t->needed_height && (uint64_t)t->texture_width * t->texture_height >= 2 * (uint64_t)t->needed_width * t->needed_height;
+}
+
+static inline void
+downscale_texture(SharedTexture *t) {
+    uint8_t *full = load_cpu_copy(t);
+    if (!full) return;
+    unsigned int bpp = t->is_opaque ? 3 : 4;
+    uint32_t width = MIN(t->width, t->needed_width), height = MIN(t->height, t->needed_height);
+    uint8_t *scaled = malloc((size_t)width * height * bpp);
+    if (!scaled) fatal("Out of memory downscaling image");
+    downscale_pixels(full, t->width, t->height, scaled, width, height, bpp);
+    free(full);
+    upload_texture(t, scaled, width, height, false);
+    free(scaled);
+}
+
+static inline bool
+texture_is_visible(const SharedTexture *t) {
+    // Displayed in this or the previous frame, the windows of this frame may not have been rendered yet
+    return t->num_visible && t->visible_frame + 1 >= shared_textures.current_frame;
+}
+
+static inline void
+finish_texture_download(SharedTexture *t) {
+    // The texture is evicted or downscaled, unless it has been displayed, or at a larger size, since the download started
+    size_t sz = (size_t)t->width * t->height * (t->is_opaque ? 3 : 4);
+    uint8_t *data = malloc(sz);
+    if (!data) fatal("Out of memory reading image data");
+    bool ok = gpu.finish_download(&t->download_buffer, data, sz) && set_cpu_copy(t, data);
+    free(data);
+    shared_textures.pending_reduction -= t->pending_reduction; t->pending_reduction = 0;
+    if (!ok) return;
+    if (t->evict_when_downloaded ? !texture_is_visible(t) : can_downscale(t)) {
+        if (t->evict_when_downloaded) evict_texture(t);
+        else downscale_texture(t);
+    } else { free(t->cpu_copy); t->cpu_copy = NULL; t->cpu_copy_sz = 0; }
+}
+
+static inline void
+cancel_texture_download(SharedTexture *t) {
+    if (!t->download_buffer) return;
+    if (t->download_fence) { free_gpu_fence(t->download_fence); t->download_fence = NULL; }
+    gpu.finish_download(&t->download_buffer, NULL, 0);
+    shared_textures.pending_reduction -= t->pending_reduction; t->pending_reduction = 0;
+}
+
+static inline bool
+reduce_texture(SharedTexture *t, bool evict) {
+    // Evict or downscale t, if it has a copy in memory, otherwise start reading it back from the GPU to do so
+    if (t->cpu_copy) {
+        if (evict) evict_texture(t);
+        else downscale_texture(t);
+        return true;
+    }
+    if (t->texture_width != t->width || t->texture_height != t->height) return false;
+    size_t sz = (size_t)t->width * t->height * (t->is_opaque ? 3 : 4);
+    t->download_fence = gpu.download_image_async(t->texture_id, &t->download_buffer, t->is_opaque, sz);
+    t->evict_when_downloaded = evict;
+    t->pending_reduction = texture_gpu_memory(t);
+    if (!evict) t->pending_reduction -= (size_t)MIN(t->width, t->needed_width) * MIN(t->height, t->needed_height) * 4;
+    shared_textures.pending_reduction += t->pending_reduction;
+    if (!t->download_fence) finish_texture_download(t);
+    else request_tick_callback();
+    return true;
+}
+
+static inline void
+ensure_texture_resident(SharedTexture *t) {
+    // Upload the texture again at full size if it was evicted or is displayed larger than it was downscaled to
+    if (t->texture_id && t->texture_width >= MIN(t->width, t->needed_width) && t->texture_height >= MIN(t->height, t->needed_height)) return;
+    if (!t->cpu_copy) return;
+    uint8_t *full = load_cpu_copy(t);
+    if (!full) return;
+    upload_texture(t, full, t->width, t->height, false);
+    free(full);
+    free(t->cpu_copy); t->cpu_copy = NULL; t->cpu_copy_sz = 0;
+}
+
+static inline size_t
+grman_gpu_memory(GraphicsManager *self) {
+    size_t ans = 0;
+    // Only one image using a texture in a graphics manager has used_storage
+    for (size_t i = 0; i < self->image_count; i++) {
+        Image *img = self->images + i;
+        if (img->texture && img->used_storage) ans += texture_gpu_memory(img->texture) - img->texture->pending_reduction;
+    }
+    return ans;
+}
+
+static inline bool
+reduce_gpu_memory(GraphicsManager *self) {
+    // Reduce the GPU memory used by the textures of self, or of all textures if self is NULL
+    SharedTexture *lru = NULL, *largest = NULL;
+    size_t count = self ? self->image_count : shared_textures.count;
+    for (size_t i = 0; i < count; i++) {
+        SharedTexture *t = self ? self->images[i].texture : shared_textures.items[i];
+        if (!t || !t->texture_id || t->download_buffer || texture_upload_pending(t)) continue;
+        if (!texture_is_visible(t)) {
+            if (!lru || t->atime < lru->atime) lru = t;
+        } else if (can_downscale(t) && (!largest || texture_gpu_memory(t) > texture_gpu_memory(largest))) largest = t;
+    }
+    if (lru) return reduce_texture(lru, true);
+    if (largest) return reduce_texture(largest, false);
+    return false;
+}
+
+static inline void
+apply_gpu_memory_budget(GraphicsManager *self) {
+    size_t window_limit = OPT(images_gpu_memory_per_window) * 1024u * 1024u, total_limit = OPT(images_gpu_memory) * 1024u * 1024u;
+    if (window_limit) {
+        while (grman_gpu_memory(self) > window_limit && reduce_gpu_memory(self));
+    }
+    if (total_limit) {
+        while (shared_textures.gpu_memory - shared_textures.pending_reduction > total_limit && reduce_gpu_memory(NULL));
+    }
+}
+
+void
+grman_new_frame(void) {
+    // Called before the windows are rendered, textures that are not displayed in this frame become candidates for eviction
+    shared_textures.current_frame++;
+    shrink_image_atlases();
+    bool pending = false;
+    for (size_t i = 0; i < shared_textures.count; i++) {
+        SharedTexture *t = shared_textures.items[i];
+        if (!t->download_buffer) continue;
+        if (t->download_fence && !gpu_upload_finished(t->download_fence)) { pending = true; continue; }
+        t->download_fence = NULL;
+        finish_texture_download(t);
+    }
+    if (pending) request_tick_callback();
+}
+
+void
+grman_mark_visible(GraphicsManager *self) {
+    // Called for the graphics managers of the windows rendered in this frame, whether or not their layers changed
+    size_t gpu_memory = shared_textures.gpu_memory;
+    for (size_t i = 0; i < self->count; i++) {
+        ImageRenderData *rd = self->render_data + i;
+        SharedTexture *t = rd->texture;
+        if (!t) continue;
+        t->visible_frame = shared_textures.current_frame; t->atime = monotonic();
+        // The texture may have been evicted while the window was not rendered
+        ensure_texture_resident(t);
+        rd->texture_id = t->texture_id;
+    }
+    if (shared_textures.gpu_memory > gpu_memory) apply_gpu_memory_budget(self);
+}
+
+static inline bool
+shares_texture(GraphicsManager *self, Image *img) {
+    for (size_t i = 0; i < self->image_count; i++) {
+        Image *q = self->images + i;
+        if (q != img && q->texture == img->texture && q->used_storage) return true;
+    }
+    return false;
+}
+
+static inline void
+acquire_texture(GraphicsManager *self, Image *img) {
+    uint64_t hash[2];
+    hash_image_data(img->load_data.data, img->load_data.data_sz, hash);
+    SharedTexture *t = NULL;
+    for (size_t i = 0; i < shared_textures.count; i++) {
+        SharedTexture *q = shared_textures.items[i];
+        if (
+            !q->modified && q->hash[0] == hash[0] && q->hash[1] == hash[1] &&
+            q->width == img->width && q->height == img->height && q->is_opaque == img->load_data.is_opaque
+        ) { t = q; break; }
+    }
+    if (!t) {
+        ensure_space_for(&shared_textures, items, SharedTexture*, shared_textures.count + 1, capacity, 16, false);
+        t = calloc(1, sizeof(SharedTexture));
+        if (!t) fatal("Out of memory allocating texture");
+        shared_textures.items[shared_textures.count++] = t;
+        memcpy(t->hash, hash, sizeof(t->hash)); t->width = img->width; t->height = img->height; t->is_opaque = img->load_data.is_opaque;
+        if (add_to_atlas(t, img->load_data.data, img->load_data.is_4byte_aligned)) {
+            // Small images are uploaded into a slot of an atlas
+        } else if (img->load_data.mapped_file && img->load_data.data_sz >= MIN_ASYNC_UPLOAD_SZ) {
+            // The data is copied into the pixel buffer, so the mapping can be released immediately
+            t->upload_fence = gpu.send_image_async(&t->texture_id, img->load_data.data, img->width, img->height, t->is_opaque, img->load_data.is_4byte_aligned);
+            t->texture_width = img->width; t->texture_height = img->height;
+            shared_textures.gpu_memory += texture_gpu_memory(t);
+        } else upload_texture(t, img->load_data.data, img->width, img->height, img->load_data.is_4byte_aligned);
+    }
+    t->refcnt++;
+    t->atime = monotonic();
+    img->texture = t;
+    if (!shares_texture(self, img)) {
+        img->used_storage = img->load_data.data_sz;
+        self->used_storage += img->used_storage;
+    }
+    apply_gpu_memory_budget(self);
+}
+
+static inline void
+release_texture(GraphicsManager *self, Image *img) {
+    if (img->used_storage) {
+        self->used_storage -= img->used_storage;
+        // Transfer the storage to another image in this manager using the same texture
+        for (size_t i = 0; i < self->image_count; i++) {
+            Image *q = self->images + i;
+            if (q != img && q->texture == img->texture && img->texture) {
+                q->used_storage = img->used_storage;
+                self->used_storage += q->used_storage;
+                break;
+            }
+        }
+        img->used_storage = 0;
+    }
+    if (!img->texture) return;
+    img->texture->refcnt--;
+    maybe_free_shared_texture(img->texture);
+    img->texture = NULL;
+}
+
+static inline void
+release_previous_texture(Image *img) {
+    if (!img->previous_texture) return;
+    img->previous_texture->refcnt--;
+    maybe_free_shared_texture(img->previous_texture);
+    img->previous_texture = NULL;
+}
+
+static inline SharedTexture*
+drawn_texture(Image *img) {
+    return img->previous_texture ? img->previous_texture : img->texture;
+}
+
+static inline void
+release_render_data(GraphicsManager *self) {
+    for (size_t i = 0; i < self->count; i++) {
+        SharedTexture *t = self->render_data[i].texture;
+        if (t) { t->num_visible--; maybe_free_shared_texture(t); }
+    }
+    self->count = 0;
+}
+// }}}
+
 static inline void
 free_image(GraphicsManager *self, Image *img) {
-    if (img->texture_id) free_texture(&img->texture_id);
+    release_previous_texture(img);
+    release_texture(self, img);
     free_refs_data(img);
     free_load_data(&(img->load_data));
-    self->used_storage -= img->used_storage;
 }
 
 
 static void
 dealloc(GraphicsManager* self) {
     size_t i;
+    if (self->num_decoding) discard_decode_jobs(self);
+    for (i = 0; i < self->num_responses; i++) free(self->responses[i].text);
+    free(self->responses);
     if (self->images) {
         for (i = 0; i < self->image_count; i++) free_image(self, self->images + i);
         free(self->images);
     }
+    release_render_data(self);
     free(self->render_data);
+    free(self->layer_refs); free(self->layer_rows); free(self->visible_layer_refs);
+    free_load_data(&self->update.load_data);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -146,8 +782,9 @@ apply_storage_quota(GraphicsManager *self, size_t storage_limit, Image *currentl
     if (!self->image_count) self->used_storage = 0;  // sanity check
 }
 
-static char add_response[512] = {0};
-static bool has_add_respose = false;
+// Thread local, since images are also decoded in the decode threads
+static _Thread_local char add_response[512] = {0};
+static _Thread_local bool has_add_respose = false;
 
 static inline void
 set_add_response(const char *code, const char *fmt, ...) {
@@ -180,24 +817,6 @@ err:
 }
 
 
-static inline const char*
-zlib_strerror(int ret) {
-#define Z(x) case x: return #x;
-    static char buf[128];
-    switch(ret) {
-        case Z_ERRNO:
-            return strerror(errno);
-        default:
-            snprintf(buf, sizeof(buf)/sizeof(buf[0]), "Unknown error: %d", ret);
-            return buf;
-        Z(Z_STREAM_ERROR);
-        Z(Z_DATA_ERROR);
-        Z(Z_MEM_ERROR);
-        Z(Z_BUF_ERROR);
-        Z(Z_VERSION_ERROR);
-    }
-#undef Z
-}
 
 static inline bool
 inflate_zlib(GraphicsManager UNUSED *self, Image *img, uint8_t *buf, size_t bufsz) {
@@ -249,6 +868,316 @@ inflate_png(GraphicsManager UNUSED *self, Image *img, uint8_t *buf, size_t bufsz
     return d.ok;
 }
 #undef ABRT
+
+static inline bool
+decode_image(Image *img, unsigned char compressed, uint32_t fmt) {
+    // Also called from the decode threads, so must use only the image dimensions and load data
+    uint8_t *buf; size_t bufsz;
+#define IB { if (img->load_data.buf) { buf = img->load_data.buf; bufsz = img->load_data.buf_used; } else { buf = img->load_data.mapped_file; bufsz = img->load_data.mapped_file_sz; } }
+    switch(compressed) {
+        case 'z':
+            IB;
+            if (!inflate_zlib(NULL, img, buf, bufsz)) return false;
+            break;
+        case 0:
+            break;
+        default:
+            set_add_response("EINVAL", "Unknown image compression: %c", compressed);
+            return false;
+    }
+    switch(fmt) {
+        case PNG:
+            IB;
+            if (!inflate_png(NULL, img, buf, bufsz)) return false;
+            break;
+        default: break;
+    }
+#undef IB
+    img->load_data.data = img->load_data.buf;
+    if (img->load_data.buf_used < img->load_data.data_sz) {
+        set_add_response("ENODATA", "Insufficient image data: %zu < %zu", img->load_data.buf_used, img->load_data.data_sz);
+        return false;
+    }
+    if (img->load_data.mapped_file) {
+        munmap(img->load_data.mapped_file, img->load_data.mapped_file_sz);
+        img->load_data.mapped_file = NULL; img->load_data.mapped_file_sz = 0;
+    }
+    return true;
+}
+
+static inline bool
+png_dimensions(const uint8_t *buf, size_t sz, uint32_t *width, uint32_t *height) {
+    // Read the dimensions from the IHDR chunk, which must be the first chunk
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    if (sz < 24 || memcmp(buf, signature, sizeof(signature)) != 0 || memcmp(buf + 12, "IHDR", 4) != 0) return false;
+#define BE32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+    *width = BE32(buf + 16); *height = BE32(buf + 20);
+#undef BE32
+    return *width && *height && *width <= 10000 && *height <= 10000;
+}
+
+static inline bool
+upload_image(GraphicsManager *self, Image *img) {
+    size_t required_sz = (img->load_data.is_opaque ? 3 : 4) * img->width * img->height;
+    if (img->load_data.data_sz != required_sz) {
+        set_add_response("EINVAL", "Image dimensions: %ux%u do not match data size: %zu, expected size: %zu", img->width, img->height, img->load_data.data_sz, required_sz);
+        return false;
+    }
+    if (LIKELY(img->data_loaded && (send_to_gpu || fake_gpu))) {
+        release_texture(self, img);
+        acquire_texture(self, img);
+        free_load_data(&img->load_data);
+        if (img->previous_texture && (img->previous_texture == img->texture || !texture_upload_pending(img->texture))) release_previous_texture(img);
+    }
+    return true;
+}
+
+static inline void
+blit_pixels(uint8_t *dest, uint32_t dest_width, unsigned int dest_bpp, const uint8_t *src, uint32_t x, uint32_t y, uint32_t width, uint32_t height, unsigned int src_bpp) {
+    // Copy the src pixels into the rect at x, y in dest, dropping the alpha channel or making them opaque as needed
+    for (uint32_t r = 0; r < height; r++) {
+        uint8_t *d = dest + ((size_t)(y + r) * dest_width + x) * dest_bpp;
+        const uint8_t *p = src + (size_t)r * width * src_bpp;
+        if (dest_bpp == src_bpp) { memcpy(d, p, (size_t)width * src_bpp); continue; }
+        for (uint32_t c = 0; c < width; c++, d += dest_bpp, p += src_bpp) {
+            d[0] = p[0]; d[1] = p[1]; d[2] = p[2];
+            if (dest_bpp == 4) d[3] = 0xff;
+        }
+    }
+}
+
+static inline bool
+update_image(GraphicsManager *self, Image *img, Image *update, uint32_t x, uint32_t y) {
+    // Replace the region of img at x, y with the pixels of update. The texture
+    // is updated in place, unless it is shared with other images, or evicted.
+    unsigned int src_bpp = update->load_data.is_opaque ? 3 : 4, dest_bpp = img->load_data.is_opaque ? 3 : 4;
+    if (update->load_data.data_sz != (size_t)src_bpp * update->width * update->height) {
+        set_add_response("EINVAL", "Image dimensions: %ux%u do not match data size: %zu", update->width, update->height, update->load_data.data_sz);
+        return false;
+    }
+    if ((uint64_t)x + update->width > img->width || (uint64_t)y + update->height > img->height) {
+        set_add_response("EINVAL", "Update of %ux%u pixels at %u, %u does not fit in the image of %ux%u pixels", update->width, update->height, x, y, img->width, img->height);
+        return false;
+    }
+    if (!send_to_gpu && !fake_gpu) {
+        // The data is kept when testing, so update it
+        LoadData *ld = &img->load_data;
+        if (ld->data != ld->buf) {
+            uint8_t *buf = malloc(ld->data_sz);
+            if (!buf) fatal("Out of memory updating image");
+            memcpy(buf, ld->data, ld->data_sz);
+            free_load_data(ld);
+            ld->buf = buf; ld->buf_capacity = ld->data_sz; ld->buf_used = ld->data_sz; ld->data = buf;
+        }
+        blit_pixels(ld->data, img->width, dest_bpp, update->load_data.data, x, y, update->width, update->height, src_bpp);
+        return true;
+    }
+    SharedTexture *t = img->texture;
+    if (!t) return false;
+    dest_bpp = t->is_opaque ? 3 : 4;
+    if (t->refcnt > 1 || t->cpu_copy) {
+        uint8_t *pixels = texture_pixels(t);
+        if (!pixels) return false;
+        blit_pixels(pixels, t->width, dest_bpp, update->load_data.data, x, y, update->width, update->height, src_bpp);
+        img->load_data.data = pixels; img->load_data.data_sz = (size_t)t->width * t->height * dest_bpp;
+        img->load_data.is_opaque = t->is_opaque; img->load_data.is_4byte_aligned = false;
+        release_texture(self, img);
+        acquire_texture(self, img);
+        img->load_data.data = NULL;
+        free(pixels);
+        self->layers_dirty = true;
+    } else {
+        const uint8_t *data = update->load_data.data;
+        bool is_4byte_aligned = update->load_data.is_4byte_aligned;
+        uint8_t *opaque = NULL;
+        if (dest_bpp != src_bpp) {
+            // The alpha channel of the update is ignored for opaque images
+            opaque = malloc((size_t)update->width * update->height * dest_bpp);
+            if (!opaque) fatal("Out of memory updating image");
+            blit_pixels(opaque, update->width, dest_bpp, data, 0, 0, update->width, update->height, src_bpp);
+            data = opaque; is_4byte_aligned = false;
+        }
+        if (t->atlas) gpu.send_image_to_atlas(image_atlases[t->atlas - 1].texture_id, t->atlas_layer, x, y, data, update->width, update->height, t->is_opaque, is_4byte_aligned);
+        else gpu.send_image_region(t->texture_id, x, y, data, update->width, update->height, t->is_opaque, is_4byte_aligned);
+        free(opaque);
+        // A copy being read back would not have the update
+        cancel_texture_download(t);
+        t->modified = true;
+    }
+    return true;
+}
+// }}}
+
+// Decode threads {{{
+// Inflating compressed data and decoding PNG data for a large image can take
+// long enough to stall rendering and input for all windows, so when
+// rendering to the GPU it is done in a pool of threads. Since the dimensions
+// of the image are known up front, it is registered and can be placed
+// immediately, but it is only drawn once it has been decoded and uploaded.
+// The response to the add command, and to every command after it, is sent
+// only then, so that the responses remain in order.
+
+#define MAX_DECODE_THREADS 4
+#define MIN_ASYNC_DECODE_SZ (64 * 1024)
+
+typedef struct {
+    size_t id, image_id;
+    id_type grman_id;
+    unsigned char compressed;
+    uint32_t format;
+    // Only the dimensions and load data are used
+    Image img;
+    bool ok, discard;
+    char response[sizeof(add_response)];
+} DecodeJob;
+
+static struct {
+    pthread_t threads[MAX_DECODE_THREADS];
+    size_t num_threads, num_busy;
+    pthread_mutex_t lock;
+    pthread_cond_t has_jobs, is_idle;
+    bool shutting_down;
+    DecodeJob *jobs, *finished, *running[MAX_DECODE_THREADS];
+    size_t jobs_count, jobs_capacity, finished_count, finished_capacity;
+} decode_threads = {{0}};
+// -1 means use as many threads as there are spare CPU cores, when rendering to the GPU
+static int requested_num_of_decode_threads = -1;
+static size_t decode_job_counter = 0;
+#define decode_threads_lock(op) pthread_mutex_##op(&decode_threads.lock)
+
+static void*
+decode_thread(void *data) {
+    size_t thread_idx = (size_t)data;
+    DecodeJob job;
+    set_thread_name("KittyImages");
+    decode_threads_lock(lock);
+    while (true) {
+        while (!decode_threads.jobs_count && !decode_threads.shutting_down) pthread_cond_wait(&decode_threads.has_jobs, &decode_threads.lock);
+        if (decode_threads.shutting_down) break;
+        job = decode_threads.jobs[0];
+        remove_from_array(decode_threads.jobs, sizeof(DecodeJob), 0, decode_threads.jobs_count--);
+        decode_threads.num_busy++;
+        decode_threads.running[thread_idx] = &job;
+        decode_threads_lock(unlock);
+
+        has_add_respose = false;
+        job.ok = decode_image(&job.img, job.compressed, job.format);
+        if (has_add_respose) memcpy(job.response, add_response, sizeof(job.response));
+
+        decode_threads_lock(lock);
+        decode_threads.running[thread_idx] = NULL;
+        decode_threads.num_busy--;
+        if (job.discard) free_load_data(&job.img.load_data);
+        else {
+            ensure_space_for(&decode_threads, finished, DecodeJob, decode_threads.finished_count + 1, finished_capacity, 16, false);
+            decode_threads.finished[decode_threads.finished_count++] = job;
+            // Only wakeup the main loop for the first of a batch of finished jobs
+            if (send_to_gpu && decode_threads.finished_count == 1) wakeup_main_loop();
+        }
+        if (!decode_threads.num_busy && !decode_threads.jobs_count) pthread_cond_broadcast(&decode_threads.is_idle);
+    }
+    decode_threads_lock(unlock);
+    return NULL;
+}
+
+static inline size_t
+desired_num_of_decode_threads() {
+    if (requested_num_of_decode_threads > -1) return MIN(MAX_DECODE_THREADS, (size_t)requested_num_of_decode_threads);
+    if (!send_to_gpu) return 0;
+    static long num_cpus = 0;
+    if (!num_cpus) num_cpus = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+    return MIN(MAX_DECODE_THREADS, (size_t)MAX(1, num_cpus - 1));
+}
+
+static inline bool
+ensure_decode_threads() {
+    if (decode_threads.num_threads) return true;
+    size_t num = desired_num_of_decode_threads();
+    decode_threads.shutting_down = false;
+    for (size_t i = 0; i < num; i++) {
+        int ret = pthread_create(decode_threads.threads + i, NULL, decode_thread, (void*)i);
+        if (ret != 0) {
+            log_error("Failed to start image decode thread with error: %s", strerror(ret));
+            if (requested_num_of_decode_threads < 0) requested_num_of_decode_threads = i;
+            break;
+        }
+        decode_threads.num_threads++;
+    }
+    return decode_threads.num_threads > 0;
+}
+
+static inline void
+wait_for_decode_threads() {
+    if (!decode_threads.num_threads) return;
+    decode_threads_lock(lock);
+    while (decode_threads.jobs_count || decode_threads.num_busy) pthread_cond_wait(&decode_threads.is_idle, &decode_threads.lock);
+    decode_threads_lock(unlock);
+}
+
+static void
+stop_decode_threads() {
+    if (!decode_threads.num_threads) return;
+    decode_threads_lock(lock);
+    decode_threads.shutting_down = true;
+    pthread_cond_broadcast(&decode_threads.has_jobs);
+    decode_threads_lock(unlock);
+    for (size_t i = 0; i < decode_threads.num_threads; i++) pthread_join(decode_threads.threads[i], NULL);
+    decode_threads.num_threads = 0;
+    for (size_t i = 0; i < decode_threads.jobs_count; i++) free_load_data(&decode_threads.jobs[i].img.load_data);
+    for (size_t i = 0; i < decode_threads.finished_count; i++) free_load_data(&decode_threads.finished[i].img.load_data);
+    decode_threads.jobs_count = 0; decode_threads.finished_count = 0;
+    free(decode_threads.jobs); decode_threads.jobs = NULL; decode_threads.jobs_capacity = 0;
+    free(decode_threads.finished); decode_threads.finished = NULL; decode_threads.finished_capacity = 0;
+}
+
+static inline bool
+start_decode_job(GraphicsManager *self, const GraphicsCommand *g, Image *img, uint32_t fmt) {
+    const uint8_t *buf = img->load_data.buf ? img->load_data.buf : img->load_data.mapped_file;
+    size_t sz = img->load_data.buf ? img->load_data.buf_used : img->load_data.mapped_file_sz;
+    if (g->action == 'q' || sz < MIN_ASYNC_DECODE_SZ) return false;
+    uint32_t width = img->width, height = img->height;
+    // The dimensions must be known before decoding, so that the image can be placed
+    if (fmt == PNG && (g->compressed || !png_dimensions(buf, sz, &width, &height))) return false;
+    if (!ensure_decode_threads()) return false;
+    img->width = width; img->height = height;
+    DecodeJob job = {.id=++decode_job_counter, .image_id=img->internal_id, .grman_id=self->id, .compressed=g->compressed, .format=fmt};
+    job.img.width = width; job.img.height = height;
+    job.img.load_data = img->load_data;
+    memset(&img->load_data, 0, sizeof(img->load_data));
+    img->decode_job = job.id;
+    self->num_decoding++;
+    decode_threads_lock(lock);
+    ensure_space_for(&decode_threads, jobs, DecodeJob, decode_threads.jobs_count + 1, jobs_capacity, 16, false);
+    decode_threads.jobs[decode_threads.jobs_count++] = job;
+    pthread_cond_signal(&decode_threads.has_jobs);
+    decode_threads_lock(unlock);
+    return true;
+}
+
+static void
+discard_decode_jobs(GraphicsManager *self) {
+    decode_threads_lock(lock);
+    size_t i, j;
+    for (i = 0, j = 0; i < decode_threads.jobs_count; i++) {
+        DecodeJob *job = decode_threads.jobs + i;
+        if (job->grman_id == self->id) { free_load_data(&job->img.load_data); continue; }
+        if (i != j) decode_threads.jobs[j] = *job;
+        j++;
+    }
+    decode_threads.jobs_count = j;
+    for (i = 0, j = 0; i < decode_threads.finished_count; i++) {
+        DecodeJob *job = decode_threads.finished + i;
+        if (job->grman_id == self->id) { free_load_data(&job->img.load_data); continue; }
+        if (i != j) decode_threads.finished[j] = *job;
+        j++;
+    }
+    decode_threads.finished_count = j;
+    for (i = 0; i < decode_threads.num_threads; i++) {
+        if (decode_threads.running[i] && decode_threads.running[i]->grman_id == self->id) decode_threads.running[i]->discard = true;
+    }
+    decode_threads_lock(unlock);
+    self->num_decoding = 0;
+}
 // }}}
 
 static bool
@@ -272,15 +1201,18 @@ find_or_create_image(GraphicsManager *self, uint32_t id, bool *existing) {
 }
 
 
+static inline Image*
+image_being_loaded(GraphicsManager *self) {
+    return self->loading_image == self->update.internal_id ? &self->update : img_by_internal_id(self, self->loading_image);
+}
+
 static Image*
 handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_t *payload, bool *is_dirty, uint32_t iid) {
 #define ABRT(code, ...) { set_add_response(#code, __VA_ARGS__); self->loading_image = 0; if (img) img->data_loaded = false; return NULL; }
-#define MAX_DATA_SZ (4 * 100000000)
     has_add_respose = false;
     bool existing, init_img = true;
     Image *img = NULL;
     unsigned char tt = g->transmission_type ? g->transmission_type : 'd';
-    enum FORMATS { RGB=24, RGBA=32, PNG=100 };
     uint32_t fmt = g->format ? g->format : RGBA;
     if (tt == 'd' && self->loading_image) init_img = false;
     if (init_img) {
@@ -288,15 +1220,33 @@ handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_
         self->last_init_graphics_command.id = iid;
         self->loading_image = 0;
         if (g->data_width > 10000 || g->data_height > 10000) ABRT(EINVAL, "Image too large");
-        remove_images(self, add_trim_predicate, NULL);
-        img = find_or_create_image(self, iid, &existing);
+        if (g->action == 'f') {
+            // The data is loaded into a separate image, and applied to the image being updated once it is complete
+            Image *target = iid ? img_by_client_id(self, iid) : NULL;
+            if (!target || !target->data_loaded) ABRT(ENOENT, "Update of non-existent image with id: %u", iid);
+            if (target->decode_job) ABRT(EBUSY, "Update of image with id: %u that is still being decoded", iid);
+            self->update_target = target->internal_id;
+            img = &self->update;
+            free_load_data(&img->load_data);
+            memset(img, 0, sizeof(Image));
+            img->internal_id = internal_id_counter++;
+            existing = false;
+        } else {
+            remove_images(self, add_trim_predicate, NULL);
+            img = find_or_create_image(self, iid, &existing);
+        }
         if (existing) {
             free_load_data(&img->load_data);
             img->data_loaded = false;
+            // Any pending decode of the previous data is discarded when it finishes
+            img->decode_job = 0;
+            // The texture is drawn until that of the new data is uploaded, see image_is_drawable()
+            if (img->texture && !img->previous_texture) { img->previous_texture = img->texture; img->previous_texture->refcnt++; }
+            release_texture(self, img);
             free_refs_data(img);
             *is_dirty = true;
             self->layers_dirty = true;
-        } else {
+        } else if (g->action != 'f') {
             img->internal_id = internal_id_counter++;
             img->client_id = iid;
         }
@@ -321,13 +1271,14 @@ handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_
         }
         if (tt == 'd') {
             if (g->more) self->loading_image = img->internal_id;
-            img->load_data.buf_capacity = img->load_data.data_sz + (g->compressed ? 1024 : 10);  // compression header
-            img->load_data.buf = malloc(img->load_data.buf_capacity);
-            img->load_data.buf_used = 0;
-            if (img->load_data.buf == NULL) {
-                ABRT(ENOMEM, "Out of memory");
-                img->load_data.buf_capacity = 0; img->load_data.buf_used = 0;
+            size_t capacity = img->load_data.data_sz + (g->compressed ? 1024 : 10);  // compression header
+            if (g->data_sz && g->compressed && fmt != PNG) {
+                // The client has told us the size of the compressed data, so the buffer need never be grown
+                if (g->data_sz > MAX_DATA_SZ) ABRT(EFBIG, "Compressed data size too large");
+                capacity = g->data_sz;
             }
+            img->load_data.buf_used = 0;
+            if (!alloc_load_buffer(&img->load_data, capacity)) ABRT(ENOMEM, "Out of memory");
         }
     } else {
         self->last_init_graphics_command.more = g->more;
@@ -335,7 +1286,7 @@ handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_
         g = &self->last_init_graphics_command;
         tt = g->transmission_type ? g->transmission_type : 'd';
         fmt = g->format ? g->format : RGBA;
-        img = img_by_internal_id(self, self->loading_image);
+        img = image_being_loaded(self);
         if (img == NULL) {
             self->loading_image = 0;
             ABRT(EILSEQ, "More payload loading refers to non-existent image");
@@ -345,16 +1296,15 @@ handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_
     static char fname[2056] = {0};
     switch(tt) {
         case 'd':  // direct
-            if (img->load_data.buf_capacity - img->load_data.buf_used < g->payload_sz) {
-                if (img->load_data.buf_used + g->payload_sz > MAX_DATA_SZ || fmt != PNG) ABRT(EFBIG, "Too much data");
-                img->load_data.buf_capacity = MIN(2 * img->load_data.buf_capacity, MAX_DATA_SZ);
-                img->load_data.buf = realloc(img->load_data.buf, img->load_data.buf_capacity);
-                if (img->load_data.buf == NULL) {
-                    ABRT(ENOMEM, "Out of memory");
-                    img->load_data.buf_capacity = 0; img->load_data.buf_used = 0;
+            // The payload may have been decoded directly into the buffer, see grman_payload_buffer()
+            if (payload != img->load_data.buf + img->load_data.buf_used) {
+                if (img->load_data.buf_capacity - img->load_data.buf_used < g->payload_sz) {
+                    if (img->load_data.buf_used + g->payload_sz > MAX_DATA_SZ || (fmt != PNG && !g->compressed)) ABRT(EFBIG, "Too much data");
+                    size_t capacity = MIN(MAX(2 * img->load_data.buf_capacity, img->load_data.buf_used + g->payload_sz), MAX_DATA_SZ);
+                    if (!alloc_load_buffer(&img->load_data, capacity)) ABRT(ENOMEM, "Out of memory");
                 }
+                memcpy(img->load_data.buf + img->load_data.buf_used, payload, g->payload_sz);
             }
-            memcpy(img->load_data.buf + img->load_data.buf_used, payload, g->payload_sz);
             img->load_data.buf_used += g->payload_sz;
             if (!g->more) { img->data_loaded = true; self->loading_image = 0; }
             break;
@@ -381,37 +1331,9 @@ handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_
     self->loading_image = 0;
     bool needs_processing = g->compressed || fmt == PNG;
     if (needs_processing) {
-        uint8_t *buf; size_t bufsz;
-#define IB { if (img->load_data.buf) { buf = img->load_data.buf; bufsz = img->load_data.buf_used; } else { buf = img->load_data.mapped_file; bufsz = img->load_data.mapped_file_sz; } }
-        switch(g->compressed) {
-            case 'z':
-                IB;
-                if (!inflate_zlib(self, img, buf, bufsz)) {
-                    img->data_loaded = false; return NULL;
-                }
-                break;
-            case 0:
-                break;
-            default:
-                ABRT(EINVAL, "Unknown image compression: %c", g->compressed);
-        }
-        switch(fmt) {
-            case PNG:
-                IB;
-                if (!inflate_png(self, img, buf, bufsz)) {
-                    img->data_loaded = false; return NULL;
-                }
-                break;
-            default: break;
-        }
-#undef IB
-        img->load_data.data = img->load_data.buf;
-        if (img->load_data.buf_used < img->load_data.data_sz) {
-            ABRT(ENODATA, "Insufficient image data: %zu < %zu", img->load_data.buf_used, img->load_data.data_sz);
-        }
-        if (img->load_data.mapped_file) {
-            munmap(img->load_data.mapped_file, img->load_data.mapped_file_sz);
-            img->load_data.mapped_file = NULL; img->load_data.mapped_file_sz = 0;
+        if (g->action != 'f' && start_decode_job(self, g, img, fmt)) return img;
+        if (!decode_image(img, g->compressed, fmt)) {
+            img->data_loaded = false; return NULL;
         }
     } else {
         if (tt == 'd') {
@@ -424,16 +1346,18 @@ handle_add_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_
             } else img->load_data.data = img->load_data.mapped_file;
         }
     }
-    size_t required_sz = (img->load_data.is_opaque ? 3 : 4) * img->width * img->height;
-    if (img->load_data.data_sz != required_sz) ABRT(EINVAL, "Image dimensions: %ux%u do not match data size: %zu, expected size: %zu", img->width, img->height, img->load_data.data_sz, required_sz);
-    if (LIKELY(img->data_loaded && send_to_gpu)) {
-        send_image_to_gpu(&img->texture_id, img->load_data.data, img->width, img->height, img->load_data.is_opaque, img->load_data.is_4byte_aligned);
+    if (g->action == 'f') {
+        Image *target = img_by_internal_id(self, self->update_target);
+        if (!target) ABRT(ENOENT, "Image being updated was deleted");
+        bool ok = update_image(self, target, img, g->x_offset, g->y_offset);
         free_load_data(&img->load_data);
-        self->used_storage += required_sz;
-        img->used_storage = required_sz;
+        img->data_loaded = false;
+        if (!ok) return NULL;
+        *is_dirty = true;
+        return target;
     }
+    if (!upload_image(self, img)) { img->data_loaded = false; return NULL; }
     return img;
-#undef MAX_DATA_SZ
 #undef ABRT
 }
 
@@ -451,6 +1375,87 @@ create_add_response(GraphicsManager UNUSED *self, bool data_loaded, uint32_t iid
     return NULL;
 }
 
+static inline void
+queue_response(GraphicsManager *self, size_t decode_job, uint32_t client_id, const char *text) {
+    ensure_space_for(self, responses, GraphicsResponse, self->num_responses + 1, responses_capacity, 16, false);
+    GraphicsResponse *r = self->responses + self->num_responses++;
+    r->decode_job = decode_job; r->client_id = client_id; r->text = NULL;
+    if (text) { r->text = strdup(text); if (!r->text) fatal("Out of memory queueing graphics response"); }
+}
+
+const char*
+grman_pop_response(GraphicsManager *self) {
+    static char rbuf[sizeof(add_response)/sizeof(add_response[0]) + 64];
+    while (self->num_responses && !self->responses[0].decode_job) {
+        char *text = self->responses[0].text;
+        remove_from_array(self->responses, sizeof(GraphicsResponse), 0, self->num_responses--);
+        if (text) {
+            snprintf(rbuf, sizeof(rbuf), "%s", text);
+            free(text);
+            return rbuf;
+        }
+    }
+    return NULL;
+}
+
+static inline void
+finish_decode_job(GraphicsManager *self, DecodeJob *job, bool *is_dirty) {
+    Image *img = img_by_internal_id(self, job->image_id);
+    has_add_respose = false;
+    bool ok = job->ok;
+    if (!ok) set_add_response("", "%s", job->response);
+    self->num_decoding--;
+    if (img && img->decode_job == job->id) {
+        img->decode_job = 0;
+        if (ok && (img->width != job->img.width || img->height != job->img.height)) {
+            set_add_response("EINVAL", "Image dimensions: %ux%u do not match the dimensions in the PNG header: %ux%u", job->img.width, job->img.height, img->width, img->height);
+            ok = false;
+        }
+        free_load_data(&img->load_data);
+        img->load_data = job->img.load_data;
+        memset(&job->img.load_data, 0, sizeof(job->img.load_data));
+        if (ok && !upload_image(self, img)) ok = false;
+        if (!ok) { img->data_loaded = false; free_refs_data(img); }
+        *is_dirty = true;
+        self->layers_dirty = true;
+    }
+    free_load_data(&job->img.load_data);
+    for (size_t i = 0; i < self->num_responses; i++) {
+        GraphicsResponse *r = self->responses + i;
+        if (r->decode_job != job->id) continue;
+        r->decode_job = 0;
+        if (r->client_id) {
+            char text[sizeof(add_response)/sizeof(add_response[0]) + 64];
+            // set_add_response() with an empty code leaves a leading colon
+            snprintf(text, sizeof(text), "Gi=%u;%s", r->client_id, ok ? "OK" : add_response + (add_response[0] == ':'));
+            r->text = strdup(text);
+            if (!r->text) fatal("Out of memory queueing graphics response");
+        }
+        break;
+    }
+}
+
+void
+grman_handle_decoded_images(GraphicsManager *self, bool *is_dirty) {
+    if (!self->num_decoding) return;
+    bool found = false;
+    decode_threads_lock(lock);
+    size_t i, j;
+    for (i = 0, j = 0; i < decode_threads.finished_count; i++) {
+        DecodeJob *job = decode_threads.finished + i;
+        if (job->grman_id == self->id) {
+            finish_decode_job(self, job, is_dirty);
+            found = true;
+        } else {
+            if (i != j) decode_threads.finished[j] = *job;
+            j++;
+        }
+    }
+    decode_threads.finished_count = j;
+    decode_threads_lock(unlock);
+    if (found && self->used_storage > STORAGE_LIMIT) apply_storage_quota(self, STORAGE_LIMIT, NULL);
+}
+
 // }}}
 
 // Displaying images {{{
@@ -514,14 +1519,6 @@ handle_put_command(GraphicsManager *self, const GraphicsCommand *g, Cursor *c, b
     c->x += ref->effective_num_cols; c->y += ref->effective_num_rows - 1;
 }
 
-static int
-cmp_by_zindex_and_image(const void *a_, const void *b_) {
-    const ImageRenderData *a = (const ImageRenderData*)a_, *b = (const ImageRenderData*)b_;
-    int ans = a->z_index - b->z_index;
-    if (ans == 0) ans = a->image_id - b->image_id;
-    return ans;
-}
-
 static inline void
 set_vertex_data(ImageRenderData *rd, const ImageRef *ref, const ImageRect *dest_rect) {
 #define R(n, a, b) rd->vertices[n*4] = ref->src_rect.a; rd->vertices[n*4 + 1] = ref->src_rect.b; rd->vertices[n*4 + 2] = dest_rect->a; rd->vertices[n*4 + 3] = dest_rect->b;
@@ -540,13 +1537,106 @@ gpu_data_for_centered_image(ImageRenderData *ans, unsigned int screen_width_px,
     set_vertex_data(ans, ref, &r);
 }
 
+static inline bool
+image_is_drawable(Image *img, bool *has_pending_uploads) {
+    // An image transmitted again is drawn with its previous texture while the new data is decoded or uploaded
+    if (img->decode_job) return img->previous_texture != NULL;
+    if (img->previous_texture) {
+        if (img->texture && texture_upload_pending(img->texture)) *has_pending_uploads = true;
+        else release_previous_texture(img);
+    }
+    return true;
+}
+
+static int
+cmp_layer_refs(const void *a_, const void *b_) {
+    const LayerRef *a = (const LayerRef*)a_, *b = (const LayerRef*)b_;
+    // The atlas is not part of the order, as that would draw images that
+    // overlap in the wrong order, only refs that are consecutive in draw
+    // order are batched, see same_batch()
+    int ans = a->z_index - b->z_index;
+    if (ans == 0) ans = a->image_id < b->image_id ? -1 : (a->image_id > b->image_id ? 1 : 0);
+    if (ans == 0) ans = (int)a->ref_idx - (int)b->ref_idx;
+    return ans;
+}
+
+static int
+cmp_layer_rows(const void *a_, const void *b_) {
+    const LayerRow *a = (const LayerRow*)a_, *b = (const LayerRow*)b_;
+    return a->start_row < b->start_row ? -1 : (a->start_row > b->start_row ? 1 : 0);
+}
+
+static int
+cmp_positions(const void *a_, const void *b_) {
+    uint32_t a = *(const uint32_t*)a_, b = *(const uint32_t*)b_;
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static inline void
+rebuild_layer_refs(GraphicsManager *self, bool *has_pending_uploads) {
+    // Index the refs of all images in draw order (z-index, image) and by row,
+    // so that when scrolling only the refs near the viewport are looked at
+    size_t n = 0;
+    for (size_t i = 0; i < self->image_count; i++) n += self->images[i].refcnt;
+    if (n > self->layer_refs_capacity) {
+        self->layer_refs_capacity = MAX(64u, n + n / 2);
+        self->layer_refs = realloc(self->layer_refs, self->layer_refs_capacity * sizeof(LayerRef));
+        self->layer_rows = realloc(self->layer_rows, self->layer_refs_capacity * sizeof(LayerRow));
+        self->visible_layer_refs = realloc(self->visible_layer_refs, self->layer_refs_capacity * sizeof(uint32_t));
+        if (!self->layer_refs || !self->layer_rows || !self->visible_layer_refs) fatal("Out of memory allocating image layers");
+    }
+    self->num_layer_refs = 0; self->max_layer_ref_rows = 0;
+    for (size_t i = 0; i < self->image_count; i++) {
+        Image *img = self->images + i;
+        if (!image_is_drawable(img, has_pending_uploads)) continue;
+        for (size_t j = 0; j < img->refcnt; j++) {
+            ImageRef *ref = img->refs + j;
+            LayerRef *l = self->layer_refs + self->num_layer_refs++;
+            l->image_idx = i; l->ref_idx = j; l->z_index = ref->z_index; l->image_id = img->internal_id;
+            // Images are not uploaded when testing, so use the atlas they would be in
+            l->atlas = drawn_texture(img) ? drawn_texture(img)->atlas : atlas_for_size(img->width, img->height);
+            self->max_layer_ref_rows = MAX(self->max_layer_ref_rows, (int32_t)ref->effective_num_rows + 1);
+        }
+    }
+    qsort(self->layer_refs, self->num_layer_refs, sizeof(LayerRef), cmp_layer_refs);
+    for (uint32_t i = 0; i < self->num_layer_refs; i++) {
+        const LayerRef *l = self->layer_refs + i;
+        self->layer_rows[i].start_row = self->images[l->image_idx].refs[l->ref_idx].start_row;
+        self->layer_rows[i].pos = i;
+    }
+    qsort(self->layer_rows, self->num_layer_refs, sizeof(LayerRow), cmp_layer_rows);
+}
+
+static inline size_t
+find_visible_layer_refs(GraphicsManager *self, int32_t first_row, int32_t last_row) {
+    // Returns the positions, in draw order, of the refs that could intersect rows [first_row, last_row]
+    int32_t min_start = first_row - self->max_layer_ref_rows;
+    size_t lo = 0, hi = self->num_layer_refs, count = 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (self->layer_rows[mid].start_row < min_start) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < self->num_layer_refs && self->layer_rows[lo].start_row <= last_row; lo++) self->visible_layer_refs[count++] = self->layer_rows[lo].pos;
+    qsort(self->visible_layer_refs, count, sizeof(uint32_t), cmp_positions);
+    return count;
+}
+
 bool
 grman_update_layers(GraphicsManager *self, unsigned int scrolled_by, float screen_left, float screen_top, float dx, float dy, unsigned int num_cols, unsigned int num_rows, CellPixelSize cell) {
-    if (self->last_scrolled_by != scrolled_by) self->layers_dirty = true;
+    bool scrolled = self->last_scrolled_by != scrolled_by;
     self->last_scrolled_by = scrolled_by;
-    if (!self->layers_dirty) return false;
+    if (self->atlas_generation != image_atlas_generation) {
+        // The layers of images in the render data may have changed
+        self->atlas_generation = image_atlas_generation;
+        if (self->count) self->layers_dirty = true;
+    }
+    if (!self->layers_dirty && !scrolled) return false;
+    bool has_pending_uploads = false;
+    // Scrolling only moves the viewport over the existing index
+    if (self->layers_dirty) rebuild_layer_refs(self, &has_pending_uploads);
     self->layers_dirty = false;
-    size_t i, j;
+    size_t i;
     self->num_of_negative_refs = 0; self->num_of_positive_refs = 0;
     Image *img; ImageRef *ref;
     ImageRect r;
@@ -556,9 +1646,12 @@ grman_update_layers(GraphicsManager *self, unsigned int scrolled_by, float scree
     float screen_height_px = num_rows * cell.height;
     float y0 = screen_top - dy * scrolled_by;
 
-    // Iterate over all visible refs and create render data
-    self->count = 0;
-    for (i = 0; i < self->image_count; i++) { img = self->images + i; for (j = 0; j < img->refcnt; j++) { ref = img->refs + j;
+    // Iterate over all visible refs, in draw order, and create render data
+    release_render_data(self);
+    size_t num_candidates = find_visible_layer_refs(self, -(int32_t)scrolled_by, (int32_t)num_rows - (int32_t)scrolled_by);
+    for (i = 0; i < num_candidates; i++) {
+        const LayerRef *l = self->layer_refs + self->visible_layer_refs[i];
+        img = self->images + l->image_idx; ref = img->refs + l->ref_idx;
         r.top = y0 - ref->start_row * dy - dy * (float)ref->cell_y_offset / (float)cell.height;
         if (ref->num_rows > 0) r.bottom = y0 - (ref->start_row + (int32_t)ref->num_rows) * dy;
         else r.bottom = r.top - screen_height * (float)ref->src_height / screen_height_px;
@@ -574,12 +1667,33 @@ grman_update_layers(GraphicsManager *self, unsigned int scrolled_by, float scree
         set_vertex_data(rd, ref, &r);
         self->count++;
         rd->z_index = ref->z_index; rd->image_id = img->internal_id;
-        rd->texture_id = img->texture_id;
-    }}
+        rd->texture = drawn_texture(img); rd->texture_id = 0;
+        rd->atlas = l->atlas; rd->layer = 0;
+        if (rd->texture) {
+            SharedTexture *t = rd->texture;
+            // The size of the texture needed to display the image at this size
+            uint32_t w = (uint32_t)ceilf((r.right - r.left) / screen_width * screen_width_px * img->width / MAX(1u, ref->src_width));
+            uint32_t h = (uint32_t)ceilf((r.top - r.bottom) / screen_height * screen_height_px * img->height / MAX(1u, ref->src_height));
+            t->needed_width = MAX(t->needed_width, MIN(w, t->width)); t->needed_height = MAX(t->needed_height, MIN(h, t->height));
+            t->num_visible++; t->visible_frame = shared_textures.current_frame; t->atime = monotonic();
+            ensure_texture_resident(t);
+            rd->texture_id = t->texture_id;
+            if (t->atlas) {
+                // The image occupies only the top left corner of its slot
+                float sx = (float)t->width / ATLAS_SLOT_SIZE(t->atlas), sy = (float)t->height / ATLAS_SLOT_SIZE(t->atlas);
+                for (unsigned int n = 0; n < 4; n++) { rd->vertices[n*4] *= sx; rd->vertices[n*4 + 1] *= sy; }
+                rd->layer = t->atlas_layer;
+            }
+        }
+    }
+    if (self->count) apply_gpu_memory_budget(self);
+    if (has_pending_uploads) {
+        // Check again on the next frame
+        self->layers_dirty = true;
+        request_tick_callback();
+    }
     if (!self->count) return false;
-    // Sort visible refs in draw order (z-index, img)
-    qsort(self->render_data, self->count, sizeof(ImageRenderData), cmp_by_zindex_and_image);
-    // Calculate the group counts
+    // Calculate the group counts, the render data is already in draw order
     i = 0;
     while (i < self->count) {
         size_t image_id = self->render_data[i].image_id, start = i;
@@ -592,6 +1706,21 @@ grman_update_layers(GraphicsManager *self, unsigned int scrolled_by, float scree
     return true;
 }
 
+static inline bool
+same_batch(const ImageRenderData *a, const ImageRenderData *b) {
+    if (a->atlas) return b->atlas == a->atlas;
+    if (b->atlas) return false;
+    return a->texture_id ? b->texture_id == a->texture_id : b->image_id == a->image_id;
+}
+
+size_t
+grman_batch_size(const ImageRenderData *rd, size_t count) {
+    // The number of images, starting at rd, that can be drawn with a single instanced draw call
+    size_t n = 1;
+    while (n < count && same_batch(rd, rd + n)) n++;
+    return n;
+}
+
 // }}}
 
 // Image lifetime/scrolling {{{
@@ -770,6 +1899,23 @@ grman_rescale(GraphicsManager *self, CellPixelSize cell) {
     }
 }
 
+uint8_t*
+grman_payload_buffer(GraphicsManager *self, const GraphicsCommand *g, size_t sz) {
+    // Where the at most sz bytes of payload of a command should be decoded to.
+    // For chunks after the first of directly transmitted data, that is the end of the data
+    // received so far, which saves copying it. NULL means the parser should use its own buffer.
+    if (!self->loading_image || (g->transmission_type && g->transmission_type != 'd')) return NULL;
+    switch(g->action) {
+        case 0: case 't': case 'T': case 'q': case 'f':
+            break;
+        default:
+            return NULL;
+    }
+    Image *img = image_being_loaded(self);
+    if (!img || !img->load_data.buf || img->load_data.buf_capacity - img->load_data.buf_used < sz) return NULL;
+    return img->load_data.buf + img->load_data.buf_used;
+}
+
 const char*
 grman_handle_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_t *payload, Cursor *c, bool *is_dirty, CellPixelSize cell) {
     Image *image;
@@ -781,10 +1927,14 @@ grman_handle_command(GraphicsManager *self, const GraphicsCommand *g, const uint
         case 't':
         case 'T':
         case 'q':
+        case 'f':
             iid = g->id; q_iid = iid;
             if (g->action == 'q') { iid = 0; if (!q_iid) { REPORT_ERROR("Query graphics command without image id"); break; } }
             image = handle_add_command(self, g, payload, is_dirty, iid);
-            ret = create_add_response(self, image != NULL, g->action == 'q' ? q_iid: self->last_init_graphics_command.id);
+            if (image && image->decode_job) {
+                // The response is sent once the image has been decoded
+                queue_response(self, image->decode_job, self->last_init_graphics_command.id, NULL);
+            } else ret = create_add_response(self, image != NULL, g->action == 'q' ? q_iid: self->last_init_graphics_command.id);
             if (self->last_init_graphics_command.action == 'T' && image && image->data_loaded) handle_put_command(self, &self->last_init_graphics_command, c, is_dirty, image, cell);
             if (g->action == 'q') remove_images(self, add_trim_predicate, NULL);
             if (self->used_storage > STORAGE_LIMIT) apply_storage_quota(self, STORAGE_LIMIT, image);
@@ -804,6 +1954,11 @@ grman_handle_command(GraphicsManager *self, const GraphicsCommand *g, const uint
             REPORT_ERROR("Unknown graphics command action: %c", g->action);
             break;
     }
+    if (ret && self->num_responses) {
+        // Keep the responses in order
+        queue_response(self, 0, 0, ret);
+        ret = NULL;
+    }
     return ret;
 }
 
@@ -819,9 +1974,9 @@ new(PyTypeObject UNUSED *type, PyObject UNUSED *args, PyObject UNUSED *kwds) {
 static inline PyObject*
 image_as_dict(Image *img) {
 #define U(x) #x, img->x
-    return Py_BuildValue("{sI sI sI sI sI sI sO sO sN}",
-        U(texture_id), U(client_id), U(width), U(height), U(internal_id), U(refcnt),
-        "data_loaded", img->data_loaded ? Py_True : Py_False,
+    return Py_BuildValue("{sI sI sI sI sI sI sO sK sO sN}",
+        "texture_id", img->texture ? img->texture->texture_id : 0, U(client_id), U(width), U(height), U(internal_id), U(refcnt),
+        "data_loaded", img->data_loaded ? Py_True : Py_False, "used_storage", (unsigned long long)img->used_storage,
         "is_4byte_aligned", img->load_data.is_4byte_aligned ? Py_True : Py_False,
         "data", Py_BuildValue("y#", img->load_data.data, img->load_data.data_sz)
     );
@@ -869,33 +2024,77 @@ W(set_send_to_gpu) {
     Py_RETURN_NONE;
 }
 
+W(new_graphics_frame) {
+    (void)args;
+    grman_new_frame();
+    Py_RETURN_NONE;
+}
+
+W(shared_texture_stats) {
+    (void)args;
+    size_t num_layers = 0;
+    for (size_t i = 0; i < arraysz(image_atlases); i++) num_layers += image_atlases[i].num_used;
+    PyObject *capacity = PyTuple_New(NUM_IMAGE_ATLASES);
+    if (!capacity) return NULL;
+    for (size_t i = 0; i < arraysz(image_atlases); i++) PyTuple_SET_ITEM(capacity, i, PyLong_FromUnsignedLong(image_atlases[i].num_layers));
+    return Py_BuildValue("{sn sn sn sN}", "count", (Py_ssize_t)shared_textures.count, "gpu_memory", (Py_ssize_t)shared_textures.gpu_memory, "atlas_layers", (Py_ssize_t)num_layers, "atlas_capacity", capacity);
+}
+
+W(set_image_decode_threads) {
+    int num;
+    PA("i", &num);
+    wait_for_decode_threads();
+    stop_decode_threads();
+    requested_num_of_decode_threads = MAX(-1, num);
+    Py_RETURN_NONE;
+}
+
+W(wait_for_image_decodes) {
+    (void)args;
+    wait_for_decode_threads();
+    Py_RETURN_NONE;
+}
+
 W(update_layers) {
     unsigned int scrolled_by, sx, sy; float xstart, ystart, dx, dy;
     CellPixelSize cell;
     PA("IffffIIII", &scrolled_by, &xstart, &ystart, &dx, &dy, &sx, &sy, &cell.width, &cell.height);
     grman_update_layers(self, scrolled_by, xstart, ystart, dx, dy, sx, sy, cell);
+    grman_mark_visible(self);
     PyObject *ans = PyTuple_New(self->count);
     for (size_t i = 0; i < self->count; i++) {
         ImageRenderData *r = self->render_data + i;
 #define R(offset) Py_BuildValue("{sf sf sf sf}", "left", r->vertices[offset + 8], "top", r->vertices[offset + 1], "right", r->vertices[offset], "bottom", r->vertices[offset + 5])
         PyTuple_SET_ITEM(ans, i,
-            Py_BuildValue("{sN sN sI si sI}", "src_rect", R(0), "dest_rect", R(2), "group_count", r->group_count, "z_index", r->z_index, "image_id", r->image_id)
+            Py_BuildValue("{sN sN sI si sI sI sI}", "src_rect", R(0), "dest_rect", R(2), "group_count", r->group_count, "z_index", r->z_index, "image_id", r->image_id, "atlas", r->atlas, "layer", (unsigned int)r->layer)
         );
 #undef R
     }
     return ans;
 }
 
+W(draw_calls) {
+    (void)args;
+    // The number of draw calls needed to draw the images below and above the text
+    size_t ans = 0, ranges[2][2] = {{0, self->num_of_negative_refs}, {self->num_of_negative_refs, self->num_of_positive_refs}};
+    for (size_t r = 0; r < arraysz(ranges); r++) {
+        for (size_t i = 0; i < ranges[r][1]; ans++) i += grman_batch_size(self->render_data + ranges[r][0] + i, ranges[r][1] - i);
+    }
+    return PyLong_FromSize_t(ans);
+}
+
 #define M(x, va) {#x, (PyCFunction)py##x, va, ""}
 
 static PyMethodDef methods[] = {
     M(image_for_client_id, METH_O),
     M(update_layers, METH_VARARGS),
+    M(draw_calls, METH_NOARGS),
     {NULL}  /* Sentinel */
 };
 
 static PyMemberDef members[] = {
     {"image_count", T_UINT, offsetof(GraphicsManager, image_count), 0, "image_count"},
+    {"used_storage", T_PYSSIZET, offsetof(GraphicsManager, used_storage), READONLY, "used_storage"},
     {NULL},
 };
 
@@ -915,9 +2114,22 @@ static PyMethodDef module_methods[] = {
     M(shm_write, METH_VARARGS),
     M(shm_unlink, METH_VARARGS),
     M(set_send_to_gpu, METH_O),
+    M(shared_texture_stats, METH_NOARGS),
+    M(new_graphics_frame, METH_NOARGS),
+    M(set_image_decode_threads, METH_VARARGS),
+    M(wait_for_image_decodes, METH_NOARGS),
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
+static void
+finalize(void) {
+    stop_decode_threads();
+    // The textures are freed with the OpenGL context
+    for (size_t i = 0; i < shared_textures.count; i++) { free(shared_textures.items[i]->cpu_copy); free(shared_textures.items[i]); }
+    free(shared_textures.items); shared_textures.items = NULL; shared_textures.count = 0;
+    for (size_t i = 0; i < arraysz(image_atlases); i++) { free(image_atlases[i].used); image_atlases[i].used = NULL; }
+}
+
 
 bool
 init_graphics(PyObject *module) {
@@ -925,6 +2137,14 @@ init_graphics(PyObject *module) {
     if (PyModule_AddObject(module, "GraphicsManager", (PyObject *)&GraphicsManager_Type) != 0) return false;
     if (PyModule_AddFunctions(module, module_methods) != 0) return false;
     Py_INCREF(&GraphicsManager_Type);
+    if (pthread_mutex_init(&decode_threads.lock, NULL) != 0 || pthread_cond_init(&decode_threads.has_jobs, NULL) != 0 || pthread_cond_init(&decode_threads.is_idle, NULL) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to create locks for image decode threads");
+        return false;
+    }
+    if (Py_AtExit(finalize) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to register the graphics at exit handler");
+        return false;
+    }
     return true;
 }
 // }}}
@@ -18,6 +18,8 @@ typedef struct {
 typedef struct {
     uint8_t *buf;
     size_t buf_capacity, buf_used;
+    // Large buffers are allocated with mmap() rather than malloc()
+    bool buf_is_mapped;
 
     uint8_t *mapped_file;
     size_t mapped_file_sz;
@@ -41,12 +43,19 @@ typedef struct {
 } ImageRef;
 
 
+typedef struct SharedTexture SharedTexture;
+
 typedef struct {
-    uint32_t texture_id, client_id, width, height;
+    SharedTexture *texture;
+    // The texture of the previous transmission of the image, drawn until the upload of texture is complete
+    SharedTexture *previous_texture;
+    uint32_t client_id, width, height;
     size_t internal_id;
 
     bool data_loaded;
     LoadData load_data;
+    // Non-zero while the image data is being decoded in a background thread
+    size_t decode_job;
 
     ImageRef *refs;
     size_t refcnt, refcap;
@@ -57,22 +66,61 @@ typedef struct {
 typedef struct {
     float vertices[16];
     uint32_t texture_id, group_count;
+    SharedTexture *texture;
+    // Non-zero if the image is in a layer of an image atlas rather than in a texture of its own
+    unsigned int atlas;
+    float layer;
     int z_index;
     size_t image_id;
 } ImageRenderData;
 
+typedef struct {
+    // A ref in the index of refs in draw order
+    uint32_t image_idx, ref_idx;
+    int32_t z_index;
+    unsigned int atlas;
+    size_t image_id;
+} LayerRef;
+
+typedef struct {
+    // A ref in the index of refs by row, pos is its position in draw order
+    int32_t start_row;
+    uint32_t pos;
+} LayerRow;
+
+typedef struct {
+    // A response that must wait for the decoding of an image to finish
+    size_t decode_job;
+    uint32_t client_id;
+    char *text;
+} GraphicsResponse;
+
 typedef struct {
     PyObject_HEAD
 
+    id_type id;
     size_t image_count, images_capacity, loading_image;
     GraphicsCommand last_init_graphics_command;
     Image *images;
+    // The data for an update of a region of the image with internal id update_target, while it is loaded
+    Image update;
+    size_t update_target;
     size_t count, capacity;
     ImageRenderData *render_data;
+    LayerRef *layer_refs;
+    LayerRow *layer_rows;
+    uint32_t *visible_layer_refs;
+    size_t num_layer_refs, layer_refs_capacity;
+    int32_t max_layer_ref_rows;
     bool layers_dirty;
+    // The image_atlas_generation the render data was created for
+    uint64_t atlas_generation;
     size_t num_of_negative_refs, num_of_positive_refs;
     unsigned int last_scrolled_by;
     size_t used_storage;
+    size_t num_decoding;
+    GraphicsResponse *responses;
+    size_t num_responses, responses_capacity;
 } GraphicsManager;
 
 
@@ -82,11 +130,33 @@ typedef struct {
     bool has_margins;
 } ScrollData;
 
+typedef struct {
+    void (*send_image)(uint32_t*, const void*, int32_t, int32_t, bool, bool);
+    void* (*send_image_async)(uint32_t*, const void*, int32_t, int32_t, bool, bool);
+    void (*send_image_region)(uint32_t, int32_t, int32_t, const void*, int32_t, int32_t, bool, bool);
+    void (*download_image)(uint32_t, void*, bool);
+    void* (*download_image_async)(uint32_t, uint32_t*, bool, size_t);
+    bool (*finish_download)(uint32_t*, void*, size_t);
+    void (*free_texture)(uint32_t*);
+    unsigned int (*realloc_atlas)(uint32_t*, unsigned int, unsigned int, unsigned int);
+    void (*compact_atlas)(uint32_t*, unsigned int, unsigned int, const uint32_t*, unsigned int);
+    void (*send_image_to_atlas)(uint32_t, unsigned int, int32_t, int32_t, const void*, int32_t, int32_t, bool, bool);
+    void (*download_image_from_atlas)(uint32_t, unsigned int, void*, int32_t, int32_t, bool);
+} GPUOperations;
+
 GraphicsManager* grman_alloc();
 void grman_clear(GraphicsManager*, bool, CellPixelSize fg);
+uint8_t* grman_payload_buffer(GraphicsManager *self, const GraphicsCommand *g, size_t sz);
 const char* grman_handle_command(GraphicsManager *self, const GraphicsCommand *g, const uint8_t *payload, Cursor *c, bool *is_dirty, CellPixelSize fg);
 bool grman_update_layers(GraphicsManager *self, unsigned int scrolled_by, float screen_left, float screen_top, float dx, float dy, unsigned int num_cols, unsigned int num_rows, CellPixelSize);
 void grman_scroll_images(GraphicsManager *self, const ScrollData*, CellPixelSize fg);
 void grman_resize(GraphicsManager*, index_type, index_type, index_type, index_type);
 void grman_rescale(GraphicsManager *self, CellPixelSize fg);
+void grman_handle_decoded_images(GraphicsManager *self, bool *is_dirty);
+const char* grman_pop_response(GraphicsManager *self);
+size_t grman_batch_size(const ImageRenderData *rd, size_t count);
+void grman_new_frame(void);
+void grman_mark_visible(GraphicsManager *self);
+uint32_t image_atlas_texture_id(unsigned int atlas);
+void grman_set_gpu_operations(const GPUOperations *ops);
 void gpu_data_for_centered_image(ImageRenderData *ans, unsigned int screen_width_px, unsigned int screen_height_px, unsigned int width, unsigned int height);
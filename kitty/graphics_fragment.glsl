@@ -1,14 +1,19 @@
 #version GLSL_VERSION
 #define ALPHA_TYPE
+#define TEXTURE_TYPE
 
+#ifdef ATLAS
+uniform sampler2DArray image;
+#else
 uniform sampler2D image;
+#endif
 #ifdef ALPHA_MASK
 uniform uint fg;
 #else
 uniform float inactive_text_alpha;
 #endif
 
-in vec2 texcoord;
+in vec3 texcoord;
 out vec4 color;
 
 #ifdef ALPHA_MASK
@@ -25,7 +30,11 @@ vec3 color_to_vec(uint c) {
 
 
 void main() {
+#ifdef ATLAS
     color = texture(image, texcoord);
+#else
+    color = texture(image, texcoord.xy);
+#endif
 #ifdef ALPHA_MASK
     color = vec4(color_to_vec(fg), color.r);
 #else
@@ -1,10 +1,21 @@
 #version GLSL_VERSION
 
 // Have to use fixed locations here as all variants of the program share the same VAO
+// Every image is an instance, the rects are left, top, right, bottom
 layout(location=0) in vec4 src;
-out vec2 texcoord;
+layout(location=1) in vec4 dest;
+layout(location=2) in float layer;
+out vec3 texcoord;
+
+const uvec2 pos_map[] = uvec2[4](
+    uvec2(2, 1),  // right, top
+    uvec2(2, 3),  // right, bottom
+    uvec2(0, 3),  // left, bottom
+    uvec2(0, 1)   // left, top
+);
 
 void main() {
-    texcoord = vec2(src[0], src[1]);
-    gl_Position = vec4(src[2], src[3], 0, 1);
+    uvec2 pos = pos_map[gl_VertexID];
+    texcoord = vec3(src[pos.x], src[pos.y], layer);
+    gl_Position = vec4(dest[pos.x], dest[pos.y], 0, 1);
 }
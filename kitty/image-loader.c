@@ -0,0 +1,450 @@
+/*
+ * image-loader.c
+ * Copyright (C) 2019 Kovid Goyal <kovid at kovidgoyal.net>
+ *
+ * Distributed under terms of the GPL3 license.
+ */
+
+// Decode and scale images for icat, so that it does not need to run
+// ImageMagick for every image. Images are loaded with the GIL released so
+// that many images can be loaded in parallel.
+
+#include "png-reader.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAS_LIBJPEG
+#include <jpeglib.h>
+#endif
+
+typedef enum { LOAD_OK, LOAD_UNSCALED_PNG, LOAD_UNSUPPORTED, LOAD_OS_ERROR, LOAD_FAILED } LoadResult;
+
+typedef struct {
+    uint8_t *data;
+    unsigned int width, height, channels;
+} Pixels;
+
+// Thread local, since images are loaded in many threads at once
+static _Thread_local char load_error[512] = {0};
+
+static void
+set_load_error(const char *code, const char *msg) {
+    snprintf(load_error, sizeof(load_error), "[%s] %s", code, msg);
+}
+
+// Decoders {{{
+
+static LoadResult
+decode_png(const uint8_t *buf, size_t bufsz, Pixels *ans) {
+    png_read_data d = {.err_handler=set_load_error};
+    inflate_png_inner(&d, buf, bufsz);
+    free(d.row_pointers);
+    if (!d.ok) { free(d.decompressed); return LOAD_FAILED; }
+    ans->data = d.decompressed; ans->width = d.width; ans->height = d.height; ans->channels = 4;
+    return LOAD_OK;
+}
+
+#ifdef HAS_LIBJPEG
+struct jpeg_error_handler {
+    struct jpeg_error_mgr pub;
+    jmp_buf jb;
+};
+
+static void
+jpeg_error_exit(j_common_ptr cinfo) {
+    struct jpeg_error_handler *eh = (struct jpeg_error_handler*)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    set_load_error("EBADJPEG", msg);
+    longjmp(eh->jb, 1);
+}
+
+static void
+jpeg_output_message(j_common_ptr cinfo UNUSED) {
+    // Warnings about recoverable corruption must not be printed to stderr
+}
+
+static LoadResult
+decode_jpeg(const uint8_t *buf, size_t bufsz, unsigned int target_width, unsigned int target_height, Pixels *ans) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_handler eh;
+    uint8_t * volatile data = NULL;
+    cinfo.err = jpeg_std_error(&eh.pub);
+    eh.pub.error_exit = jpeg_error_exit;
+    eh.pub.output_message = jpeg_output_message;
+    if (setjmp(eh.jb)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(data);
+        return LOAD_FAILED;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)buf, bufsz);
+    jpeg_read_header(&cinfo, TRUE);
+    switch (cinfo.jpeg_color_space) {
+        case JCS_YCbCr: case JCS_RGB: case JCS_GRAYSCALE:
+            break;
+        default:
+            // libjpeg cannot convert CMYK and YCCK to RGB, leave them to ImageMagick
+            jpeg_destroy_decompress(&cinfo);
+            return LOAD_UNSUPPORTED;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    // Let the decoder do as much of the downscaling as it can, by skipping
+    // DCT coefficients, as long as the image stays larger than the target
+    if (target_width && target_height) {
+        cinfo.scale_num = 1;
+        for (unsigned int denom = 8; denom > 1; denom /= 2) {
+            if (cinfo.image_width / denom >= target_width && cinfo.image_height / denom >= target_height) { cinfo.scale_denom = denom; break; }
+        }
+    }
+    jpeg_start_decompress(&cinfo);
+    size_t stride = (size_t)cinfo.output_width * 3;
+    data = malloc(stride * cinfo.output_height + 16);
+    if (!data) { set_load_error("ENOMEM", "Out of memory allocating decompression buffer for JPEG"); longjmp(eh.jb, 1); }
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = data + stride * cinfo.output_scanline;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    ans->data = data; ans->width = cinfo.output_width; ans->height = cinfo.output_height; ans->channels = 3;
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return LOAD_OK;
+}
+#endif
+
+// }}}
+
+// Scaling {{{
+
+// Images are scaled separably, first horizontally then vertically. Every
+// output pixel is a weighted sum of a span of input pixels, with weights in
+// fixed point. When shrinking, the weights are the area of each input pixel
+// covered by the output pixel (a box filter), when enlarging they interpolate
+// linearly between the two nearest input pixels. The inner loops work on
+// whole rows of bytes so that the compiler can vectorize them.
+
+#define WEIGHT_SHIFT 14
+#define WEIGHT_ONE (1 << WEIGHT_SHIFT)
+
+typedef struct {
+    unsigned int first, count;
+    int32_t *weights;
+} Span;
+
+static Span*
+compute_spans(unsigned int src, unsigned int dest) {
+    double scale = (double)src / dest;
+    unsigned int max_count = dest < src ? (unsigned int)ceil(scale) + 1 : 2;
+    Span *spans = malloc(dest * (sizeof(Span) + max_count * sizeof(int32_t)));
+    if (!spans) return NULL;
+    int32_t *weights = (int32_t*)(spans + dest);
+    for (unsigned int i = 0; i < dest; i++) {
+        Span *s = spans + i;
+        s->weights = weights + i * max_count;
+        if (dest < src) {
+            double lo = i * scale, hi = MIN((i + 1) * scale, (double)src);
+            s->first = (unsigned int)floor(lo);
+            s->count = MIN((unsigned int)ceil(hi) - s->first, max_count);
+            for (unsigned int k = 0; k < s->count; k++) {
+                double j = s->first + k;
+                s->weights[k] = (int32_t)lround((MIN(hi, j + 1) - MAX(lo, j)) / scale * WEIGHT_ONE);
+            }
+        } else {
+            double c = MIN(MAX((i + 0.5) * scale - 0.5, 0.), (double)(src - 1));
+            s->first = (unsigned int)floor(c);
+            double f = c - s->first;
+            s->count = s->first + 1 < src && f > 0 ? 2 : 1;
+            s->weights[0] = (int32_t)lround((1. - f) * WEIGHT_ONE);
+            if (s->count > 1) s->weights[1] = (int32_t)lround(f * WEIGHT_ONE);
+        }
+        // Make the weights add up to exactly one, so that flat regions stay flat
+        int32_t total = 0;
+        unsigned int largest = 0;
+        for (unsigned int k = 0; k < s->count; k++) {
+            total += s->weights[k];
+            if (s->weights[k] > s->weights[largest]) largest = k;
+        }
+        s->weights[largest] += WEIGHT_ONE - total;
+    }
+    return spans;
+}
+
+static inline uint8_t
+clamp_pixel(int32_t x) {
+    x = (x + (WEIGHT_ONE / 2)) >> WEIGHT_SHIFT;
+    return x < 0 ? 0 : (x > 255 ? 255 : x);
+}
+
+static inline void
+scale_rows(const uint8_t *data, size_t src_stride, unsigned int num_rows, uint8_t *out, unsigned int width, const Span *spans, const unsigned int ch) {
+    // Inlined with a constant number of channels, so that the loops over the
+    // channels are unrolled
+    for (unsigned int y = 0; y < num_rows; y++) {
+        const uint8_t *src = data + y * src_stride;
+        uint8_t *dest = out + (size_t)y * width * ch;
+        for (unsigned int x = 0; x < width; x++) {
+            const Span *s = spans + x;
+            int32_t a[4] = {0};
+            const uint8_t *p = src + (size_t)s->first * ch;
+            for (unsigned int k = 0; k < s->count; k++, p += ch) {
+                for (unsigned int c = 0; c < ch; c++) a[c] += s->weights[k] * p[c];
+            }
+            for (unsigned int c = 0; c < ch; c++) dest[x * ch + c] = clamp_pixel(a[c]);
+        }
+    }
+}
+
+static bool
+scale_pixels(Pixels *img, unsigned int width, unsigned int height) {
+    const unsigned int ch = img->channels;
+    size_t src_stride = (size_t)img->width * ch, stride = (size_t)width * ch;
+    Span *hspans = compute_spans(img->width, width), *vspans = compute_spans(img->height, height);
+    uint8_t *tmp = malloc(stride * img->height), *out = malloc(stride * height + 16);
+    int32_t *acc = malloc(stride * sizeof(int32_t));
+    bool ok = hspans && vspans && tmp && out && acc;
+    if (ok) {
+        if (ch == 3) scale_rows(img->data, src_stride, img->height, tmp, width, hspans, 3);
+        else scale_rows(img->data, src_stride, img->height, tmp, width, hspans, 4);
+        for (unsigned int y = 0; y < height; y++) {
+            const Span *s = vspans + y;
+            memset(acc, 0, stride * sizeof(int32_t));
+            for (unsigned int k = 0; k < s->count; k++) {
+                const uint8_t *src = tmp + (size_t)(s->first + k) * stride;
+                const int32_t w = s->weights[k];
+                for (size_t i = 0; i < stride; i++) acc[i] += w * src[i];
+            }
+            uint8_t *dest = out + y * stride;
+            for (size_t i = 0; i < stride; i++) dest[i] = clamp_pixel(acc[i]);
+        }
+        free(img->data);
+        img->data = out; out = NULL;
+        img->width = width; img->height = height;
+    } else set_load_error("ENOMEM", "Out of memory scaling image");
+    free(hspans); free(vspans); free(tmp); free(out); free(acc);
+    return ok;
+}
+
+static inline bool
+is_opaque(const Pixels *img) {
+    const uint8_t *p = img->data + 3, *limit = img->data + (size_t)img->width * img->height * 4;
+    uint8_t all = 0xff;
+    for (; p < limit; p += 4) all &= *p;
+    return all == 0xff;
+}
+
+static void
+drop_alpha(Pixels *img) {
+    const uint8_t *src = img->data;
+    uint8_t *dest = img->data;
+    for (size_t i = 0, n = (size_t)img->width * img->height; i < n; i++, src += 4, dest += 3) {
+        dest[0] = src[0]; dest[1] = src[1]; dest[2] = src[2];
+    }
+    img->channels = 3;
+}
+
+// Scale with premultiplied alpha, so that the colors of transparent pixels
+// do not bleed into their neighbors
+
+static void
+premultiply(Pixels *img) {
+    uint8_t *p = img->data, *limit = img->data + (size_t)img->width * img->height * 4;
+    for (; p < limit; p += 4) {
+        for (unsigned int c = 0; c < 3; c++) p[c] = (p[c] * p[3] + 127) / 255;
+    }
+}
+
+static void
+unpremultiply(Pixels *img) {
+    uint8_t *p = img->data, *limit = img->data + (size_t)img->width * img->height * 4;
+    for (; p < limit; p += 4) {
+        if (p[3] && p[3] != 255) {
+            for (unsigned int c = 0; c < 3; c++) p[c] = MIN(255u, (p[c] * 255u + p[3] / 2) / p[3]);
+        }
+    }
+}
+
+// }}}
+
+static void
+fit_image(unsigned int width, unsigned int height, double pwidth, double pheight, unsigned int *ans_width, unsigned int *ans_height) {
+    // Same as fit_image() in kitty/utils.py
+    double w = width, h = height;
+    if (h > pheight) { w = floor(pheight / h * w); h = pheight; }
+    if (w > pwidth) { h = floor(pwidth / w * h); w = pwidth; }
+    if (h > pheight) { w = floor(pheight / h * w); h = pheight; }
+    *ans_width = MAX(1u, (unsigned int)w); *ans_height = MAX(1u, (unsigned int)h);
+}
+
+static void
+size_for_display(unsigned int width, unsigned int height, double available_width, double available_height, bool scale_up, unsigned int *ans_width, unsigned int *ans_height) {
+    // Same as the sizes used by convert() in kittens/tui/images.py
+    *ans_width = width; *ans_height = height;
+    if (!available_height) available_height = 10. * height;
+    bool scaled = false;
+    double w = width, h = height;
+    if (scale_up && width < available_width) {
+        h = floor(h * (available_width / w)); w = available_width;
+        scaled = true;
+    }
+    if (scaled || w > available_width || h > available_height) fit_image((unsigned int)w, (unsigned int)h, available_width, available_height, ans_width, ans_height);
+}
+
+static inline bool
+is_jpeg(const uint8_t *buf, size_t sz) {
+    return sz > 3 && buf[0] == 0xff && buf[1] == 0xd8 && buf[2] == 0xff;
+}
+
+static inline bool
+is_png(const uint8_t *buf, size_t sz) {
+    return sz > 8 && memcmp(buf, "\x89PNG\r\n\x1a\n", 8) == 0;
+}
+
+static inline uint32_t
+be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static bool
+png_size(const uint8_t *buf, size_t sz, unsigned int *width, unsigned int *height) {
+    // The IHDR chunk must come first, right after the signature
+    if (sz < 24 || memcmp(buf + 12, "IHDR", 4) != 0) return false;
+    *width = be32(buf + 16); *height = be32(buf + 20);
+    return *width && *height;
+}
+
+static LoadResult
+read_file(const char *path, uint8_t **ans, size_t *ans_sz) {
+    // The file is read rather than mmapped, as it may be truncated while it
+    // is decoded, for example, in a directory that is being written to. The
+    // size of the file is only used as a hint, it is read until EOF.
+    int fd;
+    while ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 && errno == EINTR);
+    if (fd == -1) return LOAD_OS_ERROR;
+    struct stat s;
+    size_t capacity = fstat(fd, &s) == 0 && s.st_size > 0 ? (size_t)s.st_size + 1 : 64 * 1024, sz = 0;
+    uint8_t *buf = malloc(capacity);
+    while (buf) {
+        if (sz == capacity) {
+            uint8_t *nbuf = realloc(buf, 2 * capacity);
+            if (!nbuf) { free(buf); buf = NULL; break; }
+            buf = nbuf; capacity *= 2;
+        }
+        ssize_t n = read(fd, buf + sz, capacity - sz);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            int saved_errno = errno;
+            free(buf); close(fd);
+            errno = saved_errno;
+            return LOAD_OS_ERROR;
+        }
+        if (!n) break;
+        sz += n;
+    }
+    close(fd);
+    if (!buf) { set_load_error("ENOMEM", "Out of memory reading the file"); return LOAD_FAILED; }
+    if (!sz) { free(buf); set_load_error("EINVAL", "The file is empty"); return LOAD_FAILED; }
+    *ans = buf; *ans_sz = sz;
+    return LOAD_OK;
+}
+
+static LoadResult
+load_and_scale(const char *path, double available_width, double available_height, bool scale_up, Pixels *img) {
+    uint8_t *buf;
+    size_t sz;
+    LoadResult ret = read_file(path, &buf, &sz);
+    if (ret != LOAD_OK) return ret;
+    ret = LOAD_UNSUPPORTED;
+    if (is_png(buf, sz)) {
+        // A PNG that needs no resampling is sent to the terminal as is
+        unsigned int width, height;
+        if (png_size(buf, sz, &img->width, &img->height)) {
+            size_for_display(img->width, img->height, available_width, available_height, scale_up, &width, &height);
+            if (width == img->width && height == img->height) { free(buf); return LOAD_UNSCALED_PNG; }
+        }
+        ret = decode_png(buf, sz, img);
+    }
+#ifdef HAS_LIBJPEG
+    else if (is_jpeg(buf, sz)) {
+        // Only the dimensions are needed to find the target size
+        struct jpeg_decompress_struct cinfo;
+        struct jpeg_error_handler eh;
+        cinfo.err = jpeg_std_error(&eh.pub);
+        eh.pub.error_exit = jpeg_error_exit;
+        eh.pub.output_message = jpeg_output_message;
+        unsigned int target_width = 0, target_height = 0;
+        if (!setjmp(eh.jb)) {
+            jpeg_create_decompress(&cinfo);
+            jpeg_mem_src(&cinfo, (unsigned char*)buf, sz);
+            jpeg_read_header(&cinfo, TRUE);
+            size_for_display(cinfo.image_width, cinfo.image_height, available_width, available_height, scale_up, &target_width, &target_height);
+        }
+        jpeg_destroy_decompress(&cinfo);
+        ret = decode_jpeg(buf, sz, target_width, target_height, img);
+    }
+#else
+    (void)is_jpeg;
+#endif
+    free(buf);
+    if (ret != LOAD_OK) return ret;
+    unsigned int width, height;
+    size_for_display(img->width, img->height, available_width, available_height, scale_up, &width, &height);
+    if (img->channels == 4 && is_opaque(img)) drop_alpha(img);
+    if (width != img->width || height != img->height) {
+        if (img->channels == 4) premultiply(img);
+        if (!scale_pixels(img, width, height)) return LOAD_FAILED;
+        if (img->channels == 4) unpremultiply(img);
+    }
+    return LOAD_OK;
+}
+
+static PyObject*
+load_image(PyObject *self UNUSED, PyObject *args) {
+    // Return the pixels of the image scaled to fit into the available area
+    // as (data, width, height, format), or None if it is not in a format that
+    // can be decoded here. A PNG image that needs no scaling is not decoded,
+    // for it data is None and format is 100, so that the file can be sent
+    // to the terminal directly. An available_height of zero means ten times the
+    // image height, as for icat.
+    const char *path;
+    double available_width, available_height;
+    int scale_up;
+    if (!PyArg_ParseTuple(args, "sddp", &path, &available_width, &available_height, &scale_up)) return NULL;
+    Pixels img = {0};
+    LoadResult ret;
+    Py_BEGIN_ALLOW_THREADS;
+    ret = load_and_scale(path, MAX(1., available_width), MAX(0., available_height), scale_up, &img);
+    Py_END_ALLOW_THREADS;
+    PyObject *ans = NULL;
+    switch(ret) {
+        case LOAD_OK:
+            ans = Py_BuildValue("y#IIi", img.data, (Py_ssize_t)img.width * img.height * img.channels, img.width, img.height, img.channels == 3 ? 24 : 32);
+            break;
+        case LOAD_UNSCALED_PNG:
+            ans = Py_BuildValue("OIIi", Py_None, img.width, img.height, 100);
+            break;
+        case LOAD_UNSUPPORTED:
+            ans = Py_None; Py_INCREF(ans);
+            break;
+        case LOAD_OS_ERROR:
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            break;
+        case LOAD_FAILED:
+            PyErr_SetString(PyExc_ValueError, load_error);
+            break;
+    }
+    free(img.data);
+    return ans;
+}
+
+static PyMethodDef module_methods[] = {
+    METHODB(load_image, METH_VARARGS),
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+bool
+init_image_loader(PyObject *module) {
+    if (PyModule_AddFunctions(module, module_methods) != 0) return false;
+    return true;
+}
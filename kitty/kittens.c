@@ -6,6 +6,7 @@
  */
 
 #include "data-types.h"
+#include "unicode-data.h"
 
 #define CMD_BUF_SZ 2048
 
@@ -194,9 +195,213 @@ parse_input_from_terminal(PyObject *self UNUSED, PyObject *args) {
 #undef CALL
 }
 
+// Hints {{{
+
+// Native versions of the url, path and hash patterns of the hints kitten,
+// together with their post processors. They must give the same results as the
+// regular expressions and post processors in kittens/hints/main.py, which
+// are still used for other types of matches.
+
+typedef struct {
+    int kind;
+    void *data;
+    Py_ssize_t len;
+} HintText;
+
+#define R(i) PyUnicode_READ(t->kind, t->data, i)
+
+static inline bool
+is_url_delimiter(char_type ch) {
+    // Newlines join the lines a URL has been wrapped over
+    return ch != '\n' && !is_url_char(ch);
+}
+
+static inline char_type
+closing_bracket(char_type ch) {
+    switch(ch) {
+        case '(': return ')';
+        case '[': return ']';
+        case '{': return '}';
+        case '<': return '>';
+        case '*': case '"': case '\'': return ch;
+        default: return 0;
+    }
+}
+
+static inline bool
+is_trailing_punctuation(char_type ch) {
+    return ch == '.' || ch == ',' || ch == '?' || ch == '!';
+}
+
+static inline bool
+text_matches(HintText *t, Py_ssize_t at, const char *q) {
+    for (Py_ssize_t i = 0; q[i]; i++) {
+        if (at + i >= t->len || R(at + i) != (unsigned char)q[i]) return false;
+    }
+    return true;
+}
+
+static inline bool
+add_hint_match(PyObject *ans, Py_ssize_t s, Py_ssize_t e) {
+    PyObject *m = Py_BuildValue("nn", s, e);
+    if (!m) return false;
+    int ret = PyList_Append(ans, m);
+    Py_DECREF(m);
+    return ret == 0;
+}
+
+static inline void
+strip_trailing_nulls(HintText *t, Py_ssize_t s, Py_ssize_t *e) {
+    while (*e > s + 1 && R(*e - 1) == 0) (*e)--;
+}
+
+static inline void
+postprocess_url(HintText *t, Py_ssize_t s, Py_ssize_t *e) {
+    if (s > 4 && text_matches(t, s - 5, "link:")) {  // asciidoc URLs
+        for (Py_ssize_t i = *e - 1; i >= s; i--) {
+            if (R(i) == '[') { *e = i; break; }
+        }
+    }
+    while (*e > 1 && is_trailing_punctuation(R(*e - 1))) (*e)--;  // remove trailing punctuation
+    // truncate url at closing bracket/quote
+    char_type q;
+    if (s > 0 && *e <= t->len && (q = closing_bracket(R(s - 1)))) {
+        for (Py_ssize_t i = s; i < t->len; i++) {
+            if (R(i) == q) { if (i > s) *e = i; break; }
+        }
+    }
+    // Restructured Text URLs
+    if (*e > 3 && R(*e - 2) == '`' && R(*e - 1) == '_') *e -= 2;
+}
+
+static inline void
+postprocess_brackets_and_quotes(HintText *t, Py_ssize_t *s, Py_ssize_t *e) {
+    // Remove matching brackets and then matching quotes
+    char_type before;
+    if (*e > *s) {
+        before = R(*s);
+        if ((before == '(' || before == '{' || before == '[' || before == '<') && R(*e - 1) == closing_bracket(before)) { (*s)++; (*e)--; }
+    }
+    if (*e > *s) {
+        before = R(*s);
+        if ((before == '"' || before == '\'') && R(*e - 1) == before) { (*s)++; (*e)--; }
+    }
+}
+
+static bool
+find_urls(HintText *t, PyObject *prefixes, Py_ssize_t minimum_match_length, PyObject *ans) {
+    // The prefixes contain no : or /, so every match starts at the longest
+    // prefix before the first :// that is followed by at least three URL
+    // characters
+    Py_ssize_t cur = 0;
+    for (Py_ssize_t i = 0; i + 2 < t->len; i++) {
+        if (R(i) != ':' || R(i + 1) != '/' || R(i + 2) != '/') continue;
+        Py_ssize_t s = -1, e = i + 3;
+        for (Py_ssize_t p = 0; p < PyTuple_GET_SIZE(prefixes); p++) {
+            PyObject *prefix = PyTuple_GET_ITEM(prefixes, p);
+            Py_ssize_t plen = PyUnicode_GET_LENGTH(prefix), start = i - plen, c;
+            if (start < cur || (s > -1 && start >= s)) continue;
+            for (c = 0; c < plen && R(start + c) == PyUnicode_READ(PyUnicode_KIND(prefix), PyUnicode_DATA(prefix), c); c++);
+            if (c == plen) s = start;
+        }
+        if (s < 0) continue;
+        while (e < t->len && !is_url_delimiter(R(e))) e++;
+        if (e - i - 3 < 3) continue;
+        cur = e; i = e - 1;
+        strip_trailing_nulls(t, s, &e);
+        if (e - s < minimum_match_length) continue;
+        postprocess_url(t, s, &e);
+        if (!add_hint_match(ans, s, e)) return false;
+    }
+    return true;
+}
+
+static inline bool
+is_ascii_alnum(char_type ch) {
+    return ('0' <= ch && ch <= '9') || ('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z');
+}
+
+static bool
+find_paths(HintText *t, Py_ssize_t minimum_match_length, PyObject *ans) {
+    // (?:\S*/\S+)|(?:\S+[.][a-zA-Z0-9]{2,7})
+    Py_ssize_t cur = 0;
+    while (cur < t->len) {
+        Py_ssize_t s = cur, r, e = -1;
+        while (s < t->len && Py_UNICODE_ISSPACE(R(s))) s++;
+        for (r = s; r < t->len && !Py_UNICODE_ISSPACE(R(r)); r++);
+        if (s >= r) break;
+        // a slash that is not the last character of the run of non-space characters
+        for (Py_ssize_t q = s; q < r - 1; q++) {
+            if (R(q) == '/') { e = r; break; }
+        }
+        // else the last extension that is preceded by at least one character
+        for (Py_ssize_t q = r - 3; e < 0 && q > s; q--) {
+            if (R(q) == '.') {
+                Py_ssize_t n = 0;
+                while (n < 7 && q + 1 + n < r && is_ascii_alnum(R(q + 1 + n))) n++;
+                if (n >= 2) e = q + 1 + n;
+            }
+        }
+        if (e < 0) { cur = r; continue; }
+        cur = e;
+        strip_trailing_nulls(t, s, &e);
+        if (e - s < minimum_match_length) continue;
+        postprocess_brackets_and_quotes(t, &s, &e);
+        if (!add_hint_match(ans, s, e)) return false;
+    }
+    return true;
+}
+
+static bool
+find_hashes(HintText *t, Py_ssize_t minimum_match_length, PyObject *ans) {
+    // [0-9a-f]{7,128}
+    Py_ssize_t cur = 0;
+    while (cur < t->len) {
+        Py_ssize_t s = cur, e;
+        char_type ch;
+#define is_hex(ch) (('0' <= (ch) && (ch) <= '9') || ('a' <= (ch) && (ch) <= 'f'))
+        while (s < t->len && (ch = R(s), !is_hex(ch))) s++;
+        for (e = s; e < t->len && e - s < 128 && (ch = R(e), is_hex(ch)); e++);
+#undef is_hex
+        if (s >= t->len) break;
+        cur = e;
+        if (e - s < 7 || e - s < minimum_match_length) continue;
+        if (!add_hint_match(ans, s, e)) return false;
+    }
+    return true;
+}
+
+#undef R
+
+static PyObject*
+find_hint_matches(PyObject *self UNUSED, PyObject *args) {
+    PyObject *text, *url_prefixes;
+    const char *type;
+    Py_ssize_t minimum_match_length;
+    if (!PyArg_ParseTuple(args, "UsnO!", &text, &type, &minimum_match_length, &PyTuple_Type, &url_prefixes)) return NULL;
+    if (PyUnicode_READY(text) != 0) return NULL;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(url_prefixes); i++) {
+        PyObject *p = PyTuple_GET_ITEM(url_prefixes, i);
+        if (!PyUnicode_Check(p) || PyUnicode_READY(p) != 0) { PyErr_SetString(PyExc_TypeError, "URL prefixes must be strings"); return NULL; }
+    }
+    HintText t = {.kind = PyUnicode_KIND(text), .data = PyUnicode_DATA(text), .len = PyUnicode_GET_LENGTH(text)};
+    PyObject *ans = PyList_New(0);
+    if (!ans) return NULL;
+    bool ok;
+    if (strcmp(type, "url") == 0) ok = find_urls(&t, url_prefixes, minimum_match_length, ans);
+    else if (strcmp(type, "path") == 0) ok = find_paths(&t, minimum_match_length, ans);
+    else if (strcmp(type, "hash") == 0) ok = find_hashes(&t, minimum_match_length, ans);
+    else { PyErr_Format(PyExc_ValueError, "Unknown type of hint: %s", type); ok = false; }
+    if (!ok) { Py_CLEAR(ans); }
+    return ans;
+}
+
+// }}}
+
 static PyMethodDef module_methods[] = {
     METHODB(parse_input_from_terminal, METH_VARARGS),
     METHODB(read_command_response, METH_VARARGS),
+    METHODB(find_hint_matches, METH_VARARGS),
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
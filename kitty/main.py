@@ -13,13 +13,13 @@ from .child import set_default_env
 from .cli import create_opts, parse_args
 from .config import cached_values_for, initial_window_size_func
 from .constants import (
-    appname, beam_cursor_data_file, config_dir, glfw_path, is_macos,
-    is_wayland, kitty_exe, logo_data_file
+    appname, beam_cursor_data_file, cache_dir, config_dir, glfw_path,
+    is_macos, is_wayland, kitty_exe, logo_data_file
 )
 from .fast_data_types import (
     GLFW_IBEAM_CURSOR, GLFW_MOD_SUPER, create_os_window, free_font_data,
     glfw_init, glfw_terminate, load_png_data, set_custom_cursor,
-    set_default_window_icon, set_options
+    set_default_window_icon, set_glyph_cache_dir, set_options
 )
 from .fonts.box_drawing import set_scale
 from .fonts.render import set_font_family
@@ -138,10 +138,26 @@ def _run_app(opts, args):
             boss.destroy()
 
 
+def glyph_cache_dir():
+    ans = os.path.join(cache_dir(), 'glyphs')
+    try:
+        os.makedirs(ans, exist_ok=True)
+    except EnvironmentError as err:
+        log_error('Failed to create glyph cache directory with error: {}'.format(err))
+        return
+    return ans
+
+
 def run_app(opts, args):
     set_scale(opts.box_drawing_scale)
+    set_glyph_cache_dir(glyph_cache_dir() if opts.disk_cache_glyphs else None)
     set_options(opts, is_wayland, args.debug_gl, args.debug_font_fallback)
     set_font_family(opts, debug_font_matching=args.debug_font_fallback)
+    if not is_macos:
+        from .fast_data_types import set_fallback_font_cache
+        from .fonts import render
+        from .fonts.fontconfig import fallback_font_cache_fingerprint
+        set_fallback_font_cache(os.path.join(cache_dir(), 'fallback-fonts'), fallback_font_cache_fingerprint(render.current_faces))
     try:
         _run_app(opts, args)
     finally:
@@ -13,7 +13,8 @@ static inline void parse_graphics_code(Screen *screen,
   bool is_negative;
   memset(&g, 0, sizeof(g));
   size_t sz;
-  static uint8_t payload[4096];
+  static uint8_t payload_buf[4096];
+  uint8_t *payload = payload_buf;
 
   enum KEYS {
     action = 'a',
@@ -130,7 +131,7 @@ static inline void parse_graphics_code(Screen *screen,
       case action: {
         g.action = screen->parser_buf[pos++] & 0xff;
         if (g.action != 'q' && g.action != 'd' && g.action != 't' &&
-            g.action != 'T' && g.action != 'p') {
+            g.action != 'T' && g.action != 'p' && g.action != 'f') {
           REPORT_ERROR("Malformed GraphicsCommand control block, unknown flag "
                        "value for action: 0x%x",
                        g.action);
@@ -269,8 +270,18 @@ static inline void parse_graphics_code(Screen *screen,
 
     case PAYLOAD: {
       sz = screen->parser_buf_pos - pos;
+      size_t payload_capacity = sizeof(payload_buf);
+
+      if ((sz / 4) * 3 <= sizeof(payload_buf)) {
+        uint8_t *dest = screen_graphics_payload_buffer(screen, &g, (sz / 4) * 3);
+        if (dest != NULL) {
+          payload = dest;
+          payload_capacity = (sz / 4) * 3;
+        }
+      }
+
       const char *err = base64_decode(screen->parser_buf + pos, sz, payload,
-                                      sizeof(payload), &g.payload_sz);
+                                      payload_capacity, &g.payload_sz);
       if (err != NULL) {
         REPORT_ERROR(
             "Failed to parse GraphicsCommand command payload with error: %s",
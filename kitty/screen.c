@@ -549,11 +549,32 @@ write_escape_code_to_child(Screen *self, unsigned char which, const char *data)
     }
 }
 
+bool
+screen_handle_decoded_images(Screen *self) {
+    // Upload images that have finished decoding in the background and send
+    // the responses that were waiting on them
+    bool was_dirty = self->is_dirty;
+    GraphicsManager *grmans[2] = {self->main_grman, self->alt_grman};
+    for (size_t i = 0; i < arraysz(grmans); i++) {
+        GraphicsManager *g = grmans[i];
+        if (!g->num_decoding && !g->num_responses) continue;
+        grman_handle_decoded_images(g, &self->is_dirty);
+        const char *response;
+        while ((response = grman_pop_response(g)) != NULL) write_escape_code_to_child(self, APC, response);
+    }
+    return self->is_dirty && !was_dirty;
+}
+
 static inline bool
 cursor_within_margins(Screen *self) {
     return self->margin_top <= self->cursor->y && self->cursor->y <= self->margin_bottom;
 }
 
+uint8_t*
+screen_graphics_payload_buffer(Screen *self, const GraphicsCommand *cmd, size_t sz) {
+    return grman_payload_buffer(self->grman, cmd, sz);
+}
+
 void
 screen_handle_graphics_command(Screen *self, const GraphicsCommand *cmd, const uint8_t *payload) {
     unsigned int x = self->cursor->x, y = self->cursor->y;
@@ -1876,6 +1897,7 @@ WRAP1E(cursor_back, 1, -1)
 WRAP1B(erase_in_line, 0)
 WRAP1B(erase_in_display, 0)
 WRAP0(scroll_until_cursor)
+WRAP0(handle_decoded_images)
 
 #define MODE_GETSET(name, uname) \
     static PyObject* name##_get(Screen *self, void UNUSED *closure) { PyObject *ans = self->modes.m##uname ? Py_True : Py_False; Py_INCREF(ans); return ans; } \
@@ -2190,6 +2212,7 @@ static PyMethodDef methods[] = {
     MND(erase_in_line, METH_VARARGS)
     MND(erase_in_display, METH_VARARGS)
     MND(scroll_until_cursor, METH_NOARGS)
+    MND(handle_decoded_images, METH_NOARGS)
     METHOD(current_char_width, METH_NOARGS)
     MND(insert_lines, METH_VARARGS)
     MND(delete_lines, METH_VARARGS)
@@ -8,7 +8,7 @@
 #include "fonts.h"
 #include "gl.h"
 
-enum { CELL_PROGRAM, CELL_BG_PROGRAM, CELL_SPECIAL_PROGRAM, CELL_FG_PROGRAM, BORDERS_PROGRAM, GRAPHICS_PROGRAM, GRAPHICS_PREMULT_PROGRAM, GRAPHICS_ALPHA_MASK_PROGRAM, BLIT_PROGRAM, NUM_PROGRAMS };
+enum { CELL_PROGRAM, CELL_BG_PROGRAM, CELL_SPECIAL_PROGRAM, CELL_FG_PROGRAM, BORDERS_PROGRAM, GRAPHICS_PROGRAM, GRAPHICS_PREMULT_PROGRAM, GRAPHICS_ALPHA_MASK_PROGRAM, GRAPHICS_ATLAS_PROGRAM, GRAPHICS_ATLAS_PREMULT_PROGRAM, BLIT_PROGRAM, NUM_PROGRAMS };
 enum { SPRITE_MAP_UNIT, GRAPHICS_UNIT, BLIT_UNIT };
 
 // Sprites {{{
@@ -143,6 +143,168 @@ send_image_to_gpu(GLuint *tex_id, const void* data, GLsizei width, GLsizei heigh
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, is_opaque ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, data);
 }
 
+void
+send_image_region_to_gpu(GLuint tex_id, GLint x, GLint y, const void* data, GLsizei width, GLsizei height, bool is_opaque, bool is_4byte_aligned) {
+    // Replace a region of an existing texture, without reallocating it
+    glBindTexture(GL_TEXTURE_2D, tex_id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, is_4byte_aligned ? 4 : 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, is_opaque ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, data);
+}
+
+void*
+send_image_to_gpu_async(GLuint *tex_id, const void* data, GLsizei width, GLsizei height, bool is_opaque, bool is_4byte_aligned) {
+    // Copy the data into a pixel buffer object, so that the transfer into the
+    // texture happens asynchronously. Returns a fence that is signalled once
+    // the transfer is complete, or NULL if the data was uploaded synchronously.
+    size_t sz = (size_t)width * height * (is_opaque ? 3 : 4);
+    GLuint pbo;
+    glGenBuffers(1, &pbo);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, sz, NULL, GL_STREAM_DRAW);
+    void *dest = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, sz, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    GLsync fence = NULL;
+    if (dest) {
+        memcpy(dest, data, sz);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        // With a pixel buffer object bound, the data pointer is an offset into it
+        send_image_to_gpu(tex_id, NULL, width, height, is_opaque, is_4byte_aligned);
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    // The storage of the buffer is released once the transfer is complete
+    glDeleteBuffers(1, &pbo);
+    if (!dest) send_image_to_gpu(tex_id, data, width, height, is_opaque, is_4byte_aligned);
+    return fence;
+}
+
+bool
+gpu_upload_finished(void *fence) {
+    GLenum ret = glClientWaitSync(fence, 0, 0);
+    if (ret == GL_TIMEOUT_EXPIRED) return false;
+    glDeleteSync(fence);
+    return true;
+}
+
+void
+free_gpu_fence(void *fence) {
+    glDeleteSync(fence);
+}
+
+static inline GLuint
+new_image_atlas(unsigned int slot_size, unsigned int num_layers) {
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA8, slot_size, slot_size, num_layers);
+    return tex;
+}
+
+unsigned int
+realloc_image_atlas(GLuint *tex_id, unsigned int slot_size, unsigned int num_layers, unsigned int new_num_layers) {
+    // Returns the number of layers in the atlas, which is num_layers if it cannot grow any further
+    new_num_layers = MIN(new_num_layers, (unsigned int)max_array_texture_layers);
+    if (new_num_layers <= num_layers) return num_layers;
+    GLuint tex = new_image_atlas(slot_size, new_num_layers);
+    if (*tex_id) {
+        copy_image_sub_data(*tex_id, tex, slot_size, slot_size, num_layers);
+        glDeleteTextures(1, tex_id);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    *tex_id = tex;
+    return new_num_layers;
+}
+
+void
+send_image_to_atlas(GLuint tex_id, unsigned int layer, GLint x, GLint y, const void* data, GLsizei width, GLsizei height, bool is_opaque, bool is_4byte_aligned) {
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tex_id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, is_4byte_aligned ? 4 : 1);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x, y, layer, width, height, 1, is_opaque ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, data);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+void
+download_image_from_atlas(GLuint tex_id, unsigned int layer, void *data, GLsizei width, GLsizei height, bool is_opaque) {
+    // A single layer of a texture array can only be read via a framebuffer
+    GLuint fbo;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex_id, 0, layer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, is_opaque ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, data);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+}
+
+static inline void
+copy_image_layer(GLuint src_texture_id, unsigned int src_layer, GLuint dest_texture_id, unsigned int dest_layer, unsigned int slot_size) {
+    if (!GLAD_GL_ARB_copy_image) {
+        pixel *buf = malloc((size_t)slot_size * slot_size * sizeof(pixel));
+        if (buf == NULL) { fatal("Out of memory."); }
+        download_image_from_atlas(src_texture_id, src_layer, buf, slot_size, slot_size, false);
+        send_image_to_atlas(dest_texture_id, dest_layer, 0, 0, buf, slot_size, slot_size, false, true);
+        free(buf);
+    } else {
+        glCopyImageSubData(src_texture_id, GL_TEXTURE_2D_ARRAY, 0, 0, 0, src_layer, dest_texture_id, GL_TEXTURE_2D_ARRAY, 0, 0, 0, dest_layer, slot_size, slot_size, 1);
+    }
+}
+
+void
+compact_image_atlas(GLuint *tex_id, unsigned int slot_size, unsigned int new_num_layers, const uint32_t *layers, unsigned int count) {
+    // Replace the atlas with one of new_num_layers layers, whose first count layers are the ones listed in layers
+    GLuint tex = new_image_atlas(slot_size, new_num_layers);
+    for (unsigned int i = 0; i < count; i++) copy_image_layer(*tex_id, layers[i], tex, i, slot_size);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glDeleteTextures(1, tex_id);
+    *tex_id = tex;
+}
+
+void
+download_image_from_gpu(GLuint tex_id, void *data, bool is_opaque) {
+    glBindTexture(GL_TEXTURE_2D, tex_id);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, 0, is_opaque ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, data);
+}
+
+void*
+download_image_from_gpu_async(GLuint tex_id, GLuint *pbo, bool is_opaque, size_t sz) {
+    // Read the texture into a pixel buffer object, so that the transfer
+    // happens asynchronously. Returns a fence that is signalled once the
+    // transfer is complete, the pixels are then copied by finish_image_download()
+    glGenBuffers(1, pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, *pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, sz, NULL, GL_STREAM_READ);
+    glBindTexture(GL_TEXTURE_2D, tex_id);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    // With a pixel buffer object bound, the data pointer is an offset into it
+    glGetTexImage(GL_TEXTURE_2D, 0, is_opaque ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    return fence;
+}
+
+bool
+finish_image_download(GLuint *pbo, void *data, size_t sz) {
+    // Copy the pixels read by download_image_from_gpu_async() into data, unless it is NULL, and free the buffer
+    bool ok = true;
+    if (data) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, *pbo);
+        const void *src = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sz, GL_MAP_READ_BIT);
+        if (src) {
+            memcpy(data, src, sz);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        } else ok = false;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    glDeleteBuffers(1, pbo); *pbo = 0;
+    return ok;
+}
+
 // }}}
 
 // Cell {{{
@@ -200,18 +362,32 @@ create_cell_vao() {
 #undef A1
 }
 
+// Every image is an instance, with its source and destination rects and its atlas layer
+#define GRAPHICS_INSTANCE_SIZE 9
+
+static inline void
+point_graphics_attributes(ssize_t gvao_idx, size_t first) {
+    // Point the per instance attributes at the image first, since
+    // glDrawArraysInstancedBaseInstance is not available on macOS
+    const GLsizei stride = sizeof(GLfloat) * GRAPHICS_INSTANCE_SIZE;
+    uintptr_t offset = first * stride;
+    add_located_attribute_to_vao(gvao_idx, 0, 4, GL_FLOAT, stride, (void*)offset, 1);
+    add_located_attribute_to_vao(gvao_idx, 1, 4, GL_FLOAT, stride, (void*)(offset + 4 * sizeof(GLfloat)), 1);
+    add_located_attribute_to_vao(gvao_idx, 2, 1, GL_FLOAT, stride, (void*)(offset + 8 * sizeof(GLfloat)), 1);
+}
+
 ssize_t
 create_graphics_vao() {
     ssize_t vao_idx = create_vao();
     add_buffer_to_vao(vao_idx, GL_ARRAY_BUFFER);
-    add_attribute_to_vao(GRAPHICS_PROGRAM, vao_idx, "src", 4, GL_FLOAT, 0, NULL, 0);
+    point_graphics_attributes(vao_idx, 0);
     return vao_idx;
 }
 
 struct CellUniformData {
     bool constants_set;
     bool alpha_mask_fg_set;
-    GLint gploc, gpploc, cploc, cfploc, fg_loc;
+    GLint gploc, gpploc, gaploc, gapploc, cploc, cfploc, fg_loc;
     GLfloat prev_inactive_text_alpha;
 };
 
@@ -219,9 +395,15 @@ static struct CellUniformData cell_uniform_data = {0, .prev_inactive_text_alpha=
 
 static inline void
 send_graphics_data_to_gpu(size_t image_count, ssize_t gvao_idx, const ImageRenderData *render_data) {
-    size_t sz = sizeof(GLfloat) * 16 * image_count;
+    size_t sz = sizeof(GLfloat) * GRAPHICS_INSTANCE_SIZE * image_count;
     GLfloat *a = alloc_and_map_vao_buffer(gvao_idx, sz, 0, GL_STREAM_DRAW, GL_WRITE_ONLY);
-    for (size_t i = 0; i < image_count; i++, a += 16) memcpy(a, render_data[i].vertices, sizeof(render_data[0].vertices));
+    for (size_t i = 0; i < image_count; i++, a += GRAPHICS_INSTANCE_SIZE) {
+        // The vertices are the right top, right bottom, left bottom and left top corners
+        const GLfloat *v = render_data[i].vertices;
+        a[0] = v[8]; a[1] = v[1]; a[2] = v[0]; a[3] = v[5];
+        a[4] = v[10]; a[5] = v[3]; a[6] = v[2]; a[7] = v[7];
+        a[8] = render_data[i].layer;
+    }
     unmap_vao_buffer(gvao_idx, 0); a = NULL;
 }
 
@@ -320,24 +502,31 @@ cell_prepare_to_render(ssize_t vao_idx, ssize_t gvao_idx, Screen *screen, GLfloa
         send_graphics_data_to_gpu(screen->grman->count, gvao_idx, screen->grman->render_data);
         changed = true;
     }
+    if (gvao_idx) grman_mark_visible(screen->grman);
     return changed;
 }
 
 static void
 draw_graphics(int program, ssize_t vao_idx, ssize_t gvao_idx, ImageRenderData *data, GLuint start, GLuint count) {
-    bind_program(program);
+    int atlas_program = program == GRAPHICS_PREMULT_PROGRAM ? GRAPHICS_ATLAS_PREMULT_PROGRAM : GRAPHICS_ATLAS_PROGRAM;
     bind_vertex_array(gvao_idx);
     glActiveTexture(GL_TEXTURE0 + GRAPHICS_UNIT);
 
-    GLuint base = 4 * start;
     glEnable(GL_SCISSOR_TEST);
     for (GLuint i=0; i < count;) {
         ImageRenderData *rd = data + start + i;
-        glBindTexture(GL_TEXTURE_2D, rd->texture_id);
-        // You could reduce the number of draw calls by using
-        // glDrawArraysInstancedBaseInstance but Apple chose to abandon OpenGL
-        // before implementing it.
-        for (GLuint k=0; k < rd->group_count; k++, base += 4, i++) glDrawArrays(GL_TRIANGLE_FAN, base, 4);
+        // All the images in an atlas, or all the refs to an image, are drawn in one call
+        GLuint n = grman_batch_size(rd, count - i);
+        if (rd->atlas) {
+            bind_program(atlas_program);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, image_atlas_texture_id(rd->atlas));
+        } else {
+            bind_program(program);
+            glBindTexture(GL_TEXTURE_2D, rd->texture_id);
+        }
+        point_graphics_attributes(gvao_idx, start + i);
+        glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, 4, n);
+        i += n;
     }
     glDisable(GL_SCISSOR_TEST);
     bind_vertex_array(vao_idx);
@@ -457,11 +646,15 @@ set_cell_uniforms(float current_inactive_text_alpha) {
     if (!cell_uniform_data.constants_set) {
         cell_uniform_data.gploc = glGetUniformLocation(program_id(GRAPHICS_PROGRAM), "inactive_text_alpha");
         cell_uniform_data.gpploc = glGetUniformLocation(program_id(GRAPHICS_PREMULT_PROGRAM), "inactive_text_alpha");
+        cell_uniform_data.gaploc = glGetUniformLocation(program_id(GRAPHICS_ATLAS_PROGRAM), "inactive_text_alpha");
+        cell_uniform_data.gapploc = glGetUniformLocation(program_id(GRAPHICS_ATLAS_PREMULT_PROGRAM), "inactive_text_alpha");
         cell_uniform_data.cploc = glGetUniformLocation(program_id(CELL_PROGRAM), "inactive_text_alpha");
         cell_uniform_data.cfploc = glGetUniformLocation(program_id(CELL_FG_PROGRAM), "inactive_text_alpha");
 #define S(prog, name, val, type) { bind_program(prog); glUniform##type(glGetUniformLocation(program_id(prog), #name), val); }
         S(GRAPHICS_PROGRAM, image, GRAPHICS_UNIT, 1i);
         S(GRAPHICS_PREMULT_PROGRAM, image, GRAPHICS_UNIT, 1i);
+        S(GRAPHICS_ATLAS_PROGRAM, image, GRAPHICS_UNIT, 1i);
+        S(GRAPHICS_ATLAS_PREMULT_PROGRAM, image, GRAPHICS_UNIT, 1i);
         S(CELL_PROGRAM, sprites, SPRITE_MAP_UNIT, 1i); S(CELL_FG_PROGRAM, sprites, SPRITE_MAP_UNIT, 1i);
         S(CELL_PROGRAM, dim_opacity, OPT(dim_opacity), 1f); S(CELL_FG_PROGRAM, dim_opacity, OPT(dim_opacity), 1f);
 #undef S
@@ -471,6 +664,7 @@ set_cell_uniforms(float current_inactive_text_alpha) {
         cell_uniform_data.prev_inactive_text_alpha = current_inactive_text_alpha;
 #define S(prog, loc) { bind_program(prog); glUniform1f(cell_uniform_data.loc, current_inactive_text_alpha); }
         S(CELL_PROGRAM, cploc); S(CELL_FG_PROGRAM, cfploc); S(GRAPHICS_PROGRAM, gploc); S(GRAPHICS_PREMULT_PROGRAM, gpploc);
+        S(GRAPHICS_ATLAS_PROGRAM, gaploc); S(GRAPHICS_ATLAS_PREMULT_PROGRAM, gapploc);
 #undef S
     }
 }
@@ -679,7 +873,7 @@ static PyMethodDef module_methods[] = {
 bool
 init_shaders(PyObject *module) {
 #define C(x) if (PyModule_AddIntConstant(module, #x, x) != 0) { PyErr_NoMemory(); return false; }
-    C(CELL_PROGRAM); C(CELL_BG_PROGRAM); C(CELL_SPECIAL_PROGRAM); C(CELL_FG_PROGRAM); C(BORDERS_PROGRAM); C(GRAPHICS_PROGRAM); C(GRAPHICS_PREMULT_PROGRAM); C(GRAPHICS_ALPHA_MASK_PROGRAM); C(BLIT_PROGRAM);
+    C(CELL_PROGRAM); C(CELL_BG_PROGRAM); C(CELL_SPECIAL_PROGRAM); C(CELL_FG_PROGRAM); C(BORDERS_PROGRAM); C(GRAPHICS_PROGRAM); C(GRAPHICS_PREMULT_PROGRAM); C(GRAPHICS_ALPHA_MASK_PROGRAM); C(GRAPHICS_ATLAS_PROGRAM); C(GRAPHICS_ATLAS_PREMULT_PROGRAM); C(BLIT_PROGRAM);
     C(GLSL_VERSION);
     C(GL_VERSION);
     C(GL_VENDOR);
@@ -398,6 +398,8 @@ PYWRAP1(set_options) {
     S(repaint_delay, repaint_delay);
     S(input_delay, repaint_delay);
     S(sync_to_monitor, PyObject_IsTrue);
+    S(images_gpu_memory, PyLong_AsUnsignedLong);
+    S(images_gpu_memory_per_window, PyLong_AsUnsignedLong);
     S(close_on_child_death, PyObject_IsTrue);
     S(window_alert_on_bell, PyObject_IsTrue);
     S(macos_option_as_alt, PyLong_AsUnsignedLong);
@@ -38,6 +38,7 @@ typedef struct {
     unsigned long tab_bar_min_tabs;
     DisableLigature disable_ligatures;
     bool sync_to_monitor;
+    unsigned long images_gpu_memory, images_gpu_memory_per_window;
     bool close_on_child_death;
     bool window_alert_on_bell;
     bool debug_keyboard;
@@ -213,12 +214,24 @@ void draw_centered_alpha_mask(ssize_t gvao_idx, size_t screen_width, size_t scre
 void update_surface_size(int, int, uint32_t);
 void free_texture(uint32_t*);
 void send_image_to_gpu(uint32_t*, const void*, int32_t, int32_t, bool, bool);
+void download_image_from_gpu(uint32_t, void*, bool);
+void* download_image_from_gpu_async(uint32_t, uint32_t*, bool, size_t);
+bool finish_image_download(uint32_t*, void*, size_t);
+void* send_image_to_gpu_async(uint32_t*, const void*, int32_t, int32_t, bool, bool);
+bool gpu_upload_finished(void*);
+void free_gpu_fence(void*);
+unsigned int realloc_image_atlas(uint32_t*, unsigned int, unsigned int, unsigned int);
+void compact_image_atlas(uint32_t*, unsigned int, unsigned int, const uint32_t*, unsigned int);
+void send_image_to_atlas(uint32_t, unsigned int, int32_t, int32_t, const void*, int32_t, int32_t, bool, bool);
+void send_image_region_to_gpu(uint32_t, int32_t, int32_t, const void*, int32_t, int32_t, bool, bool);
+void download_image_from_atlas(uint32_t, unsigned int, void*, int32_t, int32_t, bool);
 void send_sprite_to_gpu(FONTS_DATA_HANDLE fg, unsigned int, unsigned int, unsigned int, pixel*);
 void blank_canvas(float);
 void blank_os_window(OSWindow *);
 void set_titlebar_color(OSWindow *w, color_type color);
 FONTS_DATA_HANDLE load_fonts_data(double, double, double);
 void send_prerendered_sprites_for_window(OSWindow *w);
+void upload_rendered_glyphs(FONTS_DATA_HANDLE);
 #ifdef __APPLE__
 void get_cocoa_key_equivalent(int, int, unsigned short*, int*);
 typedef enum {
@@ -17,7 +17,8 @@ from .constants import (
 from .fast_data_types import (
     BLIT_PROGRAM, CELL_BG_PROGRAM, CELL_FG_PROGRAM, CELL_PROGRAM,
     CELL_SPECIAL_PROGRAM, CSI, DCS, DECORATION, DIM,
-    GRAPHICS_ALPHA_MASK_PROGRAM, GRAPHICS_PREMULT_PROGRAM, GRAPHICS_PROGRAM,
+    GRAPHICS_ALPHA_MASK_PROGRAM, GRAPHICS_ATLAS_PREMULT_PROGRAM,
+    GRAPHICS_ATLAS_PROGRAM, GRAPHICS_PREMULT_PROGRAM, GRAPHICS_PROGRAM,
     OSC, REVERSE, SCROLL_FULL, SCROLL_LINE, SCROLL_PAGE, STRIKETHROUGH, Screen,
     add_window, cell_size_for_window, compile_program, get_clipboard_string,
     init_cell_program, set_clipboard_string, set_titlebar_color,
@@ -85,12 +86,14 @@ def load_shader_programs(semi_transparent=False):
             ff = ff.replace('#define USE_SELECTION_FG', '#define DONT_USE_SELECTION_FG')
         compile_program(p, vv, ff)
     v, f = load_shaders('graphics')
-    for which, p in {
-            'SIMPLE': GRAPHICS_PROGRAM,
-            'PREMULT': GRAPHICS_PREMULT_PROGRAM,
-            'ALPHA_MASK': GRAPHICS_ALPHA_MASK_PROGRAM,
+    for (which, texture_type), p in {
+            ('SIMPLE', 'TEXTURE'): GRAPHICS_PROGRAM,
+            ('PREMULT', 'TEXTURE'): GRAPHICS_PREMULT_PROGRAM,
+            ('ALPHA_MASK', 'TEXTURE'): GRAPHICS_ALPHA_MASK_PROGRAM,
+            ('SIMPLE', 'ATLAS'): GRAPHICS_ATLAS_PROGRAM,
+            ('PREMULT', 'ATLAS'): GRAPHICS_ATLAS_PREMULT_PROGRAM,
     }.items():
-        ff = f.replace('ALPHA_TYPE', which)
+        ff = f.replace('ALPHA_TYPE', which).replace('TEXTURE_TYPE', texture_type)
         compile_program(p, v, ff)
     init_cell_program()
 
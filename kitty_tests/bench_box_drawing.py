@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+# vim:fileencoding=utf-8
+# License: GPL v3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Measure the time to first paint a screen full of box drawing, block element
+# and braille characters, none of which have been rendered before, and compare
+# the cost of rasterizing them natively with the python implementation. Run
+# from the kitty source directory with:
+#   python3 -m kitty_tests.bench_box_drawing
+
+
+def box_heavy_lines(lines, columns):
+    from kitty.fonts.box_drawing import box_chars
+    chars = ''.join(box_chars) + ''.join(map(chr, range(0x2800, 0x2900)))
+    for i in range(lines):
+        start = (i * columns) % len(chars)
+        yield (chars[start:] + chars * (1 + columns // len(chars)))[:columns]
+
+
+def first_paint(family, size, dpi, lines, columns):
+    from time import monotonic
+    from kitty.fast_data_types import Screen, test_render_line
+    from kitty.fonts.render import setup_for_testing
+    with setup_for_testing(family, size, dpi) as (sprites, cell_width, cell_height):
+        s = Screen(None, lines, columns)
+        s.draw(''.join(box_heavy_lines(lines, columns)))
+        st = monotonic()
+        for i in range(lines):
+            test_render_line(s.line(i))
+        return monotonic() - st, cell_width, cell_height
+
+
+def rasterize(cell_width, cell_height, dpi, repeat):
+    from time import monotonic
+    from kitty.fast_data_types import render_box_glyph
+    from kitty.fonts.box_drawing import box_chars, render_box_char
+    st = monotonic()
+    for i in range(repeat):
+        for ch in box_chars:
+            render_box_glyph(ord(ch), cell_width, cell_height, dpi)
+    native = monotonic() - st
+    st = monotonic()
+    for i in range(repeat):
+        for ch in box_chars:
+            render_box_char(ch, bytearray(cell_width * cell_height), cell_width, cell_height, dpi)
+    return repeat * len(box_chars), native, monotonic() - st
+
+
+def main():
+    from argparse import ArgumentParser
+    parser = ArgumentParser(description='Benchmark rendering of box drawing characters')
+    parser.add_argument('--family', default='monospace', help='The font family to use')
+    parser.add_argument('--size', default=11.0, type=float, help='Font size in pts')
+    parser.add_argument('--dpi', default=96.0, type=float, help='The DPI to render at')
+    parser.add_argument('--lines', default=50, type=int, help='Number of lines on the screen')
+    parser.add_argument('--columns', default=200, type=int, help='Number of columns on the screen')
+    parser.add_argument('--repeat', default=10, type=int, help='Number of times to rasterize every character')
+    args = parser.parse_args()
+    elapsed, cell_width, cell_height = first_paint(args.family, args.size, args.dpi, args.lines, args.columns)
+    print('First paint of a {}x{} screen of box drawing characters: {:.2f} ms'.format(args.columns, args.lines, elapsed * 1000))
+    count, native, python = rasterize(cell_width, cell_height, args.dpi, args.repeat)
+    print('Rasterizing {} characters at {}x{}: native {:.2f} ms, python {:.2f} ms, {:.0f}x faster'.format(
+        count, cell_width, cell_height, native * 1000, python * 1000, python / max(native, 1e-9)))
+
+
+if __name__ == '__main__':
+    main()
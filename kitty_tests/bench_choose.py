@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+# vim:fileencoding=utf-8
+# License: GPL v3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Measure the wall time taken by the choose kitten to match a query against a
+# large corpus, such as the list of files in a big monorepo, for different
+# numbers of threads. By default a corpus of five million generated paths is
+# used, a real one can be given with --corpus, for example the output of git
+# ls-files. Also measure how many lines are rejected without being scored and
+# how much faster that makes matching, and the latency of every keystroke when
+# the query is typed and then erased one character at a time, matching from
+# scratch and with a Matcher. Run from the kitty source directory with:
+#   python3 -m kitty_tests.bench_choose
+
+
+def generated_corpus(count):
+    import random
+    rand = random.Random(1)
+    words = ['src', 'lib', 'test', 'core', 'util', 'render', 'client', 'server', 'proto', 'common',
+             'config', 'build', 'docs', 'internal', 'api', 'storage', 'index', 'query', 'cache', 'net']
+    exts = ['.c', '.h', '.py', '.go', '.js', '.rs', '.md', '.json']
+    lines = []
+    for i in range(count):
+        parts = [rand.choice(words) + (str(rand.randint(0, 99)) if rand.random() < 0.3 else '') for x in range(rand.randint(2, 8))]
+        lines.append(('/'.join(parts) + '_' + str(i) + rand.choice(exts)).encode('ascii'))
+    return lines
+
+
+def bench(lines, query, threads, limit, repeat):
+    from time import monotonic
+    from kittens.choose.main import match
+    best = None
+    for i in range(repeat):
+        st = monotonic()
+        results = match(lines, query, threads=threads, limit=limit)
+        elapsed = monotonic() - st
+        best = elapsed if best is None else min(best, elapsed)
+    return best, len(results)
+
+
+def prefilter(lines, query, threads, limit):
+    from kittens.choose import subseq_matcher
+    from kittens.choose.main import match
+    rejected = 1 - len(match(lines, query, threads=threads)) / max(1, len(lines))
+    subseq_matcher.set_use_prefilter(False)
+    try:
+        without, num = bench(lines, query, threads, limit, 1)
+    finally:
+        subseq_matcher.set_use_prefilter(True)
+    with_prefilter, num = bench(lines, query, threads, limit, 1)
+    return rejected, without, with_prefilter
+
+
+def typing(lines, query, threads, limit):
+    from time import monotonic
+    from kittens.choose.main import Matcher, match
+    queries = [query[:i] for i in range(1, len(query) + 1)]
+    queries += queries[-2::-1]
+    st = monotonic()
+    m = Matcher(lines, threads=threads)
+    setup = monotonic() - st
+    ans = []
+    for q in queries:
+        st = monotonic()
+        m(q, limit=limit)
+        incremental = monotonic() - st
+        st = monotonic()
+        match(lines, q, threads=threads, limit=limit)
+        ans.append((q, monotonic() - st, incremental))
+    return setup, ans
+
+
+def main():
+    import os
+    from argparse import ArgumentParser
+    parser = ArgumentParser(description='Benchmark the choose kitten')
+    parser.add_argument('--corpus', help='File with one candidate per line, instead of the generated corpus')
+    parser.add_argument('--count', default=5000000, type=int, help='Number of lines in the generated corpus')
+    parser.add_argument('--query', default='cache', help='The query to match')
+    parser.add_argument('--limit', default=100, type=int, help='Maximum number of results, zero for no limit')
+    parser.add_argument('--repeat', default=3, type=int, help='Number of runs for every thread count, the fastest is reported')
+    args = parser.parse_args()
+    if args.corpus:
+        with open(args.corpus, 'rb') as f:
+            lines = f.read().splitlines()
+    else:
+        lines = generated_corpus(args.count)
+    print('Matching {!r} against {} lines, limit: {}'.format(args.query, len(lines), args.limit))
+    thread_counts, n = [], 1
+    while n < (os.cpu_count() or 1):
+        thread_counts.append(n)
+        n *= 2
+    thread_counts.append(os.cpu_count() or 1)
+    base = None
+    for threads in thread_counts:
+        elapsed, num = bench(lines, args.query, threads, args.limit, args.repeat)
+        base = base or elapsed
+        print('{:>3} threads: {:8.1f} ms {:5.1f}x ({} results)'.format(threads, elapsed * 1000, base / elapsed, num))
+    rejected, without, with_prefilter = prefilter(lines, args.query, thread_counts[-1], args.limit)
+    print('Prefilter rejected {:.1%} of lines: {:.1f} ms without it, {:.1f} ms with it, {:.1f}x faster'.format(
+        rejected, without * 1000, with_prefilter * 1000, without / with_prefilter))
+    setup, keystrokes = typing(lines, args.query, thread_counts[-1], args.limit)
+    print('Typing the query with {} threads, creating the Matcher took {:.1f} ms'.format(thread_counts[-1], setup * 1000))
+    for q, scratch, incremental in keystrokes:
+        print('{:>16}: {:8.1f} ms from scratch {:8.1f} ms incremental'.format(q, scratch * 1000, incremental * 1000))
+
+
+if __name__ == '__main__':
+    main()
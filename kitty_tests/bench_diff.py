@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# vim:fileencoding=utf-8
+# License: GPL v3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Compare the time taken by the diff kitten to diff all the changed files in
+# two directories using the builtin diff implementation, with the time taken
+# when running git diff or diff for every file. By default two generated
+# directories of source files with random edits are used, real ones can be
+# given with --left and --right. Run from the kitty source directory with:
+#   python3 -m kitty_tests.bench_diff
+
+
+def generate_tree(base, num_files, num_lines):
+    import os
+    import random
+    rand = random.Random(1)
+    words = ['int', 'return', 'if', 'else', 'for', 'while', 'self', 'data', 'value', 'result', 'count', 'index']
+    left, right = os.path.join(base, 'left'), os.path.join(base, 'right')
+    for i in range(num_files):
+        lines = [' ' * 4 * rand.randint(0, 3) + ' '.join(rand.choice(words) for x in range(rand.randint(0, 8))) for y in range(num_lines)]
+        changed = list(lines)
+        for e in range(rand.randint(1, 20)):
+            p = rand.randrange(len(changed))
+            if rand.random() < 0.5:
+                del changed[p:p + rand.randint(1, 5)]
+            else:
+                changed[p:p] = [' '.join(rand.choice(words) for x in range(4)) for y in range(rand.randint(1, 5))]
+        for d, data in ((left, lines), (right, changed)):
+            path = os.path.join(d, 'dir{}'.format(i % 10), 'file{}.c'.format(i))
+            os.makedirs(os.path.dirname(path), exist_ok=True)
+            with open(path, 'w') as f:
+                f.write('\n'.join(data) + '\n')
+    return left, right
+
+
+def bench(left, right, diff_cmd, context, repeat):
+    from time import monotonic
+    from kittens.diff.collect import create_collection, lines_for_path
+    from kittens.diff.patch import Differ, set_diff_command
+    set_diff_command(diff_cmd)
+    collection = create_collection(left, right)
+    for path, item_type, changed_path in collection:
+        if item_type == 'diff':
+            lines_for_path(path), lines_for_path(changed_path)
+    best = None
+    for i in range(repeat):
+        d = Differ()
+        for path, item_type, changed_path in collection:
+            if item_type == 'diff':
+                d.add_diff(path, changed_path)
+        st = monotonic()
+        patches = d(context)
+        elapsed = monotonic() - st
+        if isinstance(patches, str):
+            raise SystemExit(patches)
+        best = elapsed if best is None else min(best, elapsed)
+    return best, len(patches), sum(p.added_count + p.removed_count for p in patches.values())
+
+
+def main():
+    import tempfile
+    from argparse import ArgumentParser
+    parser = ArgumentParser(description='Benchmark the diff kitten')
+    parser.add_argument('--left', help='Directory to compare, instead of the generated one')
+    parser.add_argument('--right', help='Directory to compare, instead of the generated one')
+    parser.add_argument('--files', default=500, type=int, help='Number of files in the generated directories')
+    parser.add_argument('--lines', default=1000, type=int, help='Number of lines in every generated file')
+    parser.add_argument('--context', default=3, type=int, help='Number of lines of context')
+    parser.add_argument('--repeat', default=3, type=int, help='Number of runs, the fastest is reported')
+    args = parser.parse_args()
+    with tempfile.TemporaryDirectory() as tdir:
+        if args.left and args.right:
+            left, right = args.left, args.right
+        else:
+            left, right = generate_tree(tdir, args.files, args.lines)
+        base = None
+        for diff_cmd in ('builtin', 'auto'):
+            elapsed, num, changed = bench(left, right, diff_cmd, args.context, args.repeat)
+            base = base or elapsed
+            print('{:>7}: {:8.1f} ms for {} files with {} changed lines, {:.1f}x slower than builtin'.format(
+                diff_cmd, elapsed * 1000, num, changed, elapsed / base))
+
+
+if __name__ == '__main__':
+    main()
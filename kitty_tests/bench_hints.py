@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+# vim:fileencoding=utf-8
+# License: GPL v3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Compare the time taken by the hints kitten to find all matches in the text
+# of a large window with its scrollback, using regular expressions and post
+# processors in python, and using the native scanner, for every type of match
+# the native scanner supports. Run from the kitty source directory with:
+#   python3 -m kitty_tests.bench_hints
+
+
+def generated_text(num_lines, cols):
+    import random
+    rand = random.Random(1)
+    words = ['the', 'build', 'failed', 'error:', 'warning', 'see', 'at', 'in', 'line', '42', '(', ')', '"quoted"']
+    extras = ['https://example.com/some/path?query=1', '(http://kitty.org/x)', '/usr/lib/python3/site.py',
+              'src/main.c:12', 'README.md', 'deadbeef01', '0123456789abcdef0123456789abcdef01234567']
+    lines = []
+    for i in range(num_lines):
+        line = []
+        while sum(map(len, line)) + len(line) < cols - 45:
+            line.append(rand.choice(extras) if rand.random() < 0.1 else rand.choice(words))
+        lines.append(' '.join(line))
+    return '\n'.join(lines)
+
+
+def bench(text, args, native, repeat):
+    from time import monotonic
+    from kittens.hints.main import functions_for, regex_matches
+    from kitty.fast_data_types import find_hint_matches
+    pattern, post_processors = functions_for(args)
+    best = None
+    for i in range(repeat):
+        st = monotonic()
+        if native:
+            matches = find_hint_matches(text, args.type, args.minimum_match_length, tuple(args.url_prefixes.split(',')))
+        else:
+            matches = list(regex_matches(pattern, post_processors, text, args))
+        elapsed = monotonic() - st
+        best = elapsed if best is None else min(best, elapsed)
+    return best, len(matches)
+
+
+def main():
+    from argparse import ArgumentParser
+    from kittens.hints.main import convert_text, parse_hints_args
+    parser = ArgumentParser(description='Benchmark finding matches in the hints kitten')
+    parser.add_argument('--lines', default=20000, type=int, help='Number of lines of text, including the scrollback')
+    parser.add_argument('--cols', default=200, type=int, help='Number of columns in the window')
+    parser.add_argument('--repeat', default=3, type=int, help='Number of runs, the fastest is reported')
+    args = parser.parse_args()
+    text = convert_text(generated_text(args.lines, args.cols), args.cols)
+    for typ in ('url', 'path', 'hash'):
+        hargs = parse_hints_args(['--type', typ])[0]
+        regex, num = bench(text, hargs, False, args.repeat)
+        native, num = bench(text, hargs, True, args.repeat)
+        print('{:>4}: {:8.1f} ms regex {:8.1f} ms native {:5.1f}x faster ({} matches)'.format(
+            typ, regex * 1000, native * 1000, regex / native, num))
+
+
+if __name__ == '__main__':
+    main()
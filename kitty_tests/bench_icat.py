@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+# vim:fileencoding=utf-8
+# License: GPL v3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Measure the time taken to prepare a directory of images for display with
+# icat, decoding and scaling them in process, one at a time and in parallel,
+# and with ImageMagick, if it is installed. By default a directory of
+# generated PNG images is used, a real one can be given with --directory. Run
+# from the kitty source directory with:
+#   python3 -m kitty_tests.bench_icat
+
+
+def generate_images(tdir, count, width, height):
+    import os
+    import struct
+    import zlib
+
+    def chunk(t, d):
+        return struct.pack('>I', len(d)) + t + d + struct.pack('>I', zlib.crc32(t + d))
+
+    row = os.urandom(width * 3)
+    for i in range(count):
+        rows = b''.join(b'\0' + row[(i + y) % 97:] + row[:(i + y) % 97] for y in range(height))
+        with open(os.path.join(tdir, '{}.png'.format(i)), 'wb') as f:
+            f.write(b'\x89PNG\r\n\x1a\n' + chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, 8, 2, 0, 0, 0)) + chunk(
+                b'IDAT', zlib.compress(rows, 1)) + chunk(b'IEND', b''))
+
+
+def native(paths, available_width, threads):
+    from concurrent.futures import ThreadPoolExecutor
+    from time import monotonic
+    from kitty.fast_data_types import load_image
+    st = monotonic()
+    with ThreadPoolExecutor(max_workers=threads) as pool:
+        results = list(pool.map(lambda p: load_image(p, available_width, 0, False), paths))
+    return monotonic() - st, sum(1 for r in results if r is None)
+
+
+def imagemagick(paths, available_width):
+    import os
+    from time import monotonic
+    from kittens.tui.images import convert, identify
+    st = monotonic()
+    for path in paths:
+        m = identify(path)
+        outfile = convert(path, m, available_width, 10 * m.height, False)[0]
+        os.remove(outfile)
+    return monotonic() - st
+
+
+def main():
+    import os
+    import shutil
+    import tempfile
+    from argparse import ArgumentParser
+    parser = ArgumentParser(description='Benchmark preparing images for icat')
+    parser.add_argument('--directory', help='Directory of images, instead of generated ones')
+    parser.add_argument('--count', default=100, type=int, help='Number of generated images')
+    parser.add_argument('--width', default=1920, type=int, help='Width of the generated images')
+    parser.add_argument('--height', default=1080, type=int, help='Height of the generated images')
+    parser.add_argument('--available-width', default=800, type=int, help='Width in pixels that images are scaled to fit')
+    args = parser.parse_args()
+    tdir = None
+    if args.directory:
+        paths = [os.path.join(dp, f) for dp, dn, fn in os.walk(args.directory) for f in fn]
+    else:
+        tdir = tempfile.mkdtemp()
+        generate_images(tdir, args.count, args.width, args.height)
+        paths = [os.path.join(tdir, f) for f in os.listdir(tdir)]
+    try:
+        print('Preparing {} images to fit into a width of {} pixels'.format(len(paths), args.available_width))
+        threads = os.cpu_count() or 1
+        for n in sorted({1, threads}):
+            elapsed, unsupported = native(paths, args.available_width, n)
+            print('{:>12} ({} threads): {:8.1f} ms, {:.1f} ms per image ({} unsupported)'.format(
+                'native', n, elapsed * 1000, elapsed * 1000 / len(paths), unsupported))
+        if shutil.which('convert'):
+            elapsed = imagemagick(paths, args.available_width)
+            print('{:>24}: {:8.1f} ms, {:.1f} ms per image'.format('ImageMagick', elapsed * 1000, elapsed * 1000 / len(paths)))
+    finally:
+        if tdir:
+            shutil.rmtree(tdir)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# vim:fileencoding=utf-8
+# License: GPL v3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Measure the number of draw calls and the time to prepare a frame for a
+# screen full of image thumbnails, as displayed by file managers, while
+# scrolling through them. The images are not sent to the GPU, the draw calls
+# are counted from the batches the render data is split into. Run from the
+# kitty source directory with:
+#   python3 -m kitty_tests.bench_image_drawing
+
+from argparse import ArgumentParser
+from base64 import standard_b64encode
+from time import monotonic
+
+
+def thumbnail(i, size, num_cols, num_rows):
+    # Transmit and display the image in chunks, as clients must
+    data = standard_b64encode(bytes((i + j) & 0xff for j in range(size * size * 3)))
+    chunks = [data[k:k + 4096] for k in range(0, len(data), 4096)]
+    ans = []
+    for k, chunk in enumerate(chunks):
+        cmd = 'm={}'.format(int(k < len(chunks) - 1))
+        if k == 0:
+            cmd = 'a=T,f=24,i={},s={},v={},c={},r={},'.format(i + 1, size, size, num_cols, num_rows) + cmd
+        ans.append(b'\033_G' + cmd.encode('ascii') + b';' + chunk + b'\033\\')
+    return b''.join(ans)
+
+
+def bench(count, size, lines, columns, frames):
+    from kitty.config import Options, defaults
+    from kitty.fast_data_types import Screen, parse_bytes, set_options, set_send_to_gpu
+    from kitty_tests import Callbacks
+    set_send_to_gpu(False)
+    set_options(Options(defaults._asdict()))
+    cell_width, cell_height = 8, 16
+    num_cols, num_rows = max(1, size // cell_width), max(1, size // cell_height)
+    c = Callbacks()
+    s = Screen(c, lines, columns, 2 * count * num_rows, cell_width, cell_height, 0, c)
+    per_row = max(1, columns // num_cols)
+    for i in range(count):
+        parse_bytes(s, thumbnail(i, size, num_cols, num_rows))
+        if (i + 1) % per_row == 0:
+            parse_bytes(s, b'\r\n')
+    dx, dy = 2 / columns, 2 / lines
+    max_scroll = s.historybuf.count
+    images = draw_calls = 0
+    st = monotonic()
+    for i in range(frames):
+        scrolled_by = (i * num_rows) % (max_scroll + 1)
+        images += len(s.grman.update_layers(scrolled_by, -1, 1, dx, dy, columns, lines, cell_width, cell_height))
+        draw_calls += s.grman.draw_calls()
+    return s.grman.image_count, images / frames, draw_calls / frames, (monotonic() - st) / frames
+
+
+def main():
+    parser = ArgumentParser(description='Benchmark drawing of image thumbnails')
+    parser.add_argument('--count', default=500, type=int, help='Number of thumbnails')
+    parser.add_argument('--size', default=128, type=int, help='Width and height of the thumbnails in pixels')
+    parser.add_argument('--lines', default=60, type=int, help='Number of lines on the screen')
+    parser.add_argument('--columns', default=200, type=int, help='Number of columns on the screen')
+    parser.add_argument('--frames', default=1000, type=int, help='Number of frames to render while scrolling')
+    args = parser.parse_args()
+    count, images, draw_calls, frame_time = bench(args.count, args.size, args.lines, args.columns, args.frames)
+    print('{} thumbnails of {}x{}: {:.1f} visible per frame'.format(count, args.size, args.size, images))
+    print('Draw calls per frame: {:.1f}, without batching: {:.1f}'.format(draw_calls, images))
+    print('Time to prepare a frame: {:.3f} ms'.format(frame_time * 1000))
+
+
+if __name__ == '__main__':
+    main()
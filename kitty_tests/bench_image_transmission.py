@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+# vim:fileencoding=utf-8
+# License: GPL v3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Measure the time to receive a large compressed image transmitted directly in
+# chunks, with and without the total size of the data specified in the first
+# chunk. The images are not sent to the GPU. Run from the kitty source
+# directory with:
+#   python3 -m kitty_tests.bench_image_transmission
+
+
+def serialize(cmd, data):
+    from base64 import standard_b64encode
+    data = standard_b64encode(data)
+    chunks = [data[k:k + 4096] for k in range(0, len(data), 4096)] or [b'']
+    ans = []
+    for k, chunk in enumerate(chunks):
+        c = 'm={}'.format(int(k < len(chunks) - 1))
+        if k == 0:
+            c = cmd + ',' + c
+        ans.append(b'\033_G' + c.encode('ascii') + b';' + chunk + b'\033\\')
+    return b''.join(ans)
+
+
+def image_data(width, height):
+    # Noisy data, so that it does not compress too much
+    import os
+    import zlib
+    row = os.urandom(width * 4)
+    return zlib.compress(b''.join(row[i % 61:] + row[:i % 61] for i in range(height)), 1)
+
+
+def bench(width, height, repeat):
+    from time import monotonic
+    from kitty.config import Options, defaults
+    from kitty.fast_data_types import Screen, parse_bytes, set_options, set_send_to_gpu
+    from kitty_tests import Callbacks
+    set_send_to_gpu(False)
+    set_options(Options(defaults._asdict()))
+    c = Callbacks()
+    s = Screen(c, 50, 200, 0, 8, 16, 0, c)
+    data = image_data(width, height)
+    cmd = 'a=t,f=32,o=z,i=1,s={},v={}'.format(width, height)
+    timings = {}
+    for name, hint in (('without size', ''), ('with size', ',S={}'.format(len(data)))):
+        escape_codes = serialize(cmd + hint, data)
+        st = monotonic()
+        for i in range(repeat):
+            parse_bytes(s, escape_codes)
+        timings[name] = (monotonic() - st) / repeat
+    return len(data), timings
+
+
+def main():
+    from argparse import ArgumentParser
+    parser = ArgumentParser(description='Benchmark direct transmission of large images')
+    parser.add_argument('--width', default=4000, type=int, help='Width of the image in pixels')
+    parser.add_argument('--height', default=4000, type=int, help='Height of the image in pixels')
+    parser.add_argument('--repeat', default=5, type=int, help='Number of times to transmit the image')
+    args = parser.parse_args()
+    sz, timings = bench(args.width, args.height, args.repeat)
+    print('Transmitting {:.1f} MB of compressed data:'.format(sz / 1024 / 1024))
+    for name, t in timings.items():
+        print('{:>13}: {:.1f} ms'.format(name, t * 1000))
+
+
+if __name__ == '__main__':
+    main()
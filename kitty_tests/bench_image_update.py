@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+# vim:fileencoding=utf-8
+# License: GPL v3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Compare the time to process the frames of a live plot when the entire image
+# is re-transmitted for every frame with the time when only the changed region
+# is sent, using the a=f action of the graphics protocol. The images are not
+# sent to the GPU. Run from the kitty source directory with:
+#   python3 -m kitty_tests.bench_image_update
+
+
+def serialize(cmd, data):
+    from base64 import standard_b64encode
+    data = standard_b64encode(data)
+    chunks = [data[k:k + 4096] for k in range(0, len(data), 4096)] or [b'']
+    ans = []
+    for k, chunk in enumerate(chunks):
+        c = 'm={}'.format(int(k < len(chunks) - 1))
+        if k == 0:
+            c = cmd + ',' + c
+        ans.append(b'\033_G' + c.encode('ascii') + b';' + chunk + b'\033\\')
+    return b''.join(ans)
+
+
+def frames(width, height, region, count, compress):
+    # A plot whose frames differ only in a square region
+    import zlib
+    base = bytearray(b'\x20\x30\x40' * width * height)
+    o = ',o=z' if compress else ''
+    yield serialize('a=T,f=24,i=1,s={},v={}{}'.format(width, height, o), zlib.compress(base) if compress else bytes(base))
+    x, y = (width - region) // 2, (height - region) // 2
+    for i in range(count):
+        patch = bytes((i + j) & 0xff for j in range(region * region * 3))
+        for r in range(region):
+            start = ((y + r) * width + x) * 3
+            base[start:start + region * 3] = patch[r * region * 3:(r + 1) * region * 3]
+        data = zlib.compress(bytes(base)) if compress else bytes(base)
+        full = serialize('a=t,f=24,i=1,s={},v={}{}'.format(width, height, o), data)
+        data = zlib.compress(patch) if compress else patch
+        delta = serialize('a=f,f=24,i=1,s={},v={},x={},y={}{}'.format(region, region, x, y, o), data)
+        yield full, delta
+
+
+def bench(width, height, region, count, compress):
+    from time import monotonic
+    from kitty.config import Options, defaults
+    from kitty.fast_data_types import Screen, parse_bytes, set_options, set_send_to_gpu
+    from kitty_tests import Callbacks
+    set_send_to_gpu(False)
+    set_options(Options(defaults._asdict()))
+    c = Callbacks()
+    s = Screen(c, 50, 200, 0, 8, 16, 0, c)
+    f = frames(width, height, region, count, compress)
+    parse_bytes(s, next(f))
+    timings = {'full': 0, 'delta': 0}
+    sizes = {'full': 0, 'delta': 0}
+    for full, delta in f:
+        for name, data in (('full', full), ('delta', delta)):
+            st = monotonic()
+            parse_bytes(s, data)
+            timings[name] += monotonic() - st
+            sizes[name] += len(data)
+    return timings, sizes
+
+
+def main():
+    from argparse import ArgumentParser
+    parser = ArgumentParser(description='Benchmark updating part of an image')
+    parser.add_argument('--width', default=1200, type=int, help='Width of the image in pixels')
+    parser.add_argument('--height', default=800, type=int, help='Height of the image in pixels')
+    parser.add_argument('--region', default=100, type=int, help='Width and height of the region that changes in every frame')
+    parser.add_argument('--frames', default=100, type=int, help='Number of frames')
+    parser.add_argument('--compress', action='store_true', help='Compress the data with zlib')
+    args = parser.parse_args()
+    timings, sizes = bench(args.width, args.height, args.region, args.frames, args.compress)
+    for name in ('full', 'delta'):
+        print('{:>5}: {:.2f} ms per frame, {:.1f} KB transmitted per frame'.format(
+            name, timings[name] * 1000 / args.frames, sizes[name] / 1024 / args.frames))
+    print('Delta updates are {:.1f}x faster'.format(timings['full'] / max(timings['delta'], 1e-9)))
+
+
+if __name__ == '__main__':
+    main()
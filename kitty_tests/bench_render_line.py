@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# vim:fileencoding=utf-8
+# License: GPL v3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Measure the throughput of render_line() for text that has not been rendered
+# before, but whose glyphs are already in the sprite cache. By default the
+# fonts shipped in kitty_tests are used, loaded from their files, so that the
+# results do not depend on the fonts installed. Run from the kitty source
+# directory with:
+#   python3 -m kitty_tests.bench_render_line
+
+import os
+import sys
+from argparse import ArgumentParser
+from random import Random
+from string import ascii_letters, digits, punctuation
+from time import monotonic
+
+
+def random_lines(count, length, seed):
+    rng = Random(seed)
+    words = [''.join(rng.choices(ascii_letters + digits + punctuation, k=rng.randint(1, 12))) for i in range(5000)]
+    for i in range(count):
+        line = ''
+        while len(line) < length:
+            line += rng.choice(words) + ' '
+        yield line[:length]
+
+
+def bench(font_file, size, count, length, seed):
+    from kitty.fast_data_types import Screen, current_fonts, test_render_line
+    from kitty.fonts.render import setup_for_testing
+    with setup_for_testing(size=size, main_face_path=font_file) as (sprites, cell_width, cell_height):
+        font = current_fonts()['medium'].display_name()
+        s = Screen(None, 1, length)
+        # Render all printable ASCII once, so that rasterization is not measured
+        s.draw(''.join(map(chr, range(33, 127))))
+        test_render_line(s.line(0))
+        elapsed = 0
+        for text in random_lines(count, length, seed):
+            s.reset()
+            s.draw(text)
+            line = s.line(0)
+            st = monotonic()
+            test_render_line(line)
+            elapsed += monotonic() - st
+    return font, elapsed
+
+
+def main():
+    parser = ArgumentParser(description='Benchmark rendering of lines of text')
+    parser.add_argument('--font', action='append', help='Path to the font file to use, can be specified multiple times.'
+                        ' Defaults to the Fira Code and Liberation Mono fonts in kitty_tests')
+    parser.add_argument('--size', default=11.0, type=float, help='Font size in pts')
+    parser.add_argument('--lines', default=10000, type=int, help='Number of lines to render')
+    parser.add_argument('--length', default=120, type=int, help='Number of cells per line')
+    parser.add_argument('--seed', default=sys.argv[0], type=str, help='seed to get different text')
+    args = parser.parse_args()
+    base = os.path.dirname(os.path.abspath(__file__))
+    for font_file in args.font or (os.path.join(base, 'FiraCode-Medium.otf'), os.path.join(base, 'LiberationMono-Regular.ttf')):
+        font, elapsed = bench(os.path.abspath(font_file), args.size, args.lines, args.length, args.seed)
+        print('{}: rendered {} lines in {:.3f} seconds, {:.0f} lines per second'.format(font, args.lines, elapsed, args.lines / elapsed))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+# vim:fileencoding=utf-8
+# License: GPL v3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
+
+# Measure the latency of every keystroke when a query is typed into the
+# unicode_input kitten, searching by name. The native ranked query is compared
+# with intersecting the sets of codepoints for every word in python. Run from
+# the kitty source directory with:
+#   python3 -m kitty_tests.bench_unicode_input
+
+
+def python_search(words):
+    from kittens.unicode_input.unicode_names import codepoints_for_word, name_for_codepoint
+    codepoints = codepoints_for_word(words[0])
+    for word in words[1:]:
+        intersection = codepoints & codepoints_for_word(word)
+        if intersection:
+            codepoints = intersection
+        else:
+            codepoints = {c for c in codepoints if word in (name_for_codepoint(c) or '').lower()}
+    return sorted(codepoints)
+
+
+def typing(text, limit):
+    from time import monotonic
+    from kittens.unicode_input.unicode_names import codepoints_for_query
+    ans = []
+    for i in range(2, len(text) + 1):
+        words = tuple(text[:i].lower().split())
+        st = monotonic()
+        num = len(codepoints_for_query(words, limit))
+        native = monotonic() - st
+        st = monotonic()
+        python_search(words)
+        ans.append((text[:i], num, native, monotonic() - st))
+    return ans
+
+
+def main():
+    from argparse import ArgumentParser
+    parser = ArgumentParser(description='Benchmark searching for unicode characters by name')
+    parser.add_argument('--query', default='latin small letter a with grave', help='The query to type')
+    parser.add_argument('--limit', default=1024, type=int, help='Maximum number of results')
+    args = parser.parse_args()
+    keystrokes = typing(args.query, args.limit)
+    for q, num, native, python in keystrokes:
+        print('{:>32}: {:6.3f} ms native {:6.3f} ms python ({} results)'.format(q, native * 1000, python * 1000, num))
+    print('Slowest keystroke: {:.3f} ms native {:.3f} ms python'.format(
+        max(k[2] for k in keystrokes) * 1000, max(k[3] for k in keystrokes) * 1000))
+
+
+if __name__ == '__main__':
+    main()
@@ -2,6 +2,7 @@
 # vim:fileencoding=utf-8
 # License: GPLv3 Copyright: 2019, Kovid Goyal <kovid at kovidgoyal.net>
 
+import os
 import random
 import string
 
@@ -98,3 +99,70 @@ class TestMatcher(BaseTest):
 
         for threads in range(4):
             self.basic_test(data, 'foo', None, threads=threads)
+
+        # The results must not depend on the number of threads, and limiting
+        # them must give the best ones
+        expected = self.run_matcher(data, 'ab', threads=1)
+        self.assertTrue(expected)
+        for threads in range(1, 5):
+            self.basic_test(data, 'ab', expected, threads=threads)
+            for limit in (1, 10, len(expected) + 1):
+                self.basic_test(data, 'ab', expected[:limit], threads=threads, limit=limit)
+
+    def test_prefilter(self):
+        ' Rejecting candidates before scoring must not change the results '
+        from kittens.choose import subseq_matcher
+        data = '\n'.join(['ABC/Déf', 'a.b-c', 'xyz', 'cab', 'ÄbÇ', 'a' * 300 + 'c', 'Ab9_Z', 'xxxxabxxxxxxxxc'] * 2000)
+        for query in ('abc', 'ac', 'déf', 'äç', 'ÄÇ', 'b9z', 'zz', 'x'):
+            subseq_matcher.set_use_prefilter(False)
+            try:
+                expected = run(data, query, positions=True)
+            finally:
+                subseq_matcher.set_use_prefilter(True)
+            self.ae(run(data, query, positions=True), expected)
+            self.ae(run(data, query, positions=True, threads=2), expected)
+
+    def test_stream(self):
+        ' Matching input as it is read must give the same results as matching all of it '
+        from threading import Thread
+        from kittens.choose.main import StreamMatcher
+        data = '\n'.join(['archer', 'elementary', 'xx/y', 'abc/def', 'xa/a', '', 'Ab9_Z'] * 5000) + '\nlast ab'
+
+        def write(fd):
+            with open(fd, 'wb') as f:
+                for i in range(0, len(data), 4001):
+                    f.write(data[i:i+4001].encode('utf-8'))
+
+        for threads, limit in ((1, 0), (3, 7)):
+            r, w = os.pipe()
+            t = Thread(target=write, args=(w,))
+            t.start()
+            m = StreamMatcher(r, 'ab', threads=threads, limit=limit)
+            m.wait()
+            t.join()
+            os.close(r)
+            self.ae(m.status(), {'finished': True, 'read': 30001, 'scored': 30001})
+            self.ae(m.results(), run(data, 'ab', threads=threads, limit=limit))
+            self.ae(m.results(positions=True, mark_before='|', mark_after='|'), run(data, 'ab', limit=limit, positions=True, mark='|'))
+        r, w = os.pipe()
+        os.close(w)
+        m = StreamMatcher(r, 'ab')
+        m.wait()
+        os.close(r)
+        self.ae(m.results(), [])
+
+    def test_incremental(self):
+        ' Matching as the query is typed must give the same results as matching from scratch '
+        from kittens.choose.main import Matcher
+        data = 'archer\nelementary\nxx/y\nxxxY\nabc/def\nxa/a\n' * 3000
+        for threads in (1, 2):
+            m = Matcher(data, threads=threads)
+            for query in ('a', 'ar', 'arc', 'ar', 'a', 'x', 'xy', 'xa', 'xaa'):
+                for limit in (0, 5):
+                    self.ae(m(query, limit=limit), run(data, query, limit=limit, threads=threads))
+            self.ae(m.matcher.cached_needles(), ('x', 'xa', 'xaa'))
+            self.ae(m('xa', positions=True, mark_before='|', mark_after='|'), run(data, 'xa', positions=True, mark='|'))
+            self.ae(m.matcher.cached_needles(), ('x', 'xa'))
+            self.ae(m('b'), run(data, 'b'))
+            self.ae(m.matcher.cached_needles(), ('b',))
+            self.ae(m(''), [])
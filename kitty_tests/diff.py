@@ -2,10 +2,28 @@
 # vim:fileencoding=utf-8
 # License: GPL v3 Copyright: 2018, Kovid Goyal <kovid at kovidgoyal.net>
 
+import os
+import tempfile
+from contextlib import contextmanager
 
 from . import BaseTest
 
 
+@contextmanager
+def fixture_files():
+    # Yield a temporary directory and a function that writes files into it
+    with tempfile.TemporaryDirectory() as tdir:
+
+        def w(name, data):
+            path = os.path.join(tdir, name)
+            os.makedirs(os.path.dirname(path), exist_ok=True)
+            with open(path, 'wb') as f:
+                f.write(data.encode('utf-8') if isinstance(data, str) else data)
+            return path
+
+        yield tdir, w
+
+
 class TestDiff(BaseTest):
 
     def test_changed_center(self):
@@ -44,3 +62,78 @@ class TestDiff(BaseTest):
 
         highlights = [h(0, 1, 1), h(1, 3, 2)]
         self.ae(['S1SaE1ES2SbcE2Ed'], split_with_highlights('abcd', 10, highlights))
+
+    def test_diff_lines(self):
+        from kittens.diff.diff_speedup import diff_lines
+        from kittens.diff.patch import patch_from_hunks
+
+        def t(left, right, context, *expected):
+            hunks = diff_lines(tuple(left.split()), tuple(right.split()), context)
+            self.ae(list(expected), [(h[1], h[2], h[3], h[4], [tuple(c) for c in h[5]]) for h in hunks])
+            return hunks
+
+        t('a b c', 'a b c', 3)
+        t('', 'a b', 3, (0, 0, 0, 2, [(False, 0, 2)]))
+        t('a b', '', 3, (0, 2, 0, 0, [(False, 2, 0)]))
+        t('a b c d', 'a x c d', 1, (0, 3, 0, 3, [(True, 1, 1), (False, 1, 1), (True, 1, 1)]))
+        t('a b c d e f g h', 'a B c d e f g H', 1,
+          (0, 3, 0, 3, [(True, 1, 1), (False, 1, 1), (True, 1, 1)]), (6, 2, 6, 2, [(True, 1, 1), (False, 1, 1)]))
+        t('a b c d e f g h', 'a B c d e f g H', 3,
+          (0, 8, 0, 8, [(True, 1, 1), (False, 1, 1), (True, 5, 5), (False, 1, 1)]))
+        t('a b c d', 'a c d e', 0, (1, 1, 1, 0, [(False, 1, 0)]), (4, 0, 3, 1, [(False, 0, 1)]))
+        t('x y z', '1 2', 3, (0, 3, 0, 2, [(False, 3, 2)]))
+        t('a b a b a', 'b a a b', 0, (0, 1, 0, 0, [(False, 1, 0)]), (3, 1, 2, 0, [(False, 1, 0)]), (5, 0, 3, 1, [(False, 0, 1)]))
+        hunks = diff_lines(('def f():', '    a', '    b', '    c', '    d', '    e'), ('def f():', '    a', '    b', '    c', '    d', '    E'), 1)
+        self.ae(hunks[0][0], 'def f():')
+        p = patch_from_hunks(t('a b c d', 'a c d e', 0, (1, 1, 1, 0, [(False, 1, 0)]), (4, 0, 3, 1, [(False, 0, 1)])))
+        self.ae((p.added_count, p.removed_count), (1, 1))
+        self.ae([(h.left_start, h.left_count, h.right_start, h.right_count) for h in p], [(1, 1, 0, 0), (3, 0, 3, 1)])
+
+    def test_collect_files(self):
+        from kittens.diff.collect import create_collection
+        from kittens.diff.diff_speedup import compare_files, hash_files
+        with fixture_files() as (tdir, w):
+            left, right = os.path.join(tdir, 'left'), os.path.join(tdir, 'right')
+            big = os.urandom(100003)
+            w('left/same', b'same'), w('right/same', b'same')
+            w('left/empty', b''), w('right/empty', b'')
+            a, b = w('left/d/big', big), w('right/d/big', big[:-1] + b'x')
+            w('left/size', b'abc'), w('right/size', b'abcd')
+            w('left/old', big), w('right/new', big)
+            w('left/removed', b'removed'), w('right/added', b'added')
+            self.ae(hash_files([a, a, os.path.join(tdir, 'missing')])[:2], [hash_files([a])[0]] * 2)
+            self.assertIsNone(hash_files([os.path.join(tdir, 'missing')])[0])
+            self.assertNotEqual(hash_files([a]), hash_files([b]))
+            self.ae(compare_files([(a, a), (a, b), (a, os.path.join(tdir, 'missing'))]), [True, False, False])
+            c = create_collection(left, right)
+            self.ae({os.path.relpath(p, tdir): t for p, t, o in c}, {
+                'left/d/big': 'diff', 'left/size': 'diff', 'left/old': 'rename', 'left/removed': 'removal', 'right/added': 'add'})
+
+    def test_highlight_cache(self):
+        from kittens.diff import highlight
+        from kittens.diff.collect import create_collection
+        highlight.initialize_highlighter()
+        with fixture_files() as (tdir, w):
+            left = w('left.py', 'def f(x):\n    return x\n\nclass A:\n    pass\n')
+            right = w('right.py', 'def f(x):\n    return "x"\n')
+            expected = highlight.highlight_for_diff(left, {})
+
+            def as_tuples(highlights):
+                return [[(s.start, s.end, s.start_code, s.end_code) for s in line] for line in highlights]
+
+            self.ae(as_tuples(expected), as_tuples(highlight.deserialize_highlights(highlight.serialize_highlights(expected))))
+            self.assertTrue(any(expected))
+            cdir = os.path.join(tdir, 'cache')
+            os.mkdir(cdir)
+            orig, highlight.highlight_cache_dir.ans = getattr(highlight.highlight_cache_dir, 'ans', False), cdir
+            try:
+                first = highlight.highlight_collection(create_collection(left, right), {})
+                self.ae(len(os.listdir(cdir)), 2)
+                del highlight.highlight_collection.processes
+                second = highlight.highlight_collection(create_collection(left, right), {})
+                # Everything came from the cache, no worker processes were started
+                self.assertFalse(hasattr(highlight.highlight_collection, 'processes'))
+            finally:
+                highlight.highlight_cache_dir.ans = orig
+            self.ae(as_tuples(first[left]), as_tuples(expected))
+            self.ae({k: as_tuples(v) for k, v in first.items()}, {k: as_tuples(v) for k, v in second.items()})
@@ -2,15 +2,19 @@
 # vim:fileencoding=utf-8
 # License: GPL v3 Copyright: 2017, Kovid Goyal <kovid at kovidgoyal.net>
 
+import os
 import sys
+import tempfile
 import unittest
 
 from kitty.constants import is_macos
 from kitty.fast_data_types import (
-    DECAWM, get_fallback_font, sprite_map_set_layout, sprite_map_set_limits,
+    DECAWM, Screen, get_fallback_font, glyph_cache_stats, render_box_glyph,
+    set_glyph_cache_dir, set_glyph_render_threads, set_simple_run_rendering,
+    shape_cache_stats, sprite_map_set_layout, sprite_map_set_limits,
     test_render_line, test_sprite_position_for, wcwidth
 )
-from kitty.fonts.box_drawing import box_chars
+from kitty.fonts.box_drawing import box_chars, render_box_char
 from kitty.fonts.render import render_string, setup_for_testing, shape_string
 
 from . import BaseTest
@@ -54,6 +58,27 @@ class Rendering(BaseTest):
         test_render_line(line)
         self.assertEqual(len(self.sprites), prerendered + len(box_chars))
 
+    def test_native_box_drawing(self):
+        for width, height in ((8, 17), (10, 21), (15, 31)):
+            for dpi in (72.0, 96.0, 144.0):
+                for ch in box_chars:
+                    native = render_box_glyph(ord(ch), width, height, dpi)
+                    if ch in '╭╮╯╰':
+                        # rounded corners are only implemented natively, check
+                        # that they are anti-aliased and meet the neighboring
+                        # cells exactly where the square corners do
+                        square = render_box_glyph(ord('┌┐┘└'['╭╮╯╰'.index(ch)]), width, height, dpi)
+                        self.assertTrue(set(native) - {0, 255})
+                        for x in (0, width - 1):
+                            self.ae(native[x::width], square[x::width])
+                        for y in (0, height - 1):
+                            self.ae(native[y * width:(y + 1) * width], square[y * width:(y + 1) * width])
+                        continue
+                    self.ae(native, bytes(render_box_char(ch, bytearray(width * height), width, height, dpi)), '{!r} {}x{} @ {}'.format(ch, width, height, dpi))
+        self.assertIsNone(render_box_glyph(ord('a'), 10, 21))
+        self.ae(render_box_glyph(0x2800, 10, 21), bytes(10 * 21))
+        self.assertGreater(render_box_glyph(0x28ff, 10, 21).count(255), render_box_glyph(0x2801, 10, 21).count(255))
+
     def test_font_rendering(self):
         render_string('ab\u0347\u0305你好|\U0001F601|\U0001F64f|\U0001F63a|')
         text = 'He\u0347\u0305llo\u0341, w\u0302or\u0306l\u0354d!'
@@ -67,6 +92,139 @@ class Rendering(BaseTest):
         cells = render_string(text)[-1]
         self.ae(len(cells), sz)
 
+    def test_threaded_rendering(self):
+        text = 'He\u0347\u0305llo, 你好 world!'
+        expected = render_string(text)
+        set_glyph_render_threads(2)
+        try:
+            self.ae(render_string(text), expected)
+        finally:
+            set_glyph_render_threads(-1)
+
+    def test_simple_runs(self):
+        # Runs of ASCII text that no font feature applies to are rendered
+        # without HarfBuzz, which must give the same sprites as shaping them
+        texts = ('Hello, World! 0123456789', 'The quick brown fox jumps over the lazy dog', 'a => b != c -- d <== e www :: |>')
+
+        def sprites(text):
+            s = Screen(None, 1, len(text))
+            s.draw(text)
+            line = s.line(0)
+            test_render_line(line)
+            return tuple(map(line.sprite_at, range(s.columns)))
+
+        for name in ('FiraCode-Medium.otf', 'LiberationMono-Regular.ttf'):
+            with setup_for_testing(main_face_path=os.path.abspath(os.path.join('kitty_tests', name))):
+                before = shape_cache_stats()
+                simple = [sprites(text) for text in texts]
+                if name.startswith('Liberation'):
+                    # Every run was rendered without shaping
+                    self.ae(shape_cache_stats()['misses'], before['misses'])
+                set_simple_run_rendering(False)
+                try:
+                    self.ae([sprites(text) for text in texts], simple)
+                finally:
+                    set_simple_run_rendering(True)
+
+    def test_shape_cache(self):
+        s = self.create_screen(cols=20, lines=1, scrollback=0)
+        s.draw('ab\u0347c abc 你好')
+        line = s.line(0)
+        test_render_line(line)
+        first = shape_cache_stats()
+        expected = tuple(map(line.sprite_at, range(s.columns)))
+        test_render_line(line)
+        second = shape_cache_stats()
+        self.ae(tuple(map(line.sprite_at, range(s.columns))), expected)
+        self.ae(second['misses'], first['misses'])
+        self.assertGreater(second['hits'], first['hits'])
+
+    def test_font_for_cell_cache(self):
+        s = self.create_screen(cols=24, lines=1, scrollback=0)
+        # The same character in different styles and with different combining
+        # characters must not share a cached font
+        s.draw('a\u0347 \u2716\ufe0f a \u2716 ')
+        s.cursor.bold = True
+        s.draw('a\u0347 a ')
+        s.cursor.bold = False
+        s.draw('a\u0347 \u2716\ufe0f a \u2716')
+        line = s.line(0)
+        test_render_line(line)
+        expected = tuple(map(line.sprite_at, range(s.columns)))
+        test_render_line(line)
+        self.ae(tuple(map(line.sprite_at, range(s.columns))), expected)
+        self.ae(expected[:9], expected[13:22])
+
+    @unittest.skipIf(is_macos, 'CoreText faces are not cached on disk')
+    def test_glyph_cache(self):
+        text = 'He\u0347\u0305llo, 你好 world!'
+        expected = render_string(text)
+        with tempfile.TemporaryDirectory() as tdir:
+            set_glyph_cache_dir(tdir)
+            try:
+                self.ae(render_string(text), expected)
+                first = glyph_cache_stats()
+                # the glyphs are written to disk when the font group is freed
+                self.ae(render_string(text), expected)
+                second = glyph_cache_stats()
+                self.ae(len(os.listdir(tdir)), 1)
+                self.ae(second['added'], first['added'])
+                self.assertGreater(second['hits'], first['hits'])
+            finally:
+                set_glyph_cache_dir(None)
+
+    @unittest.skipIf(is_macos, 'Fallback fonts are not remembered on macOS')
+    def test_known_fallback_fonts(self):
+        from kitty.fast_data_types import set_fallback_font_cache
+        fira = os.path.abspath('kitty_tests/FiraCode-Medium.otf')
+        with tempfile.TemporaryDirectory() as tdir:
+            path = os.path.join(tdir, 'fallback-fonts')
+            with open(path, 'w') as f:
+                f.write('#fingerprint\n')
+                f.write('0 0 0 0 1 3 61 {}\n'.format(fira))
+                f.write('0 1 0 0 1 3 63 {}\n'.format(fira))
+                f.write('1 0 0 0 1 3 62 {}\n'.format(os.path.join(tdir, 'missing.otf')))
+                f.write('garbage\n')
+            # The cache is ignored when the font configuration has changed
+            set_fallback_font_cache(path, 'changed')
+            try:
+                self.assertNotIn(fira, repr(get_fallback_font('c', False, True)))
+            finally:
+                set_fallback_font_cache(None)
+            set_fallback_font_cache(path, 'fingerprint')
+            try:
+                self.assertIn(fira, repr(get_fallback_font('a', False, False)))
+                self.assertNotIn('missing.otf', repr(get_fallback_font('b', True, False)))
+            finally:
+                set_fallback_font_cache(None)
+            # Forgotten fonts are removed from the file
+            with open(path) as f:
+                lines = f.read().splitlines()
+            self.ae(lines, ['#fingerprint', '0 0 0 0 1 3 61 {}'.format(fira), '0 1 0 0 1 3 63 {}'.format(fira)])
+
+    @unittest.skipIf(is_macos, 'Fallback fonts are looked up synchronously on macOS')
+    def test_async_fallback_fonts(self):
+        from kitty.fast_data_types import set_async_fallback_font_lookups, set_fallback_font_cache
+        s = self.create_screen(cols=4, lines=1, scrollback=0)
+        s.draw('你')
+        line = s.line(0)
+        with tempfile.TemporaryDirectory() as tdir:
+            path = os.path.join(tdir, 'fallback-fonts')
+            set_fallback_font_cache(path, 'fingerprint')
+            set_async_fallback_font_lookups(True)
+            try:
+                # The cell is drawn with the missing glyph, until the lookup in the fallback font thread finishes
+                test_render_line(line)
+                missing = line.sprite_at(0)
+                test_render_line(line)
+                self.assertNotEqual(line.sprite_at(0), missing)
+            finally:
+                set_async_fallback_font_lookups(False)
+                set_fallback_font_cache(None)
+            # and the font that was found is remembered
+            with open(path) as f:
+                self.assertIn(' 4f60 ', f.read())
+
     def test_shaping(self):
 
         def groups(text, path=None):
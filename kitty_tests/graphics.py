@@ -10,7 +10,9 @@ from base64 import standard_b64decode, standard_b64encode
 from io import BytesIO
 
 from kitty.fast_data_types import (
-    load_png_data, parse_bytes, set_send_to_gpu, shm_unlink, shm_write
+    load_image, load_png_data, new_graphics_frame, parse_bytes, set_fake_gpu,
+    set_image_decode_threads, set_send_to_gpu, shared_texture_stats, shm_unlink,
+    shm_write, wait_for_image_decodes
 )
 
 from . import BaseTest
@@ -118,6 +120,25 @@ def put_helpers(self, cw, ch):
     return s, dx, dy, put_image, put_ref, layers, rect_eq
 
 
+def texture_helpers(self, screen):
+    # Images are uploaded to textures kept in memory, see set_fake_gpu()
+
+    def add(iid, fill, w=300, h=300):
+        data = zlib.compress(bytes([fill]) * (w * h * 3))
+        res = send_command(screen, 'a=T,f=24,o=z,c=1,r=1,i=%d,s=%d,v=%d' % (iid, w, h), data)
+        self.ae(parse_response(res), 'OK')
+        return screen.grman.image_for_client_id(iid)
+
+    def delete(iid):
+        send_command(screen, 'a=d,d=I,i=%d' % iid)
+
+    def show():
+        # What rendering the window in a frame does
+        return screen.grman.update_layers(0, -1, 1, 2 / screen.columns, 2 / screen.lines, screen.columns, screen.lines, 10, 20)
+
+    return add, delete, show
+
+
 class TestGraphics(BaseTest):
 
     def test_load_images(self):
@@ -159,6 +180,21 @@ class TestGraphics(BaseTest):
         img = g.image_for_client_id(1)
         self.ae(img['data'], random_data)
 
+        # Test chunked + compressed with the size of the data specified, too small
+        # sizes must be grown
+        for S in (len(compressed_random_data), 8):
+            self.assertIsNone(l(compressed_random_data[:b], s=24, v=32, o='z', S=S, m=1))
+            self.ae(l(compressed_random_data[b:], m=0), 'OK')
+            self.ae(g.image_for_client_id(1)['data'], random_data)
+
+        # Test chunked load of data large enough to be mapped
+        random_data = byte_block(1024 * 1024 * 4)
+        for i in range(0, len(random_data), 3072):
+            kw = {'s': 1024, 'v': 1024} if i == 0 else {}
+            self.assertIsNone(l(random_data[i:i+3072], m=1, **kw))
+        self.ae(l(b'', m=0), 'OK')
+        self.ae(g.image_for_client_id(1)['data'], random_data)
+
         # Test loading from file
         f = tempfile.NamedTemporaryFile()
         f.write(random_data), f.flush()
@@ -178,6 +214,24 @@ class TestGraphics(BaseTest):
             FileNotFoundError, shm_unlink, name
         )  # check that file was deleted
 
+    def test_image_update(self):
+        s, g, l, sl = load_helpers(self)
+        sl(b'abcdefghijklmnopqrstuvwx', s=4, v=2, f=24)
+        self.ae(l(b'123456', a='f', s=2, v=1, x=1, y=1, f=24), 'OK')
+        self.ae(g.image_for_client_id(1)['data'], b'abcdefghijklmno123456vwx')
+        # The alpha channel is dropped for opaque images
+        self.ae(l(b'ABCDEFGH', a='f', s=2, v=1, f=32), 'OK')
+        self.ae(g.image_for_client_id(1)['data'], b'ABCEFGghijklmno123456vwx')
+        # Chunked and compressed
+        data = zlib.compress(b'xyz')
+        self.assertIsNone(l(data[:4], a='f', s=1, v=1, x=3, f=24, o='z', m=1))
+        self.ae(l(data[4:], m=0), 'OK')
+        self.ae(g.image_for_client_id(1)['data'], b'ABCEFGghixyzmno123456vwx')
+        self.ae(g.image_count, 1)
+        self.ae(l(b'123456', a='f', s=2, v=1, x=3, y=1, f=24).partition(':')[0], 'EINVAL')
+        self.ae(l(b'123', a='f', s=1, v=1, f=24, i=7).partition(':')[0], 'ENOENT')
+        self.ae(g.image_for_client_id(1)['data'], b'ABCEFGghixyzmno123456vwx')
+
     @unittest.skipIf(Image is None, 'PIL not available, skipping PNG tests')
     def test_load_png(self):
         s, g, l, sl = load_helpers(self)
@@ -216,6 +270,62 @@ class TestGraphics(BaseTest):
         # test error handling for loading bad png data
         self.assertRaisesRegex(ValueError, '[EBADPNG]', load_png_data, b'dsfsdfsfsfd')
 
+    def test_load_image(self):
+
+        def png(w, h, data):
+            import struct
+
+            def chunk(t, d):
+                return struct.pack('>I', len(d)) + t + d + struct.pack('>I', zlib.crc32(t + d))
+
+            rows = b''.join(b'\0' + data[y * w * 4:(y + 1) * w * 4] for y in range(h))
+            return b'\x89PNG\r\n\x1a\n' + chunk(b'IHDR', struct.pack('>IIBBBBB', w, h, 8, 6, 0, 0, 0)) + chunk(
+                b'IDAT', zlib.compress(rows)) + chunk(b'IEND', b'')
+
+        def load(data, *a):
+            with tempfile.NamedTemporaryFile() as f:
+                f.write(data), f.flush()
+                return load_image(f.name, *a)
+
+        # Images that fit are not scaled, opaque images lose their alpha channel
+        rgba_data = byte_block(6 * 4 * 4)
+        self.ae(load(png(6, 4, rgba_data), 100, 0, False), (rgba_data, 6, 4, 32))
+        opaque = bytes(x | 0xff if i % 4 == 3 else x for i, x in enumerate(rgba_data))
+        rgb_data = bytes(x for i, x in enumerate(opaque) if i % 4 != 3)
+        self.ae(load(png(6, 4, opaque), 100, 0, False), (rgb_data, 6, 4, 24))
+        # Images are scaled to fit, preserving the aspect ratio
+        flat = bytes([10, 20, 30, 255] * 40 * 20)
+        self.ae(load(png(40, 20, flat), 10, 0, False), (bytes([10, 20, 30]) * 10 * 5, 10, 5, 24))
+        self.ae(load(png(40, 20, flat), 100, 5, False)[1:3], (10, 5))
+        self.ae(load(png(40, 20, flat), 80, 80, True), (bytes([10, 20, 30]) * 80 * 40, 80, 40, 24))
+        # Unsupported formats and errors
+        self.assertIsNone(load(b'GIF89a' + b'\0' * 20, 100, 0, False))
+        self.assertRaisesRegex(ValueError, '[EBADPNG]', load, b'\x89PNG\r\n\x1a\n' + b'a' * 20, 100, 0, False)
+        self.assertRaises(FileNotFoundError, load_image, '/does-not-exist', 100, 0, False)
+
+    def test_async_decode(self):
+        s, g, l, sl = load_helpers(self)
+        w, h = 200, 120
+        data = os.urandom(w * h * 3)
+        set_image_decode_threads(2)
+        try:
+            self.assertIsNone(l(zlib.compress(data), s=w, v=h, f=24, o='z', i=7))
+            # Responses to later commands must wait for the pending one
+            self.assertIsNone(l('abc', s=1, v=1, f=24, i=8))
+            self.assertIsNone(l(zlib.compress(data), s=w, v=h + 1, f=24, o='z', i=9))
+            wait_for_image_decodes()
+            s.callbacks.clear()
+            s.handle_decoded_images()
+            responses = [x.partition(';')[2] for x in s.callbacks.wtcbuf.decode('ascii').split('\033_G') if x]
+            self.ae(responses[:2], ['OK\033\\', 'OK\033\\'])
+            self.ae(responses[2].partition(':')[0], 'EINVAL')
+            self.ae(g.image_for_client_id(7)['data'], data)
+            self.ae(g.image_for_client_id(9)['data_loaded'], False)
+            s.callbacks.clear()
+            self.ae(l('abc', s=1, v=1, f=24, i=10), 'OK')
+        finally:
+            set_image_decode_threads(-1)
+
     def test_image_put(self):
         cw, ch = 10, 20
         s, dx, dy, put_image, put_ref, layers, rect_eq = put_helpers(self, cw, ch)
@@ -288,6 +398,158 @@ class TestGraphics(BaseTest):
         s.reverse_index()
         self.ae(s.grman.image_count, 2)
 
+    def test_gr_layers_scrolling(self):
+        cw, ch = 10, 20
+        s, dx, dy, put_image, put_ref, layers, rect_eq = put_helpers(self, cw, ch)
+        for i in range(12):
+            put_image(s, cw, ch, z=(i % 3) - 1)
+            s.carriage_return(), s.linefeed()
+        # The first three images have been scrolled out of the scrollback
+        self.ae(s.grman.image_count, 9)
+        rows = [i - 8 for i in range(3, 12)]
+        for scrolled_by in range(6):
+            l0 = layers(s, scrolled_by)
+            self.ae(len(l0), sum(1 for r in rows if -scrolled_by <= r < s.lines - scrolled_by))
+            z = [x['z_index'] for x in l0]
+            self.ae(z, sorted(z))
+        l3 = layers(s, 3)
+        layers(s, 0)
+        self.ae(layers(s, 3), l3)
+
+    def test_gr_shared_textures(self):
+        set_fake_gpu(True)
+        try:
+            s = self.create_screen()
+            add, delete, show = texture_helpers(self, s)
+            base = shared_texture_stats()
+            sz = 300 * 300 * 3
+            a, b, c = add(1, 1), add(2, 1), add(3, 2)
+            self.assertTrue(a['texture_id'])
+            self.ae(a['texture_id'], b['texture_id'])
+            self.assertNotEqual(a['texture_id'], c['texture_id'])
+            self.ae(shared_texture_stats()['count'], base['count'] + 2)
+            # A shared texture is counted once against the storage quota
+            self.ae((a['used_storage'], b['used_storage'], c['used_storage']), (sz, 0, sz))
+            self.ae(s.grman.used_storage, 2 * sz)
+            # and the storage moves to another image using it, when the image that has it is deleted
+            delete(1)
+            self.ae(s.grman.image_for_client_id(2)['used_storage'], sz)
+            self.ae(s.grman.used_storage, 2 * sz)
+            delete(2)
+            self.ae(s.grman.used_storage, sz)
+            self.ae(shared_texture_stats()['count'], base['count'] + 1)
+            # Textures are shared between graphics managers, each counts it once
+            s2 = self.create_screen()
+            add2, delete2, show2 = texture_helpers(self, s2)
+            self.ae(add2(1, 2)['texture_id'], c['texture_id'])
+            self.ae(s2.grman.used_storage, sz)
+            self.ae(shared_texture_stats()['count'], base['count'] + 1)
+            # Small images share the slot of an atlas
+            add(4, 3, 10, 10), add(5, 3, 10, 10), add(6, 4, 10, 10)
+            self.ae(shared_texture_stats()['atlas_layers'], base['atlas_layers'] + 2)
+            self.ae(s.grman.used_storage, sz + 2 * 300)
+            # Transmitting an image again releases its previous texture, once the new one is uploaded
+            add(6, 5, 10, 10)
+            self.ae(shared_texture_stats()['atlas_layers'], base['atlas_layers'] + 2)
+            # A texture is freed once no image uses it
+            delete(3), delete2(1)
+            self.ae(shared_texture_stats()['count'], base['count'] + 2)
+        finally:
+            set_fake_gpu(False)
+
+    def test_gr_gpu_memory_budget(self):
+        set_fake_gpu(True)
+        try:
+            # Room for two 300x300 textures
+            opts = {'images_gpu_memory': 1, 'images_gpu_memory_per_window': 0}
+            tsz = 300 * 300 * 4
+            base = shared_texture_stats()['gpu_memory']
+
+            def gpu_memory():
+                return shared_texture_stats()['gpu_memory'] - base
+
+            # Two windows in different tabs, only the first is rendered after the first frame
+            s1, s2 = self.create_screen(options=opts), self.create_screen(options=opts)
+            add1, delete1, show1 = texture_helpers(self, s1)
+            add2, delete2, show2 = texture_helpers(self, s2)
+            new_graphics_frame()
+            add2(1, 1), show2()
+            new_graphics_frame()
+            add1(2, 2), show1()
+            new_graphics_frame()
+            show1()
+            self.ae(gpu_memory(), 2 * tsz)
+            # The texture of the window that is not rendered is evicted first,
+            # although its render data still uses it
+            add1(3, 3)
+            self.ae(s2.grman.image_for_client_id(1)['texture_id'], 0)
+            self.assertTrue(s1.grman.image_for_client_id(2)['texture_id'])
+            self.assertTrue(s1.grman.image_for_client_id(3)['texture_id'])
+            self.ae(gpu_memory(), 2 * tsz)
+            # and uploaded again when the window is rendered, the image that
+            # has not been displayed yet is evicted to make room for it
+            new_graphics_frame()
+            show2()
+            self.assertTrue(s2.grman.image_for_client_id(1)['texture_id'])
+            self.assertTrue(s1.grman.image_for_client_id(2)['texture_id'])
+            self.ae(s1.grman.image_for_client_id(3)['texture_id'], 0)
+            self.ae(gpu_memory(), 2 * tsz)
+            # When all textures are displayed, the ones displayed much smaller
+            # than the image are downscaled, to the size of the cell here
+            show1()
+            self.ae(gpu_memory(), 2 * tsz + 10 * 20 * 4)
+            for s, iid in ((s2, 1), (s1, 2), (s1, 3)):
+                self.assertTrue(s.grman.image_for_client_id(iid)['texture_id'])
+        finally:
+            set_fake_gpu(False)
+
+    def test_gr_atlas_batches(self):
+        cw, ch = 10, 20
+        s, dx, dy, put_image, put_ref, layers, rect_eq = put_helpers(self, cw, ch)
+        for i in range(5):
+            put_image(s, cw, ch)
+        l0 = layers(s)
+        self.ae([x['atlas'] for x in l0], [1] * 5)
+        self.ae(s.grman.draw_calls(), 1)
+        put_image(s, 100, ch, z=-1)
+        self.ae(layers(s)[0]['atlas'], 2)
+        self.ae(s.grman.draw_calls(), 2)
+        # Images are drawn in the order they were added in, only consecutive
+        # images in the same atlas are drawn together
+        put_image(s, 300, ch)
+        put_image(s, cw, ch)
+        l2 = layers(s)
+        self.ae([x['atlas'] for x in l2], [2, 1, 1, 1, 1, 1, 0, 1])
+        self.ae(s.grman.draw_calls(), 4)
+
+    def test_gr_atlas_shrink(self):
+        set_fake_gpu(True)
+        try:
+            new_graphics_frame()
+            s = self.create_screen()
+            add, delete, show = texture_helpers(self, s)
+            for i in range(1, 21):
+                add(i, i, 10, 10)
+            self.ae(shared_texture_stats()['atlas_capacity'][0], 32)
+            for i in range(1, 17):
+                delete(i)
+            show()
+            # The atlas is shrunk once at most a quarter of it is used, and the
+            # render data is updated for the new layers
+            new_graphics_frame()
+            self.ae(shared_texture_stats()['atlas_capacity'][0], 16)
+            l0 = show()
+            self.ae([x['image_id'] for x in l0], [s.grman.image_for_client_id(i)['internal_id'] for i in range(17, 21)])
+            self.ae([x['layer'] for x in l0], [0, 1, 2, 3])
+            self.ae(s.grman.draw_calls(), 1)
+            # and freed once it is empty
+            for i in range(17, 21):
+                delete(i)
+            new_graphics_frame()
+            self.ae(shared_texture_stats()['atlas_capacity'][0], 0)
+        finally:
+            set_fake_gpu(False)
+
     def test_gr_reset(self):
         cw, ch = 10, 20
         s, dx, dy, put_image, put_ref, layers, rect_eq = put_helpers(self, cw, ch)
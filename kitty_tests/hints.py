@@ -30,3 +30,22 @@ class TestHints(BaseTest):
         t('link:{}[xxx]'.format(u), u)
         t('`xyz <{}>`_.'.format(u), u)
         t('<a href="{}">moo'.format(u), u)
+
+    def test_native_matches(self):
+        from kittens.hints.main import parse_hints_args, functions_for, regex_matches, convert_text, native_match_type
+        from kitty.fast_data_types import find_hint_matches
+        text = convert_text('''\
+See https://example.com/a/b?c=d, (http://x.org/p) and link:ftp://f.net/x[text].
+`docs <http://d.io/x>`_ at "/usr/lib/file.so" and ./a.tar.gz or 'x/y' {ab.txt}
+commit deadbeef1234567 and 0123456789abcdef0123456789abcdef01234567 a.b c/ abcdef0
+https://wrapped.example.com/long/path/that/is/wrapped/over/lines''', 30)
+        for typ in ('url', 'path', 'hash'):
+            for min_len in (3, 10):
+                args = parse_hints_args(['--type', typ, '--minimum-match-length', str(min_len)])[0]
+                self.ae(native_match_type(args), typ)
+                pattern, post_processors = functions_for(args)
+                expected = list(regex_matches(pattern, post_processors, text, args))
+                self.assertTrue(expected)
+                self.ae(expected, [tuple(x) for x in find_hint_matches(text, typ, min_len, tuple(args.url_prefixes.split(',')))])
+        self.assertIsNone(native_match_type(parse_hints_args(['--url-prefixes', 'svn+ssh,http'])[0]))
+        self.assertIsNone(native_match_type(parse_hints_args(['--type', 'word'])[0]))
@@ -21,3 +21,24 @@ class TestUnicodeInput(BaseTest):
         self.ae(matches('horizontal', 'ell'), {0x2026, 0x22ef, 0x2b2c, 0x2b2d, 0xfe19})
         self.assertFalse(matches('sfgsfgsfgfgsdg'))
         self.assertIn(0x1f41d, matches('bee'))
+
+    def test_query(self):
+        from kittens.unicode_input.main import codepoints_matching_search
+        from kittens.unicode_input.unicode_names import codepoints_for_query, codepoints_for_word
+
+        def q(*words, limit=0):
+            return codepoints_for_query(words, limit)
+
+        self.ae(set(q('horiz', 'ell')), {0x2026, 0x22ef, 0x2b2c, 0x2b2d, 0xfe19})
+        # Exact word matches first, then shorter names
+        self.ae(q('horizontal', 'ellipsis')[0], 0x2026)
+        self.ae(q('cat', 'face')[0], 0x1f431)
+        self.ae(q('horiz', 'ell', limit=2), q('horiz', 'ell')[:2])
+        # Words that match no word in the name match anywhere in it
+        self.ae(set(q('horiz', 'llip')), set(q('horiz', 'ellip')))
+        self.assertFalse(q('sfgsfgsfgfgsdg'))
+        self.assertFalse(q('horiz', 'sfgsfgsfgfgsdg'))
+        self.assertFalse(q())
+        self.ae(set(q('smil')), set(codepoints_for_word('smil')))
+        self.ae(codepoints_matching_search(('Cat', 'Face'))[0], 0x1f431)
+        self.assertFalse(codepoints_matching_search(('c', 'face')))
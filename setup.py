@@ -245,6 +245,7 @@ def kitty_env():
     cppflags = ans.cppflags
     cppflags.append('-DPRIMARY_VERSION={}'.format(version[0] + 4000))
     cppflags.append('-DSECONDARY_VERSION={}'.format(version[1]))
+    cppflags.append('-DPATCH_VERSION={}'.format(version[2]))
     at_least_version('harfbuzz', 1, 5)
     cflags.extend(pkg_config('libpng', '--cflags-only-I'))
     if is_macos:
@@ -261,6 +262,11 @@ def kitty_env():
     gl_libs = ['-framework', 'OpenGL'] if is_macos else pkg_config('gl', '--libs')
     libpng = pkg_config('libpng', '--libs')
     ans.ldpaths += pylib + font_libs + gl_libs + libpng
+    if subprocess.run([PKGCONFIG, 'libjpeg', '--exists']).returncode == 0:
+        # Optional, used to decode JPEG images for icat
+        cppflags.append('-DHAS_LIBJPEG')
+        cflags.extend(pkg_config('libjpeg', '--cflags-only-I'))
+        ans.ldpaths += pkg_config('libjpeg', '--libs')
     if is_macos:
         ans.ldpaths.extend('-framework Cocoa'.split())
     else: